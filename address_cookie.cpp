@@ -0,0 +1,114 @@
+#include "address_cookie.h"
+#include <cstring>
+#include <random>
+
+static inline uint64_t rotate_left(uint64_t value, int bits)
+{
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static inline void sip_round(uint64_t &v0, uint64_t &v1, uint64_t &v2, uint64_t &v3)
+{
+    v0 += v1;
+    v1 = rotate_left(v1, 13);
+    v1 ^= v0;
+    v0 = rotate_left(v0, 32);
+    v2 += v3;
+    v3 = rotate_left(v3, 16);
+    v3 ^= v2;
+    v0 += v3;
+    v3 = rotate_left(v3, 21);
+    v3 ^= v0;
+    v2 += v1;
+    v1 = rotate_left(v1, 17);
+    v1 ^= v2;
+    v2 = rotate_left(v2, 32);
+}
+
+static inline uint64_t read_u64_le(const uint8_t *data)
+{
+    uint64_t value = 0;
+    for (int i = 7; i >= 0; i--)
+    {
+        value = (value << 8) | data[i];
+    }
+    return value;
+}
+
+uint64_t siphash24(const CookieKey *key, const uint8_t *data, size_t size)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ key->k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ key->k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ key->k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ key->k1;
+
+    size_t blocks = size / 8;
+    for (size_t i = 0; i < blocks; i++)
+    {
+        uint64_t m = read_u64_le(data + i * 8);
+        v3 ^= m;
+        sip_round(v0, v1, v2, v3);
+        sip_round(v0, v1, v2, v3);
+        v0 ^= m;
+    }
+
+    uint8_t last[8] = {};
+    memcpy(last, data + blocks * 8, size % 8);
+    uint64_t m = read_u64_le(last) | ((uint64_t)size << 56);
+    v3 ^= m;
+    sip_round(v0, v1, v2, v3);
+    sip_round(v0, v1, v2, v3);
+    v0 ^= m;
+
+    v2 ^= 0xff;
+    for (int i = 0; i < 4; i++)
+    {
+        sip_round(v0, v1, v2, v3);
+    }
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+void cookie_key_init(CookieKey *key)
+{
+    std::random_device random;
+    key->k0 = ((uint64_t)random() << 32) | random();
+    key->k1 = ((uint64_t)random() << 32) | random();
+}
+
+static uint64_t slot_cookie(const CookieKey *key, const sockaddr *address, uint32_t session_id, int64_t slot)
+{
+    // family (2), port (2), address (16), session (4), slot (8)
+    uint8_t input[32] = {};
+    input[0] = (uint8_t)address->sa_family;
+    if (address->sa_family == AF_INET)
+    {
+        const sockaddr_in *ipv4 = (const sockaddr_in *)address;
+        memcpy(input + 2, &ipv4->sin_port, 2);
+        memcpy(input + 4, &ipv4->sin_addr, 4);
+    }
+    else
+    {
+        const sockaddr_in6 *ipv6 = (const sockaddr_in6 *)address;
+        memcpy(input + 2, &ipv6->sin6_port, 2);
+        memcpy(input + 4, &ipv6->sin6_addr, 16);
+    }
+    memcpy(input + 20, &session_id, 4);
+    memcpy(input + 24, &slot, 8);
+    return siphash24(key, input, sizeof(input));
+}
+
+static int64_t cookie_slot(std::chrono::steady_clock::time_point now)
+{
+    return std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count() / COOKIE_LIFETIME_S;
+}
+
+uint64_t address_cookie(const CookieKey *key, const sockaddr *address, uint32_t session_id, std::chrono::steady_clock::time_point now)
+{
+    return slot_cookie(key, address, session_id, cookie_slot(now));
+}
+
+bool address_cookie_valid(const CookieKey *key, const sockaddr *address, uint32_t session_id, uint64_t cookie, std::chrono::steady_clock::time_point now)
+{
+    int64_t slot = cookie_slot(now);
+    return cookie == slot_cookie(key, address, session_id, slot) || cookie == slot_cookie(key, address, session_id, slot - 1);
+}
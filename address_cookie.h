@@ -0,0 +1,22 @@
+#ifndef ADDRESS_COOKIE_H
+#define ADDRESS_COOKIE_H
+
+#include "proxy_common.h"
+
+#define COOKIE_LIFETIME_S 30 // A cookie is accepted for one to two lifetimes after it was made.
+
+typedef struct
+{
+    uint64_t k0;
+    uint64_t k1;
+} CookieKey;
+
+// SipHash-2-4 of data, a keyed hash an attacker can't compute without the key.
+uint64_t siphash24(const CookieKey *key, const uint8_t *data, size_t size);
+void cookie_key_init(CookieKey *key);
+// Ties an address and port (and a tunnel session) to a time slot, nothing is stored:
+// whoever echoes the cookie back proves it receives at that address.
+uint64_t address_cookie(const CookieKey *key, const sockaddr *address, uint32_t session_id, std::chrono::steady_clock::time_point now);
+bool address_cookie_valid(const CookieKey *key, const sockaddr *address, uint32_t session_id, uint64_t cookie, std::chrono::steady_clock::time_point now);
+
+#endif
@@ -0,0 +1,190 @@
+#include "backend_pool.h"
+#include "logger.h"
+#include "quic_prober.h"
+#include <cstring>
+
+BackendPool::BackendPool(int family)
+{
+    this->family = family;
+}
+
+BackendPool::~BackendPool()
+{
+    this->stop();
+}
+
+int BackendPool::add(const sockaddr *address, socklen_t address_len)
+{
+    if (address->sa_family != this->family || address_len > (socklen_t)sizeof(sockaddr_storage))
+    {
+        return 1;
+    }
+
+    Backend backend{};
+    memcpy(&backend.address, address, address_len);
+    backend.address_len = address_len;
+    // Every backend is trusted until the first probe says otherwise.
+    backend.healthy = true;
+
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->backends.push_back(backend);
+    return 0;
+}
+
+int BackendPool::add(eAddressType address_type, std::string address, int port)
+{
+    if (address_type == eAddressType::IPv4 && this->family == AF_INET)
+    {
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+        {
+            return 1;
+        }
+        return this->add((sockaddr *)&addr, sizeof(addr));
+    }
+    if (address_type == eAddressType::IPv6 && this->family == AF_INET6)
+    {
+        sockaddr_in6 addr{};
+        addr.sin6_family = AF_INET6;
+        addr.sin6_port = htons(port);
+        if (inet_pton(AF_INET6, address.c_str(), &addr.sin6_addr) != 1)
+        {
+            return 1;
+        }
+        return this->add((sockaddr *)&addr, sizeof(addr));
+    }
+    if (address_type != eAddressType::Domain)
+    {
+        LOG(LOG_LEVEL_WARNING, "Backends: Skipping {}, it doesn't match the proxy address family.", address);
+        return 1;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *result = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = this->family;
+    hints.ai_socktype = SOCK_DGRAM;
+    int status = getaddrinfo(address.c_str(), std::to_string(port).c_str(), &hints, &result);
+    if (status != 0 || result == nullptr)
+    {
+        LOG(LOG_LEVEL_WARNING, "Backends: Couldn't resolve {}.", address);
+        return 1;
+    }
+    int added = this->add(result->ai_addr, (socklen_t)result->ai_addrlen);
+    freeaddrinfo(result);
+    return added;
+}
+
+void BackendPool::start()
+{
+    if (this->running)
+    {
+        return;
+    }
+    this->running = true;
+    this->health_thread = std::thread(&BackendPool::health_check, this);
+}
+
+void BackendPool::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->running = false;
+    }
+    this->wakeup.notify_all();
+    if (this->health_thread.joinable())
+    {
+        this->health_thread.join();
+    }
+}
+
+void BackendPool::health_check()
+{
+    while (this->running)
+    {
+        std::vector<Backend> snapshot;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            snapshot = this->backends;
+        }
+
+        auto started = std::chrono::steady_clock::now();
+        std::vector<QuicProbe> probes(snapshot.size());
+        for (size_t i = 0; i < snapshot.size(); i++)
+        {
+            probes[i].address = snapshot[i].address;
+            probes[i].address_len = snapshot[i].address_len;
+        }
+        // Every backend is probed at once so a dead one is noticed within one interval.
+        probe_quic_many(probes, BACKEND_PROBE_TIMEOUT_MS);
+
+        bool changed = false;
+        for (size_t i = 0; i < snapshot.size() && this->running; i++)
+        {
+            bool healthy = probes[i].reachable;
+            if (healthy != snapshot[i].healthy)
+            {
+                std::lock_guard<std::mutex> lock(this->mutex);
+                this->backends[i].healthy = healthy;
+                changed = true;
+                LOG(LOG_LEVEL_INFO, "Backends: Backend {} is now {}", i, healthy ? "healthy." : "unhealthy.");
+            }
+        }
+        if (changed)
+        {
+            this->health_generation++;
+        }
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->wakeup.wait_until(lock, started + std::chrono::milliseconds(BACKEND_PROBE_INTERVAL_MS),
+                                [this]()
+                                { return !this->running; });
+    }
+}
+
+// Round-robin over healthy backends, returns the picked index or -1 if every backend is down.
+int BackendPool::pick(sockaddr_storage *address, socklen_t *address_len)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    size_t count = this->backends.size();
+    for (size_t i = 0; i < count; i++)
+    {
+        size_t index = (this->next++) % count;
+        if (this->backends[index].healthy)
+        {
+            *address = this->backends[index].address;
+            *address_len = this->backends[index].address_len;
+            return (int)index;
+        }
+    }
+    return -1;
+}
+
+bool BackendPool::is_healthy(int index)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (index < 0 || index >= (int)this->backends.size())
+    {
+        return false;
+    }
+    return this->backends[index].healthy;
+}
+
+unsigned BackendPool::generation()
+{
+    return this->health_generation;
+}
+
+size_t BackendPool::size()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->backends.size();
+}
+
+std::vector<Backend> BackendPool::list()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    return this->backends;
+}
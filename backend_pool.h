@@ -0,0 +1,51 @@
+#ifndef BACKEND_POOL_H
+#define BACKEND_POOL_H
+
+#include "proxy_common.h"
+#include <condition_variable>
+#include <mutex>
+#include <vector>
+
+#define BACKEND_PROBE_INTERVAL_MS 2000 // Time between two health checks of the same backend.
+#define BACKEND_PROBE_TIMEOUT_MS 1000  // A backend not answering within this time is unhealthy, the probe is resent at 200 and 600 ms.
+
+typedef struct
+{
+    sockaddr_storage address;
+    socklen_t address_len;
+    bool healthy;
+} Backend;
+
+// Set of upstream servers of the same family sharing one saved server.
+// A background thread probes every backend with a QUIC initial packet and
+// proxies ask it for a healthy backend on every new session and whenever
+// generation() changes.
+class BackendPool
+{
+private:
+    int family;
+    std::vector<Backend> backends;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::atomic<bool> running{false};
+    std::atomic<unsigned> health_generation{0};
+    size_t next = 0;
+    std::thread health_thread;
+    void health_check();
+
+public:
+    BackendPool(int family);
+    ~BackendPool();
+    int add(const sockaddr *address, socklen_t address_len);
+    int add(eAddressType address_type, std::string address, int port);
+    void start();
+    void stop();
+    int pick(sockaddr_storage *address, socklen_t *address_len);
+    bool is_healthy(int index);
+    unsigned generation();
+    size_t size();
+    // Copy of the backends in the order of their indexes.
+    std::vector<Backend> list();
+};
+
+#endif
@@ -0,0 +1,130 @@
+// Compares resolve_server_address against the std::regex implementation it replaced,
+// checks both agree on every input and times them on a generated server list.
+//
+// g++ bench/address_parser_bench.cpp proxy_common.cpp -I. -O2 -std=c++17 -o address_parser_bench -lws2_32
+#include "proxy_common.h"
+#include <regex>
+#include <vector>
+
+#define BENCH_ENTRIES 20000
+#define BENCH_ROUNDS 5
+
+static std::tuple<eAddressType, std::string, int> resolve_server_address_regex(std::string address)
+{
+    int port = PROXY_DEFAULT_PORT;
+    std::regex serverAddressRegex("^([^:\\[\\]]+|\\[[^\\[\\]]+\\])(?::([0-9]+))?$");
+    std::regex domainRegex("^(?:[a-zA-Z0-9](?:[a-zA-Z0-9-]{0,61}[a-zA-Z0-9])?\\.)+[a-zA-Z]{2,}$");
+    std::smatch matches;
+    in_addr ipv4;
+    in6_addr ipv6;
+
+    if (std::regex_search(address, matches, serverAddressRegex))
+    {
+        std::string address = matches[1].str();
+        if (address.empty())
+        {
+            return {eAddressType::Invalid, "", -1};
+        }
+        if (matches[2].matched)
+        {
+            try
+            {
+                port = std::stoi(matches[2].str());
+                if (port < 1 || port > 65535)
+                {
+                    port = -1;
+                }
+            }
+            catch (...)
+            {
+                port = -1;
+            }
+        }
+
+        if (inet_pton(AF_INET, address.c_str(), &ipv4) == 1)
+        {
+            return {eAddressType::IPv4, address, port};
+        }
+        std::string raw_ipv6 = address.substr(1, address.length() - 2);
+        if (address.length() > 1 && inet_pton(AF_INET6, raw_ipv6.c_str(), &ipv6) == 1)
+        {
+            return {eAddressType::IPv6, raw_ipv6, port};
+        }
+
+        if (std::regex_match(address, domainRegex))
+        {
+            return {eAddressType::Domain, address, port};
+        }
+    }
+
+    return {eAddressType::Invalid, "", -1};
+}
+
+static std::vector<std::string> generate_entries()
+{
+    const char *fixed[] = {
+        "example.com", "play.example.com:9521", "sub-domain.example.co.uk:1", "192.168.1.1",
+        "10.0.0.1:65535", "10.0.0.1:65536", "10.0.0.1:0", "10.0.0.1:99999999999999999999",
+        "[2001:db8::1]", "[2001:db8::1]:9520", "[::ffff:192.168.1.1]:443", "[not-ipv6]",
+        "[]", "[::1", "::1", "example.com:", "example.com:abc", "-bad.example.com",
+        "bad-.example.com", "example.c", "example.123", "a..com", ".com", "localhost",
+        "", ":9520", "256.1.1.1", "1.2.3", "exa mple.com", "xn--80ak6aa92e.com",
+        "a123456789012345678901234567890123456789012345678901234567890123.com",
+        "a12345678901234567890123456789012345678901234567890123456789012.com"};
+    std::vector<std::string> entries;
+    for (int i = 0; (int)entries.size() < BENCH_ENTRIES; i++)
+    {
+        entries.push_back(fixed[i % (sizeof(fixed) / sizeof(fixed[0]))]);
+        entries.push_back("server" + std::to_string(i) + ".hytale-community.net:" + std::to_string(9520 + i % 100));
+        entries.push_back(std::to_string(i % 256) + "." + std::to_string((i / 7) % 256) + ".1." + std::to_string(i % 200));
+        entries.push_back("[2001:db8::" + std::to_string(i % 9999) + "]:" + std::to_string(i % 70000));
+    }
+    return entries;
+}
+
+template <typename F>
+static double time_ms(const std::vector<std::string> &entries, F parse, size_t *valid)
+{
+    auto started = std::chrono::steady_clock::now();
+    *valid = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++)
+    {
+        for (const auto &entry : entries)
+        {
+            *valid += std::get<0>(parse(entry)) != eAddressType::Invalid;
+        }
+    }
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count() / BENCH_ROUNDS;
+}
+
+int main()
+{
+#ifdef _WIN32
+    WSAData wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    std::vector<std::string> entries = generate_entries();
+
+    int mismatches = 0;
+    for (const auto &entry : entries)
+    {
+        if (resolve_server_address(entry) != resolve_server_address_regex(entry))
+        {
+            if (mismatches++ < 10)
+            {
+                std::cout << "Mismatch: \"" << entry << "\"" << std::endl;
+            }
+        }
+    }
+
+    size_t valid_regex;
+    size_t valid_parser;
+    double regex_ms = time_ms(entries, resolve_server_address_regex, &valid_regex);
+    double parser_ms = time_ms(entries, resolve_server_address, &valid_parser);
+
+    std::cout << entries.size() << " addresses, " << valid_parser / BENCH_ROUNDS << " valid" << std::endl;
+    std::cout << "regex:  " << regex_ms << " ms" << std::endl;
+    std::cout << "parser: " << parser_ms << " ms (" << regex_ms / parser_ms << "x)" << std::endl;
+    std::cout << mismatches << " mismatches" << std::endl;
+    return mismatches == 0 && valid_regex == valid_parser ? 0 : 1;
+}
@@ -0,0 +1,80 @@
+// Checks the vector gf256_mul_add kernel against the multiplication table and measures
+// how fast a tunnel encodes, in datagrams and megabytes per second.
+//
+// g++ bench/fec_bench.cpp gf256.cpp tunnel.cpp -I. -O2 -std=c++17 -o fec_bench
+#include "gf256.h"
+#include "tunnel.h"
+#include <cstdlib>
+#include <iostream>
+
+#define BENCH_DATAGRAM_SIZE 1200 // Typical QUIC datagram.
+#define BENCH_DATAGRAMS 200000
+
+class CountingSink : public TunnelSink
+{
+public:
+    size_t frames = 0;
+    size_t bytes = 0;
+
+    void to_peer(const char *, int size) override
+    {
+        this->frames++;
+        this->bytes += size;
+    }
+
+    void to_local(const char *, int) override
+    {
+    }
+};
+
+int main()
+{
+    int mismatches = 0;
+    uint8_t src[1500];
+    uint8_t dst[1500];
+    uint8_t expected[1500];
+    for (int c = 0; c < 256; c++)
+    {
+        for (size_t i = 0; i < sizeof(src); i++)
+        {
+            src[i] = (uint8_t)rand();
+            dst[i] = (uint8_t)rand();
+            expected[i] = dst[i] ^ gf256_mul(src[i], (uint8_t)c);
+        }
+        // Odd size so the scalar tail runs too.
+        gf256_mul_add(dst, src, (uint8_t)c, sizeof(src) - 3);
+        for (size_t i = 0; i < sizeof(src) - 3; i++)
+        {
+            mismatches += dst[i] != expected[i];
+        }
+    }
+
+    char datagram[BENCH_DATAGRAM_SIZE];
+    for (int i = 0; i < BENCH_DATAGRAM_SIZE; i++)
+    {
+        datagram[i] = (char)rand();
+    }
+    for (int parity : {1, 4, TUNNEL_FEC_MAX_PARITY})
+    {
+        // A report from session 0 makes the tunnel pick this many parity datagrams per group.
+        Tunnel tunnel(0);
+        CountingSink sink;
+        int loss = parity * 1000 / (2 * TUNNEL_FEC_GROUP);
+        char report[TUNNEL_REPORT_SIZE] = {TUNNEL_VERSION, TUNNEL_REPORT, 0, 0, 0, 0, 0, 0, 0, 0, (char)(loss >> 8), (char)loss};
+        auto now = std::chrono::steady_clock::now();
+        tunnel.receive(report, TUNNEL_REPORT_SIZE, now, &sink);
+
+        auto started = std::chrono::steady_clock::now();
+        for (int i = 0; i < BENCH_DATAGRAMS; i++)
+        {
+            tunnel.send(datagram, BENCH_DATAGRAM_SIZE, now, &sink);
+        }
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+        std::cout << tunnel.stats().parity << " parity per " << TUNNEL_FEC_GROUP << ": "
+                  << (int)(BENCH_DATAGRAMS / seconds) << " datagrams/s, "
+                  << (int)(BENCH_DATAGRAMS * (double)BENCH_DATAGRAM_SIZE / seconds / 1e6) << " MB/s" << std::endl;
+    }
+
+    std::cout << "kernel: " << gf256_kernel() << ", " << mismatches << " mismatches" << std::endl;
+    return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,268 @@
+// Per call cost of the proxy's building blocks, to follow as the code changes. Every
+// benchmark is calibrated to run at least BENCH_MIN_RUN_MS, then timed BENCH_RUNS times,
+// the median is reported with the spread of the runs as JSON on stdout. Pin it to an
+// idle core for stable numbers (taskset -c 2 ./micro_bench).
+//
+// g++ bench/micro_bench.cpp proxy_common.cpp quic_header.cpp impairment.cpp tunnel.cpp gf256.cpp logger.cpp -I. -O2 -std=c++17 -pthread -o micro_bench -lws2_32
+//
+// micro_bench [name filter]
+#include "impairment.h"
+#include "quic_header.h"
+#include "proxy_engine.h"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <vector>
+
+#define BENCH_RUNS 9         // Timed runs of each benchmark, the median is kept.
+#define BENCH_MIN_RUN_MS 20  // Iterations double until one run takes this long.
+#define BENCH_SESSIONS 1000  // Clients of the session table.
+#define BENCH_QUEUE_BATCH 64 // Datagrams pushed before the delay queue is flushed.
+
+typedef struct
+{
+    std::string name;
+    uint64_t iterations; // Per run.
+    double ns_per_op;     // Median over the runs.
+    double min_ns_per_op;
+    double spread;        // (slowest - fastest) / median, above a few percent the machine was busy.
+} BenchResult;
+
+// Keeps the compiler from dropping a result nobody reads.
+template <typename T>
+static void keep(const T &value)
+{
+#if defined(__GNUC__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void *sink;
+    sink = &value;
+#endif
+}
+
+static std::string filter; // Benchmarks whose name doesn't contain it are skipped.
+
+// body runs iterations calls and returns the number of operations they made.
+static void measure(std::vector<BenchResult> *results, const std::string &name, std::function<uint64_t(uint64_t)> body)
+{
+    if (name.find(filter) == std::string::npos)
+    {
+        return;
+    }
+    uint64_t iterations = 1;
+    while (true)
+    {
+        auto started = std::chrono::steady_clock::now();
+        body(iterations);
+        if (std::chrono::steady_clock::now() - started >= std::chrono::milliseconds(BENCH_MIN_RUN_MS))
+        {
+            break;
+        }
+        iterations *= 2;
+    }
+
+    std::vector<double> runs;
+    for (int run = 0; run < BENCH_RUNS; run++)
+    {
+        auto started = std::chrono::steady_clock::now();
+        uint64_t operations = body(iterations);
+        double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - started).count();
+        runs.push_back(elapsed / operations);
+    }
+    std::sort(runs.begin(), runs.end());
+    double median = runs[runs.size() / 2];
+    results->push_back({name, iterations, median, runs.front(), (runs.back() - runs.front()) / median});
+}
+
+static sockaddr_storage ipv4_address(uint32_t host, uint16_t port)
+{
+    sockaddr_storage address{};
+    sockaddr_in *ipv4 = (sockaddr_in *)&address;
+    ipv4->sin_family = AF_INET;
+    ipv4->sin_addr.s_addr = htonl(host);
+    ipv4->sin_port = htons(port);
+    return address;
+}
+
+static sockaddr_storage ipv6_address(uint32_t host, uint16_t port)
+{
+    sockaddr_storage address{};
+    sockaddr_in6 *ipv6 = (sockaddr_in6 *)&address;
+    ipv6->sin6_family = AF_INET6;
+    inet_pton(AF_INET6, "2001:db8::", &ipv6->sin6_addr);
+    memcpy(&ipv6->sin6_addr.s6_addr[12], &host, sizeof(host));
+    ipv6->sin6_port = htons(port);
+    return address;
+}
+
+static void bench_address_parser(std::vector<BenchResult> *results)
+{
+    const std::vector<std::pair<std::string, std::vector<std::string>>> inputs = {
+        {"ipv4", {"192.168.1.1", "10.0.0.1:9521", "172.16.254.3:65535", "8.8.8.8"}},
+        {"ipv6", {"[2001:db8::1]", "[2001:db8::1]:9520", "[::ffff:192.168.1.1]:443", "[fe80::1]"}},
+        {"domain", {"example.com", "play.example.com:9521", "server42.hytale-community.net:9600", "sub-domain.example.co.uk"}},
+        {"invalid", {"example.com:abc", "[::1", "256.1.1.1", "-bad.example.com"}}};
+    for (const auto &input : inputs)
+    {
+        const std::vector<std::string> &entries = input.second;
+        measure(results, "resolve_server_address/" + input.first, [&entries](uint64_t iterations)
+                {
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                keep(std::get<2>(resolve_server_address(entries[i % entries.size()])));
+            }
+            return iterations; });
+    }
+}
+
+static void bench_quic_probe(std::vector<BenchResult> *results)
+{
+    measure(results, "quic_write_probe", [](uint64_t iterations)
+            {
+        uint8_t buffer[QUIC_MIN_INITIAL_SIZE];
+        QuicProbeIds ids;
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            keep(quic_write_probe(buffer, &ids));
+        }
+        return iterations; });
+
+    // Version negotiation answering the probe, as a server sends it.
+    uint8_t probe[QUIC_MIN_INITIAL_SIZE];
+    QuicProbeIds ids;
+    quic_write_probe(probe, &ids);
+    uint8_t reply[7 + 2 * QUIC_PROBE_CID_LENGTH + 8] = {0x80, 0, 0, 0, 0, QUIC_PROBE_CID_LENGTH};
+    memcpy(reply + 6, ids.scid, QUIC_PROBE_CID_LENGTH);
+    reply[6 + QUIC_PROBE_CID_LENGTH] = QUIC_PROBE_CID_LENGTH;
+    memcpy(reply + 7 + QUIC_PROBE_CID_LENGTH, ids.dcid, QUIC_PROBE_CID_LENGTH);
+    const uint8_t versions[8] = {0x00, 0x00, 0x00, 0x01, 0x6b, 0x33, 0x43, 0xcf};
+    memcpy(reply + 7 + 2 * QUIC_PROBE_CID_LENGTH, versions, sizeof(versions));
+    measure(results, "quic_probe_answer", [&reply, &ids](uint64_t iterations)
+            {
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            keep(quic_probe_answer(reply, sizeof(reply), &ids));
+        }
+        return iterations; });
+}
+
+static void bench_sockaddr(std::vector<BenchResult> *results)
+{
+    const std::vector<std::pair<std::string, std::function<sockaddr_storage(uint32_t, uint16_t)>>> families = {
+        {"ipv4", ipv4_address}, {"ipv6", ipv6_address}};
+    for (const auto &family : families)
+    {
+        std::vector<sockaddr_storage> addresses;
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            addresses.push_back(family.second(0x0a000000 + i * 7919, 9520 + i));
+        }
+        measure(results, "sockaddr_hash/" + family.first, [&addresses](uint64_t iterations)
+                {
+            SockaddrHash hash;
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                keep(hash(addresses[i & 255]));
+            }
+            return iterations; });
+        measure(results, "sockaddr_equal/" + family.first, [&addresses](uint64_t iterations)
+                {
+            SockaddrEqual equal;
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                // Half the pairs are the same address.
+                keep(equal(addresses[i & 255], addresses[(i & 255) ^ (i & 256 ? 0 : 1)]));
+            }
+            return iterations; });
+    }
+}
+
+// Same table as ProxyRoute::sessions, looked up once per datagram from a client.
+static void bench_session_lookup(std::vector<BenchResult> *results)
+{
+    std::unordered_map<sockaddr_storage, ProxySession, SockaddrHash, SockaddrEqual> sessions;
+    std::vector<sockaddr_storage> clients;
+    std::vector<sockaddr_storage> strangers;
+    for (uint32_t i = 0; i < BENCH_SESSIONS; i++)
+    {
+        clients.push_back(ipv4_address(0xc0a80000 + i, 40000 + i % 20000));
+        strangers.push_back(ipv4_address(0xac100000 + i, 40000 + i % 20000));
+        sessions[clients.back()].client = clients.back();
+    }
+    // Datagrams don't come in table order.
+    std::shuffle(clients.begin(), clients.end(), std::mt19937(42));
+
+    measure(results, "session_lookup/hit", [&sessions, &clients](uint64_t iterations)
+            {
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            keep(sessions.find(clients[i % BENCH_SESSIONS]) != sessions.end());
+        }
+        return iterations; });
+    measure(results, "session_lookup/miss", [&sessions, &strangers](uint64_t iterations)
+            {
+        for (uint64_t i = 0; i < iterations; i++)
+        {
+            keep(sessions.find(strangers[i % BENCH_SESSIONS]) != sessions.end());
+        }
+        return iterations; });
+}
+
+// The impairment and egress queues keep datagrams in reused slots instead of allocating,
+// one push and its flush take a slot and give it back. Nothing is sent, the socket is -1.
+static void bench_slot_pool(std::vector<BenchResult> *results)
+{
+    const std::vector<std::pair<std::string, int>> sizes = {{"64", 64}, {"1200", 1200}};
+    for (const auto &size : sizes)
+    {
+        int bytes = size.second;
+        measure(results, "delay_queue/push_flush_" + size.first, [bytes](uint64_t iterations)
+                {
+            DelayQueue queue;
+            char data[IMPAIRMENT_PACKET_SIZE] = {};
+            sockaddr_storage to = ipv4_address(0x7f000001, 9520);
+            auto now = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; i < iterations; i++)
+            {
+                for (int j = 0; j < BENCH_QUEUE_BATCH; j++)
+                {
+                    queue.push(now, -1, (const sockaddr *)&to, sizeof(sockaddr_in), data, bytes);
+                }
+                queue.flush(now);
+            }
+            keep(queue.size());
+            return iterations * BENCH_QUEUE_BATCH; });
+    }
+}
+
+static void print_json(const std::vector<BenchResult> &results)
+{
+    std::cout << "{\n  \"runs\": " << BENCH_RUNS << ",\n  \"min_run_ms\": " << BENCH_MIN_RUN_MS << ",\n  \"benchmarks\": [";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &result = results[i];
+        char line[256];
+        snprintf(line, sizeof(line), "%s\n    {\"name\": \"%s\", \"iterations\": %llu, \"ns_per_op\": %.3f, \"min_ns_per_op\": %.3f, \"spread\": %.4f}",
+                 i == 0 ? "" : ",", result.name.c_str(), (unsigned long long)result.iterations, result.ns_per_op, result.min_ns_per_op, result.spread);
+        std::cout << line;
+    }
+    std::cout << "\n  ]\n}" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+#ifdef _WIN32
+    WSAData wsaData;
+    WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+    filter = argc > 1 ? argv[1] : "";
+    std::vector<BenchResult> results;
+    bench_address_parser(&results);
+    bench_quic_probe(&results);
+    bench_sockaddr(&results);
+    bench_session_lookup(&results);
+    bench_slot_pool(&results);
+    print_json(results);
+    return 0;
+}
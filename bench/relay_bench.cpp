@@ -0,0 +1,171 @@
+// Measures how many datagrams per second a relay forwards and their round trip time,
+// through the socket engine or, built with -DPROXY_WITH_XDP, the XDP fast path.
+// bench/xdp_veth.sh runs the three roles on a veth pair.
+//
+// g++ bench/relay_bench.cpp proxy_engine.cpp proxy_common.cpp backend_pool.cpp quic_prober.cpp rate_limiter.cpp impairment.cpp gf256.cpp tunnel.cpp latency_histogram.cpp logger.cpp client_filter.cpp address_cookie.cpp quic_header.cpp egress_scheduler.cpp handoff.cpp xdp_engine.cpp -I. -O2 -std=c++20 -pthread -o relay_bench
+//   add -DPROXY_WITH_XDP -lbpf for the fast path.
+//
+// relay_bench echo <ip:port>
+// relay_bench relay <listen ip:port> <server ip:port> [xdp interface]
+// relay_bench client <relay ip:port> <local ip> <seconds>
+#include "proxy_engine.h"
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+#define BENCH_PAYLOAD_SIZE 1200
+#define BENCH_IN_FLIGHT 32      // Datagrams the client keeps on the way.
+#define BENCH_RESEND_MS 100     // Lost datagrams are replaced after this long without replies.
+
+static bool parse_ipv4(const char *text, sockaddr_in *address)
+{
+    std::string host(text);
+    size_t colon = host.rfind(':');
+    int port = 0;
+    if (colon != std::string::npos)
+    {
+        port = atoi(host.c_str() + colon + 1);
+        host.resize(colon);
+    }
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_port = htons(port);
+    return inet_pton(AF_INET, host.c_str(), &address->sin_addr) == 1;
+}
+
+static int bound_socket(const sockaddr_in &address)
+{
+    int s = socket(AF_INET, SOCK_DGRAM, 0);
+    if (s < 0 || bind(s, (const sockaddr *)&address, sizeof(address)) < 0)
+    {
+        perror("bind");
+        exit(1);
+    }
+    return s;
+}
+
+static int run_echo(const sockaddr_in &address)
+{
+    int s = bound_socket(address);
+    char buffer[ENGINE_BUFFER_SIZE];
+    while (true)
+    {
+        sockaddr_storage from{};
+        socklen_t from_len = sizeof(from);
+        int n = recvfrom(s, buffer, sizeof(buffer), 0, (sockaddr *)&from, &from_len);
+        if (n > 0)
+        {
+            sendto(s, buffer, n, 0, (sockaddr *)&from, from_len);
+        }
+    }
+}
+
+static int run_relay(const sockaddr_in &listen, const sockaddr_in &server, const char *interface)
+{
+#ifdef PROXY_WITH_XDP
+    XdpEngine fast_path;
+#endif
+    ProxyEngine engine;
+    if (interface != nullptr)
+    {
+#ifdef PROXY_WITH_XDP
+        if (fast_path.open(interface, 0, false) != 0)
+        {
+            return 1;
+        }
+        engine.set_fast_path(&fast_path);
+#else
+        std::cerr << "Built without PROXY_WITH_XDP." << std::endl;
+        return 1;
+#endif
+    }
+    if (engine.add_route(bound_socket(listen), (const sockaddr *)&server, sizeof(server), nullptr, TUNNEL_NONE) != 0)
+    {
+        return 1;
+    }
+    while (true)
+    {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+#ifdef PROXY_WITH_XDP
+        if (interface != nullptr)
+        {
+            XdpStats stats = fast_path.stats();
+            std::cout << "xdp: " << stats.received << " received, " << stats.forwarded << " forwarded, "
+                      << stats.dropped << " dropped" << std::endl;
+        }
+#endif
+    }
+}
+
+static int run_client(const sockaddr_in &relay, const sockaddr_in &local, int seconds)
+{
+    int s = bound_socket(local);
+    ::connect(s, (const sockaddr *)&relay, sizeof(relay));
+    set_socket_nonblocking(s);
+
+    char payload[BENCH_PAYLOAD_SIZE] = {};
+    std::vector<double> rtt_us;
+    uint64_t sent = 0;
+    auto started = std::chrono::steady_clock::now();
+    auto deadline = started + std::chrono::seconds(seconds);
+    auto last_reply = started;
+    int in_flight = 0;
+    while (std::chrono::steady_clock::now() < deadline)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now - last_reply > std::chrono::milliseconds(BENCH_RESEND_MS))
+        {
+            in_flight = 0;
+            last_reply = now;
+        }
+        for (; in_flight < BENCH_IN_FLIGHT; in_flight++, sent++)
+        {
+            int64_t stamp = std::chrono::steady_clock::now().time_since_epoch().count();
+            memcpy(payload, &stamp, sizeof(stamp));
+            send(s, payload, sizeof(payload), 0);
+        }
+
+        pollfd fd{s, POLLIN, 0};
+        poll_sockets(&fd, 1, BENCH_RESEND_MS);
+        char reply[ENGINE_BUFFER_SIZE];
+        int n;
+        while ((n = recv(s, reply, sizeof(reply), 0)) >= (int)sizeof(int64_t))
+        {
+            int64_t stamp;
+            memcpy(&stamp, reply, sizeof(stamp));
+            last_reply = std::chrono::steady_clock::now();
+            rtt_us.push_back(std::chrono::duration<double, std::micro>(last_reply.time_since_epoch() - std::chrono::steady_clock::duration(stamp)).count());
+            in_flight = std::max(in_flight - 1, 0);
+        }
+    }
+
+    double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::sort(rtt_us.begin(), rtt_us.end());
+    auto percentile = [&rtt_us](double p)
+    {
+        return rtt_us.empty() ? 0.0 : rtt_us[std::min(rtt_us.size() - 1, (size_t)(p * rtt_us.size()))];
+    };
+    std::cout << (uint64_t)(rtt_us.size() / elapsed) << " pps, " << sent - rtt_us.size() - in_flight << " lost, rtt p50 "
+              << percentile(0.5) << " us, p99 " << percentile(0.99) << " us, p99.9 " << percentile(0.999) << " us" << std::endl;
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    sockaddr_in first, second;
+    std::string role = argc > 1 ? argv[1] : "";
+    if (role == "echo" && argc == 3 && parse_ipv4(argv[2], &first))
+    {
+        return run_echo(first);
+    }
+    if (role == "relay" && (argc == 4 || argc == 5) && parse_ipv4(argv[2], &first) && parse_ipv4(argv[3], &second))
+    {
+        return run_relay(first, second, argc == 5 ? argv[4] : nullptr);
+    }
+    if (role == "client" && argc == 5 && parse_ipv4(argv[2], &first) && parse_ipv4(argv[3], &second))
+    {
+        return run_client(first, second, atoi(argv[4]));
+    }
+    std::cerr << "usage: relay_bench echo <ip:port> | relay <listen ip:port> <server ip:port> [xdp interface] | client <relay ip:port> <local ip> <seconds>" << std::endl;
+    return 2;
+}
@@ -0,0 +1,49 @@
+#!/bin/sh
+# Runs bench/relay_bench through the socket engine, then through the XDP fast path in
+# generic mode, on a veth pair between two network namespaces. As root, from the
+# directory holding xdp_flow_filter.bpf.o:
+#   sh bench/xdp_veth.sh ./relay_bench [seconds]
+# The peer namespace holds the client (10.77.0.1) and the echo server (10.77.0.3), the
+# relay namespace the proxy (10.77.0.2), so the relay is one-armed like the fast path needs.
+set -e
+BENCH=${1:-./relay_bench}
+DURATION=${2:-10}
+
+cleanup()
+{
+    ip netns del xdp_relay 2>/dev/null || true
+    ip netns del xdp_peer 2>/dev/null || true
+}
+trap cleanup EXIT
+cleanup
+
+ip netns add xdp_relay
+ip netns add xdp_peer
+ip link add r0 netns xdp_relay type veth peer name p0 netns xdp_peer
+ip -n xdp_relay addr add 10.77.0.2/24 dev r0
+ip -n xdp_peer addr add 10.77.0.1/24 dev p0
+ip -n xdp_peer addr add 10.77.0.3/24 dev p0
+ip -n xdp_relay link set lo up
+ip -n xdp_relay link set r0 up
+ip -n xdp_peer link set lo up
+ip -n xdp_peer link set p0 up
+# veth leaves UDP checksums to be finished by the receiver, the rewritten frames need them complete.
+ip netns exec xdp_peer ethtool -K p0 tx off >/dev/null
+ip netns exec xdp_relay ethtool -K r0 tx off >/dev/null
+
+ip netns exec xdp_peer "$BENCH" echo 10.77.0.3:9600 &
+ECHO=$!
+for MODE in socket xdp; do
+    INTERFACE=
+    if [ "$MODE" = xdp ]; then
+        INTERFACE=r0
+    fi
+    ip netns exec xdp_relay "$BENCH" relay 10.77.0.2:9520 10.77.0.3:9600 $INTERFACE >/dev/null &
+    RELAY=$!
+    sleep 1
+    printf '%s: ' "$MODE"
+    ip netns exec xdp_peer "$BENCH" client 10.77.0.2:9520 10.77.0.1 "$DURATION"
+    kill $RELAY
+    wait $RELAY 2>/dev/null || true
+done
+kill $ECHO
@@ -0,0 +1,258 @@
+#include "client_filter.h"
+#include "logger.h"
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+
+static const uint8_t ipv4_mapped_prefix[12] = {0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+// Rules are expanded over the slots their last byte covers, a slot keeps the longest
+// rule covering it and longer rules go one node down.
+void ClientFilter::insert(int trie, const uint8_t *address, int length, int verdict)
+{
+    std::vector<FilterNode> &nodes = this->tries[trie];
+    if (nodes.empty())
+    {
+        nodes.push_back({});
+        for (FilterSlot &slot : nodes[0].slots)
+        {
+            slot = {-1, FILTER_NONE, 0};
+        }
+    }
+
+    int node = 0;
+    int depth = 0;
+    while (length - depth > 8)
+    {
+        int32_t child = nodes[node].slots[address[depth / 8]].child;
+        if (child < 0)
+        {
+            child = (int32_t)nodes.size();
+            nodes.push_back({});
+            for (FilterSlot &slot : nodes[child].slots)
+            {
+                slot = {-1, FILTER_NONE, 0};
+            }
+            nodes[node].slots[address[depth / 8]].child = child;
+        }
+        node = child;
+        depth += 8;
+    }
+
+    int bits = length - depth;
+    int first = bits == 0 ? 0 : address[depth / 8] & (0xff << (8 - bits)) & 0xff;
+    int count = 1 << (8 - bits);
+    for (int i = first; i < first + count; i++)
+    {
+        FilterSlot &slot = nodes[node].slots[i];
+        if (slot.verdict == FILTER_NONE || slot.length <= length)
+        {
+            slot.verdict = (uint8_t)verdict;
+            slot.length = (uint8_t)length;
+        }
+    }
+}
+
+int ClientFilter::lookup(const std::vector<FilterNode> &nodes, const uint8_t *address, int size)
+{
+    int verdict = FILTER_NONE;
+    if (nodes.empty())
+    {
+        return verdict;
+    }
+    int node = 0;
+    for (int i = 0; i < size; i++)
+    {
+        const FilterSlot &slot = nodes[node].slots[address[i]];
+        if (slot.verdict != FILTER_NONE)
+        {
+            verdict = slot.verdict;
+        }
+        if (slot.child < 0)
+        {
+            break;
+        }
+        node = slot.child;
+    }
+    return verdict;
+}
+
+bool ClientFilter::add_rule(const std::string &prefix, int verdict)
+{
+    size_t slash = prefix.find('/');
+    std::string address = prefix.substr(0, slash);
+    uint8_t bytes[16];
+    int trie;
+    int max_length;
+    if (inet_pton(AF_INET, address.c_str(), bytes) == 1)
+    {
+        trie = 0;
+        max_length = 32;
+    }
+    else if (inet_pton(AF_INET6, address.c_str(), bytes) == 1)
+    {
+        trie = 1;
+        max_length = 128;
+    }
+    else
+    {
+        return false;
+    }
+
+    int length = max_length;
+    if (slash != std::string::npos)
+    {
+        std::string digits = prefix.substr(slash + 1);
+        if (digits.empty() || digits.size() > 3 || digits.find_first_not_of("0123456789") != std::string::npos)
+        {
+            return false;
+        }
+        length = std::stoi(digits);
+        if (length > max_length)
+        {
+            return false;
+        }
+    }
+    if (verdict != FILTER_ALLOW && verdict != FILTER_DENY)
+    {
+        return false;
+    }
+
+    this->insert(trie, bytes, length, verdict);
+    this->rule_count++;
+    this->has_allow = this->has_allow || verdict == FILTER_ALLOW;
+    return true;
+}
+
+bool ClientFilter::allows(const sockaddr *address) const
+{
+    int verdict;
+    if (address->sa_family == AF_INET)
+    {
+        verdict = lookup(this->tries[0], (const uint8_t *)&((const sockaddr_in *)address)->sin_addr, 4);
+    }
+    else
+    {
+        const uint8_t *bytes = (const uint8_t *)&((const sockaddr_in6 *)address)->sin6_addr;
+        // Dual stack sockets see IPv4 clients as ::ffff:a.b.c.d.
+        verdict = memcmp(bytes, ipv4_mapped_prefix, sizeof(ipv4_mapped_prefix)) == 0 ? lookup(this->tries[0], bytes + 12, 4)
+                                                                                      : lookup(this->tries[1], bytes, 16);
+    }
+    if (verdict == FILTER_NONE)
+    {
+        return !this->has_allow;
+    }
+    return verdict == FILTER_ALLOW;
+}
+
+bool ClientFilter::empty() const
+{
+    return this->rule_count == 0;
+}
+
+size_t ClientFilter::rules() const
+{
+    return this->rule_count;
+}
+
+bool load_client_filter(const std::string &path, ClientFilter *filter, std::string *error)
+{
+    std::ifstream file(path);
+    if (!file)
+    {
+        *error = "couldn't open " + path;
+        return false;
+    }
+
+    ClientFilter loaded;
+    std::string line;
+    int number = 0;
+    while (std::getline(file, line))
+    {
+        number++;
+        line = line.substr(0, line.find('#'));
+        std::istringstream words(line);
+        std::string action, prefix, extra;
+        if (!(words >> action))
+        {
+            continue;
+        }
+        int verdict = action == "allow" ? FILTER_ALLOW : action == "deny" ? FILTER_DENY : FILTER_NONE;
+        if (!(words >> prefix) || (words >> extra) || !loaded.add_rule(prefix, verdict))
+        {
+            *error = path + " line " + std::to_string(number) + ": expected \"allow <prefix>\" or \"deny <prefix>\"";
+            return false;
+        }
+    }
+    *filter = std::move(loaded);
+    return true;
+}
+
+static int64_t modification_time(const std::string &path)
+{
+    std::error_code error;
+    auto time = std::filesystem::last_write_time(path, error);
+    return error ? 0 : (int64_t)time.time_since_epoch().count();
+}
+
+ClientFilterFile::~ClientFilterFile()
+{
+    this->stop();
+}
+
+bool ClientFilterFile::start(const std::string &path, std::function<void(ClientFilter)> on_change, std::string *error)
+{
+    this->stop();
+    int64_t loaded_time = modification_time(path);
+    ClientFilter filter;
+    if (!load_client_filter(path, &filter, error))
+    {
+        return false;
+    }
+    this->path = path;
+    this->on_change = on_change;
+    this->on_change(std::move(filter));
+
+    this->running = true;
+    this->watcher = std::thread(&ClientFilterFile::run, this, loaded_time);
+    return true;
+}
+
+void ClientFilterFile::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->running = false;
+    }
+    this->wake.notify_all();
+    if (this->watcher.joinable())
+    {
+        this->watcher.join();
+    }
+}
+
+void ClientFilterFile::run(int64_t loaded_time)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    while (this->running)
+    {
+        this->wake.wait_for(lock, std::chrono::milliseconds(FILTER_CHECK_INTERVAL_MS));
+        int64_t time = modification_time(this->path);
+        if (!this->running || time == loaded_time)
+        {
+            continue;
+        }
+        loaded_time = time;
+
+        ClientFilter filter;
+        std::string error;
+        if (!load_client_filter(this->path, &filter, &error))
+        {
+            LOG(LOG_LEVEL_WARNING, "Client filter: {}, keeping the previous rules.", error);
+            continue;
+        }
+        LOG(LOG_LEVEL_INFO, "Client filter: Loaded {} rules from {}.", filter.rules(), this->path);
+        this->on_change(std::move(filter));
+    }
+}
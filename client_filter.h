@@ -0,0 +1,75 @@
+#ifndef CLIENT_FILTER_H
+#define CLIENT_FILTER_H
+
+#include "proxy_common.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#define FILTER_NONE 0
+#define FILTER_ALLOW 1
+#define FILTER_DENY 2
+
+#define FILTER_STRIDE 256             // Slots per trie node, one per value of an address byte.
+#define FILTER_CHECK_INTERVAL_MS 2000 // How often the rules file is checked for changes.
+
+typedef struct
+{
+    int32_t child;   // Node holding the rules longer than this byte, -1 when none.
+    uint8_t verdict; // FILTER_*, of the longest rule ending in this node that covers the slot.
+    uint8_t length;  // Prefix length of that rule.
+} FilterSlot;
+
+typedef struct
+{
+    FilterSlot slots[FILTER_STRIDE];
+} FilterNode;
+
+// Allow and deny rules on client addresses, the longest matching prefix decides.
+// Addresses no rule covers are allowed, unless there is at least one allow rule.
+// Both families are tries with one byte per level, so a lookup reads at most 4
+// (IPv4) or 16 (IPv6) slots.
+class ClientFilter
+{
+private:
+    std::vector<FilterNode> tries[2]; // IPv4 and IPv6, node 0 is the root once a rule exists.
+    size_t rule_count = 0;
+    bool has_allow = false;
+
+    void insert(int trie, const uint8_t *address, int length, int verdict);
+    static int lookup(const std::vector<FilterNode> &nodes, const uint8_t *address, int size);
+
+public:
+    // "192.168.0.0/16", "2001:db8::/32" or a single address.
+    bool add_rule(const std::string &prefix, int verdict);
+    bool allows(const sockaddr *address) const;
+    bool empty() const;
+    size_t rules() const;
+};
+
+// One rule per line, "allow <prefix>" or "deny <prefix>", # starts a comment. On
+// failure error tells the line that couldn't be read.
+bool load_client_filter(const std::string &path, ClientFilter *filter, std::string *error);
+
+// Loads a rules file and loads it again whenever it's modified, on_change gets each
+// version that loads. A broken file is reported and the previous rules stay.
+class ClientFilterFile
+{
+private:
+    std::string path;
+    std::function<void(ClientFilter)> on_change;
+    std::mutex mutex;
+    std::condition_variable wake;
+    bool running = false;
+    std::thread watcher;
+
+    void run(int64_t loaded_time);
+
+public:
+    ~ClientFilterFile();
+    bool start(const std::string &path, std::function<void(ClientFilter)> on_change, std::string *error);
+    void stop();
+};
+
+#endif
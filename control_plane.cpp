@@ -0,0 +1,272 @@
+#include "control_plane.h"
+#include "logger.h"
+#include <algorithm>
+
+CancelToken::CancelToken(ControlExecutor *executor)
+{
+    this->executor = executor;
+}
+
+void CancelToken::cancel() const
+{
+    this->flag->store(true);
+    if (this->executor != nullptr)
+    {
+        this->executor->wake();
+    }
+}
+
+bool CancelToken::cancelled() const
+{
+    return this->flag->load();
+}
+
+// Coroutine owning a spawned Task, its frame goes away on its own once the task is done.
+struct DetachedTask
+{
+    struct promise_type
+    {
+        DetachedTask get_return_object() { return {std::coroutine_handle<promise_type>::from_promise(*this)}; }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() {}
+        void unhandled_exception() { std::terminate(); }
+    };
+    std::coroutine_handle<promise_type> handle;
+};
+
+static DetachedTask detach(Task<void> task)
+{
+    co_await task;
+}
+
+ControlExecutor::ControlExecutor()
+{
+    // Same loopback wake up as the engine's, poll() returns when a coroutine is posted or cancelled.
+    this->wake_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    this->wake_address.sin_family = AF_INET;
+    this->wake_address.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &this->wake_address.sin_addr);
+    socklen_t wake_len = sizeof(this->wake_address);
+    if (this->wake_socket < 0 ||
+        bind(this->wake_socket, (sockaddr *)&this->wake_address, sizeof(this->wake_address)) < 0 ||
+        getsockname(this->wake_socket, (sockaddr *)&this->wake_address, &wake_len) < 0)
+    {
+        LOG(LOG_LEVEL_WARNING, "Control: Wake socket creation failed, cancelling waits for the next poll timeout.");
+    }
+    else
+    {
+        set_socket_nonblocking(this->wake_socket);
+    }
+
+    this->running = true;
+    this->executor_thread = std::thread(&ControlExecutor::run, this);
+    for (int i = 0; i < CONTROL_BLOCKING_THREADS; i++)
+    {
+        std::thread(&ControlExecutor::work, this->helpers).detach();
+    }
+}
+
+ControlExecutor::~ControlExecutor()
+{
+    this->stop();
+    if (this->wake_socket >= 0)
+    {
+        close_socket(this->wake_socket);
+    }
+}
+
+void ControlExecutor::stop()
+{
+    if (!this->running)
+    {
+        return;
+    }
+    this->stopping = true;
+    this->wake();
+    if (this->executor_thread.joinable())
+    {
+        this->executor_thread.join();
+    }
+    this->running = false;
+    // Calls not started yet belong to cancelled coroutines, the running ones end on their own.
+    {
+        std::lock_guard<std::mutex> lock(this->helpers->mutex);
+        this->helpers->running = false;
+        this->helpers->jobs.clear();
+    }
+    this->helpers->jobs_changed.notify_all();
+}
+
+void ControlExecutor::wake()
+{
+    if (this->wake_socket >= 0)
+    {
+        char byte = 0;
+        sendto(this->wake_socket, &byte, 1, 0, (sockaddr *)&this->wake_address, sizeof(this->wake_address));
+    }
+}
+
+CancelToken ControlExecutor::token()
+{
+    return CancelToken(this);
+}
+
+void ControlExecutor::spawn(Task<void> task)
+{
+    this->post(detach(std::move(task)).handle);
+}
+
+void ControlExecutor::post(std::coroutine_handle<> handle)
+{
+    // Woken under the lock, the executor can't finish and go away before.
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->ready.push_back(handle);
+    this->wake();
+}
+
+void ControlExecutor::submit(std::function<void()> job)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->helpers->mutex);
+        this->helpers->jobs.push_back(std::move(job));
+    }
+    this->helpers->jobs_changed.notify_one();
+}
+
+ControlExecutor::WaitAwaiter ControlExecutor::sleep(int ms, const CancelToken &token)
+{
+    return WaitAwaiter{this, {{}, std::chrono::steady_clock::now() + std::chrono::milliseconds(ms), token, nullptr, nullptr}};
+}
+
+ControlExecutor::WaitAwaiter ControlExecutor::readable(std::vector<int> sockets, int timeout_ms, const CancelToken &token)
+{
+    return WaitAwaiter{this, {std::move(sockets), std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms), token, nullptr, nullptr}};
+}
+
+void ControlExecutor::work(std::shared_ptr<Helpers> helpers)
+{
+    while (true)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(helpers->mutex);
+            helpers->jobs_changed.wait(lock, [&helpers]()
+                                       { return !helpers->jobs.empty() || !helpers->running; });
+            if (!helpers->running)
+            {
+                return;
+            }
+            job = std::move(helpers->jobs.front());
+            helpers->jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void ControlExecutor::run()
+{
+    std::vector<pollfd> fds;
+    std::vector<size_t> owners; // Wait of each fds entry after the wake socket.
+    while (true)
+    {
+        std::deque<std::coroutine_handle<>> ready;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            ready.swap(this->ready);
+            // Stopping ends once every coroutine is done, none can be left waiting on anything.
+            if (this->stopping && ready.empty() && this->waits.empty() && this->calls.empty())
+            {
+                break;
+            }
+        }
+        for (auto handle : ready)
+        {
+            handle.resume();
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        int timeout = this->stopping ? 0 : CONTROL_POLL_TIMEOUT_MS;
+        fds.clear();
+        owners.clear();
+        fds.push_back({(socket_t)this->wake_socket, POLLIN, 0});
+        for (size_t i = 0; i < this->waits.size(); i++)
+        {
+            for (int s : this->waits[i].sockets)
+            {
+                fds.push_back({(socket_t)s, POLLIN, 0});
+                owners.push_back(i);
+            }
+            // Rounded up, waking up early would only poll again.
+            long long wait = std::chrono::duration_cast<std::chrono::milliseconds>(this->waits[i].deadline - now + std::chrono::microseconds(999)).count();
+            timeout = (int)std::clamp(wait, 0LL, (long long)timeout);
+        }
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            if (!this->ready.empty())
+            {
+                timeout = 0;
+            }
+        }
+        poll_sockets(fds.data(), fds.size(), timeout);
+        if (fds[0].revents & POLLIN)
+        {
+            char byte;
+            while (recv(this->wake_socket, &byte, 1, 0) >= 0)
+            {
+            }
+        }
+
+        std::vector<int> results(this->waits.size(), CONTROL_TIMEOUT);
+        std::vector<bool> readable(this->waits.size(), false);
+        for (size_t k = 1; k < fds.size(); k++)
+        {
+            size_t i = owners[k - 1];
+            if (!readable[i] && (fds[k].revents & (POLLIN | POLLERR | POLLHUP)))
+            {
+                // Index within that wait's sockets.
+                results[i] = (int)(std::find(this->waits[i].sockets.begin(), this->waits[i].sockets.end(), (int)fds[k].fd) - this->waits[i].sockets.begin());
+                readable[i] = true;
+            }
+        }
+        now = std::chrono::steady_clock::now();
+        std::vector<Wait> pending;
+        std::vector<std::pair<Wait, int>> finished;
+        for (size_t i = 0; i < this->waits.size(); i++)
+        {
+            Wait &wait = this->waits[i];
+            if (this->stopping || wait.token.cancelled())
+            {
+                finished.push_back({wait, CONTROL_CANCELLED});
+            }
+            else if (readable[i] || now >= wait.deadline)
+            {
+                finished.push_back({wait, results[i]});
+            }
+            else
+            {
+                pending.push_back(std::move(wait));
+            }
+        }
+        this->waits.swap(pending);
+        for (auto &entry : finished)
+        {
+            *entry.first.result = entry.second;
+            entry.first.handle.resume();
+        }
+
+        // Blocking calls a helper thread didn't finish yet, those it did are resumed from ready.
+        std::vector<std::shared_ptr<BlockingCall>> cancelled;
+        for (const auto &call : this->calls)
+        {
+            if ((this->stopping || call->token.cancelled()) && !call->claimed.exchange(true))
+            {
+                cancelled.push_back(call);
+            }
+        }
+        for (auto &call : cancelled)
+        {
+            call->handle.resume();
+        }
+    }
+}
@@ -0,0 +1,258 @@
+#ifndef CONTROL_PLANE_H
+#define CONTROL_PLANE_H
+
+#include "proxy_common.h"
+#include <algorithm>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#define CONTROL_BLOCKING_THREADS 2  // Run the calls that can only block (getaddrinfo) for every coroutine.
+#define CONTROL_POLL_TIMEOUT_MS 1000 // Upper bound between two looks at the cancelled waits.
+
+#define CONTROL_TIMEOUT -1   // A wait ran out of time, readable sockets give their index instead.
+#define CONTROL_CANCELLED -2 // Its token was cancelled or the executor is stopping.
+
+class ControlExecutor;
+
+// Shared by the coroutine checking it and whoever may stop it, copies share the flag.
+// Cancelling also wakes the coroutine out of whatever it waits on.
+class CancelToken
+{
+private:
+    std::shared_ptr<std::atomic<bool>> flag = std::make_shared<std::atomic<bool>>(false);
+    ControlExecutor *executor = nullptr;
+
+public:
+    CancelToken() = default;
+    explicit CancelToken(ControlExecutor *executor);
+    void cancel() const;
+    bool cancelled() const;
+};
+
+// Result of a coroutine, started when awaited and resuming its awaiter once done.
+template <typename T>
+class Task;
+
+template <typename T>
+struct TaskPromiseBase
+{
+    std::coroutine_handle<> continuation;
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+        template <typename Promise>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept
+        {
+            std::coroutine_handle<> next = handle.promise().continuation;
+            return next ? next : std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() { std::terminate(); }
+};
+
+template <typename T>
+struct TaskPromise : TaskPromiseBase<T>
+{
+    std::optional<T> value;
+    Task<T> get_return_object();
+    void return_value(T value) { this->value = std::move(value); }
+};
+
+template <>
+struct TaskPromise<void> : TaskPromiseBase<void>
+{
+    Task<void> get_return_object();
+    void return_void() {}
+};
+
+template <typename T>
+class Task
+{
+public:
+    typedef TaskPromise<T> promise_type;
+
+private:
+    std::coroutine_handle<promise_type> handle;
+
+public:
+    explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+    Task(Task &&other) noexcept : handle(std::exchange(other.handle, nullptr)) {}
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+    ~Task()
+    {
+        if (this->handle)
+        {
+            this->handle.destroy();
+        }
+    }
+
+    bool await_ready() { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiter)
+    {
+        this->handle.promise().continuation = awaiter;
+        return this->handle;
+    }
+    T await_resume()
+    {
+        if constexpr (!std::is_void_v<T>)
+        {
+            return std::move(*this->handle.promise().value);
+        }
+    }
+};
+
+template <typename T>
+Task<T> TaskPromise<T>::get_return_object()
+{
+    return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object()
+{
+    return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+// Runs coroutines for the control plane (resolving, probing, starting and watching
+// proxies) on one thread, so any number of them can wait on sockets, timers or
+// cancellation at once. Blocking calls go to a couple of helper threads.
+class ControlExecutor
+{
+private:
+    typedef struct
+    {
+        std::vector<int> sockets; // Empty for a plain sleep.
+        std::chrono::steady_clock::time_point deadline;
+        CancelToken token;
+        std::coroutine_handle<> handle;
+        int *result;
+    } Wait;
+
+    // Blocking call a coroutine waits on. Whoever sets claimed first resumes it, the helper
+    // thread with the result or the executor thread once its token is cancelled.
+    struct BlockingCall
+    {
+        ControlExecutor *executor;
+        CancelToken token;
+        std::coroutine_handle<> handle;
+        std::atomic<bool> claimed{false};
+    };
+
+    // Queue of the helper threads, they keep it alive themselves so stop() doesn't wait on a
+    // call whose coroutine was cancelled.
+    struct Helpers
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+        std::condition_variable jobs_changed;
+        bool running = true;
+    };
+
+    std::mutex mutex;
+    std::deque<std::coroutine_handle<>> ready;        // Resumed by the executor thread, posted from any thread.
+    std::vector<Wait> waits;                          // Only touched by the executor thread.
+    std::vector<std::shared_ptr<BlockingCall>> calls; // Same.
+    std::shared_ptr<Helpers> helpers = std::make_shared<Helpers>();
+    std::atomic<bool> running{false};
+    std::atomic<bool> stopping{false};
+    std::thread executor_thread;
+    int wake_socket = -1;
+    sockaddr_in wake_address{};
+
+    void run();
+    static void work(std::shared_ptr<Helpers> helpers);
+    void post(std::coroutine_handle<> handle);
+    void submit(std::function<void()> job);
+
+public:
+    ControlExecutor();
+    ~ControlExecutor();
+    // Cancels every wait and returns once all coroutines finished. Blocking calls still running
+    // are left to their helper thread, which drops their result.
+    void stop();
+    void wake();
+    CancelToken token();
+    // Starts a coroutine on the executor thread, nobody awaits it.
+    void spawn(Task<void> task);
+
+    struct WaitAwaiter
+    {
+        ControlExecutor *executor;
+        Wait wait;
+        int result = CONTROL_CANCELLED;
+
+        bool await_ready() { return this->wait.token.cancelled() || this->executor->stopping; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            this->wait.handle = handle;
+            this->wait.result = &this->result;
+            this->executor->waits.push_back(this->wait);
+        }
+        int await_resume() { return this->result; }
+    };
+
+    template <typename T>
+    struct BlockingAwaiter
+    {
+        // Owned by the helper thread as well, the call may outlive the awaiting coroutine.
+        struct State : BlockingCall
+        {
+            std::function<T()> call;
+            std::optional<T> result;
+        };
+        std::shared_ptr<State> state;
+
+        bool await_ready() { return this->state->token.cancelled() || this->state->executor->stopping; }
+        void await_suspend(std::coroutine_handle<> handle)
+        {
+            this->state->handle = handle;
+            this->state->executor->calls.push_back(this->state);
+            this->state->executor->submit([state = this->state]()
+                                          {
+                T result = state->call();
+                // Nobody collects it once cancelled, it goes away with this job.
+                if (!state->claimed.exchange(true))
+                {
+                    state->result.emplace(std::move(result));
+                    state->executor->post(state->handle);
+                } });
+        }
+        std::optional<T> await_resume()
+        {
+            auto &calls = this->state->executor->calls;
+            calls.erase(std::remove(calls.begin(), calls.end(), this->state), calls.end());
+            return std::move(this->state->result);
+        }
+    };
+
+    // CONTROL_TIMEOUT once ms passed, CONTROL_CANCELLED sooner.
+    WaitAwaiter sleep(int ms, const CancelToken &token);
+    // Index of the first readable socket (errors count as readable), CONTROL_TIMEOUT or CONTROL_CANCELLED.
+    WaitAwaiter readable(std::vector<int> sockets, int timeout_ms, const CancelToken &token);
+    // Runs call on a helper thread and resumes with its result, or with nothing right away
+    // once token is cancelled.
+    template <typename T>
+    BlockingAwaiter<T> blocking(std::function<T()> call, const CancelToken &token)
+    {
+        auto state = std::make_shared<typename BlockingAwaiter<T>::State>();
+        state->executor = this;
+        state->token = token;
+        state->call = std::move(call);
+        return BlockingAwaiter<T>{std::move(state)};
+    }
+};
+
+#endif
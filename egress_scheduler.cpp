@@ -0,0 +1,247 @@
+#include "egress_scheduler.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstring>
+#include <iterator>
+
+#define EGRESS_BLOCKED -1 // From transmit(), the socket's buffer is full.
+
+static sockaddr_storage flow_key(const sockaddr *to, socklen_t to_len)
+{
+    sockaddr_storage key{};
+    if (to_len > 0)
+    {
+        memcpy(&key, to, to_len);
+    }
+    return key;
+}
+
+int EgressScheduler::transmit(int s, EgressSocket *state, EgressFlow *flow, const sockaddr *to, socklen_t to_len, const char *data, int size,
+                              int64_t now_ns, int64_t pace_bytes_per_second)
+{
+    int64_t departure = 0;
+    int64_t previous = flow->next_departure_ns;
+    if (pace_bytes_per_second > 0 && state->txtime > 0)
+    {
+        departure = std::max(now_ns, flow->next_departure_ns);
+        if (departure - now_ns > (int64_t)EGRESS_PACING_HORIZON_MS * 1000000)
+        {
+            return EGRESS_DROPPED;
+        }
+        flow->next_departure_ns = departure + (int64_t)size * 1000000000 / pace_bytes_per_second;
+    }
+    if (send_datagram_at(s, to, to_len, data, size, departure) >= 0)
+    {
+        return EGRESS_SENT;
+    }
+    flow->next_departure_ns = previous;
+    return socket_buffer_full() ? EGRESS_BLOCKED : EGRESS_FAILED;
+}
+
+int EgressScheduler::enqueue(EgressSocket *state, EgressFlow *flow, const sockaddr *to, socklen_t to_len, const char *data, int size)
+{
+    if (size > PROXY_MAX_DATAGRAM || flow->packets.size() >= EGRESS_FLOW_LIMIT || this->size() >= EGRESS_QUEUE_LIMIT)
+    {
+        return EGRESS_DROPPED;
+    }
+
+    int slot;
+    if (this->free_slots.empty())
+    {
+        slot = this->slots.size();
+        this->slots.emplace_back();
+    }
+    else
+    {
+        slot = this->free_slots.back();
+        this->free_slots.pop_back();
+    }
+
+    EgressPacket &packet = this->slots[slot];
+    packet.to_len = to_len;
+    if (to_len > 0)
+    {
+        memcpy(&packet.to, to, to_len);
+    }
+    packet.size = size;
+    if (size > EGRESS_PACKET_SIZE)
+    {
+        packet.large.assign(data, data + size);
+    }
+    else
+    {
+        memcpy(packet.data, data, size);
+    }
+
+    if (flow->packets.empty())
+    {
+        if (state->round.empty())
+        {
+            this->backlogs++;
+        }
+        flow->deficit = 0;
+        state->round.push_back(flow);
+    }
+    flow->packets.push_back(slot);
+    return EGRESS_QUEUED;
+}
+
+// Large datagrams don't keep their buffer, a burst of them would hold it forever.
+void EgressScheduler::free_slot(int slot)
+{
+    std::vector<char>().swap(this->slots[slot].large);
+    this->free_slots.push_back(slot);
+}
+
+int EgressScheduler::send(int s, const sockaddr *to, socklen_t to_len, const char *data, int size, int64_t now_ns, int64_t pace_bytes_per_second)
+{
+    auto known = this->sockets.find(s);
+    if (pace_bytes_per_second <= 0 && (known == this->sockets.end() || known->second.round.empty()))
+    {
+        // Nothing queued and nothing to pace, the common case.
+        if (send_datagram_at(s, to, to_len, data, size, 0) >= 0)
+        {
+            return EGRESS_SENT;
+        }
+        if (!socket_buffer_full())
+        {
+            return EGRESS_FAILED;
+        }
+        EgressSocket *state = &this->sockets[s];
+        return this->enqueue(state, &state->flows[flow_key(to, to_len)], to, to_len, data, size);
+    }
+
+    EgressSocket *state = &this->sockets[s];
+    if (pace_bytes_per_second > 0 && state->txtime == 0)
+    {
+        state->txtime = enable_txtime(s) == 0 ? 1 : -1;
+        if (state->txtime < 0 && !this->txtime_warned)
+        {
+            LOG(LOG_LEVEL_WARNING, "Engine: SO_TXTIME refused, pacing needs Linux 4.19 or later.");
+            this->txtime_warned = true;
+        }
+    }
+    EgressFlow *flow = &state->flows[flow_key(to, to_len)];
+    // Behind what already waits, both to keep the order and to take turns fairly.
+    if (!state->round.empty())
+    {
+        return this->enqueue(state, flow, to, to_len, data, size);
+    }
+    int result = this->transmit(s, state, flow, to, to_len, data, size, now_ns, pace_bytes_per_second);
+    if (result == EGRESS_BLOCKED)
+    {
+        return this->enqueue(state, flow, to, to_len, data, size);
+    }
+    return result;
+}
+
+bool EgressScheduler::drain(int s, int64_t now_ns, int64_t pace_bytes_per_second, uint64_t *dropped)
+{
+    auto known = this->sockets.find(s);
+    if (known == this->sockets.end() || known->second.round.empty())
+    {
+        return true;
+    }
+    EgressSocket *state = &known->second;
+    while (!state->round.empty())
+    {
+        EgressFlow *flow = state->round.front();
+        if (!state->credited)
+        {
+            flow->deficit += EGRESS_QUANTUM;
+            state->credited = true;
+        }
+        while (!flow->packets.empty())
+        {
+            int slot = flow->packets.front();
+            EgressPacket &packet = this->slots[slot];
+            if (packet.size > flow->deficit)
+            {
+                break;
+            }
+            const char *data = packet.size > EGRESS_PACKET_SIZE ? packet.large.data() : packet.data;
+            int result = this->transmit(s, state, flow, (const sockaddr *)&packet.to, packet.to_len, data, packet.size,
+                                        now_ns, pace_bytes_per_second);
+            if (result == EGRESS_BLOCKED)
+            {
+                return false;
+            }
+            if (result != EGRESS_SENT)
+            {
+                (*dropped)++;
+            }
+            flow->deficit -= packet.size;
+            flow->packets.pop_front();
+            this->free_slot(slot);
+        }
+        state->round.pop_front();
+        state->credited = false;
+        if (flow->packets.empty())
+        {
+            flow->deficit = 0;
+        }
+        else
+        {
+            state->round.push_back(flow);
+        }
+    }
+    this->backlogs--;
+    return true;
+}
+
+bool EgressScheduler::backlogged(int s)
+{
+    auto known = this->sockets.find(s);
+    return known != this->sockets.end() && !known->second.round.empty();
+}
+
+bool EgressScheduler::backlogged()
+{
+    return this->backlogs > 0;
+}
+
+void EgressScheduler::expire(int64_t now_ns)
+{
+    for (auto socket = this->sockets.begin(); socket != this->sockets.end();)
+    {
+        auto &flows = socket->second.flows;
+        for (auto flow = flows.begin(); flow != flows.end();)
+        {
+            if (flow->second.packets.empty() && flow->second.next_departure_ns <= now_ns)
+            {
+                flow = flows.erase(flow);
+            }
+            else
+            {
+                ++flow;
+            }
+        }
+        socket = flows.empty() ? this->sockets.erase(socket) : std::next(socket);
+    }
+}
+
+void EgressScheduler::cancel(int s)
+{
+    auto known = this->sockets.find(s);
+    if (known == this->sockets.end())
+    {
+        return;
+    }
+    for (auto &flow : known->second.flows)
+    {
+        for (int slot : flow.second.packets)
+        {
+            this->free_slot(slot);
+        }
+    }
+    if (!known->second.round.empty())
+    {
+        this->backlogs--;
+    }
+    this->sockets.erase(known);
+}
+
+size_t EgressScheduler::size()
+{
+    return this->slots.size() - this->free_slots.size();
+}
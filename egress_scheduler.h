@@ -0,0 +1,80 @@
+#ifndef EGRESS_SCHEDULER_H
+#define EGRESS_SCHEDULER_H
+
+#include "proxy_common.h"
+#include <deque>
+#include <unordered_map>
+#include <vector>
+
+#define EGRESS_PACKET_SIZE 2048     // Datagrams up to this are kept in the slot, larger ones in a buffer of their own while queued.
+#define EGRESS_QUANTUM 2048         // Bytes a destination may send per turn, at least one datagram.
+#define EGRESS_FLOW_LIMIT 256       // Datagrams one destination may have waiting, the next ones are dropped.
+#define EGRESS_QUEUE_LIMIT 65536    // Datagrams waiting over every socket.
+#define EGRESS_PACING_HORIZON_MS 50 // A paced datagram that couldn't leave before this is dropped.
+
+#define EGRESS_SENT 0
+#define EGRESS_QUEUED 1  // The socket was full, the datagram waits for it to drain.
+#define EGRESS_DROPPED 2 // Its queue was full or pacing would hold it too long.
+#define EGRESS_FAILED 3  // errno (WSAGetLastError on Windows) tells why.
+
+typedef struct
+{
+    sockaddr_storage to; // Unused when to_len is 0, the socket is connected.
+    socklen_t to_len;
+    int size;
+    char data[EGRESS_PACKET_SIZE];
+    std::vector<char> large; // Datagrams above EGRESS_PACKET_SIZE, up to PROXY_MAX_DATAGRAM.
+} EgressPacket;
+
+// What a socket sends to one destination.
+typedef struct
+{
+    std::deque<int> packets;   // Slots waiting, oldest first.
+    int deficit;               // Bytes it may still send this turn.
+    int64_t next_departure_ns; // Pacing, CLOCK_MONOTONIC.
+} EgressFlow;
+
+typedef struct
+{
+    std::unordered_map<sockaddr_storage, EgressFlow, SockaddrHash, SockaddrEqual> flows;
+    std::deque<EgressFlow *> round; // Flows with datagrams waiting, the front one sends next.
+    bool credited;                  // The front flow got its quantum for this turn.
+    int txtime;                     // SO_TXTIME: 0 not tried, 1 enabled, -1 refused.
+} EgressSocket;
+
+// Per destination queues in front of the sockets, only used from the engine thread.
+// Datagrams go straight to the kernel until a socket is full, then they wait and the
+// destinations of that socket take turns (deficit round robin) once it's writable,
+// so one client's burst can't crowd the others out of a shared listening socket.
+// With a pacing rate, each destination's datagrams get SO_TXTIME departure times
+// spaced by that rate, which the fq qdisc keeps.
+class EgressScheduler
+{
+private:
+    std::deque<EgressPacket> slots; // Grows without moving the queued datagrams.
+    std::vector<int> free_slots;
+    std::unordered_map<int, EgressSocket> sockets;
+    size_t backlogs = 0; // Sockets with datagrams waiting.
+    bool txtime_warned = false;
+
+    int transmit(int s, EgressSocket *state, EgressFlow *flow, const sockaddr *to, socklen_t to_len, const char *data, int size,
+                 int64_t now_ns, int64_t pace_bytes_per_second);
+    int enqueue(EgressSocket *state, EgressFlow *flow, const sockaddr *to, socklen_t to_len, const char *data, int size);
+    void free_slot(int slot);
+
+public:
+    // EGRESS_*, pace_bytes_per_second 0 sends without departure times.
+    int send(int s, const sockaddr *to, socklen_t to_len, const char *data, int size, int64_t now_ns, int64_t pace_bytes_per_second);
+    // Sends what the socket takes once it's writable, true when nothing waits anymore.
+    // Datagrams the kernel refuses for another reason than a full buffer count as dropped.
+    bool drain(int s, int64_t now_ns, int64_t pace_bytes_per_second, uint64_t *dropped);
+    bool backlogged(int s);
+    bool backlogged();
+    // Forgets destinations with nothing queued and no pacing delay left.
+    void expire(int64_t now_ns);
+    // Forgets the datagrams of a socket about to be closed, its number may be reused.
+    void cancel(int s);
+    size_t size();
+};
+
+#endif
@@ -0,0 +1,173 @@
+#include "gf256.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define GF256_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define GF256_NEON
+#include <arm_neon.h>
+#endif
+
+typedef struct
+{
+    uint8_t log[256];
+    uint8_t exp[512]; // Doubled so log[a] + log[b] never needs a modulo.
+    uint8_t mul[256][256];
+} GfTables;
+
+static GfTables build_tables()
+{
+    GfTables tables{};
+    int x = 1;
+    for (int i = 0; i < 255; i++)
+    {
+        tables.exp[i] = (uint8_t)x;
+        tables.exp[i + 255] = (uint8_t)x;
+        tables.log[x] = (uint8_t)i;
+        x <<= 1;
+        if (x & 0x100)
+        {
+            x ^= 0x11D;
+        }
+    }
+    for (int a = 1; a < 256; a++)
+    {
+        for (int b = 1; b < 256; b++)
+        {
+            tables.mul[a][b] = tables.exp[tables.log[a] + tables.log[b]];
+        }
+    }
+    return tables;
+}
+
+static const GfTables tables = build_tables();
+
+uint8_t gf256_mul(uint8_t a, uint8_t b)
+{
+    return tables.mul[a][b];
+}
+
+uint8_t gf256_inv(uint8_t a)
+{
+    return a == 0 ? 0 : tables.exp[255 - tables.log[a]];
+}
+
+static void mul_add_scalar(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size)
+{
+    const uint8_t *row = tables.mul[c];
+    for (size_t i = 0; i < size; i++)
+    {
+        dst[i] ^= row[src[i]];
+    }
+}
+
+// The vector kernels split every byte in two nibbles, c * b = low[b & 15] ^ high[b >> 4],
+// and look both up 16 or 32 bytes at a time with a byte shuffle.
+static void nibble_tables(uint8_t c, uint8_t *low, uint8_t *high)
+{
+    for (int i = 0; i < 16; i++)
+    {
+        low[i] = tables.mul[c][i];
+        high[i] = tables.mul[c][i << 4];
+    }
+}
+
+#ifdef GF256_X86
+__attribute__((target("ssse3"))) static void mul_add_ssse3(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size)
+{
+    alignas(16) uint8_t low[16], high[16];
+    nibble_tables(c, low, high);
+    __m128i low_table = _mm_load_si128((const __m128i *)low);
+    __m128i high_table = _mm_load_si128((const __m128i *)high);
+    __m128i mask = _mm_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(src + i));
+        __m128i product = _mm_xor_si128(_mm_shuffle_epi8(low_table, _mm_and_si128(bytes, mask)),
+                                        _mm_shuffle_epi8(high_table, _mm_and_si128(_mm_srli_epi64(bytes, 4), mask)));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(_mm_loadu_si128((const __m128i *)(dst + i)), product));
+    }
+    mul_add_scalar(dst + i, src + i, c, size - i);
+}
+
+__attribute__((target("avx2"))) static void mul_add_avx2(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size)
+{
+    alignas(16) uint8_t low[16], high[16];
+    nibble_tables(c, low, high);
+    __m256i low_table = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)low));
+    __m256i high_table = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)high));
+    __m256i mask = _mm256_set1_epi8(0x0F);
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)(src + i));
+        __m256i product = _mm256_xor_si256(_mm256_shuffle_epi8(low_table, _mm256_and_si256(bytes, mask)),
+                                           _mm256_shuffle_epi8(high_table, _mm256_and_si256(_mm256_srli_epi64(bytes, 4), mask)));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(dst + i)), product));
+    }
+    mul_add_scalar(dst + i, src + i, c, size - i);
+}
+#endif
+
+#ifdef GF256_NEON
+static void mul_add_neon(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size)
+{
+    uint8_t low[16], high[16];
+    nibble_tables(c, low, high);
+    uint8x16_t low_table = vld1q_u8(low);
+    uint8x16_t high_table = vld1q_u8(high);
+    uint8x16_t mask = vdupq_n_u8(0x0F);
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16)
+    {
+        uint8x16_t bytes = vld1q_u8(src + i);
+        uint8x16_t product = veorq_u8(vqtbl1q_u8(low_table, vandq_u8(bytes, mask)),
+                                      vqtbl1q_u8(high_table, vshrq_n_u8(bytes, 4)));
+        vst1q_u8(dst + i, veorq_u8(vld1q_u8(dst + i), product));
+    }
+    mul_add_scalar(dst + i, src + i, c, size - i);
+}
+#endif
+
+typedef void (*MulAdd)(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size);
+
+static MulAdd pick_kernel(const char **name)
+{
+#ifdef GF256_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        *name = "avx2";
+        return mul_add_avx2;
+    }
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        *name = "ssse3";
+        return mul_add_ssse3;
+    }
+#endif
+#ifdef GF256_NEON
+    *name = "neon";
+    return mul_add_neon;
+#endif
+    *name = "scalar";
+    return mul_add_scalar;
+}
+
+static const char *kernel_name;
+static const MulAdd kernel = pick_kernel(&kernel_name);
+
+void gf256_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size)
+{
+    if (c == 0)
+    {
+        return;
+    }
+    kernel(dst, src, c, size);
+}
+
+const char *gf256_kernel()
+{
+    return kernel_name;
+}
@@ -0,0 +1,15 @@
+#ifndef GF256_H
+#define GF256_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Arithmetic in GF(2^8) with the 0x11D polynomial, used by the tunnel's Reed-Solomon parity.
+uint8_t gf256_mul(uint8_t a, uint8_t b);
+uint8_t gf256_inv(uint8_t a);
+// dst[i] ^= c * src[i], the FEC hot loop. Uses AVX2 or SSSE3 when the CPU has them
+// (NEON on ARM), a table lookup per byte otherwise.
+void gf256_mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t size);
+const char *gf256_kernel();
+
+#endif
@@ -0,0 +1,423 @@
+#include "handoff.h"
+#include <algorithm>
+#include <cstring>
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+
+#define HANDOFF_MAX_SIZE (64 * 1024 * 1024) // Larger tables are refused, the sender isn't a proxy.
+#define HANDOFF_ACK 'A'
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// Records as sent, both processes run on the same machine so fields stay native.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t routes;
+    uint32_t sockets;
+} HandoffHeader;
+
+typedef struct
+{
+    int32_t listen_socket; // Index in the sockets sent after the records.
+    int32_t listen_port;
+    sockaddr_storage upstream;
+    uint32_t upstream_len;
+    int32_t tunnel;
+    uint32_t backends;
+    uint32_t sessions;
+} HandoffRouteRecord;
+
+typedef struct
+{
+    sockaddr_storage address;
+    uint32_t address_len;
+    uint8_t healthy;
+} HandoffBackendRecord;
+
+typedef struct
+{
+    sockaddr_storage client;
+    uint32_t client_len;
+    int32_t upstream; // Index in the sockets.
+    int32_t backend;
+    uint8_t replied;
+    uint8_t confirmed;
+} HandoffSessionRecord;
+
+void handoff_close(const std::vector<HandoffRoute> &routes)
+{
+    for (const auto &route : routes)
+    {
+        close_socket(route.listen_socket);
+        for (const auto &session : route.sessions)
+        {
+            close_socket(session.upstream);
+        }
+    }
+}
+
+#ifdef _WIN32
+
+// Windows would need WSADuplicateSocket and the successor's process id instead.
+int handoff_listen(const std::string &path)
+{
+    return -1;
+}
+
+int handoff_connect(const std::string &path)
+{
+    return -1;
+}
+
+int handoff_accept(int listener)
+{
+    return -1;
+}
+
+int handoff_send(int s, const std::vector<HandoffRoute> &routes)
+{
+    return 1;
+}
+
+int handoff_receive(int s, std::vector<HandoffRoute> *routes)
+{
+    return 1;
+}
+
+int handoff_acknowledge(int s)
+{
+    return 1;
+}
+
+bool handoff_acknowledged(int s)
+{
+    return false;
+}
+
+#else
+
+static bool unix_address(const std::string &path, sockaddr_un *address)
+{
+    if (path.empty() || path.size() >= sizeof(address->sun_path))
+    {
+        return false;
+    }
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, path.c_str(), path.size());
+    return true;
+}
+
+// Blocking calls on both ends, bounded so a stuck peer can't hang the other process.
+static void set_timeouts(int s)
+{
+    timeval timeout{HANDOFF_TIMEOUT_MS / 1000, (HANDOFF_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+static bool send_all(int s, const void *data, size_t size)
+{
+    const char *next = (const char *)data;
+    while (size > 0)
+    {
+        ssize_t sent = send(s, next, size, MSG_NOSIGNAL);
+        if (sent <= 0)
+        {
+            return false;
+        }
+        next += sent;
+        size -= sent;
+    }
+    return true;
+}
+
+static bool receive_all(int s, void *data, size_t size)
+{
+    char *next = (char *)data;
+    while (size > 0)
+    {
+        ssize_t received = recv(s, next, size, 0);
+        if (received <= 0)
+        {
+            return false;
+        }
+        next += received;
+        size -= received;
+    }
+    return true;
+}
+
+static void append(std::vector<char> *out, const void *data, size_t size)
+{
+    out->insert(out->end(), (const char *)data, (const char *)data + size);
+}
+
+static bool take(const std::vector<char> &in, size_t *offset, void *data, size_t size)
+{
+    if (in.size() - *offset < size)
+    {
+        return false;
+    }
+    memcpy(data, in.data() + *offset, size);
+    *offset += size;
+    return true;
+}
+
+int handoff_listen(const std::string &path)
+{
+    sockaddr_un address;
+    if (!unix_address(path, &address))
+    {
+        return -1;
+    }
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0)
+    {
+        return -1;
+    }
+    // Left over by a process that didn't exit cleanly.
+    unlink(path.c_str());
+    if (bind(s, (sockaddr *)&address, sizeof(address)) < 0 || chmod(path.c_str(), 0600) < 0 || listen(s, 1) < 0)
+    {
+        close_socket(s);
+        return -1;
+    }
+    set_socket_nonblocking(s);
+    return s;
+}
+
+int handoff_connect(const std::string &path)
+{
+    sockaddr_un address;
+    if (!unix_address(path, &address))
+    {
+        return -1;
+    }
+    int s = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (s < 0)
+    {
+        return -1;
+    }
+    if (::connect(s, (sockaddr *)&address, sizeof(address)) < 0)
+    {
+        close_socket(s);
+        return -1;
+    }
+    set_timeouts(s);
+    return s;
+}
+
+// Only a process of the same user gets the sockets, whatever the permissions of path.
+int handoff_accept(int listener)
+{
+    int s = accept(listener, nullptr, nullptr);
+    if (s < 0)
+    {
+        return -1;
+    }
+#if defined(__linux__)
+    ucred peer{};
+    socklen_t peer_len = sizeof(peer);
+    bool same_user = getsockopt(s, SOL_SOCKET, SO_PEERCRED, &peer, &peer_len) == 0 && peer.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    bool same_user = getpeereid(s, &uid, &gid) == 0 && uid == getuid();
+#endif
+    if (!same_user)
+    {
+        close_socket(s);
+        return -1;
+    }
+    set_timeouts(s);
+    return s;
+}
+
+int handoff_send(int s, const std::vector<HandoffRoute> &routes)
+{
+    std::vector<char> blob;
+    std::vector<int> sockets;
+    HandoffHeader header{HANDOFF_MAGIC, HANDOFF_VERSION, (uint32_t)routes.size(), 0};
+    append(&blob, &header, sizeof(header));
+    for (const auto &route : routes)
+    {
+        HandoffRouteRecord record{(int32_t)sockets.size(), route.listen_port, route.upstream, (uint32_t)route.upstream_len, route.tunnel,
+                                  (uint32_t)route.backends.size(), (uint32_t)route.sessions.size()};
+        sockets.push_back(route.listen_socket);
+        append(&blob, &record, sizeof(record));
+        for (const auto &backend : route.backends)
+        {
+            HandoffBackendRecord backend_record{backend.address, (uint32_t)backend.address_len, backend.healthy};
+            append(&blob, &backend_record, sizeof(backend_record));
+        }
+        for (const auto &session : route.sessions)
+        {
+            HandoffSessionRecord session_record{session.client, (uint32_t)session.client_len, (int32_t)sockets.size(), session.backend,
+                                                session.replied, session.confirmed};
+            sockets.push_back(session.upstream);
+            append(&blob, &session_record, sizeof(session_record));
+        }
+    }
+    header.sockets = sockets.size();
+    memcpy(blob.data(), &header, sizeof(header));
+
+    uint32_t size = blob.size();
+    if (!send_all(s, &size, sizeof(size)) || !send_all(s, blob.data(), blob.size()))
+    {
+        return 1;
+    }
+    // The sockets follow in chunks, each riding on one byte.
+    for (size_t first = 0; first < sockets.size(); first += HANDOFF_FDS_PER_MESSAGE)
+    {
+        size_t count = std::min(sockets.size() - first, (size_t)HANDOFF_FDS_PER_MESSAGE);
+        char byte = 0;
+        iovec payload{&byte, 1};
+        std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+        msghdr message{};
+        message.msg_iov = &payload;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+        cmsghdr *rights = CMSG_FIRSTHDR(&message);
+        rights->cmsg_level = SOL_SOCKET;
+        rights->cmsg_type = SCM_RIGHTS;
+        rights->cmsg_len = CMSG_LEN(count * sizeof(int));
+        memcpy(CMSG_DATA(rights), &sockets[first], count * sizeof(int));
+        if (sendmsg(s, &message, MSG_NOSIGNAL) != 1)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static bool receive_sockets(int s, size_t expected, std::vector<int> *sockets)
+{
+    std::vector<char> control(CMSG_SPACE(HANDOFF_FDS_PER_MESSAGE * sizeof(int)));
+    while (sockets->size() < expected)
+    {
+        char byte;
+        iovec payload{&byte, 1};
+        msghdr message{};
+        message.msg_iov = &payload;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data();
+        message.msg_controllen = control.size();
+#ifdef MSG_CMSG_CLOEXEC
+        ssize_t received = recvmsg(s, &message, MSG_CMSG_CLOEXEC);
+#else
+        ssize_t received = recvmsg(s, &message, 0);
+#endif
+        if (received != 1)
+        {
+            return false;
+        }
+        for (cmsghdr *rights = CMSG_FIRSTHDR(&message); rights != nullptr; rights = CMSG_NXTHDR(&message, rights))
+        {
+            if (rights->cmsg_level == SOL_SOCKET && rights->cmsg_type == SCM_RIGHTS)
+            {
+                size_t count = (rights->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const int *received_sockets = (const int *)CMSG_DATA(rights);
+                sockets->insert(sockets->end(), received_sockets, received_sockets + count);
+            }
+        }
+        if (message.msg_flags & MSG_CTRUNC)
+        {
+            return false;
+        }
+    }
+    return sockets->size() == expected;
+}
+
+static bool parse_routes(const std::vector<char> &blob, size_t offset, uint32_t count, const std::vector<int> &sockets, std::vector<HandoffRoute> *routes)
+{
+    for (uint32_t i = 0; i < count; i++)
+    {
+        HandoffRouteRecord record;
+        if (!take(blob, &offset, &record, sizeof(record)) ||
+            record.listen_socket < 0 || (size_t)record.listen_socket >= sockets.size() ||
+            record.upstream_len > sizeof(sockaddr_storage))
+        {
+            return false;
+        }
+        HandoffRoute route{sockets[record.listen_socket], record.listen_port, record.upstream, (socklen_t)record.upstream_len, record.tunnel, {}, {}};
+        for (uint32_t j = 0; j < record.backends; j++)
+        {
+            HandoffBackendRecord backend;
+            if (!take(blob, &offset, &backend, sizeof(backend)) || backend.address_len > sizeof(sockaddr_storage))
+            {
+                return false;
+            }
+            route.backends.push_back({backend.address, (socklen_t)backend.address_len, backend.healthy != 0});
+        }
+        for (uint32_t j = 0; j < record.sessions; j++)
+        {
+            HandoffSessionRecord session;
+            if (!take(blob, &offset, &session, sizeof(session)) ||
+                session.upstream < 0 || (size_t)session.upstream >= sockets.size() ||
+                session.client_len > sizeof(sockaddr_storage))
+            {
+                return false;
+            }
+            route.sessions.push_back({session.client, (socklen_t)session.client_len, sockets[session.upstream], session.backend,
+                                      session.replied != 0, session.confirmed != 0});
+        }
+        routes->push_back(std::move(route));
+    }
+    return offset == blob.size();
+}
+
+int handoff_receive(int s, std::vector<HandoffRoute> *routes)
+{
+    routes->clear();
+    uint32_t size;
+    HandoffHeader header;
+    if (!receive_all(s, &size, sizeof(size)) || size < sizeof(header) || size > HANDOFF_MAX_SIZE)
+    {
+        return 1;
+    }
+    std::vector<char> blob(size);
+    if (!receive_all(s, blob.data(), blob.size()))
+    {
+        return 1;
+    }
+    size_t offset = 0;
+    take(blob, &offset, &header, sizeof(header));
+    if (header.magic != HANDOFF_MAGIC || header.version != HANDOFF_VERSION || header.sockets > size)
+    {
+        return 1;
+    }
+
+    std::vector<int> sockets;
+    if (!receive_sockets(s, header.sockets, &sockets) || !parse_routes(blob, offset, header.routes, sockets, routes))
+    {
+        for (int socket : sockets)
+        {
+            close_socket(socket);
+        }
+        routes->clear();
+        return 1;
+    }
+    return 0;
+}
+
+int handoff_acknowledge(int s)
+{
+    char ack = HANDOFF_ACK;
+    return send_all(s, &ack, 1) ? 0 : 1;
+}
+
+bool handoff_acknowledged(int s)
+{
+    char ack;
+    return receive_all(s, &ack, 1) && ack == HANDOFF_ACK;
+}
+
+#endif
@@ -0,0 +1,57 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H
+
+#include "proxy_common.h"
+#include "backend_pool.h"
+#include <vector>
+
+#define HANDOFF_MAGIC 0x48554450    // "HUDP", first word of every handoff.
+#define HANDOFF_VERSION 1           // Bumped whenever the records sent change.
+#define HANDOFF_FDS_PER_MESSAGE 128 // Sockets per sendmsg(), Linux takes up to 253.
+#define HANDOFF_TIMEOUT_MS 5000     // Either side gives up once the other is silent this long.
+
+// A client of a plain route, its upstream socket moves to the new process as is so the
+// server keeps seeing the same source address.
+typedef struct
+{
+    sockaddr_storage client;
+    socklen_t client_len;
+    int upstream;
+    int backend; // Index in the route's backends.
+    bool replied;
+    bool confirmed;
+} HandoffSession;
+
+// What a process needs to keep forwarding a route another one was running.
+typedef struct
+{
+    int listen_socket;
+    int listen_port;
+    sockaddr_storage upstream;
+    socklen_t upstream_len;
+    int tunnel;
+    std::vector<Backend> backends;        // Of its BackendPool in order, empty without failover.
+    std::vector<HandoffSession> sessions; // Plain routes only, tunnel sessions can't move and start over.
+} HandoffRoute;
+
+// Hands the sockets of running routes from a process to the one replacing it over a
+// Unix socket (SCM_RIGHTS), the clients never see them close. Unix only, the calls
+// fail on Windows.
+
+// Unix socket at path the running process waits on for its successor, only the same
+// user may connect. -1 on error.
+int handoff_listen(const std::string &path);
+// -1 when no process waits at path.
+int handoff_connect(const std::string &path);
+// Next successor waiting on listener, -1 when none or it runs as another user.
+int handoff_accept(int listener);
+int handoff_send(int s, const std::vector<HandoffRoute> &routes);
+// The sockets received belong to the caller, none are left open on error.
+int handoff_receive(int s, std::vector<HandoffRoute> *routes);
+// The successor adopted every route, the sender may close its copies.
+int handoff_acknowledge(int s);
+bool handoff_acknowledged(int s);
+// Closes every socket of routes.
+void handoff_close(const std::vector<HandoffRoute> &routes);
+
+#endif
@@ -0,0 +1,201 @@
+#include "impairment.h"
+#include "logger.h"
+#include <cstdlib>
+#include <cstring>
+
+bool impairment_enabled(const ImpairmentConfig &config)
+{
+    return config.delay_ms > 0 || config.jitter_ms > 0 || config.loss > 0 || config.duplicate > 0 || config.reorder > 0;
+}
+
+bool parse_impairment(const std::string &text, ImpairmentConfig *config)
+{
+    ImpairmentConfig parsed{};
+    size_t start = 0;
+    while (start < text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+        std::string item = text.substr(start, end - start);
+        start = end + 1;
+
+        size_t equal = item.find('=');
+        if (equal == std::string::npos)
+        {
+            return false;
+        }
+        std::string key = item.substr(0, equal);
+        std::string value = item.substr(equal + 1);
+        char *value_end;
+        double number = strtod(value.c_str(), &value_end);
+        if (value.empty() || *value_end != '\0' || number < 0)
+        {
+            return false;
+        }
+
+        if (key == "delay")
+        {
+            parsed.delay_ms = (int)number;
+        }
+        else if (key == "jitter")
+        {
+            parsed.jitter_ms = (int)number;
+        }
+        else if (key == "loss" && number <= 100)
+        {
+            parsed.loss = number;
+        }
+        else if (key == "duplicate" && number <= 100)
+        {
+            parsed.duplicate = number;
+        }
+        else if (key == "reorder" && number <= 100)
+        {
+            parsed.reorder = number;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    *config = parsed;
+    return true;
+}
+
+static void send_datagram(int socket, const sockaddr *to, socklen_t to_len, const char *data, int size)
+{
+    int sent = to_len == 0 ? send(socket, data, size, 0) : sendto(socket, data, size, 0, to, to_len);
+    if (sent < 0 && !socket_would_block())
+    {
+#ifdef _WIN32
+        LOG(LOG_LEVEL_ERROR, "Impairment: Failed to send a delayed packet: {}", WSAGetLastError());
+#else
+        LOG(LOG_LEVEL_ERROR, "Impairment: Failed to send a delayed packet: {}", strerror(errno));
+#endif
+    }
+}
+
+bool DelayQueue::push(std::chrono::steady_clock::time_point when, int socket, const sockaddr *to, socklen_t to_len, const char *data, int size)
+{
+    if (size > PROXY_MAX_DATAGRAM || this->size() >= IMPAIRMENT_QUEUE_LIMIT)
+    {
+        return false;
+    }
+
+    int slot;
+    if (this->free_slots.empty())
+    {
+        slot = this->slots.size();
+        this->slots.emplace_back();
+    }
+    else
+    {
+        slot = this->free_slots.back();
+        this->free_slots.pop_back();
+    }
+
+    DelayedPacket &packet = this->slots[slot];
+    packet.socket = socket;
+    packet.to_len = to_len;
+    if (to_len > 0)
+    {
+        memcpy(&packet.to, to, to_len);
+    }
+    packet.size = size;
+    if (size > IMPAIRMENT_PACKET_SIZE)
+    {
+        packet.large.assign(data, data + size);
+    }
+    else
+    {
+        memcpy(packet.data, data, size);
+    }
+    this->due.push({{when, this->sequence++}, slot});
+    return true;
+}
+
+// Poll timeout so the engine wakes up for the next due datagram.
+int DelayQueue::next_timeout_ms(std::chrono::steady_clock::time_point now, int maximum)
+{
+    if (this->due.empty())
+    {
+        return maximum;
+    }
+    auto when = this->due.top().first.first;
+    if (when <= now)
+    {
+        return 0;
+    }
+    // Rounded up, waking up early would only spin until the datagram is due.
+    long long wait = std::chrono::duration_cast<std::chrono::milliseconds>(when - now + std::chrono::microseconds(999)).count();
+    return wait < maximum ? (int)wait : maximum;
+}
+
+void DelayQueue::flush(std::chrono::steady_clock::time_point now)
+{
+    while (!this->due.empty() && this->due.top().first.first <= now)
+    {
+        int slot = this->due.top().second;
+        this->due.pop();
+        DelayedPacket &packet = this->slots[slot];
+        if (packet.socket >= 0)
+        {
+            send_datagram(packet.socket, (sockaddr *)&packet.to, packet.to_len,
+                          packet.size > IMPAIRMENT_PACKET_SIZE ? packet.large.data() : packet.data, packet.size);
+        }
+        packet.socket = -1;
+        // Large datagrams don't keep their buffer, a burst of them would hold it forever.
+        std::vector<char>().swap(packet.large);
+        this->free_slots.push_back(slot);
+    }
+}
+
+// Forgets the datagrams of a socket about to be closed, its number may be reused.
+void DelayQueue::cancel(int socket)
+{
+    for (auto &packet : this->slots)
+    {
+        if (packet.socket == socket)
+        {
+            packet.socket = -1;
+        }
+    }
+}
+
+size_t DelayQueue::size()
+{
+    return this->slots.size() - this->free_slots.size();
+}
+
+Impairment::Impairment() : random(std::random_device{}())
+{
+}
+
+void Impairment::send(DelayQueue *queue, const ImpairmentConfig &config, std::chrono::steady_clock::time_point now,
+                      int socket, const sockaddr *to, socklen_t to_len, const char *data, int size)
+{
+    if (config.loss > 0 && this->percent(this->random) < config.loss)
+    {
+        return;
+    }
+    int copies = config.duplicate > 0 && this->percent(this->random) < config.duplicate ? 2 : 1;
+    for (int i = 0; i < copies; i++)
+    {
+        int delay = config.delay_ms;
+        if (config.jitter_ms > 0)
+        {
+            delay += std::uniform_int_distribution<int>(0, config.jitter_ms)(this->random);
+        }
+        if (config.reorder > 0 && this->percent(this->random) < config.reorder)
+        {
+            delay = 0;
+        }
+        if (delay <= 0 || !queue->push(now + std::chrono::milliseconds(delay), socket, to, to_len, data, size))
+        {
+            send_datagram(socket, to, to_len, data, size);
+        }
+    }
+}
@@ -0,0 +1,71 @@
+#ifndef IMPAIRMENT_H
+#define IMPAIRMENT_H
+
+#include "proxy_common.h"
+#include <deque>
+#include <queue>
+#include <random>
+#include <vector>
+
+#define IMPAIRMENT_PACKET_SIZE 2048  // Datagrams up to this are kept in the slot, larger ones in a buffer of their own while held.
+#define IMPAIRMENT_QUEUE_LIMIT 65536 // Datagrams held back at once, the next ones are sent right away.
+
+typedef struct
+{
+    int delay_ms;
+    int jitter_ms;    // Random extra delay between 0 and jitter_ms, delayed datagrams can overtake each other.
+    double loss;      // Percent of the datagrams dropped.
+    double duplicate; // Percent of the datagrams sent twice.
+    double reorder;   // Percent of the datagrams sent right away, ahead of the delayed ones.
+} ImpairmentConfig;
+
+bool impairment_enabled(const ImpairmentConfig &config);
+// Parses "delay=100,jitter=20,loss=1.5,duplicate=0,reorder=5", missing keys stay 0.
+bool parse_impairment(const std::string &text, ImpairmentConfig *config);
+
+typedef struct
+{
+    int socket;
+    sockaddr_storage to; // Unused when to_len is 0, the socket is connected.
+    socklen_t to_len;
+    int size;
+    char data[IMPAIRMENT_PACKET_SIZE];
+    std::vector<char> large; // Datagrams above IMPAIRMENT_PACKET_SIZE, up to PROXY_MAX_DATAGRAM.
+} DelayedPacket;
+
+// Datagrams held back by the impairment stage. Packets live in reused slots and a
+// min-heap of due times orders them, so thousands of delayed datagrams cost no
+// thread or allocation each. Only used from the engine thread.
+class DelayQueue
+{
+private:
+    typedef std::pair<std::chrono::steady_clock::time_point, uint64_t> DueKey;
+    typedef std::pair<DueKey, int> DueEntry;
+
+    std::deque<DelayedPacket> slots; // Grows without moving the held datagrams.
+    std::vector<int> free_slots;
+    std::priority_queue<DueEntry, std::vector<DueEntry>, std::greater<DueEntry>> due;
+    uint64_t sequence = 0; // Keeps datagrams due at the same time in arrival order.
+
+public:
+    bool push(std::chrono::steady_clock::time_point when, int socket, const sockaddr *to, socklen_t to_len, const char *data, int size);
+    int next_timeout_ms(std::chrono::steady_clock::time_point now, int maximum);
+    void flush(std::chrono::steady_clock::time_point now);
+    void cancel(int socket);
+    size_t size();
+};
+
+// Applies an ImpairmentConfig to one datagram: drops, duplicates, delays or sends it.
+class Impairment
+{
+private:
+    std::mt19937 random;
+    std::uniform_real_distribution<double> percent{0.0, 100.0};
+
+public:
+    Impairment();
+    void send(DelayQueue *queue, const ImpairmentConfig &config, std::chrono::steady_clock::time_point now,
+              int socket, const sockaddr *to, socklen_t to_len, const char *data, int size);
+};
+
+#endif
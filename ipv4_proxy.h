@@ -2,21 +2,23 @@
 #define IPV4_PROXY_H
 
 #include "proxy_common.h"
+#include "proxy_engine.h"
 
+// Starts IPv4 routes on the shared engine: the listening socket is served by the engine
+// thread once connect() returns, use ProxyEngine::remove_route to stop it.
 class IPv4Proxy
 {
 private:
+    ProxyEngine *engine;
     int proxySocket;
-    std::atomic<int> state{PROXY_IDDLE};
-    std::atomic<bool> running{false};
-    void manage_server_response(int serverSocket, sockaddr_in client, socklen_t client_len);
+    std::shared_ptr<BackendPool> backends;
+    int tunnel = TUNNEL_NONE;
 
 public:
-    IPv4Proxy(int proxySocket);
+    IPv4Proxy(ProxyEngine *engine, int proxySocket);
     int connect(in_addr serverIp4, int port);
-    int disconnect();
-    int get_state();
-    bool is_running();
+    void set_backends(std::shared_ptr<BackendPool> backends);
+    void set_tunnel(int tunnel);
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,73 @@
+#include "latency_histogram.h"
+
+// Values under 4 ns have a bucket each, the others are split by their top three bits.
+static int bucket_of(uint64_t ns)
+{
+    if (ns < 4)
+    {
+        return (int)ns;
+    }
+    int exponent = 63 - __builtin_clzll(ns);
+    int index = exponent * 4 + (int)((ns >> (exponent - 2)) & 3);
+    return index < LATENCY_BUCKETS ? index : LATENCY_BUCKETS - 1;
+}
+
+// Middle of the bucket.
+static int64_t bucket_value(int index)
+{
+    if (index < 4)
+    {
+        return index;
+    }
+    int exponent = index / 4;
+    int64_t low = (int64_t)(4 + index % 4) << (exponent - 2);
+    return low + ((int64_t)1 << (exponent - 2)) / 2;
+}
+
+void latency_add(LatencyHistogram *histogram, int64_t ns)
+{
+    if (ns < 0)
+    {
+        return;
+    }
+    histogram->count++;
+    histogram->total_ns += ns;
+    if ((uint64_t)ns > histogram->max_ns)
+    {
+        histogram->max_ns = ns;
+    }
+    histogram->buckets[bucket_of(ns)]++;
+}
+
+void latency_merge(LatencyHistogram *into, const LatencyHistogram *from)
+{
+    into->count += from->count;
+    into->total_ns += from->total_ns;
+    if (from->max_ns > into->max_ns)
+    {
+        into->max_ns = from->max_ns;
+    }
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        into->buckets[i] += from->buckets[i];
+    }
+}
+
+int64_t latency_percentile(const LatencyHistogram *histogram, double fraction)
+{
+    if (histogram->count == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(fraction * histogram->count);
+    uint64_t seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        seen += histogram->buckets[i];
+        if (seen > rank)
+        {
+            return bucket_value(i);
+        }
+    }
+    return (int64_t)histogram->max_ns;
+}
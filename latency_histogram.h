@@ -0,0 +1,21 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <cstdint>
+
+#define LATENCY_BUCKETS 160 // Four per power of two up to 2^40 ns, a value is within 25% of its bucket.
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint32_t buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+void latency_add(LatencyHistogram *histogram, int64_t ns);
+void latency_merge(LatencyHistogram *into, const LatencyHistogram *from);
+// Nanoseconds below which that fraction of the values fall, 0 when empty.
+int64_t latency_percentile(const LatencyHistogram *histogram, double fraction);
+
+#endif
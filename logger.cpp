@@ -0,0 +1,278 @@
+#include "logger.h"
+#include <algorithm>
+#include <ctime>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+// Single producer (its thread) and single consumer (the writer).
+struct LogRing
+{
+    LogRecord records[LOG_RING_SIZE];
+    std::atomic<uint32_t> head{0}; // Next record the thread writes.
+    std::atomic<uint32_t> tail{0}; // Next record the writer prints.
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> finished{false}; // The thread exited, the ring goes away once empty.
+};
+
+class LogWriter
+{
+private:
+    std::mutex mutex;
+    std::vector<std::shared_ptr<LogRing>> rings;
+    std::atomic<bool> running{true};
+    std::atomic<uint64_t> printed{0}; // Passes over the rings, for log_flush().
+    std::thread worker;
+
+    bool drain();
+    void run();
+
+public:
+    std::atomic<int> level{LOG_LEVEL_INFO};
+
+    LogWriter();
+    ~LogWriter();
+    std::shared_ptr<LogRing> add_ring();
+    void flush();
+};
+
+static LogWriter &log_writer()
+{
+    static LogWriter writer;
+    return writer;
+}
+
+// Marks the thread's ring finished when the thread exits.
+struct LogRingOwner
+{
+    std::shared_ptr<LogRing> ring;
+
+    ~LogRingOwner()
+    {
+        if (this->ring)
+        {
+            this->ring->finished.store(true, std::memory_order_release);
+        }
+    }
+};
+
+static thread_local LogRingOwner log_ring_owner;
+
+static std::string format_record(const LogRecord &record)
+{
+    static const char *level_names[] = {"DEBUG", "INFO", "WARNING", "ERROR"};
+    time_t seconds = (time_t)(record.time_ms / 1000);
+    tm local{};
+#ifdef _WIN32
+    localtime_s(&local, &seconds);
+#else
+    localtime_r(&seconds, &local);
+#endif
+    std::ostringstream line;
+    line << std::put_time(&local, "%H:%M:%S") << '.' << std::setw(3) << std::setfill('0') << record.time_ms % 1000
+         << std::setfill(' ') << ' ' << level_names[record.level] << ' ';
+
+    int next = 0;
+    for (const char *c = record.format; *c != '\0'; c++)
+    {
+        if (c[0] != '{' || c[1] != '}' || next == record.arg_count)
+        {
+            line << *c;
+            continue;
+        }
+        const LogArg &arg = record.args[next++];
+        c++;
+        switch (arg.type)
+        {
+        case LOG_ARG_SIGNED:
+            line << arg.value.i;
+            break;
+        case LOG_ARG_UNSIGNED:
+            line << arg.value.u;
+            break;
+        case LOG_ARG_DOUBLE:
+            line << arg.value.d;
+            break;
+        case LOG_ARG_TEXT:
+            line.write(record.text + arg.offset, arg.length);
+            break;
+        case LOG_ARG_ADDRESS:
+        {
+            sockaddr_storage address{};
+            memcpy(&address, record.text + arg.offset, std::min<size_t>(arg.length, sizeof(address)));
+            line << format_address((sockaddr *)&address);
+            break;
+        }
+        }
+    }
+    if (record.suppressed > 0)
+    {
+        line << " (" << record.suppressed << " more like this skipped)";
+    }
+    line << '\n';
+    return line.str();
+}
+
+LogWriter::LogWriter()
+{
+    this->worker = std::thread(&LogWriter::run, this);
+}
+
+LogWriter::~LogWriter()
+{
+    this->running.store(false);
+    if (this->worker.joinable())
+    {
+        this->worker.join();
+    }
+    this->drain();
+}
+
+std::shared_ptr<LogRing> LogWriter::add_ring()
+{
+    std::shared_ptr<LogRing> ring = std::make_shared<LogRing>();
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->rings.push_back(ring);
+    return ring;
+}
+
+// Prints whatever every ring holds, returns whether there was anything.
+bool LogWriter::drain()
+{
+    std::vector<std::shared_ptr<LogRing>> current;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        current = this->rings;
+    }
+
+    std::string out, errors;
+    for (const std::shared_ptr<LogRing> &ring : current)
+    {
+        bool finished = ring->finished.load(std::memory_order_acquire);
+        uint32_t tail = ring->tail.load(std::memory_order_relaxed);
+        uint32_t head = ring->head.load(std::memory_order_acquire);
+        for (; tail != head; tail++)
+        {
+            const LogRecord &record = ring->records[tail % LOG_RING_SIZE];
+            (record.level >= LOG_LEVEL_WARNING ? errors : out) += format_record(record);
+        }
+        ring->tail.store(tail, std::memory_order_release);
+
+        uint64_t dropped = ring->dropped.exchange(0);
+        if (dropped > 0)
+        {
+            errors += "Logger: " + std::to_string(dropped) + " messages dropped, the writer fell behind.\n";
+        }
+        if (finished)
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->rings.erase(std::remove(this->rings.begin(), this->rings.end(), ring), this->rings.end());
+        }
+    }
+
+    if (!out.empty())
+    {
+        std::cout << out << std::flush;
+    }
+    if (!errors.empty())
+    {
+        std::cerr << errors << std::flush;
+    }
+    return !out.empty() || !errors.empty();
+}
+
+void LogWriter::run()
+{
+    while (this->running.load())
+    {
+        bool busy = this->drain();
+        this->printed.fetch_add(1);
+        if (!busy)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(LOG_WRITER_SLEEP_MS));
+        }
+    }
+}
+
+void LogWriter::flush()
+{
+    // Two full passes guarantee one started after this call.
+    uint64_t target = this->printed.load() + 2;
+    while (this->running.load() && this->printed.load() < target)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+}
+
+void log_set_level(int level)
+{
+    log_writer().level.store(level);
+}
+
+bool log_enabled(int level)
+{
+    return level >= log_writer().level.load(std::memory_order_relaxed);
+}
+
+bool log_site_allow(LogSite *site, uint32_t *suppressed)
+{
+    int64_t second = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    int64_t current = site->second.load(std::memory_order_relaxed);
+    *suppressed = 0;
+    if (current != second && site->second.compare_exchange_strong(current, second))
+    {
+        site->printed.store(1, std::memory_order_relaxed);
+        *suppressed = site->suppressed.exchange(0);
+        return true;
+    }
+    if (site->printed.load(std::memory_order_relaxed) < LOG_SITE_BURST &&
+        site->printed.fetch_add(1, std::memory_order_relaxed) < LOG_SITE_BURST)
+    {
+        return true;
+    }
+    site->suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+LogRecord *log_begin()
+{
+    LogRingOwner &owner = log_ring_owner;
+    if (!owner.ring)
+    {
+        owner.ring = log_writer().add_ring();
+    }
+    LogRing *ring = owner.ring.get();
+    uint32_t head = ring->head.load(std::memory_order_relaxed);
+    if (head - ring->tail.load(std::memory_order_acquire) == LOG_RING_SIZE)
+    {
+        ring->dropped.fetch_add(1, std::memory_order_relaxed);
+        return nullptr;
+    }
+    return &ring->records[head % LOG_RING_SIZE];
+}
+
+void log_commit()
+{
+    LogRing *ring = log_ring_owner.ring.get();
+    ring->head.store(ring->head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void log_flush()
+{
+    log_writer().flush();
+}
+
+int parse_log_level(const std::string &text)
+{
+    static const char *names[] = {"debug", "info", "warning", "error"};
+    for (int level = LOG_LEVEL_DEBUG; level <= LOG_LEVEL_ERROR; level++)
+    {
+        if (text == names[level])
+        {
+            return level;
+        }
+    }
+    return -1;
+}
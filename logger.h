@@ -0,0 +1,159 @@
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include "proxy_common.h"
+#include <cstring>
+#include <type_traits>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+
+#define LOG_RING_SIZE 1024     // Records a thread can have waiting for the writer, the next ones are dropped.
+#define LOG_MAX_ARGS 8
+#define LOG_TEXT_SIZE 160      // Bytes of copied strings and addresses per record.
+#define LOG_SITE_BURST 20      // Lines one LOG() may print per second, the rest are counted and skipped.
+#define LOG_WRITER_SLEEP_MS 10 // Writer pause when every ring is empty.
+
+#define LOG_ARG_SIGNED 0
+#define LOG_ARG_UNSIGNED 1
+#define LOG_ARG_DOUBLE 2
+#define LOG_ARG_TEXT 3
+#define LOG_ARG_ADDRESS 4 // sockaddr copied as is, formatted by the writer.
+
+// One per LOG() line, shared by every thread going through it.
+typedef struct
+{
+    std::atomic<int64_t> second{-1};
+    std::atomic<uint32_t> printed{0};
+    std::atomic<uint32_t> suppressed{0};
+} LogSite;
+
+typedef struct
+{
+    int type;
+    uint16_t offset; // In LogRecord::text, for LOG_ARG_TEXT and LOG_ARG_ADDRESS.
+    uint16_t length;
+    union
+    {
+        int64_t i;
+        uint64_t u;
+        double d;
+    } value;
+} LogArg;
+
+// Arguments are captured as they are and only formatted on the writer thread.
+typedef struct
+{
+    const char *format; // String literal, {} marks where each argument goes.
+    int level;
+    uint32_t suppressed; // Lines of the same LOG() skipped by the rate limit before this one.
+    int64_t time_ms;     // system_clock
+    int arg_count;
+    LogArg args[LOG_MAX_ARGS];
+    int text_used;
+    char text[LOG_TEXT_SIZE];
+} LogRecord;
+
+void log_set_level(int level);
+bool log_enabled(int level);
+bool log_site_allow(LogSite *site, uint32_t *suppressed);
+LogRecord *log_begin();
+void log_commit();
+// Waits until the writer printed everything logged so far.
+void log_flush();
+// "debug", "info", "warning" or "error", -1 otherwise.
+int parse_log_level(const std::string &text);
+
+inline void log_capture_text(LogRecord *record, LogArg *arg, int type, const void *data, size_t size)
+{
+    size_t room = LOG_TEXT_SIZE - record->text_used;
+    size = size < room ? size : room;
+    arg->type = type;
+    arg->offset = (uint16_t)record->text_used;
+    arg->length = (uint16_t)size;
+    memcpy(record->text + record->text_used, data, size);
+    record->text_used += (int)size;
+}
+
+template <typename T>
+inline void log_capture(LogRecord *record, const T &value)
+{
+    if (record->arg_count == LOG_MAX_ARGS)
+    {
+        return;
+    }
+    LogArg *arg = &record->args[record->arg_count++];
+    if constexpr (std::is_same_v<T, bool>)
+    {
+        log_capture_text(record, arg, LOG_ARG_TEXT, value ? "true" : "false", value ? 4 : 5);
+    }
+    else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>)
+    {
+        arg->type = LOG_ARG_SIGNED;
+        arg->value.i = value;
+    }
+    else if constexpr (std::is_integral_v<T>)
+    {
+        arg->type = LOG_ARG_UNSIGNED;
+        arg->value.u = value;
+    }
+    else if constexpr (std::is_floating_point_v<T>)
+    {
+        arg->type = LOG_ARG_DOUBLE;
+        arg->value.d = value;
+    }
+    else if constexpr (std::is_same_v<T, std::string>)
+    {
+        log_capture_text(record, arg, LOG_ARG_TEXT, value.data(), value.size());
+    }
+    else if constexpr (std::is_same_v<T, sockaddr_storage>)
+    {
+        log_capture_text(record, arg, LOG_ARG_ADDRESS, &value, value.ss_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6));
+    }
+    else if constexpr (std::is_convertible_v<T, const sockaddr *>)
+    {
+        const sockaddr *address = value;
+        log_capture_text(record, arg, LOG_ARG_ADDRESS, address, address->sa_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6));
+    }
+    else
+    {
+        static_assert(std::is_convertible_v<T, const char *>, "LOG() takes numbers, strings and socket addresses");
+        const char *text = value;
+        log_capture_text(record, arg, LOG_ARG_TEXT, text, strlen(text));
+    }
+}
+
+// Never blocks: a line over its site's rate or that finds the thread's ring full is skipped.
+template <typename... Args>
+void log_write(LogSite *site, int level, const char *format, const Args &...args)
+{
+    uint32_t suppressed;
+    if (!log_enabled(level) || !log_site_allow(site, &suppressed))
+    {
+        return;
+    }
+    LogRecord *record = log_begin();
+    if (record == nullptr)
+    {
+        return;
+    }
+    record->format = format;
+    record->level = level;
+    record->suppressed = suppressed;
+    record->time_ms = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    record->arg_count = 0;
+    record->text_used = 0;
+    (log_capture(record, args), ...);
+    log_commit();
+}
+
+#define LOG(level, ...)                             \
+    do                                              \
+    {                                               \
+        static LogSite log_site;                    \
+        log_write(&log_site, level, __VA_ARGS__);   \
+    } while (0)
+
+#endif
@@ -5,73 +5,152 @@
 #endif
 #include <wx/simplebook.h>
 #include <wx/statline.h>
-#include "sqlite3.h"
 #include "proxy_common.h"
 #include "ipv4_proxy.h"
 #include "ipv6_proxy.h"
+#include "backend_pool.h"
+#include "control_plane.h"
+#include "handoff.h"
+#include "proxy_engine.h"
+#include "logger.h"
+#include "quic_prober.h"
+#include "server_store.h"
+#include "server_io.h"
 #include <wx/artprov.h>
 #include <wx/clipbrd.h>
+#include <wx/cmdline.h>
+#include <wx/filedlg.h>
+#include <wx/choicdlg.h>
+#include <wx/listbox.h>
+#include <wx/listctrl.h>
+#include <wx/numdlg.h>
+#include <algorithm>
+#include <map>
 
 #define SERVER_NAME_WXCOLOR wxColor(10, 100, 200)
 #define SERVER_PORT_WXCOLOR wxColor(140, 140, 140)
+#define SERVER_REACHABLE_WXCOLOR wxColor(0, 150, 0)
+#define SERVER_UNREACHABLE_WXCOLOR wxColor(200, 0, 0)
 #define SERVER_MOVE_UP -1
 #define SERVER_MOVE_DOWN 1
+#define SERVER_PAGE_SIZE 64  // Rows read from servers.db at once by the server list.
+#define SERVER_PAGE_CACHE 16 // Pages kept in memory before the cache is dropped.
+#define SERVER_LIST_WILDCARD "Server lists (*.csv;*.json)|*.csv;*.json|CSV (*.csv)|*.csv|JSON (*.json)|*.json"
+#define ROUTE_STARTING -1
+#define PROXY_PROBE_TIMEOUT_MS 3000  // Resolved addresses of a domain get this long to answer the QUIC probe.
+#define PROXY_STATE_POLL_MS 5        // Between two looks at the state of the proxy's route.
+#define PROXY_HANDOFF_WAIT_MS 60000  // Successors are waited for in rounds this long.
 
 class MyApp : public wxApp
 {
-    sqlite3 *db;
+    ServerStore store;
     WSAData wsaData;
+    RateLimit session_limit{}; // Per client, from the command line.
+    RateLimit global_limit{};  // Every client of every route together.
+    ImpairmentConfig upstream_impairment{};
+    ImpairmentConfig downstream_impairment{};
+    std::vector<sockaddr_storage> tunnel_paths;
+    long bundle_delay_us = 0;
+    long pace_mbps = 0;
+    LowLatencyConfig low_latency{0, 0, -1, false};
+    wxString client_filter; // Rules file, empty lets every client in.
+    bool validate_clients = false;
+    wxString handoff_path; // Unix socket restarts take the routes over through, empty disables it.
+#ifdef PROXY_WITH_XDP
+    wxString xdp_interface; // Empty keeps every packet on the sockets.
+    bool xdp_native = false;
+#endif
 
 public:
     virtual bool OnInit();
     virtual int OnExit() override;
+    virtual void OnInitCmdLine(wxCmdLineParser &parser) override;
+    virtual bool OnCmdLineParsed(wxCmdLineParser &parser) override;
 };
 
 typedef struct
 {
-    int id;
-    std::string name;
-    eAddressType address_type;
-    std::string address;
-    int port;
-} ServerRecord;
+    int listen_port;
+    int server_id;
+    int tunnel;          // TUNNEL_NONE, TUNNEL_ENTRY or TUNNEL_EXIT.
+    int listen_socket;   // -1 unless the route is running on the engine.
+    int error;           // wxEVT_PROXY_THREAD_STOPPED code of the last start, ROUTE_STARTING meanwhile.
+    std::string message; // Explanation of error.
+    std::string server_name;
+    long start_id; // Of the last start, its wxEVT_ROUTE_STARTED carries it back.
+} RouteRecord;
 
 wxDEFINE_EVENT(wxEVT_CONNECT_SERVER_RECORD, wxThreadEvent);
-wxDEFINE_EVENT(wxEVT_DELETE_SERVER_RECORD, wxThreadEvent);
-wxDEFINE_EVENT(wxEVT_MOVE_SERVER_RECORD, wxThreadEvent);
 // Disable on connection
 wxDEFINE_EVENT(wxEVT_SET_ENABLE_INPUT, wxThreadEvent);
 wxDEFINE_EVENT(wxEVT_PROXY_THREAD_UPDATE, wxThreadEvent);
 wxDEFINE_EVENT(wxEVT_PROXY_THREAD_RESOLVED_ADDRESS, wxThreadEvent);
 wxDEFINE_EVENT(wxEVT_PROXY_THREAD_STOPPED, wxThreadEvent);
-
-class ProxyThread : public wxThread
+wxDEFINE_EVENT(wxEVT_SERVER_PING_RESULT, wxThreadEvent);
+wxDEFINE_EVENT(wxEVT_ROUTE_STARTED, wxThreadEvent);
+wxDEFINE_EVENT(wxEVT_ROUTES_CHANGED, wxThreadEvent);
+wxDEFINE_EVENT(wxEVT_SERVER_SAVED, wxThreadEvent);
+wxDEFINE_EVENT(wxEVT_SERVERS_IMPORTED, wxThreadEvent);
+// Another process took every route over, this one closes.
+wxDEFINE_EVENT(wxEVT_HANDED_OFF, wxThreadEvent);
+
+// Saved servers shown as a virtual list, rows are read from the store a page at a
+// time when they become visible so the cost doesn't depend on the list size.
+class ServerListCtrl : public wxListCtrl
 {
-public:
-    ProxyThread(wxWindow *parent, int proxy_port, ServerRecord server_record);
-    ~ProxyThread();
+private:
+    ServerStore *store;
+    mutable std::map<long, std::vector<ServerRecord>> pages;
+    mutable std::map<long, ServerRecord> page_ends; // Last row of the pages read since the reload, the next page starts after it.
+    std::map<int, ProbeResult> pings;
+    mutable wxItemAttr reachable_attr;
+    mutable wxItemAttr unreachable_attr;
+    const std::vector<ServerRecord> &GetPage(long page) const;
 
 protected:
-    virtual ExitCode Entry();
+    virtual wxString OnGetItemText(long item, long column) const override;
+    virtual wxItemAttr *OnGetItemColumnAttr(long item, long column) const override;
 
-private:
-    int proxy_port;
-    ServerRecord server_record;
-    wxWindow *parent;
+public:
+    ServerListCtrl(wxWindow *parent, ServerStore *store);
+    void Reload();
+    bool GetRecord(long item, ServerRecord *record) const;
+    long GetSelectedItem() const;
+    void SelectItem(long item);
+    void SetPings(std::vector<ProbeResult> results);
 };
 
 class MainFrame : public wxFrame
 {
 public:
-    MainFrame(sqlite3 *db);
+    MainFrame(ServerStore *store);
+    void SetRateLimits(RateLimit session_limit, RateLimit global_limit);
+    void SetImpairment(ImpairmentConfig upstream, ImpairmentConfig downstream);
+    void SetTunnelPaths(std::vector<sockaddr_storage> local_addresses);
+    void SetBundleDelay(int microseconds);
+    void SetPacing(int64_t bytes_per_second);
+    void SetLowLatency(LowLatencyConfig config);
+    bool SetClientFilter(const std::string &path, std::string *error);
+    void SetClientValidation(bool enabled);
+#ifdef PROXY_WITH_XDP
+    bool SetFastPath(const char *interface, bool native);
+#endif
+    // Starts the saved routes, taking over those of a process waiting at handoff_path
+    // first. With a path, this process then waits there for its own successor.
+    void StartRoutes(const std::string &handoff_path);
 
 protected:
-    ProxyThread *proxy_thread;
-    wxCriticalSection m_pThreadCS;
-    friend class ProxyThread;
+#ifdef PROXY_WITH_XDP
+    XdpEngine fast_path; // Declared first so the engine using it is destroyed before it.
+#endif
+    ProxyEngine engine; // Shared by the proxy thread and every route.
+    ClientFilterFile client_filter; // Declared after the engine so it stops first.
+    ControlExecutor control;        // Same, its coroutines start and stop routes.
+    CancelToken proxy_token;        // Of the proxy started from the server list.
+    bool proxy_running = false;
 
 private:
-    sqlite3 *db;
+    ServerStore *store;
     void OnPortUpdate(wxFocusEvent &event);
     wxTextCtrl *ptr_port_input;
     wxTextCtrl *ptr_ip_input;
@@ -79,56 +158,63 @@ private:
     wxButton *ptr_save_button;
     wxButton *ptr_stop_proxy_button;
     wxSimplebook *status_book;
-    wxScrolledWindow *server_list;
+    ServerListCtrl *server_list;
+    wxButton *ptr_server_connect_button;
     wxTextCtrl *proxy_server_address_ptr;
     wxTextCtrl *proxy_resolved_server_address_ptr;
     wxBoxSizer *proxy_server_address_sizer_ptr;
     wxStaticText *profile_name_ptr;
     wxTextCtrl *profile_address_ptr;
     wxButton *copy_proxy_address_button_ptr;
+    QuicProber *prober;
+    wxListBox *route_list;
+    std::vector<RouteRecord> routes;
+    long route_starts = 0; // Ids of the route starts so far.
+    std::vector<int> probe_ids;
     int port;
 
     void OnDirectConnect(wxCommandEvent &event);
     void OnSave(wxCommandEvent &event);
-    void RenderServerRecord(ServerRecord record);
+    void RefreshProbeTargets();
 
     int ValidateServerAddress(eAddressType address_type, std::string address, int port);
-    std::vector<ServerRecord> LoadServerRecordFromSql();
+    int ParseServerRecord(std::string input, ServerRecord &record);
+    bool GetSelectedRecord(ServerRecord *record);
+    void StartRoute(RouteRecord &route);
+    std::vector<HandoffRoute> TakeOver(const std::string &handoff_path);
+    void AdoptProxy(const HandoffRoute &route);
+    void RenderRoutes();
+
+    void MoveServerRecord(int move);
 
     // Handle
-    void MoveServerRecord(wxThreadEvent &event);
     void ConnectFromServerRecord(wxThreadEvent &event);
-    void DeleteServerRecord(wxThreadEvent &event);
+    void OnServerConnect(wxCommandEvent &event);
+    void OnServerActivated(wxListEvent &event);
+    void OnServerDelete(wxCommandEvent &event);
+    void OnServerMoveUp(wxCommandEvent &event);
+    void OnServerMoveDown(wxCommandEvent &event);
+    void OnServerCopyAddress(wxCommandEvent &event);
+    void OnServerListCacheHint(wxListEvent &event);
     void OnProxyThreadStopped(wxThreadEvent &event);
     void OnProxyThreadUpdate(wxThreadEvent &event);
     void OnProxyThreadResolvedAddress(wxThreadEvent &event);
+    void OnServerPingResult(wxThreadEvent &event);
+    void OnServerSaved(wxThreadEvent &event);
+    void OnImportServers(wxCommandEvent &event);
+    void OnExportServers(wxCommandEvent &event);
+    void OnServersImported(wxThreadEvent &event);
+    void OnRouteStarted(wxThreadEvent &event);
+    void OnRoutesChanged(wxThreadEvent &event);
+    void OnAddRoute(wxCommandEvent &event);
+    void OnRemoveRoute(wxCommandEvent &event);
     void StopProxy();
     void OnStopProxy(wxCommandEvent &event);
     void OnCopyProxyAddress(wxCommandEvent &event);
+    void OnHandedOff(wxThreadEvent &event);
     void OnClose(wxCloseEvent &event);
 };
 
-class ServerWidget : public wxPanel
-{
-private:
-    ServerRecord record;
-    void OnConnect(wxCommandEvent &event);
-    void OnDelete(wxCommandEvent &event);
-    void OnMoveUp(wxCommandEvent &event);
-    void OnMoveDown(wxCommandEvent &event);
-    void CopyAddress(wxCommandEvent &event);
-    wxButton *connect_button;
-
-public:
-    ServerWidget(wxWindow *parent, ServerRecord record);
-    int GetRecordId();
-    ServerRecord GetRecord();
-    std::string GetFullAddress();
-    std::string GetMinimalAddress();
-    bool SetConnectButtonEnable(bool state);
-    void ExchangeRecordId(ServerWidget *other);
-};
-
 class DeleteServerRecordDialog : public wxDialog
 {
 public:
@@ -141,313 +227,743 @@ public:
 
 wxIMPLEMENT_APP(MyApp);
 
-ProxyThread::ProxyThread(wxWindow *parent, int proxy_port, ServerRecord server_record) : wxThread(wxTHREAD_DETACHED)
+// Frees a getaddrinfo result, also when its lookup was cancelled and nobody collects it.
+struct AddressListFree
 {
-    this->parent = parent;
-    this->proxy_port = proxy_port;
-    this->server_record = server_record;
-}
+    void operator()(addrinfo *list) const { freeaddrinfo(list); }
+};
+typedef std::unique_ptr<addrinfo, AddressListFree> AddressList;
 
-wxThread::ExitCode ProxyThread::Entry()
+// getaddrinfo can only block, coroutines run it through ControlExecutor::blocking().
+// Empty when host couldn't be resolved.
+static AddressList lookup_address(const std::string &host)
 {
-    eAddressType mode = eAddressType::Invalid;
-    wxThreadEvent *threadEvent;
-    struct in_addr serverIp4;
-    struct in6_addr serverIp6;
-    struct addrinfo *result = nullptr;
-    struct addrinfo *p = nullptr;
-    struct addrinfo hints;
+    addrinfo hints;
     memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_DGRAM; // One entry per address.
+    addrinfo *result = nullptr;
+    int status = getaddrinfo(host.c_str(), NULL, &hints, &result);
+    if (status != 0)
+    {
+        fprintf(stderr, "For domain (%s) error in getaddrinfo: %s\n", host.c_str(), gai_strerror(status));
+        return nullptr;
+    }
+    return AddressList(result);
+}
 
-    if (this->server_record.address_type == eAddressType::Domain)
+// Connects a probe socket to one resolved address, -1 when that address can't be tried.
+static int open_probe_socket(addrinfo *candidate, int port)
+{
+    ((sockaddr_in *)candidate->ai_addr)->sin_port = htons(port); // Same offset in sockaddr_in6.
+    int s = socket(candidate->ai_family, SOCK_DGRAM, 0);
+    if (s < 0)
     {
-        std::string address_str = this->server_record.address;
-        int status = getaddrinfo(address_str.c_str(), NULL, &hints, &result);
-        if (status != 0)
-        {
-            fprintf(stderr, "For domain (%s) error in getaddrinfo: %s\n", this->server_record.address.c_str(), gai_strerror(status));
-            threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_STOPPED);
-            threadEvent->SetInt(1);
-            threadEvent->SetString(this->server_record.address);
-            wxQueueEvent(this->parent, threadEvent);
-            return (wxThread::ExitCode)0;
-        }
+        return -1;
+    }
+    if (set_socket_nonblocking(s) != 0 ||
+        ::connect(s, candidate->ai_addr, candidate->ai_addrlen) < 0)
+    {
+        close_socket(s);
+        return -1;
+    }
+    std::cout << "QUIC: Testing " << format_address(candidate->ai_addr) << std::endl;
+    return s;
+}
 
-        for (p = result; p != NULL; p = p->ai_next)
+// Sends a new probe on a probe socket, attempts keeps it to check answers against.
+static void send_probe(int s, std::vector<ProbeAttempt> *attempts)
+{
+    uint8_t buffer[QUIC_MIN_INITIAL_SIZE];
+    ProbeAttempt attempt;
+    int n = quic_write_probe(buffer, &attempt.ids);
+    attempt.sent = std::chrono::steady_clock::now();
+    if (send(s, (const char *)buffer, n, 0) >= 0)
+    {
+        attempts->push_back(attempt);
+    }
+}
+
+// Finds the address to forward to. All resolved addresses of a domain are sent the QUIC
+// probe at once and the first one answering it is used. Returns 0 or a
+// wxEVT_PROXY_THREAD_STOPPED error code, callers check the token for cancellation.
+Task<int> resolve_server_record(ControlExecutor *control, ServerRecord record, CancelToken token, eAddressType *mode, in_addr *serverIp4, in6_addr *serverIp6)
+{
+    *mode = eAddressType::Invalid;
+    if (record.address_type == eAddressType::IPv4)
+    {
+        if (inet_pton(AF_INET, record.address.c_str(), serverIp4) == 1)
         {
-            // void *addr;
-
-            if (p->ai_family == AF_INET)
-            { // IPv4
-                struct sockaddr_in *ipv4 = reinterpret_cast<struct sockaddr_in *>(p->ai_addr);
-                if (test_ipv4_quic(ipv4->sin_addr, this->server_record.port) == 0)
-                {
-                    serverIp4 = (ipv4->sin_addr);
-                    mode = eAddressType::IPv4;
-                    break;
-                }
-            }
-            else
-            { // IPv6
-                struct sockaddr_in6 *ipv6 = reinterpret_cast<struct sockaddr_in6 *>(p->ai_addr);
-                if (test_ipv6_quic(ipv6->sin6_addr, this->server_record.port) == 0)
-                {
-                    serverIp6 = (ipv6->sin6_addr);
-                    mode = eAddressType::IPv6;
-                    break;
-                }
-            }
+            *mode = eAddressType::IPv4;
         }
-        freeaddrinfo(result);
-        if (mode == eAddressType::Invalid)
+        co_return *mode == eAddressType::Invalid ? 5 : 0;
+    }
+    if (record.address_type == eAddressType::IPv6)
+    {
+        if (inet_pton(AF_INET6, record.address.c_str(), serverIp6) == 1)
         {
-            threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_STOPPED);
-            threadEvent->SetInt(2);
-            threadEvent->SetString(this->server_record.address);
-            wxQueueEvent(this->parent, threadEvent);
-            return (wxThread::ExitCode)0;
+            *mode = eAddressType::IPv6;
         }
+        co_return *mode == eAddressType::Invalid ? 5 : 0;
+    }
+    if (record.address_type != eAddressType::Domain)
+    {
+        co_return 5;
+    }
 
-        if (mode == eAddressType::IPv6)
+    std::string host = record.address;
+    auto lookup = control->blocking<AddressList>([host]()
+                                                 { return lookup_address(host); },
+                                                 token);
+    std::optional<AddressList> result = co_await lookup;
+    if (!result || !*result)
+    {
+        co_return 1;
+    }
+
+    std::vector<int> sockets;
+    std::vector<const addrinfo *> candidates;        // Of each socket.
+    std::vector<std::vector<ProbeAttempt>> attempts; // Of each socket.
+    for (addrinfo *p = result->get(); p != NULL; p = p->ai_next)
+    {
+        if (p->ai_family != AF_INET && p->ai_family != AF_INET6)
         {
-            threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_RESOLVED_ADDRESS);
-            char ipv6[INET6_ADDRSTRLEN];
-            inet_ntop(AF_INET6, &serverIp6, ipv6, sizeof(ipv6));
-            threadEvent->SetString("[" + std::string(ipv6) + "]:" + std::to_string(this->server_record.port));
-            wxQueueEvent(this->parent, threadEvent);
+            continue;
         }
-        else
+        int s = open_probe_socket(p, record.port);
+        if (s >= 0)
         {
-            threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_RESOLVED_ADDRESS);
-            char ipv4[INET_ADDRSTRLEN];
-            inet_ntop(AF_INET, &serverIp4, ipv4, sizeof(ipv4));
-            threadEvent->SetString(std::string(ipv4) + ":" + std::to_string(this->server_record.port));
-            wxQueueEvent(this->parent, threadEvent);
+            sockets.push_back(s);
+            candidates.push_back(p);
+            attempts.emplace_back();
         }
     }
-    else if (this->server_record.address_type == eAddressType::IPv4)
+
+    // Silent addresses get a new probe after PROBER_RETRY_MS, then twice as long each time.
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(PROXY_PROBE_TIMEOUT_MS);
+    auto next_attempt = std::chrono::steady_clock::now();
+    int retry_ms = PROBER_RETRY_MS;
+    while (!sockets.empty() && *mode == eAddressType::Invalid)
     {
-        if (inet_pton(AF_INET, this->server_record.address.c_str(), &serverIp4) == 1)
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
         {
-            mode = eAddressType::IPv4;
+            break;
         }
-    }
-    else if (this->server_record.address_type == eAddressType::IPv6)
-    {
-        if (inet_pton(AF_INET6, this->server_record.address.c_str(), &serverIp6) == 1)
+        if (now >= next_attempt)
+        {
+            for (size_t i = 0; i < sockets.size(); i++)
+            {
+                send_probe(sockets[i], &attempts[i]);
+            }
+            next_attempt = now + std::chrono::milliseconds(retry_ms);
+            retry_ms *= 2;
+        }
+        int wait = (int)std::chrono::ceil<std::chrono::milliseconds>(std::min(deadline, next_attempt) - now).count();
+        int ready = co_await control->readable(sockets, wait, token);
+        if (ready == CONTROL_CANCELLED)
         {
-            mode = eAddressType::IPv6;
+            break;
+        }
+        if (ready == CONTROL_TIMEOUT)
+        {
+            continue;
+        }
+        uint8_t buffer[2048];
+        int n = recv(sockets[ready], (char *)buffer, sizeof(buffer), 0);
+        auto received = std::chrono::steady_clock::now();
+        if (n < 0)
+        {
+            if (socket_would_block())
+            {
+                continue;
+            }
+            // Unreachable, the other addresses may still answer.
+            close_socket(sockets[ready]);
+            sockets.erase(sockets.begin() + ready);
+            candidates.erase(candidates.begin() + ready);
+            attempts.erase(attempts.begin() + ready);
+            continue;
+        }
+        // Anything but an answer echoing a probe's ids is ignored.
+        for (const auto &attempt : attempts[ready])
+        {
+            int answer = quic_probe_answer(buffer, n, &attempt.ids);
+            if (answer == QUIC_NOT_QUIC)
+            {
+                continue;
+            }
+            const addrinfo *answered = candidates[ready];
+            std::cout << "QUIC: " << quic_kind_name(answer) << " answer from " << format_address(answered->ai_addr) << " in "
+                      << std::chrono::duration_cast<std::chrono::milliseconds>(received - attempt.sent).count() << " ms" << std::endl;
+            if (answered->ai_family == AF_INET)
+            {
+                *serverIp4 = ((sockaddr_in *)answered->ai_addr)->sin_addr;
+                *mode = eAddressType::IPv4;
+            }
+            else
+            {
+                *serverIp6 = ((sockaddr_in6 *)answered->ai_addr)->sin6_addr;
+                *mode = eAddressType::IPv6;
+            }
+            break;
         }
     }
-
-    if (mode == eAddressType::Invalid)
+    for (int s : sockets)
     {
-        threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_STOPPED);
-        threadEvent->SetInt(5);
-        wxQueueEvent(this->parent, threadEvent);
-        return (wxThread::ExitCode)0;
+        close_socket(s);
     }
+    co_return *mode == eAddressType::Invalid ? 2 : 0;
+}
 
+// Binds a new proxy socket on every interface. Returns 0 or a wxEVT_PROXY_THREAD_STOPPED error code.
+int open_proxy_socket(int proxy_port, int *proxy_socket)
+{
     int proxySocket = socket(AF_INET, SOCK_DGRAM, 0);
     if (proxySocket < 0)
     {
         perror("Proxy socket creation failed");
-        threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_STOPPED);
-        threadEvent->SetInt(3);
-        wxQueueEvent(this->parent, threadEvent);
-        return (wxThread::ExitCode)0;
+        return 3;
     }
     sockaddr_in proxyAddress;
     proxyAddress.sin_family = AF_INET;
-    proxyAddress.sin_port = htons(this->proxy_port);
+    proxyAddress.sin_port = htons(proxy_port);
     proxyAddress.sin_addr.s_addr = INADDR_ANY;
     if (bind(proxySocket, (struct sockaddr *)&proxyAddress, sizeof(proxyAddress)) == -1)
     {
         perror("Proxy bind failed");
         close_socket(proxySocket);
-        threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_STOPPED);
-        threadEvent->SetInt(4);
-        threadEvent->SetString(std::to_string(this->proxy_port));
-        wxQueueEvent(this->parent, threadEvent);
-        return (wxThread::ExitCode)0;
+        return 4;
     }
 
-#ifdef _WIN32
-    int timeoutMs = 10000;
-    setsockopt(proxySocket, SOL_SOCKET, SO_RCVTIMEO,
-               (char *)&timeoutMs, sizeof(timeoutMs));
-#else
-    struct timeval tv;
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
-    setsockopt(proxySocket, SOL_SOCKET, SO_RCVTIMEO,
-               (char *)&tv, sizeof(tv));
-#endif
     char ipAddress[INET_ADDRSTRLEN];
     inet_ntop(AF_INET, &(proxyAddress.sin_addr), ipAddress, INET_ADDRSTRLEN);
     std::cout << "Proxy [" << proxySocket << "] bound to \"" << ipAddress << ":" << ntohs(proxyAddress.sin_port) << "\"." << std::endl;
+    *proxy_socket = proxySocket;
+    return 0;
+}
 
-    int proxy_state = PROXY_IDDLE;
-    int target_port = this->server_record.port;
-    int temp;
+// Pool with the resolved address plus the record backends of the same family,
+// nullptr when there is nothing to fail over to or token was cancelled. Domain backends are
+// looked up through ControlExecutor::blocking() like the record itself.
+Task<std::shared_ptr<BackendPool>> create_backend_pool(ControlExecutor *control, ServerRecord record, eAddressType mode, in_addr serverIp4, in6_addr serverIp6,
+                                                       CancelToken token)
+{
+    if (record.backends.empty())
+    {
+        co_return nullptr;
+    }
+
+    std::shared_ptr<BackendPool> backend_pool = std::make_shared<BackendPool>(mode == eAddressType::IPv4 ? AF_INET : AF_INET6);
     if (mode == eAddressType::IPv4)
     {
-        IPv4Proxy proxy_v4(proxySocket);
-        std::thread t([this, &proxy_v4, serverIp4, target_port]()
-                      { proxy_v4.connect(serverIp4, target_port); });
-        t.detach();
+        sockaddr_in primary{};
+        primary.sin_family = AF_INET;
+        primary.sin_port = htons(record.port);
+        primary.sin_addr = serverIp4;
+        backend_pool->add((sockaddr *)&primary, sizeof(primary));
+    }
+    else
+    {
+        sockaddr_in6 primary{};
+        primary.sin6_family = AF_INET6;
+        primary.sin6_port = htons(record.port);
+        primary.sin6_addr = serverIp6;
+        backend_pool->add((sockaddr *)&primary, sizeof(primary));
+    }
+    int family = mode == eAddressType::IPv4 ? AF_INET : AF_INET6;
+    for (const auto &backend : record.backends)
+    {
+        if (backend.address_type != eAddressType::Domain)
+        {
+            backend_pool->add(backend.address_type, backend.address, backend.port);
+            continue;
+        }
+        std::string host = backend.address;
+        auto lookup = control->blocking<AddressList>([host]()
+                                                     { return lookup_address(host); },
+                                                     token);
+        std::optional<AddressList> result = co_await lookup;
+        if (!result)
+        {
+            co_return nullptr;
+        }
+        if (!*result)
+        {
+            continue;
+        }
+        addrinfo *p = result->get();
+        while (p != NULL && p->ai_family != family)
+        {
+            p = p->ai_next;
+        }
+        if (p != NULL)
+        {
+            ((sockaddr_in *)p->ai_addr)->sin_port = htons(backend.port); // Same offset in sockaddr_in6.
+            backend_pool->add(p->ai_addr, (socklen_t)p->ai_addrlen);
+        }
+        else
+        {
+            std::cout << "Backend " << host << " has no address of the proxy's family, skipping it." << std::endl;
+        }
+    }
+    if (backend_pool->size() < 2)
+    {
+        co_return nullptr;
+    }
+
+    std::cout << "Proxy using " << backend_pool->size() << " backends." << std::endl;
+    backend_pool->start();
+    co_return backend_pool;
+}
+
+// Hands proxy_socket to the engine. Returns 0 or a wxEVT_PROXY_THREAD_STOPPED error code,
+// on error the socket still belongs to the caller.
+int start_proxy(ProxyEngine *engine, int proxy_socket, ServerRecord record, eAddressType mode, in_addr serverIp4, in6_addr serverIp6, int tunnel,
+                std::shared_ptr<BackendPool> backend_pool)
+{
+    int status;
+    if (mode == eAddressType::IPv4)
+    {
+        IPv4Proxy proxy_v4(engine, proxy_socket);
+        proxy_v4.set_backends(backend_pool);
+        proxy_v4.set_tunnel(tunnel);
+        status = proxy_v4.connect(serverIp4, record.port);
+    }
+    else
+    {
+        IPv6Proxy proxy_v6(engine, proxy_socket);
+        proxy_v6.set_backends(backend_pool);
+        proxy_v6.set_tunnel(tunnel);
+        status = proxy_v6.connect(serverIp6, record.port);
+    }
+    return status == 0 ? 0 : 6;
+}
+
+// Hands a route another process was running to the engine with its clients. Returns 0
+// or a wxEVT_PROXY_THREAD_STOPPED error code, on error the sockets still belong to the caller.
+int adopt_route(ProxyEngine *engine, const HandoffRoute &route)
+{
+    std::shared_ptr<BackendPool> backend_pool;
+    if (!route.backends.empty())
+    {
+        backend_pool = std::make_shared<BackendPool>(route.upstream.ss_family);
+        for (const auto &backend : route.backends)
+        {
+            backend_pool->add((const sockaddr *)&backend.address, backend.address_len);
+        }
+        backend_pool->start();
+    }
+    return engine->adopt_route(route, backend_pool) == 0 ? 0 : 6;
+}
+
+// Comma separated IPv4 or IPv6 addresses of local interfaces, without brackets or ports.
+bool parse_local_addresses(const std::string &text, std::vector<sockaddr_storage> *addresses)
+{
+    size_t start = 0;
+    while (start < text.size())
+    {
+        size_t end = text.find(',', start);
+        if (end == std::string::npos)
+        {
+            end = text.size();
+        }
+        std::string address = text.substr(start, end - start);
+        start = end + 1;
 
-        while (proxy_v4.get_state() != PROXY_READY)
+        sockaddr_storage local{};
+        if (inet_pton(AF_INET, address.c_str(), &((sockaddr_in *)&local)->sin_addr) == 1)
+        {
+            local.ss_family = AF_INET;
+        }
+        else if (inet_pton(AF_INET6, address.c_str(), &((sockaddr_in6 *)&local)->sin6_addr) == 1)
+        {
+            local.ss_family = AF_INET6;
+        }
+        else
         {
-            this->Sleep(5);
+            return false;
         }
+        addresses->push_back(local);
+    }
+    return true;
+}
+
+// Reports the state of the proxy's route to parent until token is cancelled, then
+// removes the route.
+Task<void> watch_proxy(ControlExecutor *control, wxWindow *parent, ProxyEngine *engine, int proxy_socket, int proxy_port, CancelToken token)
+{
+    wxThreadEvent *threadEvent;
 
-        while (true)
+    // The engine thread does the forwarding, this only reports state changes.
+    int proxy_state = PROXY_IDDLE;
+    int temp;
+    while (co_await control->sleep(PROXY_STATE_POLL_MS, token) != CONTROL_CANCELLED)
+    {
+        temp = engine->get_route_state(proxy_socket);
+        if (temp != proxy_state)
         {
-            temp = proxy_v4.get_state();
-            if (temp != proxy_state)
+            proxy_state = temp;
+            if (proxy_state == PROXY_READY)
             {
-                proxy_state = temp;
-                if (proxy_state == PROXY_READY)
-                {
-                    threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_UPDATE);
-                    threadEvent->SetInt(1);
-                    threadEvent->SetString("localhost:" + std::to_string(this->proxy_port));
-                    wxQueueEvent(this->parent, threadEvent);
-                }
-                else if (proxy_state == PROXY_ESTABLISHED)
-                {
-                    threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_UPDATE);
-                    threadEvent->SetInt(2);
-                    wxQueueEvent(this->parent, threadEvent);
-                }
+                threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_UPDATE);
+                threadEvent->SetInt(1);
+                threadEvent->SetString("localhost:" + std::to_string(proxy_port));
+                wxQueueEvent(parent, threadEvent);
             }
-            this->Sleep(5); // Sleep for 5ms
-
-            if (this->TestDestroy())
+            else if (proxy_state == PROXY_ESTABLISHED)
             {
-                proxy_v4.disconnect();
-                while (proxy_v4.is_running())
-                {
-                    this->Sleep(5);
-                }
-                break;
+                threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_UPDATE);
+                threadEvent->SetInt(2);
+                wxQueueEvent(parent, threadEvent);
             }
-            // wxQueueEvent(m_pHandler, new wxThreadEvent(wxEVT_COMMAND_MYTHREAD_UPDATE));
         }
     }
-    else if (mode == eAddressType::IPv6)
+
+    // Closes proxy_socket too.
+    engine->remove_route(proxy_socket);
+    threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_STOPPED);
+    threadEvent->SetInt(0);
+    wxQueueEvent(parent, threadEvent);
+}
+
+// Resolves, binds and hands the proxy started from the server list to the engine, then
+// reports its state until token is cancelled. Progress goes to parent as the
+// wxEVT_PROXY_THREAD_* events, ending with wxEVT_PROXY_THREAD_STOPPED.
+Task<void> run_proxy(ControlExecutor *control, wxWindow *parent, ProxyEngine *engine, int proxy_port, ServerRecord record, CancelToken token)
+{
+    eAddressType mode;
+    wxThreadEvent *threadEvent;
+    struct in_addr serverIp4;
+    struct in6_addr serverIp6;
+
+    int status = co_await resolve_server_record(control, record, token, &mode, &serverIp4, &serverIp6);
+    if (token.cancelled())
+    {
+        threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_STOPPED);
+        threadEvent->SetInt(0);
+        wxQueueEvent(parent, threadEvent);
+        co_return;
+    }
+    if (status != 0)
     {
-        IPv6Proxy proxy_v6(proxySocket);
-        std::thread t([this, &proxy_v6, serverIp6, target_port]()
-                      { proxy_v6.connect(serverIp6, target_port); });
-        t.detach();
+        threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_STOPPED);
+        threadEvent->SetInt(status);
+        threadEvent->SetString(record.address);
+        wxQueueEvent(parent, threadEvent);
+        co_return;
+    }
 
-        while (true)
+    if (record.address_type == eAddressType::Domain)
+    {
+        threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_RESOLVED_ADDRESS);
+        if (mode == eAddressType::IPv6)
         {
-            temp = proxy_v6.get_state();
-            if (temp != proxy_state)
-            {
-                proxy_state = temp;
-                if (proxy_state == PROXY_READY)
-                {
-                    threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_UPDATE);
-                    threadEvent->SetInt(1);
-                    threadEvent->SetString("localhost:" + std::to_string(this->proxy_port));
-                    wxQueueEvent(this->parent, threadEvent);
-                }
-                else if (proxy_state == PROXY_ESTABLISHED)
-                {
-                    threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_UPDATE);
-                    threadEvent->SetInt(2);
-                    wxQueueEvent(this->parent, threadEvent);
-                }
-            }
-            this->Sleep(5); // Sleep for 5ms
+            char ipv6[INET6_ADDRSTRLEN];
+            inet_ntop(AF_INET6, &serverIp6, ipv6, sizeof(ipv6));
+            threadEvent->SetString("[" + std::string(ipv6) + "]:" + std::to_string(record.port));
+        }
+        else
+        {
+            char ipv4[INET_ADDRSTRLEN];
+            inet_ntop(AF_INET, &serverIp4, ipv4, sizeof(ipv4));
+            threadEvent->SetString(std::string(ipv4) + ":" + std::to_string(record.port));
+        }
+        wxQueueEvent(parent, threadEvent);
+    }
+
+    std::shared_ptr<BackendPool> backend_pool = co_await create_backend_pool(control, record, mode, serverIp4, serverIp6, token);
+    if (token.cancelled())
+    {
+        threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_STOPPED);
+        threadEvent->SetInt(0);
+        wxQueueEvent(parent, threadEvent);
+        co_return;
+    }
+    int proxySocket;
+    status = open_proxy_socket(proxy_port, &proxySocket);
+    if (status == 0)
+    {
+        status = start_proxy(engine, proxySocket, record, mode, serverIp4, serverIp6, TUNNEL_NONE, backend_pool);
+        if (status != 0)
+        {
+            close_socket(proxySocket);
+        }
+    }
+    if (status != 0)
+    {
+        threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_STOPPED);
+        threadEvent->SetInt(status);
+        threadEvent->SetString(std::to_string(proxy_port));
+        wxQueueEvent(parent, threadEvent);
+        co_return;
+    }
+
+    co_await watch_proxy(control, parent, engine, proxySocket, proxy_port, token);
+}
 
-            if (this->TestDestroy())
+std::string proxy_error_message(int code, std::string detail)
+{
+    switch (code)
+    {
+    case 1:
+        return "Couldn't resolve domain \"" + detail + "\".";
+    case 2:
+        return "For domain \"" + detail + "\", couldn't connect to any detected address.";
+    case 3:
+        return "Failed to create socket.";
+    case 4:
+        return "Failed to start on port " + detail + ".";
+    case 5:
+        return "Unknown Operation Mode Error.";
+    case 6:
+        return "Couldn't start forwarding.";
+    default:
+        return "";
+    }
+}
+
+// Starts a route of the routes tab, the same steps as run_proxy() without watching it
+// afterwards. The result goes to parent as wxEVT_ROUTE_STARTED.
+Task<void> start_route(ControlExecutor *control, wxWindow *parent, ProxyEngine *engine, ServerRecord record, RouteRecord route)
+{
+    eAddressType mode;
+    struct in_addr serverIp4;
+    struct in6_addr serverIp6;
+    std::string detail = record.address;
+    int status = co_await resolve_server_record(control, record, CancelToken(), &mode, &serverIp4, &serverIp6);
+    if (status == 0)
+    {
+        std::shared_ptr<BackendPool> backend_pool = co_await create_backend_pool(control, record, mode, serverIp4, serverIp6, CancelToken());
+        detail = std::to_string(route.listen_port);
+        status = open_proxy_socket(route.listen_port, &route.listen_socket);
+        if (status == 0)
+        {
+            status = start_proxy(engine, route.listen_socket, record, mode, serverIp4, serverIp6, route.tunnel, backend_pool);
+            if (status != 0)
             {
-                proxy_v6.disconnect();
-                while (proxy_v6.is_running())
-                {
-                    this->Sleep(5);
-                }
-                break;
+                close_socket(route.listen_socket);
+                route.listen_socket = -1;
             }
-            // wxQueueEvent(m_pHandler, new wxThreadEvent(wxEVT_COMMAND_MYTHREAD_UPDATE));
         }
     }
+    route.error = status;
+    route.message = proxy_error_message(status, detail);
 
-    // return proxySocket;
-
-    close_socket(proxySocket);
-    threadEvent = new wxThreadEvent(wxEVT_PROXY_THREAD_STOPPED);
-    threadEvent->SetInt(0);
-    wxQueueEvent(this->parent, threadEvent);
-    return (wxThread::ExitCode)0;
+    wxThreadEvent *event = new wxThreadEvent(wxEVT_ROUTE_STARTED);
+    event->SetPayload(route);
+    wxQueueEvent(parent, event);
 }
 
-ProxyThread::~ProxyThread()
+// Waits on listener for a restarted process and hands it every route with its clients,
+// then tells parent to close with wxEVT_HANDED_OFF. Routes a failed successor didn't
+// acknowledge are taken back. Closes listener once done or stopped.
+Task<void> serve_handoff(ControlExecutor *control, wxWindow *parent, ProxyEngine *engine, int listener)
 {
-    MainFrame *mainFrame = wxStaticCast(this->parent, MainFrame);
-    if (mainFrame)
+    std::vector<int> waiting{listener};
+    while (true)
     {
-        wxCriticalSectionLocker enter(mainFrame->m_pThreadCS);
-        mainFrame->proxy_thread = nullptr;
+        int ready = co_await control->readable(waiting, PROXY_HANDOFF_WAIT_MS, CancelToken());
+        if (ready == CONTROL_CANCELLED)
+        {
+            break;
+        }
+        int successor = ready == CONTROL_TIMEOUT ? -1 : handoff_accept(listener);
+        if (successor < 0)
+        {
+            continue;
+        }
+
+        // Clients are on hold from here until the successor adopted the routes.
+        std::vector<HandoffRoute> routes;
+        engine->export_routes(&routes);
+        bool handed = handoff_send(successor, routes) == 0;
+        if (handed)
+        {
+            std::vector<int> answer{successor};
+            handed = co_await control->readable(answer, HANDOFF_TIMEOUT_MS, CancelToken()) == 0 && handoff_acknowledged(successor);
+        }
+        close_socket(successor);
+        if (handed)
+        {
+            std::cout << "Handoff: " << routes.size() << " routes handed over." << std::endl;
+            handoff_close(routes);
+            wxQueueEvent(parent, new wxThreadEvent(wxEVT_HANDED_OFF));
+            break;
+        }
+
+        std::cerr << "Handoff: The new process didn't take the routes, keeping them." << std::endl;
+        for (const auto &route : routes)
+        {
+            if (adopt_route(engine, route) != 0)
+            {
+                handoff_close({route});
+            }
+        }
     }
+    close_socket(listener);
+}
 
-    // the thread is being destroyed; make sure not to leave dangling pointers around
+ServerListCtrl::ServerListCtrl(wxWindow *parent, ServerStore *store)
+    : wxListCtrl(parent, wxID_ANY, wxDefaultPosition, wxDefaultSize, wxLC_REPORT | wxLC_VIRTUAL | wxLC_SINGLE_SEL | wxSUNKEN_BORDER)
+{
+    this->store = store;
+    this->reachable_attr.SetTextColour(SERVER_REACHABLE_WXCOLOR);
+    this->unreachable_attr.SetTextColour(SERVER_UNREACHABLE_WXCOLOR);
+    this->AppendColumn("Name", wxLIST_FORMAT_LEFT, 200);
+    this->AppendColumn("Address", wxLIST_FORMAT_LEFT, 320);
+    this->AppendColumn("Ping", wxLIST_FORMAT_RIGHT, 90);
+    this->Reload();
 }
 
-std::string ServerWidget::GetFullAddress()
+// Drops every cached page, rows are read again when they are drawn.
+void ServerListCtrl::Reload()
 {
-    if (this->record.address_type == eAddressType::IPv6)
+    this->pages.clear();
+    this->page_ends.clear();
+    long count = this->store->count_servers();
+    this->SetItemCount(count);
+    if (count > 0)
     {
-        return "[" + this->record.address + "]:" + std::to_string(this->record.port);
+        this->RefreshItems(0, count - 1);
     }
-    return this->record.address + ":" + std::to_string(this->record.port);
 }
 
-std::string ServerWidget::GetMinimalAddress()
+const std::vector<ServerRecord> &ServerListCtrl::GetPage(long page) const
 {
-    std::string response;
-    if (this->record.address_type == eAddressType::IPv6)
+    auto it = this->pages.find(page);
+    if (it != this->pages.end())
     {
-        response = "[" + this->record.address + "]";
+        return it->second;
     }
-    else
+    if (this->pages.size() >= SERVER_PAGE_CACHE)
     {
-        response = this->record.address;
+        this->pages.clear();
     }
-    if (record.port != PROXY_DEFAULT_PORT)
+
+    // Pages are read from where the closest page before them ended, a jump past pages
+    // never drawn only walks the sort keys in between.
+    const ServerRecord *after = nullptr;
+    long after_page = -1;
+    auto end = this->page_ends.lower_bound(page);
+    if (end != this->page_ends.begin())
     {
-        return response += ":" + std::to_string(this->record.port);
+        end--;
+        after = &end->second;
+        after_page = end->first;
     }
-    return response;
+    if (after_page < page - 1)
+    {
+        ServerRecord skipped;
+        if (!this->store->seek_server(after, (page - 1 - after_page) * SERVER_PAGE_SIZE, &skipped))
+        {
+            return this->pages[page];
+        }
+        after = &(this->page_ends[page - 1] = skipped);
+    }
+    std::vector<ServerRecord> &rows = this->pages[page] = this->store->load_page(after, SERVER_PAGE_SIZE);
+    if (!rows.empty())
+    {
+        this->page_ends[page] = rows.back();
+    }
+    return rows;
 }
 
-bool ServerWidget::SetConnectButtonEnable(bool state)
+bool ServerListCtrl::GetRecord(long item, ServerRecord *record) const
 {
-    if (state)
+    if (item < 0 || item >= this->GetItemCount())
+    {
+        return false;
+    }
+    const std::vector<ServerRecord> &page = this->GetPage(item / SERVER_PAGE_SIZE);
+    size_t index = item % SERVER_PAGE_SIZE;
+    if (index >= page.size())
     {
-        return this->connect_button->Enable();
+        return false;
     }
-    return this->connect_button->Disable();
+    *record = page[index];
+    return true;
 }
 
-void ServerWidget::ExchangeRecordId(ServerWidget *other)
+long ServerListCtrl::GetSelectedItem() const
 {
-    std::swap(this->record.id, other->record.id);
+    return this->GetNextItem(-1, wxLIST_NEXT_ALL, wxLIST_STATE_SELECTED);
 }
 
-int ServerWidget::GetRecordId()
+void ServerListCtrl::SelectItem(long item)
 {
-    return this->record.id;
+    if (item < 0 || item >= this->GetItemCount())
+    {
+        return;
+    }
+    this->SetItemState(item, wxLIST_STATE_SELECTED | wxLIST_STATE_FOCUSED, wxLIST_STATE_SELECTED | wxLIST_STATE_FOCUSED);
+    this->EnsureVisible(item);
+}
+
+void ServerListCtrl::SetPings(std::vector<ProbeResult> results)
+{
+    for (const auto &result : results)
+    {
+        this->pings[result.id] = result;
+    }
+    long top = this->GetTopItem();
+    long last = std::min(top + this->GetCountPerPage(), this->GetItemCount() - 1);
+    if (last >= top)
+    {
+        this->RefreshItems(top, last);
+    }
 }
 
-ServerRecord ServerWidget::GetRecord()
+wxString ServerListCtrl::OnGetItemText(long item, long column) const
 {
-    return this->record;
+    ServerRecord record;
+    if (!this->GetRecord(item, &record))
+    {
+        return "";
+    }
+    switch (column)
+    {
+    case 0:
+        return wxString::FromUTF8(record.name);
+    case 1:
+    {
+        std::string address = minimal_address(record.address_type, record.address, record.port);
+        if (!record.backends.empty())
+        {
+            address += " +" + std::to_string(record.backends.size()) + " backends";
+        }
+        return address;
+    }
+    case 2:
+    {
+        auto it = this->pings.find(record.id);
+        if (it == this->pings.end())
+        {
+            return "Pinging...";
+        }
+        if (!it->second.reachable)
+        {
+            return "Unreachable";
+        }
+        return std::to_string(it->second.rtt_ms) + " ms";
+    }
+    default:
+        return "";
+    }
+}
+
+wxItemAttr *ServerListCtrl::OnGetItemColumnAttr(long item, long column) const
+{
+    ServerRecord record;
+    if (column != 2 || !this->GetRecord(item, &record))
+    {
+        return nullptr;
+    }
+    auto it = this->pings.find(record.id);
+    if (it == this->pings.end())
+    {
+        return nullptr;
+    }
+    return it->second.reachable ? &this->reachable_attr : &this->unreachable_attr;
 }
 
 DeleteServerRecordDialog::DeleteServerRecordDialog(ServerRecord record,
@@ -516,31 +1032,6 @@ DeleteServerRecordDialog::DeleteServerRecordDialog(ServerRecord record,
                { this->EndModal(wxID_CLOSE); });
 }
 
-std::vector<ServerRecord> MainFrame::LoadServerRecordFromSql()
-{
-    std::vector<ServerRecord> records;
-    sqlite3_stmt *stmt;
-    if (sqlite3_prepare_v2(db, "SELECT id, name, address_type, address, port FROM server;", -1, &stmt, NULL) != SQLITE_OK)
-    {
-        std::cerr << "Couldn't load servers from sqlite3." << std::endl;
-        return records;
-    }
-    while (sqlite3_step(stmt) == SQLITE_ROW)
-    {
-        int id = sqlite3_column_int(stmt, 0);
-        const char *rawName = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 1));
-        std::string name = rawName ? rawName : "";
-        eAddressType addr_type = static_cast<eAddressType>(sqlite3_column_int(stmt, 2));
-        const char *rawAddr = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 3));
-        std::string address = rawAddr ? rawAddr : "";
-        int port = sqlite3_column_int(stmt, 4);
-        records.push_back({id, name, addr_type, address, port});
-    }
-
-    sqlite3_finalize(stmt);
-    return records;
-}
-
 int MainFrame::ValidateServerAddress(eAddressType address_type, std::string address, int port)
 {
     if (address_type == eAddressType::Invalid)
@@ -566,6 +1057,21 @@ int MainFrame::ValidateServerAddress(eAddressType address_type, std::string addr
     return 0;
 }
 
+// Accepts a single address or a comma separated list, every address after the first one
+// is stored as a failover backend.
+int MainFrame::ParseServerRecord(std::string input, ServerRecord &record)
+{
+    switch (parse_server_record(input, record))
+    {
+    case 0:
+        return 0;
+    case 2:
+        return MainFrame::ValidateServerAddress(eAddressType::Domain, "", -1);
+    default:
+        return MainFrame::ValidateServerAddress(eAddressType::Invalid, "", -1);
+    }
+}
+
 void MainFrame::ConnectFromServerRecord(wxThreadEvent &event)
 {
     if (this->port == -1)
@@ -577,7 +1083,7 @@ void MainFrame::ConnectFromServerRecord(wxThreadEvent &event)
         return;
     }
 
-    if (this->proxy_thread != nullptr)
+    if (this->proxy_running)
     {
         return;
     }
@@ -585,16 +1091,9 @@ void MainFrame::ConnectFromServerRecord(wxThreadEvent &event)
     ServerRecord record = event.GetPayload<ServerRecord>();
 
     this->status_book->SetSelection(1);
-    this->proxy_thread = new ProxyThread(this, this->port, record);
-
-    if (this->proxy_thread->Run() != wxTHREAD_NO_ERROR)
-    {
-        wxLogError("Can't create the thread!");
-        delete this->proxy_thread;
-        this->proxy_thread = nullptr;
-        this->status_book->SetSelection(0);
-        return;
-    }
+    this->proxy_running = true;
+    this->proxy_token = this->control.token();
+    this->control.spawn(run_proxy(&this->control, this, &this->engine, this->port, record, this->proxy_token));
 
     this->ptr_port_input->Disable();
     this->ptr_ip_input->Disable();
@@ -620,284 +1119,138 @@ void MainFrame::ConnectFromServerRecord(wxThreadEvent &event)
         this->proxy_server_address_ptr->SetValue(record.address + ":" + std::to_string(record.port));
     }
 
-    wxSizer *server_sizer = this->server_list->GetSizer();
-    wxSizerItemList &children = server_sizer->GetChildren();
-
-    for (auto child : children)
-    {
-        ServerWidget *widget = wxDynamicCast(child->GetWindow(), ServerWidget);
-
-        if (widget)
-        {
-            widget->SetConnectButtonEnable(false);
-        }
-    }
+    this->ptr_server_connect_button->Disable();
 }
 
-void MainFrame::DeleteServerRecord(wxThreadEvent &event)
+bool MainFrame::GetSelectedRecord(ServerRecord *record)
 {
-    wxObject *origin = event.GetEventObject();
-    ServerWidget *panel = wxDynamicCast(origin, ServerWidget);
-    if (!panel)
-    {
-        return;
-    }
-    int record_id = panel->GetRecordId();
-
-    sqlite3_stmt *stmt;
-    char *error_msg;
-
-    sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, &error_msg);
-    if (sqlite3_prepare_v2(db, "DELETE FROM server WHERE id = ?;", -1, &stmt, NULL) != SQLITE_OK)
-    {
-
-        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, &error_msg);
-        sqlite3_free(error_msg);
-        return;
-    }
-
-    sqlite3_bind_int(stmt, 1, record_id);
+    return this->server_list->GetRecord(this->server_list->GetSelectedItem(), record);
+}
 
-    if (sqlite3_step(stmt) != SQLITE_DONE)
+void MainFrame::OnServerConnect(wxCommandEvent &event)
+{
+    ServerRecord record;
+    if (!this->GetSelectedRecord(&record))
     {
-
-        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, &error_msg);
-        sqlite3_finalize(stmt);
-        sqlite3_free(error_msg);
         return;
     }
+    wxThreadEvent *request = new wxThreadEvent(wxEVT_CONNECT_SERVER_RECORD);
+    request->SetEventObject(this);
+    request->SetPayload(record);
+    wxQueueEvent(this, request);
+}
 
-    sqlite3_exec(db, "COMMIT;", NULL, NULL, &error_msg);
-    sqlite3_free(error_msg);
-    sqlite3_finalize(stmt);
-    if (panel->Destroy())
+void MainFrame::OnServerActivated(wxListEvent &event)
+{
+    if (this->ptr_server_connect_button->IsEnabled())
     {
-        this->server_list->GetSizer()->Layout();
-        this->server_list->FitInside();
+        wxCommandEvent connect;
+        this->OnServerConnect(connect);
     }
 }
-void MainFrame::MoveServerRecord(wxThreadEvent &event)
-{
-    wxObject *origin = event.GetEventObject();
-    ServerWidget *panel = wxDynamicCast(origin, ServerWidget);
 
-    if (!panel)
+void MainFrame::OnServerDelete(wxCommandEvent &event)
+{
+    ServerRecord record;
+    if (!this->GetSelectedRecord(&record))
     {
         return;
     }
-    int target = -1;
-    wxBoxSizer *server_sizer = (wxBoxSizer *)this->server_list->GetSizer();
-    int limit = (int)server_sizer->GetItemCount();
 
-    for (int i = 0; i < limit; i++)
-    {
-        if (server_sizer->GetItem(i)->GetWindow() == panel)
-        {
-            target = i;
-            break;
-        }
-    }
-
-    if (target == -1)
+    DeleteServerRecordDialog dialog(record,
+                                    "Confirm Deletion",
+                                    wxYES_NO | wxNO_DEFAULT,
+                                    this);
+    if (dialog.ShowModal() != wxID_YES)
     {
         return;
     }
 
-    int move = event.GetInt();
+    // Its backends and routes go with it.
+    this->store->delete_server(record.id);
 
-    ServerWidget *exchange = NULL;
-    int other;
-
-    if (move == SERVER_MOVE_UP)
+    for (auto it = this->routes.begin(); it != this->routes.end();)
     {
-        if (target == 0) // it's already on top
+        if (it->server_id != record.id)
         {
-            return;
+            it++;
+            continue;
         }
-        other = target - 1;
-        exchange = wxDynamicCast(server_sizer->GetItem(other)->GetWindow(), ServerWidget);
-    }
-    else if (move == SERVER_MOVE_DOWN)
-    {
-        int other = target + 1;
-        if (other == limit) // it's already on bottom
+        if (it->listen_socket >= 0)
         {
-            return;
+            this->engine.remove_route(it->listen_socket);
         }
-        exchange = wxDynamicCast(server_sizer->GetItem(other)->GetWindow(), ServerWidget);
+        it = this->routes.erase(it);
     }
+    this->RenderRoutes();
 
-    if (!exchange)
-    {
-        return;
-    }
-
-    ServerRecord panel_record = panel->GetRecord();
-    ServerRecord exchange_record = exchange->GetRecord();
-    std::swap(panel_record.id, exchange_record.id);
-
-    char *error_msg = nullptr;
-
-    // 1. Start the transaction
-    sqlite3_exec(db, "BEGIN TRANSACTION;", nullptr, nullptr, &error_msg);
-
-    const char *sql = "UPDATE server SET name = ?, address_type=?, address=?, port=? WHERE id = ?;";
-    sqlite3_stmt *stmt;
-
-    if (sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr) == SQLITE_OK)
-    {
-
-        sqlite3_bind_text(stmt, 1, panel_record.name.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int(stmt, 2, static_cast<int>(panel_record.address_type));
-        sqlite3_bind_text(stmt, 3, panel_record.address.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int(stmt, 4, panel_record.port);
-        sqlite3_bind_int(stmt, 5, panel_record.id);
-        if (sqlite3_step(stmt) != SQLITE_DONE)
-        {
-            sqlite3_finalize(stmt);
-            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-            return;
-        }
-        sqlite3_reset(stmt); // Reset is required to reuse the prepared statement
-
-        sqlite3_bind_text(stmt, 1, exchange_record.name.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int(stmt, 2, static_cast<int>(exchange_record.address_type));
-        sqlite3_bind_text(stmt, 3, exchange_record.address.c_str(), -1, SQLITE_TRANSIENT);
-        sqlite3_bind_int(stmt, 4, exchange_record.port);
-        sqlite3_bind_int(stmt, 5, exchange_record.id);
-        if (sqlite3_step(stmt) != SQLITE_DONE)
-        {
-            sqlite3_finalize(stmt);
-            sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-            return;
-        };
-
-        sqlite3_finalize(stmt);
-
-        // 4. Commit the changes to disk
-        sqlite3_exec(db, "COMMIT;", nullptr, nullptr, &error_msg);
-    }
-    else
-    {
-        sqlite3_exec(db, "ROLLBACK;", nullptr, nullptr, nullptr);
-        return;
-    }
-
-    panel->ExchangeRecordId(exchange);
-
-    ServerWidget *to_rerender = move == SERVER_MOVE_UP ? panel : exchange;
+    long selection = this->server_list->GetSelectedItem();
+    this->server_list->Reload();
+    this->server_list->SelectItem(std::min(selection, this->server_list->GetItemCount() - 1));
+    this->RefreshProbeTargets();
+}
 
-    server_sizer->Detach(to_rerender);
-    server_sizer->Insert(std::min(other, target), to_rerender, 0, wxALL | wxEXPAND);
-    this->server_list->GetSizer()->Layout();
-    this->server_list->FitInside();
+void MainFrame::OnServerMoveUp(wxCommandEvent &event)
+{
+    this->MoveServerRecord(SERVER_MOVE_UP);
 }
 
-void ServerWidget::OnConnect(wxCommandEvent &event)
+void MainFrame::OnServerMoveDown(wxCommandEvent &event)
 {
-    ServerRecord record = this->record;
-    wxThreadEvent *request = new wxThreadEvent(wxEVT_CONNECT_SERVER_RECORD);
-    request->SetEventObject(this);
-    request->SetPayload(record);
-    request->ResumePropagation(wxEVENT_PROPAGATE_MAX);
-    wxQueueEvent(this, request);
+    this->MoveServerRecord(SERVER_MOVE_DOWN);
 }
-void ServerWidget::OnDelete(wxCommandEvent &event)
+
+void MainFrame::MoveServerRecord(int move)
 {
+    long target = this->server_list->GetSelectedItem();
+    long other = target + move;
+    ServerRecord record;
+    ServerRecord exchange;
+    if (!this->server_list->GetRecord(target, &record) || !this->server_list->GetRecord(other, &exchange))
+    {
+        return; // nothing selected, or it's already on top or bottom
+    }
 
-    DeleteServerRecordDialog dialog(this->record,
-                                    "Confirm Deletion",
-                                    wxYES_NO | wxNO_DEFAULT);
+    // The server lands between exchange and the one past it, only its sort key changes.
+    ServerRecord beyond;
+    double near_position = exchange.position;
+    double far_position = near_position + move * 2;
+    if (this->server_list->GetRecord(other + move, &beyond))
+    {
+        far_position = beyond.position;
+    }
 
-    if (dialog.ShowModal() == wxID_YES)
+    double position;
+    if (position_between(std::min(near_position, far_position), std::max(near_position, far_position), &position))
     {
-        wxThreadEvent *request = new wxThreadEvent(wxEVT_DELETE_SERVER_RECORD);
-        request->SetEventObject(this);
-        request->ResumePropagation(wxEVENT_PROPAGATE_MAX);
-        wxQueueEvent(this, request);
+        this->store->set_position(record.id, position);
     }
-}
-void ServerWidget::OnMoveUp(wxCommandEvent &event)
-{
-    wxThreadEvent *request = new wxThreadEvent(wxEVT_MOVE_SERVER_RECORD);
-    request->SetEventObject(this);
-    request->SetInt(SERVER_MOVE_UP);
-    request->ResumePropagation(wxEVENT_PROPAGATE_MAX);
-    wxQueueEvent(this, request);
-}
-void ServerWidget::OnMoveDown(wxCommandEvent &event)
-{
-    wxThreadEvent *request = new wxThreadEvent(wxEVT_MOVE_SERVER_RECORD);
-    request->SetEventObject(this);
-    request->SetInt(SERVER_MOVE_DOWN);
-    request->ResumePropagation(wxEVENT_PROPAGATE_MAX);
-    wxQueueEvent(this, request);
+    else
+    {
+        // Every server gets its row + 1 as key, then the gap is wide again.
+        this->store->renumber_positions();
+        this->store->set_position(record.id, other + 1 + move * 0.5);
+    }
+
+    this->server_list->Reload();
+    this->server_list->SelectItem(other);
+    this->RefreshProbeTargets();
 }
 
-void ServerWidget::CopyAddress(wxCommandEvent &event)
+void MainFrame::OnServerCopyAddress(wxCommandEvent &event)
 {
-    if (wxTheClipboard->Open())
+    ServerRecord record;
+    if (this->GetSelectedRecord(&record) && wxTheClipboard->Open())
     {
-        wxTheClipboard->SetData(new wxTextDataObject(this->GetMinimalAddress()));
+        wxTheClipboard->SetData(new wxTextDataObject(server_minimal_address(record)));
         wxTheClipboard->Close();
     }
 }
 
-ServerWidget::ServerWidget(wxWindow *parent, ServerRecord record) : wxPanel(parent, wxID_ANY, wxDefaultPosition, wxDefaultSize, wxBORDER_SIMPLE)
+void MainFrame::OnServerListCacheHint(wxListEvent &event)
 {
-    this->record = record;
-    wxBoxSizer *sizer = new wxBoxSizer(wxVERTICAL);
-    wxBoxSizer *padding = new wxBoxSizer(wxVERTICAL);
-    wxStaticText *title = new wxStaticText(this, wxID_ANY, record.name, wxDefaultPosition, wxDefaultSize, wxST_ELLIPSIZE_END);
-    title->SetFont(wxFont(16, wxFONTFAMILY_DEFAULT, wxFONTSTYLE_NORMAL, wxFONTWEIGHT_BOLD));
-    title->SetForegroundColour(SERVER_NAME_WXCOLOR);
-    sizer->Add(title, 0, wxEXPAND);
-    wxBoxSizer *address = new wxBoxSizer(wxHORIZONTAL);
-    wxStaticText *address_text;
-    switch (record.address_type)
-    {
-    case eAddressType::IPv4:
-    case eAddressType::Domain:
-        address_text = new wxStaticText(this, wxID_ANY, record.address);
-        address_text->SetFont(wxFont(12, wxFONTFAMILY_DEFAULT, wxFONTSTYLE_NORMAL, wxFONTWEIGHT_SEMIBOLD));
-        break;
-    case eAddressType::IPv6:
-        address_text = new wxStaticText(this, wxID_ANY, "[" + record.address + "]");
-        address_text->SetFont(wxFont(12, wxFONTFAMILY_DEFAULT, wxFONTSTYLE_NORMAL, wxFONTWEIGHT_SEMIBOLD));
-        break;
-    default:
-        address_text = new wxStaticText(this, wxID_ANY, "N/A");
-        break;
-    }
-    address->Add(address_text);
-    wxStaticText *port_text = new wxStaticText(this, wxID_ANY, ":" + std::to_string(record.port));
-    port_text->SetFont(wxFont(12, wxFONTFAMILY_DEFAULT, wxFONTSTYLE_NORMAL, wxFONTWEIGHT_NORMAL));
-    port_text->SetForegroundColour(SERVER_PORT_WXCOLOR);
-    address->Add(port_text, 0, wxALIGN_CENTER_VERTICAL);
-    sizer->Add(address, 1, wxEXPAND | wxBOTTOM, 5);
-
-    wxBoxSizer *buttons = new wxBoxSizer(wxHORIZONTAL);
-    wxButton *move_up_button = new wxButton(this, wxID_ANY, L"▲");
-    move_up_button->Bind(wxEVT_BUTTON, &ServerWidget::OnMoveUp, this);
-    buttons->Add(move_up_button, 0, wxRIGHT, 5);
-    wxButton *move_down_button = new wxButton(this, wxID_ANY, L"▼");
-    move_down_button->Bind(wxEVT_BUTTON, &ServerWidget::OnMoveDown, this);
-    buttons->Add(move_down_button, 0, wxRIGHT, 5);
-    wxButton *copy_button = new wxButton(this, wxID_ANY, L"📋Copy Address");
-    copy_button->Bind(wxEVT_BUTTON, &ServerWidget::CopyAddress, this);
-    buttons->Add(copy_button, 0, wxRIGHT, 5);
-    buttons->Add(new wxPanel(this), 1, wxEXPAND);
-    this->connect_button = new wxButton(this, wxID_ANY, "Connect");
-    this->connect_button->Bind(wxEVT_BUTTON, &ServerWidget::OnConnect, this);
-    buttons->Add(this->connect_button, 0, wxRIGHT, 5);
-    wxButton *delete_button = new wxButton(this, wxID_ANY, "Delete");
-    delete_button->Bind(wxEVT_BUTTON, &ServerWidget::OnDelete, this);
-    buttons->Add(delete_button, 0);
-    sizer->Add(buttons, 0, wxEXPAND);
-    // sizer->Add(buttons, 0, wxEXPAND | wxALIGN_LEFT);
-
-    padding->Add(sizer, 0, wxALL | wxEXPAND, 5);
-    this->SetSizer(padding);
+    event.Skip();
+    this->RefreshProbeTargets();
 }
 
 void select_all(wxKeyEvent &event)
@@ -925,8 +1278,122 @@ void focus_select_all(wxFocusEvent &event)
     }
 }
 
+void MyApp::OnInitCmdLine(wxCmdLineParser &parser)
+{
+    wxApp::OnInitCmdLine(parser);
+    parser.AddOption("", "client-pps", "Packets per second a client may send, 0 for unlimited", wxCMD_LINE_VAL_NUMBER);
+    parser.AddOption("", "client-bps", "Bytes per second a client may send, 0 for unlimited", wxCMD_LINE_VAL_NUMBER);
+    parser.AddOption("", "total-pps", "Packets per second of all clients together, 0 for unlimited", wxCMD_LINE_VAL_NUMBER);
+    parser.AddOption("", "total-bps", "Bytes per second of all clients together, 0 for unlimited", wxCMD_LINE_VAL_NUMBER);
+    parser.AddOption("", "impair-upstream", "Emulate a bad network from clients to servers: delay=ms,jitter=ms,loss=%,duplicate=%,reorder=%");
+    parser.AddOption("", "impair-downstream", "Same as impair-upstream from servers to clients");
+    parser.AddOption("", "tunnel-paths", "Local addresses tunnel entries also send every packet from, comma separated");
+    parser.AddOption("", "tunnel-bundle-us", "Microseconds tunnel packets wait for others to share a datagram, 0 only packs packets arriving together", wxCMD_LINE_VAL_NUMBER);
+    parser.AddOption("", "pace-mbps", "Megabits per second each client's packets are spread out to, both ways (Linux with the fq qdisc), 0 sends them as they come", wxCMD_LINE_VAL_NUMBER);
+    parser.AddOption("", "busy-poll-us", "Microseconds the kernel spins on the network device for each socket read (Linux, needs CAP_NET_ADMIN)", wxCMD_LINE_VAL_NUMBER);
+    parser.AddOption("", "spin-us", "Microseconds the engine keeps polling without sleeping while packets arrive closer than that", wxCMD_LINE_VAL_NUMBER);
+    parser.AddOption("", "engine-cpu", "Pin the forwarding thread to this CPU", wxCMD_LINE_VAL_NUMBER);
+    parser.AddSwitch("", "realtime", "Run the forwarding thread with real-time priority");
+    parser.AddOption("", "client-filter", "File of allow/deny rules on client addresses, reloaded when it changes");
+    parser.AddSwitch("", "validate-clients", "Only open sessions for clients proving they receive at their address, against spoofed floods");
+    parser.AddOption("", "log-level", "Least important messages printed: debug, info, warning or error");
+#ifndef _WIN32
+    parser.AddOption("", "handoff", "Unix socket path, a proxy started with the same path takes the routes and clients of this one over");
+#endif
+#ifdef PROXY_WITH_XDP
+    parser.AddOption("", "xdp-interface", "Forward established IPv4 sessions with AF_XDP on this interface, queue 0");
+    parser.AddSwitch("", "xdp-native", "Attach the XDP program in driver mode instead of generic mode");
+#endif
+}
+
+bool MyApp::OnCmdLineParsed(wxCmdLineParser &parser)
+{
+    long value;
+    if (parser.Found("client-pps", &value))
+    {
+        this->session_limit.packets_per_second = value;
+    }
+    if (parser.Found("client-bps", &value))
+    {
+        this->session_limit.bytes_per_second = value;
+    }
+    if (parser.Found("total-pps", &value))
+    {
+        this->global_limit.packets_per_second = value;
+    }
+    if (parser.Found("total-bps", &value))
+    {
+        this->global_limit.bytes_per_second = value;
+    }
+    wxString impairment;
+    if (parser.Found("impair-upstream", &impairment) && !parse_impairment(impairment.ToStdString(), &this->upstream_impairment))
+    {
+        wxMessageBox("Invalid --impair-upstream, expected for example delay=100,jitter=20,loss=1.5", "Error");
+        return false;
+    }
+    if (parser.Found("impair-downstream", &impairment) && !parse_impairment(impairment.ToStdString(), &this->downstream_impairment))
+    {
+        wxMessageBox("Invalid --impair-downstream, expected for example delay=100,jitter=20,loss=1.5", "Error");
+        return false;
+    }
+    wxString paths;
+    if (parser.Found("tunnel-paths", &paths) && !parse_local_addresses(paths.ToStdString(), &this->tunnel_paths))
+    {
+        wxMessageBox("Invalid --tunnel-paths, expected local addresses like 192.168.1.20,10.0.0.5", "Error");
+        return false;
+    }
+    if (parser.Found("tunnel-bundle-us", &this->bundle_delay_us) && (this->bundle_delay_us < 0 || this->bundle_delay_us > 10000))
+    {
+        wxMessageBox("Invalid --tunnel-bundle-us, expected 0 to 10000 microseconds", "Error");
+        return false;
+    }
+    if (parser.Found("pace-mbps", &this->pace_mbps) && (this->pace_mbps < 0 || this->pace_mbps > 100000))
+    {
+        wxMessageBox("Invalid --pace-mbps, expected 0 to 100000 megabits per second", "Error");
+        return false;
+    }
+    if (parser.Found("busy-poll-us", &value))
+    {
+        this->low_latency.busy_poll_us = (int)std::clamp(value, 0L, 1000L);
+    }
+    if (parser.Found("spin-us", &value))
+    {
+        this->low_latency.spin_us = (int)std::clamp(value, 0L, 100000L);
+    }
+    if (parser.Found("engine-cpu", &value))
+    {
+        this->low_latency.cpu = (int)value;
+    }
+    this->low_latency.realtime = parser.Found("realtime");
+    parser.Found("client-filter", &this->client_filter);
+    this->validate_clients = parser.Found("validate-clients");
+    wxString level;
+    if (parser.Found("log-level", &level))
+    {
+        int parsed = parse_log_level(level.ToStdString());
+        if (parsed < 0)
+        {
+            wxMessageBox("Invalid --log-level, expected debug, info, warning or error", "Error");
+            return false;
+        }
+        log_set_level(parsed);
+    }
+#ifndef _WIN32
+    parser.Found("handoff", &this->handoff_path);
+#endif
+#ifdef PROXY_WITH_XDP
+    parser.Found("xdp-interface", &this->xdp_interface);
+    this->xdp_native = parser.Found("xdp-native");
+#endif
+    return wxApp::OnCmdLineParsed(parser);
+}
+
 bool MyApp::OnInit()
 {
+    if (!wxApp::OnInit())
+    {
+        return false;
+    }
 
 #ifdef _WIN32
     WSAData wsaData;
@@ -938,25 +1405,34 @@ bool MyApp::OnInit()
     }
     this->wsaData = wsaData;
 #endif
-    int rc = sqlite3_open("servers.db", &this->db);
-    if (rc != SQLITE_OK)
+    if (this->store.open("servers.db") != 0)
     {
-        std::cerr << "Cannot open database: " << sqlite3_errmsg(db) << std::endl;
         wxMessageBox("Couldn't create save file.", "Error");
         return false;
     }
-
-    char *error_message = nullptr;
-    rc = sqlite3_exec(db, "CREATE TABLE IF NOT EXISTS server(id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, address_type INTEGER, address TEXT NOT NULL, port INTEGER);", nullptr, nullptr, &error_message);
-
-    if (rc != SQLITE_OK)
-    {
-        std::cerr << "Table creation failed: " << error_message << std::endl;
-        sqlite3_free(error_message);
-        sqlite3_close(this->db);
+    MainFrame *frame = new MainFrame(&this->store);
+    frame->SetRateLimits(this->session_limit, this->global_limit);
+    frame->SetImpairment(this->upstream_impairment, this->downstream_impairment);
+    frame->SetTunnelPaths(this->tunnel_paths);
+    frame->SetBundleDelay((int)this->bundle_delay_us);
+    frame->SetPacing((int64_t)this->pace_mbps * 125000);
+    frame->SetLowLatency(this->low_latency);
+    frame->SetClientValidation(this->validate_clients);
+    std::string error;
+    if (!this->client_filter.IsEmpty() && !frame->SetClientFilter(this->client_filter.ToStdString(), &error))
+    {
+        wxMessageBox("Invalid --client-filter, " + error, "Error");
+        frame->Destroy();
         return false;
     }
-    MainFrame *frame = new MainFrame(db);
+#ifdef PROXY_WITH_XDP
+    if (!this->xdp_interface.IsEmpty() && !frame->SetFastPath(this->xdp_interface.ToStdString().c_str(), this->xdp_native))
+    {
+        wxMessageBox("Couldn't start the XDP fast path, every packet goes through the sockets.", "Warning");
+    }
+#endif
+    // Last, the routes taken over resume with every setting in place.
+    frame->StartRoutes(this->handoff_path.ToStdString());
     frame->Show(true);
 
     return true;
@@ -964,11 +1440,12 @@ bool MyApp::OnInit()
 
 int MyApp::OnExit()
 {
+    log_flush();
 #ifdef _WIN32
     WSACleanup();
 #endif
 
-    sqlite3_close(this->db);
+    this->store.close();
     return wxApp::OnExit();
 }
 
@@ -994,18 +1471,21 @@ void MainFrame::OnPortUpdate(wxFocusEvent &event)
     event.Skip();
 }
 
-MainFrame::MainFrame(sqlite3 *db)
+MainFrame::MainFrame(ServerStore *store)
     : wxFrame(NULL, wxID_ANY, "Hytale UDP Proxy", wxDefaultPosition, wxSize(800, 600))
 {
-    this->proxy_thread = nullptr;
     this->Bind(wxEVT_CONNECT_SERVER_RECORD, &MainFrame::ConnectFromServerRecord, this);
-    this->Bind(wxEVT_DELETE_SERVER_RECORD, &MainFrame::DeleteServerRecord, this);
-    this->Bind(wxEVT_MOVE_SERVER_RECORD, &MainFrame::MoveServerRecord, this);
     this->Bind(wxEVT_PROXY_THREAD_UPDATE, &MainFrame::OnProxyThreadUpdate, this);
     this->Bind(wxEVT_PROXY_THREAD_STOPPED, &MainFrame::OnProxyThreadStopped, this);
     this->Bind(wxEVT_PROXY_THREAD_RESOLVED_ADDRESS, &MainFrame::OnProxyThreadResolvedAddress, this);
+    this->Bind(wxEVT_SERVER_PING_RESULT, &MainFrame::OnServerPingResult, this);
+    this->Bind(wxEVT_ROUTE_STARTED, &MainFrame::OnRouteStarted, this);
+    this->Bind(wxEVT_ROUTES_CHANGED, &MainFrame::OnRoutesChanged, this);
+    this->Bind(wxEVT_SERVER_SAVED, &MainFrame::OnServerSaved, this);
+    this->Bind(wxEVT_SERVERS_IMPORTED, &MainFrame::OnServersImported, this);
+    this->Bind(wxEVT_HANDED_OFF, &MainFrame::OnHandedOff, this);
     this->Bind(wxEVT_CLOSE_WINDOW, &MainFrame::OnClose, this);
-    this->db = db;
+    this->store = store;
     this->port = PROXY_DEFAULT_PORT;
     this->SetMinSize(wxSize(800, 600));
 
@@ -1070,14 +1550,51 @@ MainFrame::MainFrame(sqlite3 *db)
     // main_grid->AddGrowableCol(0, 2);
     // main_grid->AddGrowableCol(2, 3);
     // main_grid->AddGrowableRow(0);
-    this->server_list = new wxScrolledWindow(left_col, wxID_ANY, wxDefaultPosition, wxDefaultSize, wxVSCROLL | wxSUNKEN_BORDER);
-    // this->server_list->SetBackgroundColour(wxColor(255, 0, 0));
-    wxBoxSizer *server_sizer = new wxBoxSizer(wxVERTICAL);
-    this->server_list->SetSizer(server_sizer);
-    this->server_list->SetScrollRate(0, 10);
+    this->server_list = new ServerListCtrl(left_col, this->store);
+    this->server_list->Bind(wxEVT_LIST_ITEM_ACTIVATED, &MainFrame::OnServerActivated, this);
+    this->server_list->Bind(wxEVT_LIST_CACHE_HINT, &MainFrame::OnServerListCacheHint, this);
     left_sizer->Add(new wxStaticLine(left_col, wxID_ANY, wxDefaultPosition, wxDefaultSize, wxLI_HORIZONTAL), 0, wxEXPAND | wxTOP | wxBOTTOM, 5);
     left_sizer->Add(new wxStaticText(left_col, wxID_ANY, "Saved Servers:"), 0, wxBOTTOM, 5);
-    left_sizer->Add(server_list, 1, wxEXPAND);
+    left_sizer->Add(server_list, 1, wxEXPAND | wxBOTTOM, 5);
+
+    wxBoxSizer *server_buttons = new wxBoxSizer(wxHORIZONTAL);
+    wxButton *move_up_button = new wxButton(left_col, wxID_ANY, L"▲");
+    move_up_button->Bind(wxEVT_BUTTON, &MainFrame::OnServerMoveUp, this);
+    server_buttons->Add(move_up_button, 0, wxRIGHT, 5);
+    wxButton *move_down_button = new wxButton(left_col, wxID_ANY, L"▼");
+    move_down_button->Bind(wxEVT_BUTTON, &MainFrame::OnServerMoveDown, this);
+    server_buttons->Add(move_down_button, 0, wxRIGHT, 5);
+    wxButton *copy_button = new wxButton(left_col, wxID_ANY, L"📋Copy Address");
+    copy_button->Bind(wxEVT_BUTTON, &MainFrame::OnServerCopyAddress, this);
+    server_buttons->Add(copy_button, 0, wxRIGHT, 5);
+    wxButton *import_button = new wxButton(left_col, wxID_ANY, "Import...");
+    import_button->Bind(wxEVT_BUTTON, &MainFrame::OnImportServers, this);
+    server_buttons->Add(import_button, 0, wxRIGHT, 5);
+    wxButton *export_button = new wxButton(left_col, wxID_ANY, "Export...");
+    export_button->Bind(wxEVT_BUTTON, &MainFrame::OnExportServers, this);
+    server_buttons->Add(export_button, 0, wxRIGHT, 5);
+    server_buttons->AddStretchSpacer(1);
+    this->ptr_server_connect_button = new wxButton(left_col, wxID_ANY, "Connect");
+    this->ptr_server_connect_button->Bind(wxEVT_BUTTON, &MainFrame::OnServerConnect, this);
+    server_buttons->Add(this->ptr_server_connect_button, 0, wxRIGHT, 5);
+    wxButton *delete_button = new wxButton(left_col, wxID_ANY, "Delete");
+    delete_button->Bind(wxEVT_BUTTON, &MainFrame::OnServerDelete, this);
+    server_buttons->Add(delete_button, 0);
+    left_sizer->Add(server_buttons, 0, wxEXPAND);
+
+    left_sizer->Add(new wxStaticText(left_col, wxID_ANY, "Routes:"), 0, wxTOP | wxBOTTOM, 5);
+    wxBoxSizer *routes_sizer = new wxBoxSizer(wxHORIZONTAL);
+    this->route_list = new wxListBox(left_col, wxID_ANY, wxDefaultPosition, wxSize(wxDefaultCoord, 80));
+    routes_sizer->Add(this->route_list, 1, wxEXPAND | wxRIGHT, 5);
+    wxBoxSizer *route_buttons = new wxBoxSizer(wxVERTICAL);
+    wxButton *add_route_button = new wxButton(left_col, wxID_ANY, "Add Route...");
+    add_route_button->Bind(wxEVT_BUTTON, &MainFrame::OnAddRoute, this);
+    route_buttons->Add(add_route_button, 0, wxEXPAND | wxBOTTOM, 5);
+    wxButton *remove_route_button = new wxButton(left_col, wxID_ANY, "Remove Route");
+    remove_route_button->Bind(wxEVT_BUTTON, &MainFrame::OnRemoveRoute, this);
+    route_buttons->Add(remove_route_button, 0, wxEXPAND);
+    routes_sizer->Add(route_buttons, 0);
+    left_sizer->Add(routes_sizer, 0, wxEXPAND);
 
     left_sizer->Add(new wxStaticLine(left_col, wxID_ANY, wxDefaultPosition, wxDefaultSize, wxLI_HORIZONTAL), 0, wxEXPAND | wxTOP | wxBOTTOM, 5);
     // left_sizer->Add(new wxStaticText(left_col, wxID_ANY, "Saved Servers:"), 0, wxBOTTOM, 5);
@@ -1097,110 +1614,507 @@ MainFrame::MainFrame(sqlite3 *db)
     temp = new wxBoxSizer(wxHORIZONTAL);
     temp->Add(new wxStaticText(left_col, wxID_ANY, "Status:"), 0, wxRIGHT, 5);
 
-    wxSimplebook *status_book = new wxSimplebook(left_col, wxID_ANY);
+    wxSimplebook *status_book = new wxSimplebook(left_col, wxID_ANY);
+
+    // Stopped 0
+    wxStaticText *status_text = new wxStaticText(status_book, wxID_ANY, "Stopped", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
+    status_text->SetForegroundColour(*wxRED);
+    wxFont status_font = status_text->GetFont();
+    status_font.SetWeight(wxFONTWEIGHT_BOLD);
+    status_text->SetFont(status_font);
+    status_book->AddPage(status_text, "Stopped");
+
+    // Starting 1
+    status_text = new wxStaticText(status_book, wxID_ANY, "Starting...", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
+    status_text->SetForegroundColour(*wxBLUE);
+    status_font = status_text->GetFont();
+    status_font.SetWeight(wxFONTWEIGHT_BOLD);
+    status_text->SetFont(status_font);
+    status_book->AddPage(status_text, "Starting");
+
+    // Ready 2
+    status_text = new wxStaticText(status_book, wxID_ANY, "Ready", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
+    status_text->SetForegroundColour(*wxGREEN);
+    status_font = status_text->GetFont();
+    status_font.SetWeight(wxFONTWEIGHT_BOLD);
+    status_text->SetFont(status_font);
+    status_book->AddPage(status_text, "Ready");
+
+    // Connected 3
+    status_text = new wxStaticText(status_book, wxID_ANY, "Connected", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
+    status_text->SetForegroundColour(*wxBLUE);
+    status_font = status_text->GetFont();
+    status_font.SetWeight(wxFONTWEIGHT_BOLD);
+    status_text->SetFont(status_font);
+    status_book->AddPage(status_text, "Connected");
+
+    // Stopping 4
+    status_text = new wxStaticText(status_book, wxID_ANY, "Stopping...", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
+    status_text->SetForegroundColour(*wxRED);
+    status_font = status_text->GetFont();
+    status_font.SetWeight(wxFONTWEIGHT_BOLD);
+    status_text->SetFont(status_font);
+    status_book->AddPage(status_text, "Stopping");
+
+    status_book->SetSelection(0);
+
+    this->status_book = status_book;
+
+    temp->Add(status_book, 1, wxEXPAND);
+    first->Add(temp, 0, wxEXPAND);
+    proxy_sizer->Add(first, 0, wxEXPAND | wxBOTTOM, 5);
+    temp = new wxBoxSizer(wxHORIZONTAL);
+    temp->Add(new wxStaticText(left_col, wxID_ANY, "Proxy Address:"), 0, wxRIGHT | wxALIGN_CENTER_VERTICAL, 5);
+    wxTextCtrl *proxy_address = new wxTextCtrl(left_col, wxID_ANY, "", wxDefaultPosition, wxDefaultSize, wxTE_READONLY);
+    proxy_address->Bind(wxEVT_SET_FOCUS, &focus_select_all);
+    profile_address_ptr = proxy_address;
+    temp->Add(proxy_address, 1, wxEXPAND);
+    wxButton *copy_proxy_address_button = new wxButton(left_col, wxID_ANY, "Copy");
+    copy_proxy_address_button->Bind(wxEVT_BUTTON, &MainFrame::OnCopyProxyAddress, this);
+    copy_proxy_address_button->Disable();
+    this->copy_proxy_address_button_ptr = copy_proxy_address_button;
+    temp->Add(copy_proxy_address_button);
+    proxy_sizer->Add(temp, 0, wxEXPAND | wxBOTTOM, 5);
+    wxBoxSizer *server_address_sizer = new wxBoxSizer(wxHORIZONTAL);
+    temp = new wxBoxSizer(wxHORIZONTAL);
+    temp->Add(new wxStaticText(left_col, wxID_ANY, "Server Address:"), 0, wxRIGHT | wxALIGN_CENTER_VERTICAL, 5);
+    wxTextCtrl *server_txt_ctrol = new wxTextCtrl(left_col, wxID_ANY, "", wxDefaultPosition, wxDefaultSize);
+    server_txt_ctrol->Disable();
+    this->proxy_server_address_ptr = server_txt_ctrol;
+    temp->Add(server_txt_ctrol, 1, wxEXPAND);
+    server_address_sizer->Add(temp, 1, wxEXPAND | wxRight, 5);
+    temp = new wxBoxSizer(wxHORIZONTAL);
+    temp->Add(new wxStaticText(left_col, wxID_ANY, "Resolved Address:"), 0, wxLEFT | wxRIGHT | wxALIGN_CENTER_VERTICAL, 5);
+    wxTextCtrl *resolved_address = new wxTextCtrl(left_col, wxID_ANY, "", wxDefaultPosition, wxDefaultSize);
+    resolved_address->Disable();
+    this->proxy_resolved_server_address_ptr = resolved_address;
+    temp->Add(resolved_address, 2, wxEXPAND);
+    server_address_sizer->Add(temp, 1, wxEXPAND);
+    server_address_sizer->Hide(1);
+    this->proxy_server_address_sizer_ptr = server_address_sizer;
+
+    proxy_sizer->Add(server_address_sizer, 0, wxEXPAND | wxBOTTOM, 0);
+
+    temp = new wxBoxSizer(wxHORIZONTAL);
+    temp->Add(proxy_sizer, 1, wxEXPAND | wxRIGHT, 10);
+    wxButton *stop = new wxButton(left_col, wxID_ANY, "Stop Proxy");
+    stop->Bind(wxEVT_BUTTON, &MainFrame::OnStopProxy, this);
+    stop->Disable();
+    this->ptr_stop_proxy_button = stop;
+
+    temp->Add(stop, 0, wxEXPAND);
+
+    left_sizer->Add(temp, 0, wxEXPAND);
+
+    wxBoxSizer *sizer = new wxBoxSizer(wxVERTICAL);
+    sizer->Add(left_col, 1, wxEXPAND);
+    this->SetSizer(sizer);
+
+    // Results are posted back as events, the prober never touches the widgets.
+    this->prober = new QuicProber([this](std::vector<ProbeResult> results)
+                                  {
+        wxThreadEvent *event = new wxThreadEvent(wxEVT_SERVER_PING_RESULT);
+        event->SetPayload(results);
+        wxQueueEvent(this, event); });
+    this->RefreshProbeTargets();
+    this->prober->start();
+
+    this->engine.set_listener([this]()
+                              { wxQueueEvent(this, new wxThreadEvent(wxEVT_ROUTES_CHANGED)); });
+
+    // Force the layout to calculate
+    this->Layout();
+}
+
+void MainFrame::StartRoutes(const std::string &handoff_path)
+{
+    std::vector<HandoffRoute> handed;
+    if (!handoff_path.empty())
+    {
+        handed = this->TakeOver(handoff_path);
+    }
+
+    for (const auto &entry : this->store->load_routes())
+    {
+        this->routes.push_back({entry.listen_port, entry.server_id, entry.tunnel, -1, ROUTE_STARTING, "", "", 0});
+        RouteRecord &route = this->routes.back();
+        auto taken = std::find_if(handed.begin(), handed.end(), [&route](const HandoffRoute &candidate)
+                                  { return candidate.listen_port == route.listen_port; });
+        if (taken == handed.end())
+        {
+            this->StartRoute(route);
+            continue;
+        }
+        ServerRecord record;
+        if (this->store->load_server(route.server_id, &record))
+        {
+            route.server_name = record.name;
+        }
+        route.listen_socket = taken->listen_socket;
+        route.error = 0;
+        handed.erase(taken);
+    }
+    // What's left was the proxy started from the server list.
+    for (const auto &route : handed)
+    {
+        if (this->proxy_running)
+        {
+            this->engine.remove_route(route.listen_socket);
+            continue;
+        }
+        this->AdoptProxy(route);
+    }
+    this->RenderRoutes();
+
+    if (!handoff_path.empty())
+    {
+        int listener = handoff_listen(handoff_path);
+        if (listener < 0)
+        {
+            std::cerr << "Handoff: Couldn't listen on " << handoff_path << ", restarts won't keep the clients." << std::endl;
+            return;
+        }
+        this->control.spawn(serve_handoff(&this->control, this, &this->engine, listener));
+    }
+}
+
+// Adopts the routes of the process waiting at handoff_path, if there is one. Returns the
+// routes now running on the engine.
+std::vector<HandoffRoute> MainFrame::TakeOver(const std::string &handoff_path)
+{
+    std::vector<HandoffRoute> handed;
+    std::vector<HandoffRoute> adopted;
+    int predecessor = handoff_connect(handoff_path);
+    if (predecessor < 0)
+    {
+        return adopted;
+    }
+    if (handoff_receive(predecessor, &handed) != 0)
+    {
+        std::cerr << "Handoff: Couldn't receive the routes of the running process." << std::endl;
+        close_socket(predecessor);
+        return adopted;
+    }
+    for (const auto &route : handed)
+    {
+        if (adopt_route(&this->engine, route) == 0)
+        {
+            adopted.push_back(route);
+        }
+        else
+        {
+            handoff_close({route});
+        }
+    }
+    handoff_acknowledge(predecessor);
+    close_socket(predecessor);
+    std::cout << "Handoff: Took " << adopted.size() << " routes over." << std::endl;
+    return adopted;
+}
+
+// Shows the proxy taken over from the previous process as if it was started here, its
+// saved server isn't known anymore.
+void MainFrame::AdoptProxy(const HandoffRoute &route)
+{
+    this->port = route.listen_port;
+    this->ptr_port_input->SetValue(std::to_string(route.listen_port));
+    this->status_book->SetSelection(1);
+    this->proxy_running = true;
+    this->proxy_token = this->control.token();
+    this->control.spawn(watch_proxy(&this->control, this, &this->engine, route.listen_socket, route.listen_port, this->proxy_token));
+
+    this->ptr_port_input->Disable();
+    this->ptr_ip_input->Disable();
+    this->ptr_connect_button->Disable();
+    this->ptr_save_button->Disable();
+    this->ptr_stop_proxy_button->Enable();
+    this->profile_name_ptr->SetLabel("Taken Over");
+    this->proxy_server_address_ptr->SetValue(format_address((const sockaddr *)&route.upstream));
+    this->ptr_server_connect_button->Disable();
+}
+
+// Resolving and probing can take seconds, a coroutine does it and hands the listening
+// socket to the engine, the result comes back as wxEVT_ROUTE_STARTED.
+void MainFrame::StartRoute(RouteRecord &route)
+{
+    ServerRecord record;
+    if (!this->store->load_server(route.server_id, &record))
+    {
+        route.error = 1;
+        route.message = "Its server was deleted.";
+        return;
+    }
+    route.server_name = record.name;
+    route.start_id = ++this->route_starts;
+    this->control.spawn(start_route(&this->control, this, &this->engine, record, route));
+}
+
+void MainFrame::OnRouteStarted(wxThreadEvent &event)
+{
+    RouteRecord started = event.GetPayload<RouteRecord>();
+    for (auto &route : this->routes)
+    {
+        if (route.start_id == started.start_id && route.error == ROUTE_STARTING)
+        {
+            route = started;
+            this->RenderRoutes();
+            return;
+        }
+    }
+
+    // Removed while it was starting.
+    if (started.listen_socket >= 0)
+    {
+        this->engine.remove_route(started.listen_socket);
+    }
+}
+
+void MainFrame::OnRoutesChanged(wxThreadEvent &event)
+{
+    this->RenderRoutes();
+}
+
+void MainFrame::SetRateLimits(RateLimit session_limit, RateLimit global_limit)
+{
+    this->engine.set_rate_limits(session_limit, global_limit);
+}
+
+void MainFrame::SetImpairment(ImpairmentConfig upstream, ImpairmentConfig downstream)
+{
+    this->engine.set_impairment(upstream, downstream);
+}
+
+void MainFrame::SetTunnelPaths(std::vector<sockaddr_storage> local_addresses)
+{
+    this->engine.set_tunnel_paths(local_addresses);
+}
+
+void MainFrame::SetBundleDelay(int microseconds)
+{
+    this->engine.set_bundle_delay(microseconds);
+}
+
+void MainFrame::SetPacing(int64_t bytes_per_second)
+{
+    this->engine.set_pacing(bytes_per_second);
+}
 
-    // Stopped 0
-    wxStaticText *status_text = new wxStaticText(status_book, wxID_ANY, "Stopped", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
-    status_text->SetForegroundColour(*wxRED);
-    wxFont status_font = status_text->GetFont();
-    status_font.SetWeight(wxFONTWEIGHT_BOLD);
-    status_text->SetFont(status_font);
-    status_book->AddPage(status_text, "Stopped");
+void MainFrame::SetLowLatency(LowLatencyConfig config)
+{
+    this->engine.set_low_latency(config);
+}
 
-    // Starting 1
-    status_text = new wxStaticText(status_book, wxID_ANY, "Starting...", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
-    status_text->SetForegroundColour(*wxBLUE);
-    status_font = status_text->GetFont();
-    status_font.SetWeight(wxFONTWEIGHT_BOLD);
-    status_text->SetFont(status_font);
-    status_book->AddPage(status_text, "Starting");
+void MainFrame::SetClientValidation(bool enabled)
+{
+    this->engine.set_client_validation(enabled);
+}
 
-    // Ready 2
-    status_text = new wxStaticText(status_book, wxID_ANY, "Ready", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
-    status_text->SetForegroundColour(*wxGREEN);
-    status_font = status_text->GetFont();
-    status_font.SetWeight(wxFONTWEIGHT_BOLD);
-    status_text->SetFont(status_font);
-    status_book->AddPage(status_text, "Ready");
+bool MainFrame::SetClientFilter(const std::string &path, std::string *error)
+{
+    return this->client_filter.start(path, [this](ClientFilter filter)
+                                     { this->engine.set_client_filter(std::move(filter)); }, error);
+}
 
-    // Connected 3
-    status_text = new wxStaticText(status_book, wxID_ANY, "Connected", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
-    status_text->SetForegroundColour(*wxBLUE);
-    status_font = status_text->GetFont();
-    status_font.SetWeight(wxFONTWEIGHT_BOLD);
-    status_text->SetFont(status_font);
-    status_book->AddPage(status_text, "Connected");
+#ifdef PROXY_WITH_XDP
+bool MainFrame::SetFastPath(const char *interface, bool native)
+{
+    if (this->fast_path.open(interface, 0, native) != 0)
+    {
+        return false;
+    }
+    this->engine.set_fast_path(&this->fast_path);
+    return true;
+}
+#endif
 
-    // Stopping 4
-    status_text = new wxStaticText(status_book, wxID_ANY, "Stopping...", wxDefaultPosition, wxDefaultSize, wxALIGN_RIGHT);
-    status_text->SetForegroundColour(*wxRED);
-    status_font = status_text->GetFont();
-    status_font.SetWeight(wxFONTWEIGHT_BOLD);
-    status_text->SetFont(status_font);
-    status_book->AddPage(status_text, "Stopping");
+// Tells the proxy being slow apart from the kernel dropping packets before the proxy sees them.
+static std::string kernel_drops_text(const RouteStatus &status)
+{
+    std::string text;
+    if (status.kernel_drops > 0)
+    {
+        text += ", " + std::to_string(status.kernel_drops) + " packets dropped by the system (receive buffer " +
+                std::to_string(status.receive_buffer / 1024) + " KiB)";
+    }
+    if (status.send_failures > 0)
+    {
+        text += ", " + std::to_string(status.send_failures) + " packets the system couldn't send";
+    }
+    if (status.oversize > 0)
+    {
+        text += ", " + std::to_string(status.oversize) + " packets too big";
+        if (status.path_mtu > 0)
+        {
+            text += " (path MTU " + std::to_string(status.path_mtu) + ")";
+        }
+    }
+    return text;
+}
 
-    status_book->SetSelection(0);
+static std::string rejected_text(const RouteStatus &status)
+{
+    std::string text;
+    if (status.filtered > 0)
+    {
+        text += ", " + std::to_string(status.filtered) + " packets from filtered addresses";
+    }
+    if (status.unvalidated > 0)
+    {
+        text += ", " + std::to_string(status.unvalidated) + " packets from unvalidated clients";
+    }
+    return text;
+}
 
-    this->status_book = status_book;
+void MainFrame::RenderRoutes()
+{
+    std::map<int, RouteStatus> status;
+    for (const auto &route_status : this->engine.get_routes())
+    {
+        status[route_status.listen_socket] = route_status;
+    }
 
-    temp->Add(status_book, 1, wxEXPAND);
-    first->Add(temp, 0, wxEXPAND);
-    proxy_sizer->Add(first, 0, wxEXPAND | wxBOTTOM, 5);
-    temp = new wxBoxSizer(wxHORIZONTAL);
-    temp->Add(new wxStaticText(left_col, wxID_ANY, "Proxy Address:"), 0, wxRIGHT | wxALIGN_CENTER_VERTICAL, 5);
-    wxTextCtrl *proxy_address = new wxTextCtrl(left_col, wxID_ANY, "", wxDefaultPosition, wxDefaultSize, wxTE_READONLY);
-    proxy_address->Bind(wxEVT_SET_FOCUS, &focus_select_all);
-    profile_address_ptr = proxy_address;
-    temp->Add(proxy_address, 1, wxEXPAND);
-    wxButton *copy_proxy_address_button = new wxButton(left_col, wxID_ANY, "Copy");
-    copy_proxy_address_button->Bind(wxEVT_BUTTON, &MainFrame::OnCopyProxyAddress, this);
-    copy_proxy_address_button->Disable();
-    this->copy_proxy_address_button_ptr = copy_proxy_address_button;
-    temp->Add(copy_proxy_address_button);
-    proxy_sizer->Add(temp, 0, wxEXPAND | wxBOTTOM, 5);
-    wxBoxSizer *server_address_sizer = new wxBoxSizer(wxHORIZONTAL);
-    temp = new wxBoxSizer(wxHORIZONTAL);
-    temp->Add(new wxStaticText(left_col, wxID_ANY, "Server Address:"), 0, wxRIGHT | wxALIGN_CENTER_VERTICAL, 5);
-    wxTextCtrl *server_txt_ctrol = new wxTextCtrl(left_col, wxID_ANY, "", wxDefaultPosition, wxDefaultSize);
-    server_txt_ctrol->Disable();
-    this->proxy_server_address_ptr = server_txt_ctrol;
-    temp->Add(server_txt_ctrol, 1, wxEXPAND);
-    server_address_sizer->Add(temp, 1, wxEXPAND | wxRight, 5);
-    temp = new wxBoxSizer(wxHORIZONTAL);
-    temp->Add(new wxStaticText(left_col, wxID_ANY, "Resolved Address:"), 0, wxLEFT | wxRIGHT | wxALIGN_CENTER_VERTICAL, 5);
-    wxTextCtrl *resolved_address = new wxTextCtrl(left_col, wxID_ANY, "", wxDefaultPosition, wxDefaultSize);
-    resolved_address->Disable();
-    this->proxy_resolved_server_address_ptr = resolved_address;
-    temp->Add(resolved_address, 2, wxEXPAND);
-    server_address_sizer->Add(temp, 1, wxEXPAND);
-    server_address_sizer->Hide(1);
-    this->proxy_server_address_sizer_ptr = server_address_sizer;
+    int selection = this->route_list->GetSelection();
+    this->route_list->Clear();
+    for (const auto &route : this->routes)
+    {
+        std::string line = std::to_string(route.listen_port) + " -> " + route.server_name;
+        if (route.tunnel != TUNNEL_NONE)
+        {
+            line += std::string(" (") + tunnel_mode_name(route.tunnel) + ")";
+        }
+        line += ": ";
+        auto it = status.find(route.listen_socket);
+        if (route.error == ROUTE_STARTING)
+        {
+            line += "Starting...";
+        }
+        else if (route.error != 0)
+        {
+            line += "Failed, " + route.message;
+        }
+        else if (it == status.end())
+        {
+            line += "Stopped";
+        }
+        else if (it->second.state == PROXY_ESTABLISHED)
+        {
+            line += "Connected (" + std::to_string(it->second.sessions) + " clients to " + it->second.upstream;
+            if (it->second.dropped_packets > 0)
+            {
+                line += ", " + std::to_string(it->second.dropped_packets) + " packets over the rate limit";
+            }
+            if (it->second.recovered > 0)
+            {
+                line += ", " + std::to_string(it->second.recovered) + " lost packets rebuilt";
+            }
+            if (it->second.duplicates > 0)
+            {
+                line += ", " + std::to_string(it->second.duplicates) + " copies from other paths dropped";
+            }
+            if (it->second.residency_p50_ns > 0)
+            {
+                line += ", " + std::to_string(it->second.residency_p50_ns / 1000) + " us in the proxy (p99 " +
+                        std::to_string(it->second.residency_p99_ns / 1000) + " us)";
+            }
+            line += rejected_text(it->second) + kernel_drops_text(it->second) + ")";
+        }
+        else
+        {
+            line += "Ready (" + it->second.upstream + rejected_text(it->second) + kernel_drops_text(it->second) + ")";
+        }
+        this->route_list->Append(line);
+    }
+    if (selection != wxNOT_FOUND && selection < (int)this->route_list->GetCount())
+    {
+        this->route_list->SetSelection(selection);
+    }
+}
 
-    proxy_sizer->Add(server_address_sizer, 0, wxEXPAND | wxBOTTOM, 0);
+void MainFrame::OnAddRoute(wxCommandEvent &event)
+{
+    ServerRecord record;
+    if (!this->GetSelectedRecord(&record))
+    {
+        wxMessageBox("Select the server to forward to in Saved Servers first.", "Add Route", wxOK | wxICON_ERROR);
+        return;
+    }
 
-    temp = new wxBoxSizer(wxHORIZONTAL);
-    temp->Add(proxy_sizer, 1, wxEXPAND | wxRIGHT, 10);
-    wxButton *stop = new wxButton(left_col, wxID_ANY, "Stop Proxy");
-    stop->Bind(wxEVT_BUTTON, &MainFrame::OnStopProxy, this);
-    stop->Disable();
-    this->ptr_stop_proxy_button = stop;
+    long listen_port = wxGetNumberFromUser("Clients connect to this local port and reach " + record.name + ".", "Port:", "Add Route",
+                                           PROXY_DEFAULT_PORT + 1, 1, 65535, this);
+    if (listen_port == -1)
+    {
+        return;
+    }
+    for (const auto &route : this->routes)
+    {
+        if (route.listen_port == listen_port)
+        {
+            wxMessageBox("Port " + std::to_string(listen_port) + " already has a route.", "Add Route", wxOK | wxICON_ERROR);
+            return;
+        }
+    }
 
-    temp->Add(stop, 0, wxEXPAND);
+    wxArrayString modes;
+    modes.Add("Direct");
+    modes.Add("Tunnel entry: " + record.name + " is another proxy with a tunnel exit route");
+    modes.Add("Tunnel exit: clients are proxies with a tunnel entry route");
+    int tunnel = wxGetSingleChoiceIndex("Tunnels add parity between two proxies so lost packets are rebuilt on the other side.",
+                                        "Add Route", modes, this);
+    if (tunnel == -1)
+    {
+        return;
+    }
 
-    left_sizer->Add(temp, 0, wxEXPAND);
+    this->store->insert_route((int)listen_port, record.id, tunnel);
+    this->routes.push_back({(int)listen_port, record.id, tunnel, -1, ROUTE_STARTING, "", "", 0});
+    this->StartRoute(this->routes.back());
+    this->RenderRoutes();
+}
 
-    wxBoxSizer *sizer = new wxBoxSizer(wxVERTICAL);
-    sizer->Add(left_col, 1, wxEXPAND);
-    this->SetSizer(sizer);
+void MainFrame::OnRemoveRoute(wxCommandEvent &event)
+{
+    int selection = this->route_list->GetSelection();
+    if (selection == wxNOT_FOUND || selection >= (int)this->routes.size())
+    {
+        return;
+    }
+    RouteRecord route = this->routes[selection];
+    this->store->delete_route(route.listen_port);
+    this->routes.erase(this->routes.begin() + selection);
+    if (route.listen_socket >= 0)
+    {
+        this->engine.remove_route(route.listen_socket);
+    }
+    this->RenderRoutes();
+}
 
-    auto records = LoadServerRecordFromSql();
-    for (const auto &server : records)
+// Only the rows on screen are pinged, scrolling moves the targets along.
+void MainFrame::RefreshProbeTargets()
+{
+    std::vector<ProbeTarget> targets;
+    std::vector<int> ids;
+    long top = this->server_list->GetTopItem();
+    long last = std::min(top + this->server_list->GetCountPerPage(), this->server_list->GetItemCount() - 1);
+    for (long item = top; item <= last; item++)
+    {
+        ServerRecord record;
+        if (this->server_list->GetRecord(item, &record))
+        {
+            targets.push_back({record.id, record.address_type, record.address, record.port});
+            ids.push_back(record.id);
+        }
+    }
+    if (ids == this->probe_ids)
     {
-        this->RenderServerRecord(server);
+        return;
     }
+    this->probe_ids = ids;
+    this->prober->set_targets(targets);
+}
 
-    // Force the layout to calculate
-    this->Layout();
+void MainFrame::OnServerPingResult(wxThreadEvent &event)
+{
+    this->server_list->SetPings(event.GetPayload<std::vector<ProbeResult>>());
 }
 
 void MainFrame::OnDirectConnect(wxCommandEvent &event)
@@ -1216,13 +2130,12 @@ void MainFrame::OnDirectConnect(wxCommandEvent &event)
 
     wxString ip_wxstring = this->ptr_ip_input->GetValue().Trim(true).Trim(false);
     int proxy_port = this->port;
-    auto [address_type, address, port] = resolve_server_address(ip_wxstring.ToStdString());
-    if (MainFrame::ValidateServerAddress(address_type, address, port) != 0)
+    ServerRecord record = {0, "", eAddressType::Invalid, "", -1, {}, 0};
+    if (MainFrame::ParseServerRecord(ip_wxstring.ToStdString(), record) != 0)
     {
         return;
     }
 
-    ServerRecord record = {0, "", address_type, address, port};
     wxThreadEvent *request = new wxThreadEvent(wxEVT_CONNECT_SERVER_RECORD);
     request->SetEventObject(this);
     request->SetPayload(record);
@@ -1234,8 +2147,8 @@ void MainFrame::OnSave(wxCommandEvent &event)
     wxString ip_wxstring = this->ptr_ip_input->GetValue().Trim(true).Trim(false);
     std::string ip_string = ip_wxstring.ToStdString();
     int proxy_port = this->port;
-    auto [address_type, address, port] = resolve_server_address(ip_string);
-    if (MainFrame::ValidateServerAddress(address_type, address, port) != 0)
+    ServerRecord record = {0, "", eAddressType::Invalid, "", -1, {}, 0};
+    if (MainFrame::ParseServerRecord(ip_string, record) != 0)
     {
         return;
     }
@@ -1276,50 +2189,94 @@ void MainFrame::OnSave(wxCommandEvent &event)
         break;
     }
 
-    sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL);
-
-    sqlite3_stmt *stmt;
-
-    const char *sql = "INSERT INTO server (name,address_type,address,port) VALUES (?, ?, ?, ?) RETURNING id;";
+    record.name = server_name;
+    this->store->insert_server(record, [this](ServerRecord saved)
+                               {
+        wxThreadEvent *event = new wxThreadEvent(wxEVT_SERVER_SAVED);
+        event->SetPayload(saved);
+        wxQueueEvent(this, event); });
+}
 
-    sqlite3_prepare_v2(db, sql, -1, &stmt, NULL);
+void MainFrame::OnServerSaved(wxThreadEvent &event)
+{
+    ServerRecord record = event.GetPayload<ServerRecord>();
+    if (record.id == -1)
+    {
+        wxMessageBox(
+            "Couldn't save " + record.name + ".",
+            "Save Server",
+            wxOK | wxICON_ERROR);
+        return;
+    }
+    this->server_list->Reload();
+    this->server_list->SelectItem(this->server_list->GetItemCount() - 1);
+    this->RefreshProbeTargets();
+}
 
-    sqlite3_bind_text(stmt, 1, server_name.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(stmt, 2, static_cast<int>(address_type));
-    sqlite3_bind_text(stmt, 3, address.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(stmt, 4, port);
+void MainFrame::OnImportServers(wxCommandEvent &event)
+{
+    wxFileDialog dialog(this, "Import Servers", "", "", SERVER_LIST_WILDCARD, wxFD_OPEN | wxFD_FILE_MUST_EXIST);
+    if (dialog.ShowModal() != wxID_OK)
+    {
+        return;
+    }
 
-    if (sqlite3_step(stmt) == SQLITE_ROW)
+    std::vector<ServerRecord> records;
+    std::vector<std::string> errors;
+    int skipped = 0;
+    int status = import_servers(dialog.GetPath().ToStdString(), records, &skipped, errors);
+    if (status != 0)
     {
-        int newId = sqlite3_column_int(stmt, 0);
-        sqlite3_step(stmt);
-        sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
-        this->RenderServerRecord({newId, server_name, address_type, address, port});
+        wxMessageBox(
+            status == 1 ? "Couldn't open the file." : "The file isn't a JSON array of servers.",
+            "Import Servers",
+            wxOK | wxICON_ERROR);
         return;
     }
-    else
+
+    std::string message = std::to_string(skipped) + " entries skipped:";
+    for (const auto &error : errors)
     {
-        // Something went wrong, undo everything!
-        sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
-        sqlite3_finalize(stmt);
+        message += "\n" + error;
     }
+    this->store->insert_servers(records, [this, skipped, message](int inserted)
+                                {
+        wxThreadEvent *event = new wxThreadEvent(wxEVT_SERVERS_IMPORTED);
+        event->SetInt(inserted);
+        event->SetString(skipped > 0 ? message : "");
+        wxQueueEvent(this, event); });
 }
 
-void MainFrame::RenderServerRecord(ServerRecord record)
+void MainFrame::OnServersImported(wxThreadEvent &event)
 {
-    if (record.address_type == eAddressType::Invalid)
+    int inserted = event.GetInt();
+    if (inserted == -1)
     {
+        wxMessageBox("Couldn't save the imported servers.", "Import Servers", wxOK | wxICON_ERROR);
         return;
     }
+    this->server_list->Reload();
+    this->RefreshProbeTargets();
 
-    wxBoxSizer *server_sizer = (wxBoxSizer *)this->server_list->GetSizer();
-    ServerWidget *widget = new ServerWidget(this->server_list, record);
-
-    server_sizer->Add(widget, 0, wxALL | wxEXPAND);
+    wxString message = "Imported " + std::to_string(inserted) + " servers.";
+    if (!event.GetString().IsEmpty())
+    {
+        message += "\n\n" + event.GetString();
+    }
+    wxMessageBox(message, "Import Servers", wxOK | wxICON_INFORMATION);
+}
 
-    server_sizer->Layout();
-    this->server_list->FitInside();
+void MainFrame::OnExportServers(wxCommandEvent &event)
+{
+    wxFileDialog dialog(this, "Export Servers", "", "servers.csv", SERVER_LIST_WILDCARD, wxFD_SAVE | wxFD_OVERWRITE_PROMPT);
+    if (dialog.ShowModal() != wxID_OK)
+    {
+        return;
+    }
+    if (export_servers(dialog.GetPath().ToStdString(), this->store->load_page(nullptr, -1)) != 0)
+    {
+        wxMessageBox("Couldn't write the file.", "Export Servers", wxOK | wxICON_ERROR);
+    }
 }
 
 void MainFrame::OnProxyThreadUpdate(wxThreadEvent &event)
@@ -1346,6 +2303,7 @@ void MainFrame::OnProxyThreadUpdate(wxThreadEvent &event)
 void MainFrame::OnProxyThreadStopped(wxThreadEvent &event)
 {
     std::cout << "Proxy Stopped" << std::endl;
+    this->proxy_running = false;
     this->ptr_port_input->Enable();
     this->ptr_ip_input->Enable();
     this->ptr_connect_button->Enable();
@@ -1357,59 +2315,18 @@ void MainFrame::OnProxyThreadStopped(wxThreadEvent &event)
     this->profile_name_ptr->SetForegroundColour(wxColour());
     this->profile_address_ptr->SetValue("");
     this->copy_proxy_address_button_ptr->Disable();
+    this->ptr_server_connect_button->Enable();
     this->Layout();
 
-    wxSizer *server_sizer = this->server_list->GetSizer();
-    wxSizerItemList &children = server_sizer->GetChildren();
-
-    for (auto child : children)
-    {
-        ServerWidget *widget = wxDynamicCast(child->GetWindow(), ServerWidget);
-
-        if (widget)
-        {
-            widget->SetConnectButtonEnable(true);
-        }
-    }
-
     this->status_book->SetSelection(0);
 
     int state = event.GetInt();
-
-    switch (state)
+    if (state != 0)
     {
-    case 1:
-        wxMessageBox(
-            "Couldn't resolve domain \"" + event.GetString().ToStdString() + "\".",
-            "Proxy Server Error",
-            wxOK | wxICON_ERROR);
-        break;
-    case 2:
-        wxMessageBox(
-            "For domain \"" + event.GetString().ToStdString() + "\", couldn't connect to any detected address.",
-            "Proxy Server Error",
-            wxOK | wxICON_ERROR);
-        break;
-    case 3:
-        wxMessageBox(
-            "Failed to create socket.",
-            "Proxy Server Error",
-            wxOK | wxICON_ERROR);
-        break;
-    case 4:
-        wxMessageBox(
-            "Failed to start on port " + event.GetString().ToStdString() + ".",
-            "Proxy Server Error",
-            wxOK | wxICON_ERROR);
-        break;
-    case 5:
         wxMessageBox(
-            "Unknown Operation Mode Error.",
+            proxy_error_message(state, event.GetString().ToStdString()),
             "Proxy Server Error",
             wxOK | wxICON_ERROR);
-        break;
-    default:
-        break;
     }
 }
 
@@ -1420,50 +2337,36 @@ void MainFrame::OnProxyThreadResolvedAddress(wxThreadEvent &event)
     this->Layout();
 }
 
+// Returns at once, wxEVT_PROXY_THREAD_STOPPED follows once the route is removed.
 void MainFrame::StopProxy()
 {
     std::cout << "Called to stop proxy;" << std::endl;
-
-    {
-        wxCriticalSectionLocker enter(m_pThreadCS);
-
-        if (this->proxy_thread) // does the thread still exist?
-        {
-            wxMessageOutputDebug().Printf("MYFRAME: deleting thread");
-
-            if (this->proxy_thread->Delete() != wxTHREAD_NO_ERROR)
-                wxLogError("Can't delete the thread!");
-        }
-    } // exit from the critical section to give the thread
-      // the possibility to enter its destructor
-      // (which is guarded with m_pThreadCS critical section!)
-
-    while (1)
-    {
-        { // was the ~MyThread() function executed?
-            wxCriticalSectionLocker enter(m_pThreadCS);
-            if (!this->proxy_thread)
-                break;
-        }
-
-        // wait for thread completion
-        wxThread::This()->Sleep(1);
-    }
+    this->proxy_token.cancel();
 }
+
 void MainFrame::OnStopProxy(wxCommandEvent &event)
 {
     this->ptr_stop_proxy_button->Disable();
     this->status_book->SetSelection(4);
     this->status_book->GetParent()->Layout();
-
-    wxYield();
-    wxMilliSleep(500);
     this->StopProxy();
 }
 
+void MainFrame::OnHandedOff(wxThreadEvent &event)
+{
+    this->Close(true);
+}
+
 void MainFrame::OnClose(wxCloseEvent &)
 {
     this->StopProxy();
+    this->prober->stop();
+    delete this->prober;
+    // Coroutines still resolving would queue events to a destroyed frame.
+    this->control.stop();
+    this->engine.set_listener(nullptr);
+    // Flushes queued writes, their results are dropped with the frame.
+    this->store->close();
 
     this->Destroy();
 }
@@ -1,7 +1,16 @@
 #include "proxy_common.h"
 #include <ctime>
 #include <cstdlib>
-#include <regex>
+#include <cstring>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#endif
+#include <sched.h>
+#endif
 
 int close_socket(socket_t s)
 {
@@ -12,300 +21,618 @@ int close_socket(socket_t s)
 #endif
 }
 
-typedef struct
+int set_socket_timeout(int s, int timeout_ms)
 {
-    char *bytes;
-    int size;
-} udp_packet;
+#ifdef _WIN32
+    return setsockopt(s, SOL_SOCKET, SO_RCVTIMEO,
+                      (char *)&timeout_ms, sizeof(timeout_ms));
+#else
+    struct timeval tv;
+    tv.tv_sec = timeout_ms / 1000;
+    tv.tv_usec = (timeout_ms % 1000) * 1000;
 
-void create_quic_initial_packet(char *buffer, int *n)
-{
-    srand(time(0));
-    int len = 0;
-    // QUIC headerbit
-    buffer[len++] = 0xc0;
-    // QUIC version
-    buffer[len++] = 0x00;
-    buffer[len++] = 0x00;
-    buffer[len++] = 0x00;
-    buffer[len++] = 0x01;
-
-    // Destination Connection ID
-    // First, length
-    buffer[len++] = 0x08;
-    int limit = len + 8;
-    while (len < limit)
-    {
-        buffer[len++] = rand();
-    }
+    return setsockopt(s, SOL_SOCKET, SO_RCVTIMEO,
+                      (char *)&tv, sizeof(tv));
+#endif
+}
 
-    // Source Connection ID
-    buffer[len++] = 0x08;
-    limit = len + 8;
-    while (len < limit)
+int set_socket_nonblocking(int s)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(s, FIONBIO, &mode);
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    if (flags < 0)
     {
-        buffer[len++] = rand();
+        return flags;
     }
+    return fcntl(s, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
 
-    // Token Length
-    buffer[len++] = 0x00;
+// True when the last socket call failed only because a non-blocking socket had nothing to do.
+bool socket_would_block()
+{
+#ifdef _WIN32
+    return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+    return errno == EWOULDBLOCK || errno == EAGAIN;
+#endif
+}
+
+int poll_sockets(pollfd *fds, size_t count, int timeout_ms)
+{
+#ifdef _WIN32
+    return WSAPoll(fds, (ULONG)count, timeout_ms);
+#else
+    return poll(fds, (nfds_t)count, timeout_ms);
+#endif
+}
 
-    while (len < 1200) // filling everything with 0 because it doesn't matter
+// Lets the kernel spin on the device queue of the socket instead of waiting for an
+// interrupt (Linux only). Raising it above net.core.busy_read needs CAP_NET_ADMIN.
+int set_socket_busy_poll(int s, int microseconds)
+{
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+    if (setsockopt(s, SOL_SOCKET, SO_BUSY_POLL, &microseconds, sizeof(microseconds)) < 0)
     {
-        buffer[len++] = 0x00;
+        return -1;
     }
+#ifdef SO_PREFER_BUSY_POLL
+    // Keeps the device interrupts off while the socket is being polled (Linux 5.11).
+    int prefer = microseconds > 0;
+    setsockopt(s, SOL_SOCKET, SO_PREFER_BUSY_POLL, &prefer, sizeof(prefer));
+#endif
+    return 0;
+#else
+    return -1;
+#endif
+}
 
-    *n = len;
+// Asks the kernel to attach the number of datagrams it dropped on this socket (its
+// receive buffer was full) to every read, Linux only.
+int enable_drop_counter(int s)
+{
+#if defined(__linux__) && defined(SO_RXQ_OVFL)
+    int enabled = 1;
+    return setsockopt(s, SOL_SOCKET, SO_RXQ_OVFL, &enabled, sizeof(enabled));
+#else
+    return -1;
+#endif
 }
 
-int test_ipv4_quic(in_addr ipv4, int port)
+#ifdef __linux__
+static void read_timestamping(cmsghdr *header, KernelTimestamp *timestamp)
 {
-    char address[INET_ADDRSTRLEN];
-    if (inet_ntop(AF_INET, &ipv4, address, sizeof(address)) == nullptr)
-    {
-        std::cerr << "inet_ntop failed: " << WSAGetLastError() << std::endl;
-        return 1;
-    }
-    std::cout << "QUIC IPv4: Testing " << address << ":" << port << std::endl;
+    scm_timestamping times;
+    memcpy(&times, CMSG_DATA(header), sizeof(times));
+    timestamp->software_ns = (int64_t)times.ts[0].tv_sec * 1000000000 + times.ts[0].tv_nsec;
+    timestamp->hardware_ns = (int64_t)times.ts[2].tv_sec * 1000000000 + times.ts[2].tv_nsec;
+}
+#endif
 
-    int serverSocket = socket(AF_INET, SOCK_DGRAM, 0);
-    if (serverSocket < 0)
+// recvfrom() that also updates kernel_drops when the SO_RXQ_OVFL counter comes along,
+// and arrival with the kernel's receive timestamp. from, kernel_drops and arrival may be null.
+// A datagram larger than size is cut and the result is above size: its full size on
+// Linux, size + 1 on Windows which doesn't tell. Elsewhere it goes unnoticed.
+int receive_datagram(int s, char *buffer, int size, sockaddr_storage *from, socklen_t *from_len, uint32_t *kernel_drops, KernelTimestamp *arrival)
+{
+#if defined(__linux__) && defined(SO_RXQ_OVFL)
+    iovec data{buffer, (size_t)size};
+    char control[CMSG_SPACE(sizeof(uint32_t)) + CMSG_SPACE(sizeof(scm_timestamping))];
+    msghdr message{};
+    message.msg_name = from;
+    message.msg_namelen = from != nullptr ? *from_len : 0;
+    message.msg_iov = &data;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    int n = (int)recvmsg(s, &message, MSG_TRUNC);
+    if (n < 0)
     {
-        std::cout << "QUIC IPv4: Server socket creation failed." << std::endl;
-
-        return 2;
+        return n;
     }
-    sockaddr_in addr{};
-    addr.sin_family = AF_INET;
-    addr.sin_port = htons(port);
-    addr.sin_addr = ipv4;
-    int s = ::connect(serverSocket, (sockaddr *)&addr, sizeof(addr));
-    if (s < 0)
+    if (from != nullptr)
     {
-        std::cout << "QUIC IPv4: Couldn't connect to " << address << ":" << port << std::endl;
-        close_socket(serverSocket);
-        return 3;
+        *from_len = message.msg_namelen;
     }
-
-    sockaddr_in local_client{};
-    socklen_t local_client_len = sizeof(local_client);
-
-    if (getsockname(serverSocket, (sockaddr *)&local_client, &local_client_len) == 0)
+    for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
     {
-        char ip[INET_ADDRSTRLEN];
-        inet_ntop(AF_INET, &local_client.sin_addr, ip, sizeof(ip));
-
-        uint16_t lport = ntohs(local_client.sin_port);
-
-        std::cout << "QUIC IPv4: Connected to server " << address << ":" << port << " with " << ip
-                  << ":" << lport << std::endl;
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SO_RXQ_OVFL && kernel_drops != nullptr)
+        {
+            memcpy(kernel_drops, CMSG_DATA(header), sizeof(uint32_t));
+        }
+        else if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_TIMESTAMPING && arrival != nullptr)
+        {
+            read_timestamping(header, arrival);
+        }
     }
-    char buffer[2048];
-    int n;
-
-#ifdef _WIN32
-    int timeoutMs = 10000;
-    setsockopt(serverSocket, SOL_SOCKET, SO_RCVTIMEO,
-               (char *)&timeoutMs, sizeof(timeoutMs));
+    return n;
 #else
-    struct timeval tv;
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
+    int n = recvfrom(s, buffer, size, 0, (sockaddr *)from, from_len);
+#ifdef _WIN32
+    if (n < 0 && WSAGetLastError() == WSAEMSGSIZE)
+    {
+        return size + 1;
+    }
+#endif
+    return n;
+#endif
+}
 
-    setsockopt(serverSocket, SOL_SOCKET, SO_RCVTIMEO,
-               (char *)&tv, sizeof(tv));
+#ifdef __linux__
+#define TIMESTAMPING_FLAGS (SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE | SOF_TIMESTAMPING_SOFTWARE |   \
+                            SOF_TIMESTAMPING_RX_HARDWARE | SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RAW_HARDWARE | \
+                            SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY)
 #endif
 
-    create_quic_initial_packet(buffer, &n);
-    std::cout << "QUIC IPv4: Sending QUIC packet." << std::endl;
-    int sentd = send(serverSocket,
-                     buffer,
-                     n,
-                     0);
+// Kernel (and network card, when it's set up for it) timestamps of every datagram the
+// socket receives and sends, Linux only. Sent datagrams are numbered from 0 in the order
+// they're sent and their timestamps come back on the error queue with that number.
+int enable_timestamping(int s)
+{
+#ifdef __linux__
+    int flags = TIMESTAMPING_FLAGS;
+    return setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags));
+#else
+    return -1;
+#endif
+}
 
-    if (sentd < 0)
-    {
-#ifdef _WIN32
-        std::cerr << "sendto failed: " << WSAGetLastError() << "\n";
+// Numbers the next sent datagram 0 again, after sends that couldn't be accounted for.
+int restart_timestamping(int s)
+{
+#ifdef __linux__
+    int off = 0;
+    setsockopt(s, SOL_SOCKET, SO_TIMESTAMPING, &off, sizeof(off));
+    return enable_timestamping(s);
 #else
-        perror("sendto");
+    return -1;
 #endif
-        std::cout << "QUIC IPv4: Failed to send QUIC request to " << address << ":" << port << std::endl;
-        return 1;
+}
+
+// Reads one message of the error queue: 1 when it's the transmit timestamp of datagram
+// id, 0 for anything else, -1 once the queue is empty.
+int receive_transmit_timestamp(int s, uint32_t *id, KernelTimestamp *departure)
+{
+#ifdef __linux__
+    char control[CMSG_SPACE(sizeof(scm_timestamping)) + CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+    msghdr message{};
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    if (recvmsg(s, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+    {
+        return -1;
     }
-    std::cout << "QUIC IPv4: Packet has been sent. Waiting for response..." << std::endl;
-    n = recv(serverSocket, buffer, sizeof(buffer), 0);
-    if (n < 0)
+    bool stamped = false;
+    bool numbered = false;
+    for (cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr; header = CMSG_NXTHDR(&message, header))
     {
-#ifdef _WIN32
-        if (WSAGetLastError() == WSAETIMEDOUT)
-#else
-        if (errno == EWOULDBLOCK || errno == EAGAIN)
-#endif
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_TIMESTAMPING)
         {
-            std::cout << "QUIC IPv4: Server response timeout. " << std::endl;
+            read_timestamping(header, departure);
+            stamped = true;
         }
-        else
+        else if ((header->cmsg_level == SOL_IP && header->cmsg_type == IP_RECVERR) ||
+                 (header->cmsg_level == SOL_IPV6 && header->cmsg_type == IPV6_RECVERR))
         {
-            std::cout << "QUIC IPv4: Server response error. " << std::endl;
+            sock_extended_err error;
+            memcpy(&error, CMSG_DATA(header), sizeof(error));
+            if (error.ee_errno == ENOMSG && error.ee_origin == SO_EE_ORIGIN_TIMESTAMPING)
+            {
+                *id = error.ee_data;
+                numbered = true;
+            }
         }
+    }
+    return stamped && numbered ? 1 : 0;
+#else
+    return -1;
+#endif
+}
 
-        close_socket(serverSocket);
-        return 1;
+// True when a send failed because the socket's send buffer or the device queue is full.
+bool socket_buffer_full()
+{
+#ifdef _WIN32
+    int error = WSAGetLastError();
+    return error == WSAEWOULDBLOCK || error == WSAENOBUFS;
+#else
+    return errno == EWOULDBLOCK || errno == EAGAIN || errno == ENOBUFS;
+#endif
+}
+
+// SO_RCVBUF or SO_SNDBUF as the kernel reports it (Linux doubles the requested size
+// for its bookkeeping), -1 on error.
+int socket_buffer_size(int s, int option)
+{
+    int size = 0;
+    socklen_t size_len = sizeof(size);
+    if (getsockopt(s, SOL_SOCKET, option, (char *)&size, &size_len) < 0)
+    {
+        return -1;
     }
+    return size;
+}
 
-    close_socket(serverSocket);
-    return 0;
+// Asks for a bigger buffer and returns what the kernel granted, it may cap the request
+// (net.core.rmem_max / wmem_max on Linux).
+int grow_socket_buffer(int s, int option, int size)
+{
+    setsockopt(s, SOL_SOCKET, option, (const char *)&size, sizeof(size));
+    return socket_buffer_size(s, option);
 }
 
-int test_ipv6_quic(in6_addr ipv6, int port)
+// Lets datagrams carry the CLOCK_MONOTONIC time they may leave at, which the fq qdisc
+// holds them until. Linux only, other qdiscs ignore the times.
+int enable_txtime(int s)
 {
-    char address[INET6_ADDRSTRLEN];
-    if (inet_ntop(AF_INET6, &ipv6, address, sizeof(address)) == nullptr)
+#if defined(__linux__) && defined(SO_TXTIME)
+    sock_txtime config{CLOCK_MONOTONIC, 0};
+    return setsockopt(s, SOL_SOCKET, SO_TXTIME, &config, sizeof(config));
+#else
+    return -1;
+#endif
+}
+
+// send() or sendto() when to_len is 0 or not, with a departure time when departure_ns
+// isn't 0 (the socket needs enable_txtime).
+int send_datagram_at(int s, const sockaddr *to, socklen_t to_len, const char *data, int size, int64_t departure_ns)
+{
+#if defined(__linux__) && defined(SO_TXTIME)
+    if (departure_ns != 0)
     {
-        std::cerr << "inet_ntop failed: " << WSAGetLastError() << std::endl;
-        return 1;
+        iovec payload{(void *)data, (size_t)size};
+        char control[CMSG_SPACE(sizeof(uint64_t))] = {};
+        msghdr message{};
+        message.msg_name = (void *)to;
+        message.msg_namelen = to_len;
+        message.msg_iov = &payload;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_TXTIME;
+        header->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        uint64_t departure = (uint64_t)departure_ns;
+        memcpy(CMSG_DATA(header), &departure, sizeof(departure));
+        return (int)sendmsg(s, &message, 0);
     }
-    std::cout << "QUIC IPv6: Testing [" << address << "]:" << port << std::endl;
+#endif
+    return to_len == 0 ? (int)send(s, data, size, 0) : (int)sendto(s, data, size, 0, to, to_len);
+}
 
-    int serverSocket = socket(AF_INET6, SOCK_DGRAM, 0);
-    if (serverSocket < 0)
+static int socket_family(int s)
+{
+    sockaddr_storage local{};
+    socklen_t local_len = sizeof(local);
+    if (getsockname(s, (sockaddr *)&local, &local_len) < 0)
     {
-        std::cout << "QUIC IPv6: Server socket creation failed." << std::endl;
+        return -1;
+    }
+    return local.ss_family;
+}
 
-        return 2;
+// Sets Don't Fragment on everything the socket sends, as QUIC requires (RFC 9000 section
+// 14). A datagram above the path MTU then fails with EMSGSIZE instead of leaving in
+// fragments, the endpoints' own MTU discovery sees it lost and sends smaller ones.
+int enable_path_mtu_discovery(int s)
+{
+    int family = socket_family(s);
+#ifdef __linux__
+    int mode = IP_PMTUDISC_DO;
+    if (family == AF_INET6)
+    {
+        mode = IPV6_PMTUDISC_DO;
+        return setsockopt(s, IPPROTO_IPV6, IPV6_MTU_DISCOVER, &mode, sizeof(mode));
     }
-    sockaddr_in6 addr{};
-    addr.sin6_family = AF_INET6;
-    addr.sin6_port = htons(port);
-    addr.sin6_addr = ipv6;
-    int s = ::connect(serverSocket, (sockaddr *)&addr, sizeof(addr));
-    if (s < 0)
+    return setsockopt(s, IPPROTO_IP, IP_MTU_DISCOVER, &mode, sizeof(mode));
+#elif defined(_WIN32)
+    DWORD enabled = 1;
+    if (family == AF_INET6)
     {
-        std::cout << "QUIC IPv6: Couldn't connect to " << address << ":" << port << std::endl;
-        close_socket(serverSocket);
-        return 3;
+        return setsockopt(s, IPPROTO_IPV6, IPV6_DONTFRAG, (const char *)&enabled, sizeof(enabled));
     }
+    return setsockopt(s, IPPROTO_IP, IP_DONTFRAGMENT, (const char *)&enabled, sizeof(enabled));
+#else
+    return -1;
+#endif
+}
 
-    sockaddr_in6 local_client{};
-    socklen_t local_client_len = sizeof(local_client);
-
-    if (getsockname(serverSocket, (sockaddr *)&local_client, &local_client_len) == 0)
+// Path MTU the kernel knows towards the destination of a connected socket, it drops
+// when an ICMP "packet too big" comes back. Linux only, -1 elsewhere or on error.
+int path_mtu(int s)
+{
+#ifdef __linux__
+    int mtu = 0;
+    socklen_t mtu_len = sizeof(mtu);
+    bool ipv6 = socket_family(s) == AF_INET6;
+    if (getsockopt(s, ipv6 ? IPPROTO_IPV6 : IPPROTO_IP, ipv6 ? IPV6_MTU : IP_MTU, &mtu, &mtu_len) < 0)
     {
-        char ip[INET6_ADDRSTRLEN];
-        inet_ntop(AF_INET6, &local_client.sin6_addr, ip, sizeof(ip));
-
-        uint16_t lport = ntohs(local_client.sin6_port);
-
-        std::cout << "QUIC IPv6: Connected to server [" << address << "]:" << port << " with [" << ip
-                  << "]:" << lport << std::endl;
+        return -1;
     }
-    char buffer[2048];
-    int n;
+    return mtu;
+#else
+    return -1;
+#endif
+}
 
+// True when a send failed because the datagram is above the path MTU (with Don't
+// Fragment) or the largest size the socket takes.
+bool datagram_too_big()
+{
 #ifdef _WIN32
-    int timeoutMs = 10000;
-    setsockopt(serverSocket, SOL_SOCKET, SO_RCVTIMEO,
-               (char *)&timeoutMs, sizeof(timeoutMs));
+    return WSAGetLastError() == WSAEMSGSIZE;
 #else
-    struct timeval tv;
-    tv.tv_sec = 10;
-    tv.tv_usec = 0;
-
-    setsockopt(serverSocket, SOL_SOCKET, SO_RCVTIMEO,
-               (char *)&tv, sizeof(tv));
+    return errno == EMSGSIZE;
 #endif
+}
 
-    create_quic_initial_packet(buffer, &n);
-    std::cout << "QUIC IPv6: Sending QUIC packet." << std::endl;
-    int sentd = send(serverSocket,
-                     buffer,
-                     n,
-                     0);
-
-    if (sentd < 0)
-    {
+int pin_current_thread(int cpu)
+{
 #ifdef _WIN32
-        std::cerr << "sendto failed: " << WSAGetLastError() << "\n";
+    return SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << cpu) != 0 ? 0 : -1;
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0 ? 0 : -1;
 #else
-        perror("sendto");
+    return -1;
 #endif
-        std::cout << "QUIC IPv6: Failed to send QUIC request to " << address << ":" << port << std::endl;
-        return 1;
-    }
-    std::cout << "QUIC IPv6: Packet has been sent. Waiting for response..." << std::endl;
-    n = recv(serverSocket, buffer, sizeof(buffer), 0);
-    if (n < 0)
-    {
+}
+
+// Lowest real-time priority: above every normal thread, below the kernel's own.
+int set_current_thread_realtime()
+{
 #ifdef _WIN32
-        if (WSAGetLastError() == WSAETIMEDOUT)
+    return SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL) ? 0 : -1;
 #else
-        if (errno == EWOULDBLOCK || errno == EAGAIN)
+    sched_param param{};
+    param.sched_priority = sched_get_priority_min(SCHED_FIFO);
+    return pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) == 0 ? 0 : -1;
 #endif
-        {
-            std::cout << "QUIC IPv6: Server response timeout. " << std::endl;
-        }
-        else
-        {
-            std::cout << "QUIC IPv6: Server response error. " << std::endl;
-        }
+}
 
-        close_socket(serverSocket);
-        return 1;
+// Compares family, port and address, IPv6 scope included.
+bool sockaddr_equal(const sockaddr *a, const sockaddr *b)
+{
+    if (a->sa_family != b->sa_family)
+    {
+        return false;
+    }
+    if (a->sa_family == AF_INET)
+    {
+        const sockaddr_in *a4 = (const sockaddr_in *)a;
+        const sockaddr_in *b4 = (const sockaddr_in *)b;
+        return a4->sin_port == b4->sin_port && a4->sin_addr.s_addr == b4->sin_addr.s_addr;
     }
+    const sockaddr_in6 *a6 = (const sockaddr_in6 *)a;
+    const sockaddr_in6 *b6 = (const sockaddr_in6 *)b;
+    return a6->sin6_port == b6->sin6_port &&
+           a6->sin6_scope_id == b6->sin6_scope_id &&
+           memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(struct in6_addr)) == 0;
+}
 
-    close_socket(serverSocket);
-    return 0;
+// FNV-1a over the same fields sockaddr_equal compares.
+size_t sockaddr_hash(const sockaddr *address)
+{
+    const unsigned char *bytes;
+    size_t len;
+    uint16_t port;
+    if (address->sa_family == AF_INET)
+    {
+        const sockaddr_in *ipv4 = (const sockaddr_in *)address;
+        bytes = (const unsigned char *)&ipv4->sin_addr;
+        len = sizeof(ipv4->sin_addr);
+        port = ipv4->sin_port;
+    }
+    else
+    {
+        const sockaddr_in6 *ipv6 = (const sockaddr_in6 *)address;
+        bytes = (const unsigned char *)&ipv6->sin6_addr;
+        len = sizeof(ipv6->sin6_addr);
+        port = ipv6->sin6_port;
+    }
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ bytes[i]) * 1099511628211ULL;
+    }
+    hash = (hash ^ (port & 0xff)) * 1099511628211ULL;
+    hash = (hash ^ (port >> 8)) * 1099511628211ULL;
+    return (size_t)hash;
 }
 
-std::tuple<eAddressType, std::string, int> resolve_server_address(std::string address)
+// "1.2.3.4:9520" or "[2001:db8::1]:9520"
+std::string format_address(const sockaddr *address)
+{
+    char ip[INET6_ADDRSTRLEN] = "";
+    if (address->sa_family == AF_INET)
+    {
+        const sockaddr_in *ipv4 = (const sockaddr_in *)address;
+        inet_ntop(AF_INET, &ipv4->sin_addr, ip, sizeof(ip));
+        return std::string(ip) + ":" + std::to_string(ntohs(ipv4->sin_port));
+    }
+    const sockaddr_in6 *ipv6 = (const sockaddr_in6 *)address;
+    inet_ntop(AF_INET6, &ipv6->sin6_addr, ip, sizeof(ip));
+    return "[" + std::string(ip) + "]:" + std::to_string(ntohs(ipv6->sin6_port));
+}
+
+typedef struct
+{
+    char *bytes;
+    int size;
+} udp_packet;
+
+static bool is_alnum(char c)
 {
-    int port = PROXY_DEFAULT_PORT;
-    std::regex serverAddressRegex("^([^:\\[\\]]+|\\[[^\\[\\]]+\\])(?::([0-9]+))?$");
-    std::regex domainRegex("^(?:[a-zA-Z0-9](?:[a-zA-Z0-9-]{0,61}[a-zA-Z0-9])?\\.)+[a-zA-Z]{2,}$");
-    std::smatch matches;
-    in_addr ipv4;
-    in6_addr ipv6;
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9');
+}
+
+static bool is_alpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
 
-    if (std::regex_search(address, matches, serverAddressRegex))
+// Labels of 1-63 alphanumerics or inner hyphens separated by dots, ending with a
+// top level domain of 2+ letters.
+static bool is_domain(const char *text, size_t length)
+{
+    size_t label_start = 0;
+    bool has_label = false;
+    for (size_t i = 0; i <= length; i++)
     {
-        std::string address = matches[1].str();
-        if (address.empty())
+        if (i < length && text[i] != '.')
         {
-            return {eAddressType::Invalid, "", -1};
+            continue;
         }
-        if (matches[2].matched)
+        size_t label_length = i - label_start;
+        const char *label = text + label_start;
+        if (i == length)
         {
-            try
+            if (!has_label || label_length < 2)
+            {
+                return false;
+            }
+            for (size_t j = 0; j < label_length; j++)
             {
-                port = std::stoi(matches[2].str());
-                if (port < 1 || port > 65535)
+                if (!is_alpha(label[j]))
                 {
-                    port = -1;
+                    return false;
                 }
             }
-            catch (...)
+            return true;
+        }
+        if (label_length < 1 || label_length > 63 || !is_alnum(label[0]) || !is_alnum(label[label_length - 1]))
+        {
+            return false;
+        }
+        for (size_t j = 1; j + 1 < label_length; j++)
+        {
+            if (!is_alnum(label[j]) && label[j] != '-')
             {
-                port = -1;
+                return false;
             }
         }
+        has_label = true;
+        label_start = i + 1;
+    }
+    return false;
+}
 
-        if (inet_pton(AF_INET, address.c_str(), &ipv4) == 1)
+// inet_pton wants a terminated string, a stack copy keeps it allocation free.
+static bool is_inet(int family, const char *text, size_t length)
+{
+    char buffer[INET6_ADDRSTRLEN];
+    unsigned char address[sizeof(in6_addr)];
+    if (length >= sizeof(buffer))
+    {
+        return false;
+    }
+    memcpy(buffer, text, length);
+    buffer[length] = '\0';
+    return inet_pton(family, buffer, address) == 1;
+}
+
+eAddressType parse_server_address(const char *text, size_t length, const char **host, size_t *host_length, int *port)
+{
+    *host = nullptr;
+    *host_length = 0;
+    *port = -1;
+
+    size_t i = 0;
+    bool bracketed = length > 0 && text[0] == '[';
+    if (bracketed)
+    {
+        i = 1;
+        while (i < length && text[i] != '[' && text[i] != ']')
+        {
+            i++;
+        }
+        if (i == 1 || i == length || text[i] != ']')
+        {
+            return eAddressType::Invalid;
+        }
+        i++;
+    }
+    else
+    {
+        while (i < length && text[i] != ':' && text[i] != '[' && text[i] != ']')
         {
-            return {eAddressType::IPv4, address, port};
+            i++;
         }
-        std::string raw_ipv6 = address.substr(1, address.length() - 2);
-        if (address.length() > 1 && inet_pton(AF_INET6, raw_ipv6.c_str(), &ipv6) == 1)
+        if (i == 0)
         {
-            return {eAddressType::IPv6, raw_ipv6, port};
+            return eAddressType::Invalid;
         }
+    }
+    size_t address_end = i;
 
-        // most expensive check
-        if (std::regex_match(address, domainRegex))
+    int parsed_port = PROXY_DEFAULT_PORT;
+    if (i < length)
+    {
+        if (text[i] != ':' || i + 1 == length)
+        {
+            return eAddressType::Invalid;
+        }
+        long value = 0;
+        for (i++; i < length; i++)
+        {
+            if (text[i] < '0' || text[i] > '9')
+            {
+                return eAddressType::Invalid;
+            }
+            if (value <= 65535)
+            {
+                value = value * 10 + (text[i] - '0');
+            }
+        }
+        parsed_port = value < 1 || value > 65535 ? -1 : (int)value;
+    }
+
+    *port = parsed_port;
+    if (bracketed)
+    {
+        if (is_inet(AF_INET6, text + 1, address_end - 2))
         {
-            return {eAddressType::Domain, address, port};
+            *host = text + 1;
+            *host_length = address_end - 2;
+            return eAddressType::IPv6;
+        }
+    }
+    else
+    {
+        *host = text;
+        *host_length = address_end;
+        if (is_inet(AF_INET, text, address_end))
+        {
+            return eAddressType::IPv4;
+        }
+        if (is_domain(text, address_end))
+        {
+            return eAddressType::Domain;
         }
     }
 
-    return {eAddressType::Invalid, "", -1};
-}
\ No newline at end of file
+    *host = nullptr;
+    *host_length = 0;
+    *port = -1;
+    return eAddressType::Invalid;
+}
+
+std::tuple<eAddressType, std::string, int> resolve_server_address(std::string address)
+{
+    const char *host;
+    size_t host_length;
+    int port;
+    eAddressType address_type = parse_server_address(address.data(), address.size(), &host, &host_length, &port);
+    if (address_type == eAddressType::Invalid)
+    {
+        return {eAddressType::Invalid, "", -1};
+    }
+    return {address_type, std::string(host, host_length), port};
+}
@@ -7,6 +7,8 @@
 #include <string>
 #include <thread>
 #include <chrono>
+#include <cstdint>
+#include <tuple>
 #include <utility>
 
 #ifndef _WIN32_WINNT
@@ -28,6 +30,8 @@ using socket_t = int;
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
+#include <poll.h>
 #include <unistd.h>
 #endif
 
@@ -38,11 +42,56 @@ using socket_t = int;
 #define PROXY_DISCONNECTING 4 // Proxy is clearing.
 
 #define PROXY_DEFAULT_PORT 9520
+#define PROXY_MAX_DATAGRAM 65536 // Receive buffers never grow past this, the largest UDP payload fits.
+
+// When the kernel saw a datagram arrive or leave, for SO_TIMESTAMPING.
+typedef struct
+{
+    int64_t software_ns; // CLOCK_REALTIME, 0 when missing.
+    int64_t hardware_ns; // Clock of the network card, 0 when missing.
+} KernelTimestamp;
 
 int close_socket(socket_t s);
+int set_socket_timeout(int s, int timeout_ms);
+int set_socket_nonblocking(int s);
+bool socket_would_block();
+int poll_sockets(pollfd *fds, size_t count, int timeout_ms);
+int set_socket_busy_poll(int s, int microseconds);
+int enable_drop_counter(int s);
+int receive_datagram(int s, char *buffer, int size, sockaddr_storage *from, socklen_t *from_len, uint32_t *kernel_drops, KernelTimestamp *arrival);
+int enable_timestamping(int s);
+int restart_timestamping(int s);
+int receive_transmit_timestamp(int s, uint32_t *id, KernelTimestamp *departure);
+bool socket_buffer_full();
+int socket_buffer_size(int s, int option);
+int grow_socket_buffer(int s, int option, int size);
+int enable_txtime(int s);
+int send_datagram_at(int s, const sockaddr *to, socklen_t to_len, const char *data, int size, int64_t departure_ns);
+int enable_path_mtu_discovery(int s);
+int path_mtu(int s);
+bool datagram_too_big();
+int pin_current_thread(int cpu);
+int set_current_thread_realtime();
+
+bool sockaddr_equal(const sockaddr *a, const sockaddr *b);
+size_t sockaddr_hash(const sockaddr *address);
+std::string format_address(const sockaddr *address);
+
+struct SockaddrHash
+{
+    size_t operator()(const sockaddr_storage &address) const
+    {
+        return sockaddr_hash((const sockaddr *)&address);
+    }
+};
 
-int test_ipv4_quic(in_addr ipv4, int port);
-int test_ipv6_quic(in6_addr ipv6, int port);
+struct SockaddrEqual
+{
+    bool operator()(const sockaddr_storage &a, const sockaddr_storage &b) const
+    {
+        return sockaddr_equal((const sockaddr *)&a, (const sockaddr *)&b);
+    }
+};
 
 enum eAddressType
 {
@@ -52,6 +101,9 @@ enum eAddressType
     Invalid
 };
 
+// Parses "<address>[:port]" where address is a domain, an IPv4 or a bracketed IPv6
+// without allocating, host points inside text. port is -1 when out of range.
+eAddressType parse_server_address(const char *text, size_t length, const char **host, size_t *host_length, int *port);
 std::tuple<eAddressType, std::string, int> resolve_server_address(std::string address);
 
 #endif
\ No newline at end of file
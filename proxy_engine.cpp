@@ -0,0 +1,1831 @@
+#include "proxy_engine.h"
+#include "logger.h"
+#include <algorithm>
+#include <cstring>
+
+// Routes a session's tunnel output: towards the other proxy or towards the local side
+// (game clients on entries, the game server on exits).
+class SessionSink : public TunnelSink
+{
+private:
+    ProxyEngine *engine;
+    ProxyRoute *route;
+    ProxySession *session;
+    std::chrono::steady_clock::time_point now;
+
+public:
+    SessionSink(ProxyEngine *engine, ProxyRoute *route, ProxySession *session, std::chrono::steady_clock::time_point now)
+        : engine(engine), route(route), session(session), now(now)
+    {
+    }
+
+    void to_peer(const char *frame, int size) override
+    {
+        this->engine->send_to_peer(this->route, this->session, frame, size, this->now);
+    }
+
+    void to_local(const char *datagram, int size) override
+    {
+        if (this->route->tunnel == TUNNEL_ENTRY)
+        {
+            if (!this->session->confirmed)
+            {
+                QuicHeader header;
+                quic_classify((const uint8_t *)datagram, size, &header);
+                this->engine->learn_server_cid(this->session, datagram, size, header);
+            }
+            this->engine->send_to_client(this->route, &this->session->client, this->session->client_len, datagram, size, this->now);
+        }
+        else
+        {
+            this->engine->send_to_server(this->route, this->session->upstream, datagram, size, this->now);
+        }
+    }
+};
+
+// steady_clock is CLOCK_MONOTONIC on Linux, the clock SO_TXTIME departure times use.
+static int64_t monotonic_ns(std::chrono::steady_clock::time_point time)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+}
+
+ProxyEngine::ProxyEngine()
+{
+    // Loopback socket the other threads write to, so poll() returns as soon as the routes change.
+    this->wake_socket = socket(AF_INET, SOCK_DGRAM, 0);
+    this->wake_address.sin_family = AF_INET;
+    this->wake_address.sin_port = 0;
+    inet_pton(AF_INET, "127.0.0.1", &this->wake_address.sin_addr);
+    socklen_t wake_len = sizeof(this->wake_address);
+    if (this->wake_socket < 0 ||
+        bind(this->wake_socket, (sockaddr *)&this->wake_address, sizeof(this->wake_address)) < 0 ||
+        getsockname(this->wake_socket, (sockaddr *)&this->wake_address, &wake_len) < 0)
+    {
+        LOG(LOG_LEVEL_WARNING, "Engine: Wake socket creation failed, route changes will be applied on the next poll timeout.");
+    }
+    else
+    {
+        set_socket_nonblocking(this->wake_socket);
+    }
+
+    cookie_key_init(&this->cookie_key);
+
+    this->running = true;
+    this->engine_thread = std::thread(&ProxyEngine::run, this);
+}
+
+ProxyEngine::~ProxyEngine()
+{
+    this->running = false;
+    this->wake();
+    if (this->engine_thread.joinable())
+    {
+        this->engine_thread.join();
+    }
+    if (this->wake_socket >= 0)
+    {
+        close_socket(this->wake_socket);
+    }
+}
+
+void ProxyEngine::wake()
+{
+    if (this->wake_socket >= 0)
+    {
+        char byte = 0;
+        sendto(this->wake_socket, &byte, 1, 0, (sockaddr *)&this->wake_address, sizeof(this->wake_address));
+    }
+}
+
+int ProxyEngine::add_route(int listen_socket, const sockaddr *upstream, socklen_t upstream_len, std::shared_ptr<BackendPool> backends, int tunnel)
+{
+    if (upstream_len > (socklen_t)sizeof(sockaddr_storage))
+    {
+        return 1;
+    }
+
+    std::unique_ptr<ProxyRoute> route = std::make_unique<ProxyRoute>();
+    route->listen_socket = listen_socket;
+    route->listen_port = 0;
+    memcpy(&route->upstream, upstream, upstream_len);
+    route->upstream_len = upstream_len;
+    route->tunnel = tunnel;
+    route->backends = backends;
+    route->backend_generation = backends ? backends->generation() : 0;
+    return this->queue_route(std::move(route));
+}
+
+int ProxyEngine::adopt_route(const HandoffRoute &handed, std::shared_ptr<BackendPool> backends)
+{
+    if (handed.upstream_len > (socklen_t)sizeof(sockaddr_storage))
+    {
+        return 1;
+    }
+
+    std::unique_ptr<ProxyRoute> route = std::make_unique<ProxyRoute>();
+    route->listen_socket = handed.listen_socket;
+    route->listen_port = handed.listen_port;
+    route->upstream = handed.upstream;
+    route->upstream_len = handed.upstream_len;
+    route->tunnel = handed.tunnel;
+    route->backends = backends;
+    route->backend_generation = backends ? backends->generation() : 0;
+    route->handed = handed.sessions;
+    return this->queue_route(std::move(route));
+}
+
+// Hands a new route to the engine thread and waits until it runs.
+int ProxyEngine::queue_route(std::unique_ptr<ProxyRoute> route)
+{
+    int listen_socket = route->listen_socket;
+    sockaddr_storage local{};
+    socklen_t local_len = sizeof(local);
+    if (getsockname(listen_socket, (sockaddr *)&local, &local_len) == 0)
+    {
+        route->listen_port = ntohs(local.ss_family == AF_INET ? ((sockaddr_in *)&local)->sin_port
+                                                               : ((sockaddr_in6 *)&local)->sin6_port);
+    }
+    set_socket_nonblocking(listen_socket);
+
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (!this->running || this->status.count(listen_socket))
+    {
+        return 1;
+    }
+    this->added.push_back(std::move(route));
+    lock.unlock();
+    this->wake();
+
+    lock.lock();
+    this->changed.wait(lock, [this, listen_socket]()
+                       { return !this->running || this->status.count(listen_socket); });
+    return this->status.count(listen_socket) ? 0 : 1;
+}
+
+int ProxyEngine::export_routes(std::vector<HandoffRoute> *routes)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (!this->running)
+    {
+        return 1;
+    }
+    this->export_requested = true;
+    lock.unlock();
+    this->wake();
+
+    lock.lock();
+    this->changed.wait(lock, [this]()
+                       { return !this->running || !this->export_requested; });
+    if (this->export_requested)
+    {
+        return 1;
+    }
+    routes->swap(this->exported);
+    this->exported.clear();
+    return 0;
+}
+
+int ProxyEngine::remove_route(int listen_socket)
+{
+    std::unique_lock<std::mutex> lock(this->mutex);
+    if (!this->status.count(listen_socket))
+    {
+        return 1;
+    }
+    this->removed.push_back(listen_socket);
+    lock.unlock();
+    this->wake();
+
+    lock.lock();
+    this->changed.wait(lock, [this, listen_socket]()
+                       { return !this->status.count(listen_socket); });
+    return 0;
+}
+
+int ProxyEngine::get_route_state(int listen_socket)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto it = this->status.find(listen_socket);
+    if (it == this->status.end())
+    {
+        return PROXY_IDDLE;
+    }
+    return it->second.state;
+}
+
+std::vector<RouteStatus> ProxyEngine::get_routes()
+{
+    std::vector<RouteStatus> routes;
+    std::lock_guard<std::mutex> lock(this->mutex);
+    for (const auto &entry : this->status)
+    {
+        routes.push_back(entry.second);
+    }
+    return routes;
+}
+
+// Called from the engine thread whenever a route is added, removed or changes state.
+void ProxyEngine::set_listener(std::function<void()> listener)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->listener = listener;
+}
+
+// Limits only apply to client to server traffic, 0 leaves a rate unlimited. Running
+// sessions get fresh buckets with the new limits.
+void ProxyEngine::set_rate_limits(RateLimit session_limit, RateLimit global_limit)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->session_limit = session_limit;
+        this->global_limit = global_limit;
+        this->limits_changed = true;
+    }
+    this->wake();
+}
+
+void ProxyEngine::apply_limits()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->active_session_limit = this->session_limit;
+        rate_limiter_init(&this->global_limiter, this->global_limit, std::chrono::steady_clock::now());
+        this->limits_changed = false;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    for (auto &entry : this->routes)
+    {
+        for (auto &session : entry.second->sessions)
+        {
+            rate_limiter_init(&session.second.limiter, this->active_session_limit, now);
+        }
+    }
+#ifdef PROXY_WITH_XDP
+    if (rate_limit_enabled(this->active_session_limit) || this->global_limiter.packets.rate > 0 || this->global_limiter.bytes.rate > 0)
+    {
+        this->leave_fast_paths();
+    }
+#endif
+}
+
+// Emulates a bad network on the client to server (upstream) and server to client
+// (downstream) traffic, for testing only.
+void ProxyEngine::set_impairment(ImpairmentConfig upstream, ImpairmentConfig downstream)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->upstream_impairment = upstream;
+        this->downstream_impairment = downstream;
+        this->impairment_changed = true;
+    }
+    this->wake();
+}
+
+void ProxyEngine::apply_impairment()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->active_upstream_impairment = this->upstream_impairment;
+    this->active_downstream_impairment = this->downstream_impairment;
+    this->impaired = impairment_enabled(this->upstream_impairment) || impairment_enabled(this->downstream_impairment);
+    this->impairment_changed = false;
+    if (this->impaired)
+    {
+        LOG(LOG_LEVEL_INFO, "Engine: Network impairment enabled.");
+#ifdef PROXY_WITH_XDP
+        this->leave_fast_paths();
+#endif
+    }
+}
+
+// Local addresses tunnel entries send from besides the default one, every frame goes
+// over all of them and the exit keeps the first copy. Applies to new sessions.
+void ProxyEngine::set_tunnel_paths(std::vector<sockaddr_storage> local_addresses)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->path_addresses = local_addresses;
+        this->paths_changed = true;
+    }
+    this->wake();
+}
+
+// Tunnel frames produced in the same poll pass always share datagrams, a delay also
+// holds them back so frames from the next passes join, polling meanwhile instead of sleeping.
+void ProxyEngine::set_bundle_delay(int microseconds)
+{
+    this->bundle_delay_us = microseconds;
+    this->wake();
+}
+
+// Spreads each client's datagrams (both ways) out to this rate with SO_TXTIME, for the
+// fq qdisc to enforce, 0 sends them as they come.
+void ProxyEngine::set_pacing(int64_t bytes_per_second)
+{
+    this->pace_bytes_per_second = bytes_per_second;
+}
+
+void ProxyEngine::apply_paths()
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    this->active_path_addresses = this->path_addresses;
+    this->paths_changed = false;
+}
+
+// Trades CPU for wake-up latency. While datagrams keep coming closer together than
+// spin_us the engine polls without sleeping, once they space out it sleeps in poll()
+// again, so an idle proxy doesn't hold a core.
+void ProxyEngine::set_low_latency(LowLatencyConfig config)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->low_latency = config;
+        this->low_latency_changed = true;
+    }
+    this->wake();
+}
+
+void ProxyEngine::apply_low_latency()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->active_low_latency = this->low_latency;
+        this->low_latency_changed = false;
+    }
+    const LowLatencyConfig &config = this->active_low_latency;
+    if (config.cpu >= 0 && pin_current_thread(config.cpu) != 0)
+    {
+        LOG(LOG_LEVEL_WARNING, "Engine: Couldn't pin the engine thread to CPU {}.", config.cpu);
+    }
+    if (config.realtime && set_current_thread_realtime() != 0)
+    {
+        LOG(LOG_LEVEL_WARNING, "Engine: Couldn't give the engine thread real-time priority.");
+    }
+    for (auto &entry : this->routes)
+    {
+        this->tune_socket(entry.second->listen_socket);
+        for (auto &session : entry.second->sessions)
+        {
+            this->tune_socket(session.second.upstream);
+            for (const auto &path : session.second.paths)
+            {
+                if (path.socket >= 0)
+                {
+                    this->tune_socket(path.socket);
+                }
+            }
+        }
+    }
+}
+
+// Datagrams from rejected addresses are dropped before any session or upstream socket
+// exists for them. Sessions of clients the new rules reject are closed.
+void ProxyEngine::set_client_filter(ClientFilter filter)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->client_filter = std::move(filter);
+        this->filter_changed = true;
+    }
+    this->wake();
+}
+
+void ProxyEngine::apply_client_filter()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->active_client_filter = this->client_filter;
+        this->filter_changed = false;
+    }
+    for (auto &entry : this->routes)
+    {
+        ProxyRoute *route = entry.second.get();
+        std::vector<ProxySession *> rejected;
+        for (auto &session : route->sessions)
+        {
+            if (!this->active_client_filter.allows((const sockaddr *)&session.second.client))
+            {
+                rejected.push_back(&session.second);
+            }
+        }
+        for (ProxySession *session : rejected)
+        {
+            this->close_session(route, session);
+        }
+    }
+}
+
+// Makes spoofed floods cheap. Plain and entry routes only open sessions for datagrams
+// shaped like a QUIC Initial and keep at most ENGINE_MAX_UNCONFIRMED sessions whose
+// client hasn't answered the server yet, the oldest one makes room for a new client.
+// Exit routes only open sessions for entries that echoed a cookie sent to their address.
+void ProxyEngine::set_client_validation(bool enabled)
+{
+    this->validate_clients = enabled;
+}
+
+// Drops of the kernel only show in the counter it attaches to reads.
+void ProxyEngine::watch_socket(int s, SocketCounters *counters)
+{
+    enable_drop_counter(s);
+    counters->receive_buffer = socket_buffer_size(s, SO_RCVBUF);
+}
+
+// Grows the receive buffer when the kernel dropped datagrams or a burst filled more
+// than half of it, until ENGINE_MAX_SOCKET_BUFFER or the kernel's own limit.
+void ProxyEngine::size_receive_buffer(ProxyRoute *route, int s, SocketCounters *counters, int burst)
+{
+    counters->peak_burst = std::max(counters->peak_burst, burst);
+    bool dropped = counters->kernel_drops != counters->sized_drops;
+    if (counters->capped || (!dropped && counters->peak_burst * 2 <= counters->receive_buffer))
+    {
+        return;
+    }
+    counters->sized_drops = counters->kernel_drops;
+    int wanted = std::min(std::max(counters->receive_buffer * 2, counters->peak_burst * 4), ENGINE_MAX_SOCKET_BUFFER);
+    int granted = grow_socket_buffer(s, SO_RCVBUF, wanted);
+    if (granted <= counters->receive_buffer)
+    {
+        counters->capped = true;
+        LOG(LOG_LEVEL_WARNING, "Proxy {}: The kernel keeps a receive buffer at {} bytes, raise net.core.rmem_max to let it grow.",
+            route->listen_port, counters->receive_buffer);
+        return;
+    }
+    counters->receive_buffer = granted;
+    counters->capped = granted >= ENGINE_MAX_SOCKET_BUFFER;
+}
+
+// A socket the egress queues had to wait for gets a send buffer twice as big for the next bursts.
+void ProxyEngine::grow_send_buffer(int s)
+{
+    int size = socket_buffer_size(s, SO_SNDBUF);
+    if (size > 0 && size < ENGINE_MAX_SOCKET_BUFFER)
+    {
+        grow_socket_buffer(s, SO_SNDBUF, std::min(size * 2, ENGINE_MAX_SOCKET_BUFFER));
+    }
+}
+
+// Plain routes only, tunnels send several datagrams for each one they forward.
+void ProxyEngine::start_timestamps(int s, TransmitTimestamps *timestamps)
+{
+    timestamps->enabled = enable_timestamping(s) == 0;
+}
+
+// Called after every send on a timestamped socket. The kernel numbers sends in order,
+// so one that failed or went through the impairment or egress queues breaks the count
+// until the numbering restarts, once nothing is left in those queues.
+void ProxyEngine::sent(int s, TransmitTimestamps *timestamps, bool ok, ProxySession *session, const KernelTimestamp &arrival)
+{
+    if (!timestamps->enabled)
+    {
+        return;
+    }
+    if (!ok || timestamps->stale)
+    {
+        timestamps->stale = true;
+        if (ok && !this->impaired && this->delayed.size() == 0 && this->egress.size() == 0)
+        {
+            this->read_timestamps(s, timestamps);
+            restart_timestamping(s);
+            *timestamps = TransmitTimestamps{};
+            timestamps->enabled = true;
+        }
+        return;
+    }
+    uint32_t id = timestamps->next_id++;
+    if (arrival.software_ns != 0 || arrival.hardware_ns != 0)
+    {
+        timestamps->pending[id % ENGINE_TIMESTAMP_PENDING] = {id, true, arrival, session};
+    }
+}
+
+// Drains the transmit timestamps of the error queue into the sessions' residency.
+// Hardware arrivals wait for the hardware departure, the two clocks don't compare.
+void ProxyEngine::read_timestamps(int s, TransmitTimestamps *timestamps)
+{
+    uint32_t id;
+    KernelTimestamp departure;
+    int read;
+    while ((read = receive_transmit_timestamp(s, &id, &departure)) >= 0)
+    {
+        PendingSend &pending = timestamps->pending[id % ENGINE_TIMESTAMP_PENDING];
+        if (read == 0 || !pending.used || pending.id != id)
+        {
+            continue;
+        }
+        int64_t residency;
+        if (pending.arrival.hardware_ns != 0)
+        {
+            if (departure.hardware_ns == 0)
+            {
+                continue;
+            }
+            residency = departure.hardware_ns - pending.arrival.hardware_ns;
+        }
+        else if (departure.software_ns != 0)
+        {
+            residency = departure.software_ns - pending.arrival.software_ns;
+        }
+        else
+        {
+            continue;
+        }
+        pending.used = false;
+        latency_add(&pending.session->residency, residency);
+    }
+}
+
+void ProxyEngine::tune_socket(int s)
+{
+    enable_path_mtu_discovery(s);
+    if (this->active_low_latency.busy_poll_us > 0 && set_socket_busy_poll(s, this->active_low_latency.busy_poll_us) != 0)
+    {
+        LOG(LOG_LEVEL_WARNING, "Engine: SO_BUSY_POLL refused, it needs Linux and CAP_NET_ADMIN.");
+        this->active_low_latency.busy_poll_us = 0;
+    }
+}
+
+void ProxyEngine::apply_changes()
+{
+    std::vector<std::unique_ptr<ProxyRoute>> added;
+    std::vector<int> removed;
+    bool exporting;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        added.swap(this->added);
+        removed.swap(this->removed);
+        exporting = this->export_requested;
+    }
+
+    for (auto &route : added)
+    {
+        LOG(LOG_LEVEL_INFO, "Proxy {}: Forwarding to {} ({}).", route->listen_port, route->upstream, tunnel_mode_name(route->tunnel));
+        int listen_socket = route->listen_socket;
+        this->tune_socket(listen_socket);
+        this->watch_socket(listen_socket, &route->counters);
+        if (route->tunnel == TUNNEL_NONE)
+        {
+            this->start_timestamps(listen_socket, &route->timestamps);
+        }
+        if (!route->handed.empty())
+        {
+            LOG(LOG_LEVEL_INFO, "Proxy {}: Taking over {} clients.", route->listen_port, route->handed.size());
+        }
+        for (const auto &handed : route->handed)
+        {
+            ProxySession *session = this->add_session(route.get(), handed.client, handed.client_len, handed.upstream, handed.backend, 0);
+            session->replied = handed.replied;
+            if (handed.confirmed && !session->confirmed)
+            {
+                session->confirmed = true;
+                route->unconfirmed--;
+            }
+            // The other process numbered sends already, counting restarts with the next one.
+            session->timestamps.stale = session->timestamps.enabled;
+        }
+        route->timestamps.stale = route->timestamps.enabled && !route->handed.empty();
+        route->handed.clear();
+        this->routes[listen_socket] = std::move(route);
+    }
+
+    for (int listen_socket : removed)
+    {
+        auto it = this->routes.find(listen_socket);
+        if (it == this->routes.end())
+        {
+            continue;
+        }
+        ProxyRoute *route = it->second.get();
+        LOG(LOG_LEVEL_INFO, "Proxy {}: Stopping...", route->listen_port);
+        while (!route->sessions.empty())
+        {
+            this->close_session(route, &route->sessions.begin()->second);
+        }
+        this->delayed.cancel(route->listen_socket);
+        this->egress.cancel(route->listen_socket);
+        close_socket(route->listen_socket);
+        this->routes.erase(it);
+    }
+
+    if (exporting)
+    {
+        this->hand_off_routes();
+    }
+}
+
+// Empties the engine for export_routes(), every socket stays open for the next process.
+// Datagrams still waiting in the impairment or egress queues are lost.
+void ProxyEngine::hand_off_routes()
+{
+    std::vector<HandoffRoute> exported;
+    for (auto &entry : this->routes)
+    {
+        ProxyRoute *route = entry.second.get();
+        HandoffRoute handed{route->listen_socket, route->listen_port, route->upstream, route->upstream_len, route->tunnel,
+                            route->backends ? route->backends->list() : std::vector<Backend>{}, {}};
+        // Tunnel state can't move, entries start new tunnel sessions with the next datagram.
+        while (route->tunnel != TUNNEL_NONE && !route->sessions.empty())
+        {
+            this->close_session(route, &route->sessions.begin()->second);
+        }
+        for (auto &client : route->sessions)
+        {
+            ProxySession &session = client.second;
+#ifdef PROXY_WITH_XDP
+            this->leave_fast_path(&session);
+#endif
+            this->delayed.cancel(session.upstream);
+            this->egress.cancel(session.upstream);
+            handed.sessions.push_back({session.client, session.client_len, session.upstream, session.backend, session.replied, session.confirmed});
+        }
+        this->delayed.cancel(route->listen_socket);
+        this->egress.cancel(route->listen_socket);
+        exported.push_back(std::move(handed));
+    }
+    LOG(LOG_LEVEL_INFO, "Engine: Handing {} routes over.", exported.size());
+    this->routes.clear();
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->exported = std::move(exported);
+        this->export_requested = false;
+    }
+    this->changed.notify_all();
+}
+
+void ProxyEngine::publish_status()
+{
+    std::map<int, RouteStatus> status;
+    for (const auto &entry : this->routes)
+    {
+        ProxyRoute *route = entry.second.get();
+        RouteStatus &route_status = status[entry.first];
+        route_status = {route->listen_socket, route->listen_port,
+                        route->sessions.empty() ? PROXY_READY : PROXY_ESTABLISHED,
+                        route->sessions.size(),
+                        format_address((sockaddr *)&route->upstream), 0, route->tunnel, 0, 0,
+                        route->counters.kernel_drops, route->send_failures, route->filtered, route->unvalidated, route->oversize, -1,
+                        route->counters.receive_buffer, 0, 0, {}};
+        LatencyHistogram residency{};
+        for (const auto &session : route->sessions)
+        {
+            latency_merge(&residency, &session.second.residency);
+            route_status.dropped_packets += session.second.dropped_packets;
+            route_status.kernel_drops += session.second.counters.kernel_drops;
+            int mtu = session.second.path_mtu;
+            if (mtu > 0 && (route_status.path_mtu < 0 || mtu < route_status.path_mtu))
+            {
+                route_status.path_mtu = mtu;
+            }
+            if (session.second.tunnel)
+            {
+                TunnelStats stats = session.second.tunnel->stats();
+                route_status.recovered += stats.recovered;
+                route_status.duplicates += stats.duplicates;
+            }
+            route_status.clients.push_back({format_address((sockaddr *)&session.second.client),
+                                            session.second.dropped_packets, session.second.dropped_bytes,
+                                            1 + (int)session.second.paths.size(), session.second.counters.kernel_drops,
+                                            latency_percentile(&session.second.residency, 0.5),
+                                            latency_percentile(&session.second.residency, 0.99), session.second.path_mtu});
+        }
+        route_status.residency_p50_ns = latency_percentile(&residency, 0.5);
+        route_status.residency_p99_ns = latency_percentile(&residency, 0.99);
+    }
+
+    std::function<void()> listener;
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        bool different = status.size() != this->status.size();
+        for (auto it = status.begin(); !different && it != status.end(); ++it)
+        {
+            auto old = this->status.find(it->first);
+            different = old == this->status.end() ||
+                        old->second.state != it->second.state ||
+                        old->second.sessions != it->second.sessions ||
+                        old->second.dropped_packets != it->second.dropped_packets ||
+                        old->second.kernel_drops != it->second.kernel_drops ||
+                        old->second.send_failures != it->second.send_failures ||
+                        old->second.filtered != it->second.filtered ||
+                        old->second.unvalidated != it->second.unvalidated ||
+                        old->second.oversize != it->second.oversize ||
+                        old->second.path_mtu != it->second.path_mtu ||
+                        old->second.residency_p99_ns != it->second.residency_p99_ns ||
+                        old->second.recovered != it->second.recovered;
+        }
+        if (!different)
+        {
+            return;
+        }
+        this->status = status;
+        listener = this->listener;
+    }
+    this->changed.notify_all();
+    if (listener)
+    {
+        listener();
+    }
+}
+
+ProxySession *ProxyEngine::open_session(ProxyRoute *route, const sockaddr_storage &client, socklen_t client_len, uint32_t tunnel_session)
+{
+    sockaddr_storage target = route->upstream;
+    socklen_t target_len = route->upstream_len;
+    int backend = 0;
+    if (route->backends)
+    {
+        // New clients are spread over the healthy backends.
+        int picked = route->backends->pick(&target, &target_len);
+        if (picked == -1)
+        {
+            target = route->upstream;
+            target_len = route->upstream_len;
+            picked = 0;
+        }
+        backend = picked;
+    }
+
+    int upstream = socket(target.ss_family, SOCK_DGRAM, 0);
+    if (upstream < 0)
+    {
+        LOG(LOG_LEVEL_ERROR, "Proxy {}: Server socket creation failed.", route->listen_port);
+        return nullptr;
+    }
+    if (::connect(upstream, (sockaddr *)&target, target_len) < 0)
+    {
+        LOG(LOG_LEVEL_ERROR, "Proxy {}: Couldn't connect to {}", route->listen_port, target);
+        close_socket(upstream);
+        return nullptr;
+    }
+
+    LOG(LOG_LEVEL_INFO, "Proxy {}: A client has connected: {}", route->listen_port, client);
+    ProxySession *opened = this->add_session(route, client, client_len, upstream, backend, tunnel_session);
+    if (route->tunnel == TUNNEL_ENTRY)
+    {
+        this->open_paths(route, opened, target, target_len);
+        this->send_hellos(route, opened, opened->last_activity);
+    }
+    return opened;
+}
+
+// Tracks a client whose upstream socket is connected already, opened here or taken over.
+ProxySession *ProxyEngine::add_session(ProxyRoute *route, const sockaddr_storage &client, socklen_t client_len, int upstream, int backend, uint32_t tunnel_session)
+{
+    set_socket_nonblocking(upstream);
+    this->tune_socket(upstream);
+
+    ProxySession session{};
+    this->watch_socket(upstream, &session.counters);
+    session.path_mtu = path_mtu(upstream);
+    if (route->tunnel == TUNNEL_NONE)
+    {
+        this->start_timestamps(upstream, &session.timestamps);
+    }
+    memcpy(&session.client, &client, client_len);
+    session.client_len = client_len;
+    session.upstream = upstream;
+    session.backend = backend;
+    session.last_activity = std::chrono::steady_clock::now();
+    rate_limiter_init(&session.limiter, this->active_session_limit, session.last_activity);
+    session.tunnel_session = tunnel_session;
+    if (route->tunnel != TUNNEL_NONE)
+    {
+        session.tunnel = std::make_unique<Tunnel>(tunnel_session);
+    }
+    session.validated = route->tunnel != TUNNEL_ENTRY;
+    session.confirmed = route->tunnel == TUNNEL_EXIT || !this->validate_clients;
+    session.opened = session.last_activity;
+    if (!session.confirmed)
+    {
+        route->unconfirmed++;
+        route->unconfirmed_order.push_back({session.client, session.opened});
+    }
+
+    ProxySession *added = &route->sessions.emplace(session.client, std::move(session)).first->second;
+    if (route->tunnel == TUNNEL_EXIT)
+    {
+        route->tunnel_sessions[tunnel_session] = added;
+    }
+    return added;
+}
+
+void ProxyEngine::open_paths(ProxyRoute *route, ProxySession *session, const sockaddr_storage &target, socklen_t target_len)
+{
+    for (const auto &local : this->active_path_addresses)
+    {
+        if (local.ss_family != target.ss_family)
+        {
+            continue;
+        }
+        int path = socket(target.ss_family, SOCK_DGRAM, 0);
+        if (path < 0)
+        {
+            continue;
+        }
+        socklen_t local_len = local.ss_family == AF_INET ? sizeof(sockaddr_in) : sizeof(sockaddr_in6);
+        if (bind(path, (const sockaddr *)&local, local_len) < 0 || ::connect(path, (const sockaddr *)&target, target_len) < 0)
+        {
+            LOG(LOG_LEVEL_WARNING, "Proxy {}: Couldn't open a path from {}.", route->listen_port, local);
+            close_socket(path);
+            continue;
+        }
+        set_socket_nonblocking(path);
+        this->tune_socket(path);
+        session->paths.push_back({path, target, target_len, false, 0});
+    }
+}
+
+// Clients of exit routes are entry proxies, a session can reach us from several
+// addresses and its id tells which one a new address belongs to.
+ProxySession *ProxyEngine::find_session(ProxyRoute *route, const sockaddr_storage &client, socklen_t client_len, const char *datagram, int size, const QuicHeader &header, bool validated)
+{
+    auto it = route->sessions.find(client);
+    if (it != route->sessions.end())
+    {
+        return &it->second;
+    }
+    if (!this->active_client_filter.allows((const sockaddr *)&client))
+    {
+        route->filtered++;
+        return nullptr;
+    }
+    if (route->tunnel != TUNNEL_EXIT)
+    {
+        // First datagram of a QUIC connection: an Initial padded as RFC 9000 requires, with
+        // a destination connection id of at least 8 bytes. Other versions are let through
+        // alike so the server can answer them with version negotiation.
+        bool initial = (header.kind == QUIC_INITIAL || header.kind == QUIC_OTHER_VERSION) && size >= QUIC_MIN_INITIAL_SIZE && header.dcid_length >= 8;
+        if (this->validate_clients && !initial)
+        {
+            route->unvalidated++;
+            return nullptr;
+        }
+        // Spoofed Initials can't lock new clients out, the client waiting the longest
+        // makes room.
+        ProxySession *oldest = this->validate_clients && route->unconfirmed >= ENGINE_MAX_UNCONFIRMED ? this->oldest_unconfirmed(route) : nullptr;
+        if (oldest != nullptr)
+        {
+            LOG(LOG_LEVEL_DEBUG, "Proxy {}: Client {} replaced by a new client before confirming its address.", route->listen_port, oldest->client);
+            this->close_session(route, oldest);
+        }
+        return this->open_session(route, client, client_len, route->tunnel == TUNNEL_ENTRY ? tunnel_new_session_id() : 0);
+    }
+
+    auto path = route->tunnel_paths.find(client);
+    if (path != route->tunnel_paths.end())
+    {
+        return path->second;
+    }
+    uint32_t tunnel_session;
+    if (!tunnel_frame_session(datagram, size, &tunnel_session))
+    {
+        return nullptr;
+    }
+    if (this->validate_clients && !validated)
+    {
+        route->unvalidated++;
+        return nullptr;
+    }
+    auto known = route->tunnel_sessions.find(tunnel_session);
+    if (known == route->tunnel_sessions.end())
+    {
+        return this->open_session(route, client, client_len, tunnel_session);
+    }
+    ProxySession *session = known->second;
+    session->paths.push_back({-1, client, client_len, false, 0});
+    route->tunnel_paths[client] = session;
+    LOG(LOG_LEVEL_INFO, "Proxy {}: Client {} added a path from {}", route->listen_port, session->client, client);
+    return session;
+}
+
+// Exits answer an entry's hello with a cookie for its address and keep nothing until
+// the entry echoes it. An echoed cookie opens the session (or adds the path) and is
+// acknowledged with a cookie again. False for any frame that isn't a hello or cookie.
+bool ProxyEngine::answer_hello(ProxyRoute *route, const sockaddr_storage &client, socklen_t client_len, const char *frame, int size, std::chrono::steady_clock::time_point now)
+{
+    int type;
+    uint32_t tunnel_session;
+    uint64_t cookie;
+    if (!tunnel_read_handshake(frame, size, &type, &tunnel_session, &cookie))
+    {
+        return false;
+    }
+    if (type != TUNNEL_HELLO)
+    {
+        return true;
+    }
+    if (cookie != 0 && address_cookie_valid(&this->cookie_key, (const sockaddr *)&client, tunnel_session, cookie, now))
+    {
+        QuicHeader header{QUIC_NOT_QUIC, 0, 0, 0};
+        ProxySession *session = this->find_session(route, client, client_len, frame, size, header, true);
+        if (session == nullptr)
+        {
+            return true;
+        }
+        session->last_activity = now;
+    }
+    char reply[TUNNEL_HANDSHAKE_SIZE];
+    tunnel_write_handshake(reply, TUNNEL_COOKIE, tunnel_session, address_cookie(&this->cookie_key, (const sockaddr *)&client, tunnel_session, now));
+    this->send_to_client(route, &client, client_len, reply, TUNNEL_HANDSHAKE_SIZE, now);
+    return true;
+}
+
+// Entries say hello on every socket of a session the exit hasn't acknowledged yet.
+void ProxyEngine::send_hellos(ProxyRoute *route, ProxySession *session, std::chrono::steady_clock::time_point now)
+{
+    char frame[TUNNEL_HANDSHAKE_SIZE];
+    if (!session->validated)
+    {
+        tunnel_write_handshake(frame, TUNNEL_HELLO, session->tunnel_session, session->cookie);
+        this->send_to_server(route, session->upstream, frame, TUNNEL_HANDSHAKE_SIZE, now);
+    }
+    for (const auto &path : session->paths)
+    {
+        if (!path.validated)
+        {
+            tunnel_write_handshake(frame, TUNNEL_HELLO, session->tunnel_session, path.cookie);
+            this->send_to_server(route, path.socket, frame, TUNNEL_HANDSHAKE_SIZE, now);
+        }
+    }
+    session->hellos++;
+    session->hello_sent = now;
+}
+
+// A cookie the entry already echoed on that socket is the exit's acknowledgement.
+void ProxyEngine::take_cookie(ProxyRoute *route, ProxySession *session, int upstream, uint64_t cookie, std::chrono::steady_clock::time_point now)
+{
+    bool *validated = &session->validated;
+    uint64_t *echoed = &session->cookie;
+    for (auto &path : session->paths)
+    {
+        if (path.socket == upstream)
+        {
+            validated = &path.validated;
+            echoed = &path.cookie;
+        }
+    }
+    if (*validated)
+    {
+        return;
+    }
+    if (cookie == *echoed)
+    {
+        if (upstream == session->upstream)
+        {
+            this->release_held(route, session, now);
+        }
+        else
+        {
+            *validated = true;
+        }
+        return;
+    }
+    *echoed = cookie;
+    char frame[TUNNEL_HANDSHAKE_SIZE];
+    tunnel_write_handshake(frame, TUNNEL_HELLO, session->tunnel_session, cookie);
+    this->send_to_server(route, upstream, frame, TUNNEL_HANDSHAKE_SIZE, now);
+}
+
+void ProxyEngine::release_held(ProxyRoute *route, ProxySession *session, std::chrono::steady_clock::time_point now)
+{
+    session->validated = true;
+    std::vector<std::vector<char>> held = std::move(session->held);
+    session->held.clear();
+    for (const auto &frame : held)
+    {
+        this->send_to_peer(route, session, frame.data(), (int)frame.size(), now);
+    }
+}
+
+void ProxyEngine::close_session(ProxyRoute *route, ProxySession *session)
+{
+    LOG(LOG_LEVEL_INFO, "Proxy {}: Client {} has been disconnected.", route->listen_port, session->client);
+    if (session->dropped_packets > 0)
+    {
+        LOG(LOG_LEVEL_INFO, "Proxy {}: {} packets ({} bytes) of that client were over the rate limit.",
+            route->listen_port, session->dropped_packets, session->dropped_bytes);
+    }
+#ifdef PROXY_WITH_XDP
+    this->leave_fast_path(session);
+#endif
+    for (auto &pending : route->timestamps.pending)
+    {
+        if (pending.session == session)
+        {
+            pending.used = false;
+        }
+    }
+    this->delayed.cancel(session->upstream);
+    this->egress.cancel(session->upstream);
+    close_socket(session->upstream);
+    for (const auto &path : session->paths)
+    {
+        if (path.socket >= 0)
+        {
+            this->delayed.cancel(path.socket);
+            this->egress.cancel(path.socket);
+            close_socket(path.socket);
+        }
+        else
+        {
+            route->tunnel_paths.erase(path.address);
+        }
+    }
+    if (route->tunnel == TUNNEL_EXIT)
+    {
+        route->tunnel_sessions.erase(session->tunnel_session);
+    }
+    if (session->bundle_listed)
+    {
+        this->bundles.erase(std::find(this->bundles.begin(), this->bundles.end(), std::make_pair(route, session)));
+    }
+    if (!session->confirmed)
+    {
+        route->unconfirmed--;
+    }
+    sockaddr_storage client = session->client;
+    route->sessions.erase(client);
+    this->closed_sessions++;
+}
+
+// Connection ids are chosen by the server and only sent to the client's address, a
+// spoofer never sees them. Servers using zero-length ids leave the session unconfirmed.
+void ProxyEngine::learn_server_cid(ProxySession *session, const char *datagram, int size, const QuicHeader &header)
+{
+    if ((header.kind != QUIC_INITIAL && header.kind != QUIC_HANDSHAKE && header.kind != QUIC_RETRY) || header.scid_length == 0 ||
+        7 + header.dcid_length + header.scid_length > size)
+    {
+        return;
+    }
+    memcpy(session->server_cid, datagram + 7 + header.dcid_length, header.scid_length);
+    session->server_cid_length = header.scid_length;
+}
+
+// A Handshake or 1-RTT packet sent to the server's connection id proves the client
+// received the server's reply.
+void ProxyEngine::confirm_session(ProxyRoute *route, ProxySession *session, const char *datagram, int size, const QuicHeader &header)
+{
+    int length = session->server_cid_length;
+    bool confirms = false;
+    if (length > 0 && header.kind == QUIC_HANDSHAKE)
+    {
+        confirms = header.dcid_length == length && memcmp(datagram + 6, session->server_cid, length) == 0;
+    }
+    else if (length > 0 && header.kind == QUIC_ONE_RTT)
+    {
+        // Short headers don't carry the length, the client uses the one the server picked.
+        confirms = size > 1 + length && memcmp(datagram + 1, session->server_cid, length) == 0;
+    }
+    if (confirms)
+    {
+        session->confirmed = true;
+        route->unconfirmed--;
+    }
+}
+
+// Drops the entries of sessions confirmed or closed since they were queued.
+ProxySession *ProxyEngine::oldest_unconfirmed(ProxyRoute *route)
+{
+    if (route->unconfirmed == 0)
+    {
+        route->unconfirmed_order.clear();
+        return nullptr;
+    }
+    while (!route->unconfirmed_order.empty())
+    {
+        const auto &oldest = route->unconfirmed_order.front();
+        auto it = route->sessions.find(oldest.first);
+        if (it != route->sessions.end() && !it->second.confirmed && it->second.opened == oldest.second)
+        {
+            return &it->second;
+        }
+        route->unconfirmed_order.pop_front();
+    }
+    return nullptr;
+}
+
+// Reads what's waiting on a socket, up to a batch, and tags the QUIC headers of all of
+// it at once. A datagram larger than the slots is cut, it's dropped and counted in
+// oversize and the slots grow to fit the next one. Returns the number of datagrams read.
+int ProxyEngine::receive_batch(int s, ReceivedDatagram *batch, bool addressed, uint32_t *kernel_drops, uint64_t *oversize, bool timestamps, bool quic, int *burst)
+{
+    int count = 0;
+    for (int i = 0; i < ENGINE_BATCH_SIZE; i++)
+    {
+        ReceivedDatagram *datagram = &batch[count];
+        datagram->from_len = sizeof(datagram->from);
+        datagram->arrival = {};
+        int n = receive_datagram(s, datagram->data, this->buffer_size, addressed ? &datagram->from : nullptr, addressed ? &datagram->from_len : nullptr,
+                                 kernel_drops, timestamps ? &datagram->arrival : nullptr);
+        if (n < 0)
+        {
+            if (socket_would_block())
+            {
+                break;
+            }
+            // ICMP errors from clients that went away, nothing to read.
+            continue;
+        }
+        if (n > this->buffer_size)
+        {
+            (*oversize)++;
+            int wanted = this->buffer_size;
+            while (wanted < n && wanted < PROXY_MAX_DATAGRAM)
+            {
+                wanted *= 2;
+            }
+            this->wanted_buffer_size = std::max(this->wanted_buffer_size, wanted);
+            continue;
+        }
+        datagram->size = n;
+        *burst += n;
+        count++;
+    }
+
+    const uint8_t *data[ENGINE_BATCH_SIZE];
+    int sizes[ENGINE_BATCH_SIZE];
+    QuicHeader headers[ENGINE_BATCH_SIZE];
+    for (int i = 0; i < count; i++)
+    {
+        data[i] = (const uint8_t *)batch[i].data;
+        sizes[i] = quic ? batch[i].size : 0;
+    }
+    quic_classify_batch(data, sizes, count, headers);
+    for (int i = 0; i < count; i++)
+    {
+        batch[i].header = headers[i];
+    }
+    return count;
+}
+
+void ProxyEngine::forward_from_clients(ProxyRoute *route, ReceivedDatagram *batch)
+{
+    int burst = 0;
+    int count = this->receive_batch(route->listen_socket, batch, true, &route->counters.kernel_drops, &route->oversize, route->timestamps.enabled,
+                                    route->tunnel != TUNNEL_EXIT, &burst);
+    auto now = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+    {
+        const ReceivedDatagram &datagram = batch[i];
+        char *buffer = datagram.data;
+        int n = datagram.size;
+        if (route->tunnel == TUNNEL_EXIT && this->answer_hello(route, datagram.from, datagram.from_len, buffer, n, now))
+        {
+            continue;
+        }
+        ProxySession *session = this->find_session(route, datagram.from, datagram.from_len, buffer, n, datagram.header, false);
+        if (session == nullptr)
+        {
+            continue;
+        }
+
+        session->last_activity = now;
+        if (!session->confirmed)
+        {
+            this->confirm_session(route, session, buffer, n, datagram.header);
+        }
+        // Both limiters have to agree before either is charged, a datagram dropped by the
+        // global limit doesn't eat into the client's own budget.
+        if (!rate_limiter_check(&session->limiter, n, now) || !rate_limiter_check(&this->global_limiter, n, now))
+        {
+            session->dropped_packets++;
+            session->dropped_bytes += n;
+            continue;
+        }
+        rate_limiter_consume(&session->limiter, n);
+        rate_limiter_consume(&this->global_limiter, n);
+        if (route->tunnel == TUNNEL_NONE)
+        {
+            bool ok = this->send_to_server(route, session->upstream, buffer, n, now);
+            this->sent(session->upstream, &session->timestamps, ok, session, datagram.arrival);
+            continue;
+        }
+        if (route->tunnel == TUNNEL_ENTRY && n > TUNNEL_MAX_PAYLOAD)
+        {
+            route->oversize++;
+            continue;
+        }
+        SessionSink sink(this, route, session, now);
+        if (route->tunnel == TUNNEL_ENTRY)
+        {
+            session->tunnel->send(buffer, n, now, &sink);
+        }
+        else
+        {
+            session->tunnel->receive(buffer, n, now, &sink);
+        }
+        this->track_bundle(route, session);
+    }
+    this->size_receive_buffer(route, route->listen_socket, &route->counters, burst);
+}
+
+void ProxyEngine::forward_from_server(ProxyRoute *route, ProxySession *session, int upstream, ReceivedDatagram *batch)
+{
+    // Path sockets have their own kernel counters, only the main upstream is tracked.
+    SocketCounters *counters = upstream == session->upstream ? &session->counters : nullptr;
+    int burst = 0;
+    int count = this->receive_batch(upstream, batch, false, counters != nullptr ? &counters->kernel_drops : nullptr, &route->oversize,
+                                    session->timestamps.enabled, route->tunnel != TUNNEL_ENTRY, &burst);
+    auto now = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; i++)
+    {
+        const ReceivedDatagram &datagram = batch[i];
+        char *buffer = datagram.data;
+        int n = datagram.size;
+        session->replied = true;
+        if (route->tunnel == TUNNEL_NONE)
+        {
+            if (!session->confirmed)
+            {
+                this->learn_server_cid(session, buffer, n, datagram.header);
+            }
+            bool ok = this->send_to_client(route, &session->client, session->client_len, buffer, n, now);
+            this->sent(route->listen_socket, &route->timestamps, ok, session, datagram.arrival);
+            continue;
+        }
+        int type;
+        uint32_t tunnel_session;
+        uint64_t cookie;
+        if (route->tunnel == TUNNEL_ENTRY && tunnel_read_handshake(buffer, n, &type, &tunnel_session, &cookie))
+        {
+            if (type == TUNNEL_COOKIE && tunnel_session == session->tunnel_session)
+            {
+                this->take_cookie(route, session, upstream, cookie, now);
+            }
+            continue;
+        }
+        if (route->tunnel == TUNNEL_EXIT && n > TUNNEL_MAX_PAYLOAD)
+        {
+            route->oversize++;
+            continue;
+        }
+        SessionSink sink(this, route, session, now);
+        if (route->tunnel == TUNNEL_ENTRY)
+        {
+            session->tunnel->receive(buffer, n, now, &sink);
+        }
+        else
+        {
+            session->tunnel->send(buffer, n, now, &sink);
+        }
+        this->track_bundle(route, session);
+    }
+    if (counters != nullptr)
+    {
+        this->size_receive_buffer(route, upstream, counters, burst);
+    }
+#ifdef PROXY_WITH_XDP
+    // After a reply went through the kernel, which resolved the client's MAC on the way.
+    this->try_fast_path(route, session, now);
+#endif
+}
+
+// True when the datagram went straight to the kernel. When the socket is full it waits
+// in the egress queues instead, only dropped once its client's queue is full.
+bool ProxyEngine::send_to_server(ProxyRoute *route, int upstream, const char *data, int size, std::chrono::steady_clock::time_point now)
+{
+    if (this->impaired)
+    {
+        this->impairment.send(&this->delayed, this->active_upstream_impairment, now, upstream, nullptr, 0, data, size);
+        return false;
+    }
+    int result = this->egress.send(upstream, nullptr, 0, data, size, monotonic_ns(now), this->pace_bytes_per_second);
+    if (result == EGRESS_DROPPED)
+    {
+        route->send_failures++;
+    }
+    else if (result == EGRESS_FAILED && datagram_too_big())
+    {
+        this->too_big(route, upstream, size);
+    }
+    else if (result == EGRESS_FAILED)
+    {
+#ifdef _WIN32
+        LOG(LOG_LEVEL_ERROR, "Proxy {}: Failed to send to server: {}", route->listen_port, WSAGetLastError());
+#else
+        LOG(LOG_LEVEL_ERROR, "Proxy {}: Failed to send to server: {}", route->listen_port, strerror(errno));
+#endif
+    }
+    return result == EGRESS_SENT;
+}
+
+bool ProxyEngine::send_to_client(ProxyRoute *route, const sockaddr_storage *client, socklen_t client_len, const char *data, int size, std::chrono::steady_clock::time_point now)
+{
+    if (this->impaired)
+    {
+        this->impairment.send(&this->delayed, this->active_downstream_impairment, now, route->listen_socket,
+                              (const sockaddr *)client, client_len, data, size);
+        return false;
+    }
+    int result = this->egress.send(route->listen_socket, (const sockaddr *)client, client_len, data, size, monotonic_ns(now), this->pace_bytes_per_second);
+    if (result == EGRESS_DROPPED)
+    {
+        route->send_failures++;
+    }
+    else if (result == EGRESS_FAILED && datagram_too_big())
+    {
+        this->too_big(route, route->listen_socket, size);
+    }
+    else if (result == EGRESS_FAILED)
+    {
+#ifdef _WIN32
+        LOG(LOG_LEVEL_ERROR, "Proxy {}: Failed to send to client {}: {}", route->listen_port, *client, WSAGetLastError());
+#else
+        LOG(LOG_LEVEL_ERROR, "Proxy {}: Failed to send to client {}: {}", route->listen_port, *client, strerror(errno));
+#endif
+    }
+    return result == EGRESS_SENT;
+}
+
+// The kernel refused a datagram above the path MTU of s, Don't Fragment is set. The
+// endpoint's own MTU discovery sees it lost, the session notes the MTU for the status.
+void ProxyEngine::too_big(ProxyRoute *route, int s, int size)
+{
+    route->oversize++;
+    if (s == route->listen_socket)
+    {
+        return;
+    }
+    int mtu = path_mtu(s);
+    for (auto &entry : route->sessions)
+    {
+        ProxySession &session = entry.second;
+        if (session.upstream == s && session.path_mtu != mtu)
+        {
+            LOG(LOG_LEVEL_INFO, "Proxy {}: Path MTU to the server of {} is {} bytes, a {} bytes datagram didn't fit.",
+                route->listen_port, session.client, mtu, size);
+            session.path_mtu = mtu;
+        }
+    }
+}
+
+// Tunnel frames go over every path of the session, the other proxy drops the copies.
+void ProxyEngine::send_to_peer(ProxyRoute *route, ProxySession *session, const char *data, int size, std::chrono::steady_clock::time_point now)
+{
+    if (route->tunnel == TUNNEL_ENTRY)
+    {
+        if (!session->validated)
+        {
+            if (session->held.size() < TUNNEL_HELD_FRAMES)
+            {
+                session->held.emplace_back(data, data + size);
+            }
+            return;
+        }
+        this->send_to_server(route, session->upstream, data, size, now);
+        for (const auto &path : session->paths)
+        {
+            this->send_to_server(route, path.socket, data, size, now);
+        }
+    }
+    else
+    {
+        this->send_to_client(route, &session->client, session->client_len, data, size, now);
+        for (const auto &path : session->paths)
+        {
+            this->send_to_client(route, &path.address, path.address_len, data, size, now);
+        }
+    }
+}
+
+// Parity of groups that stopped filling up and loss reports are sent from here.
+void ProxyEngine::tick_tunnels(std::chrono::steady_clock::time_point now)
+{
+    for (auto &entry : this->routes)
+    {
+        ProxyRoute *route = entry.second.get();
+        if (route->tunnel == TUNNEL_NONE)
+        {
+            continue;
+        }
+        for (auto &session : route->sessions)
+        {
+            if (route->tunnel == TUNNEL_ENTRY && session.second.hellos < TUNNEL_HELLO_ATTEMPTS &&
+                now - session.second.hello_sent >= std::chrono::milliseconds(TUNNEL_HELLO_RETRY_MS))
+            {
+                this->send_hellos(route, &session.second, now);
+            }
+            else if (!session.second.validated && session.second.hellos == TUNNEL_HELLO_ATTEMPTS &&
+                     now - session.second.hello_sent >= std::chrono::milliseconds(TUNNEL_HELLO_RETRY_MS))
+            {
+                // An exit from before cookies, it takes frames without them.
+                this->release_held(route, &session.second, now);
+            }
+            SessionSink sink(this, route, &session.second, now);
+            session.second.tunnel->tick(now, &sink);
+            this->track_bundle(route, &session.second);
+        }
+    }
+}
+
+void ProxyEngine::track_bundle(ProxyRoute *route, ProxySession *session)
+{
+    if (!session->bundle_listed && session->tunnel->bundle_pending())
+    {
+        session->bundle_listed = true;
+        this->bundles.push_back({route, session});
+    }
+}
+
+void ProxyEngine::flush_bundles(std::chrono::steady_clock::time_point now)
+{
+    auto delay = std::chrono::microseconds(this->bundle_delay_us.load());
+    for (size_t i = 0; i < this->bundles.size();)
+    {
+        ProxyRoute *route = this->bundles[i].first;
+        ProxySession *session = this->bundles[i].second;
+        if (now - session->tunnel->bundle_since() < delay)
+        {
+            i++;
+            continue;
+        }
+        SessionSink sink(this, route, session, now);
+        session->tunnel->flush_bundle(&sink);
+        session->bundle_listed = false;
+        this->bundles[i] = this->bundles.back();
+        this->bundles.pop_back();
+    }
+}
+
+// Moves the sessions of unhealthy backends to a healthy one, the clients keep talking
+// to the same proxy address so they never notice.
+void ProxyEngine::check_backends(ProxyRoute *route)
+{
+    if (!route->backends || route->backends->generation() == route->backend_generation)
+    {
+        return;
+    }
+    route->backend_generation = route->backends->generation();
+
+    for (auto &entry : route->sessions)
+    {
+        ProxySession &session = entry.second;
+        if (route->backends->is_healthy(session.backend))
+        {
+            continue;
+        }
+        sockaddr_storage address;
+        socklen_t address_len;
+        int picked = route->backends->pick(&address, &address_len);
+        if (picked == -1)
+        {
+            LOG(LOG_LEVEL_WARNING, "Proxy {}: No healthy backend available, keeping backend {}.", route->listen_port, session.backend);
+            continue;
+        }
+        if (::connect(session.upstream, (sockaddr *)&address, address_len) < 0)
+        {
+            LOG(LOG_LEVEL_WARNING, "Proxy {}: Couldn't switch to backend {}.", route->listen_port, picked);
+            continue;
+        }
+        session.backend = picked;
+        for (const auto &path : session.paths)
+        {
+            if (path.socket >= 0)
+            {
+                ::connect(path.socket, (sockaddr *)&address, address_len);
+            }
+        }
+        LOG(LOG_LEVEL_INFO, "Proxy {}: Client {} moved to backend {}.", route->listen_port, session.client, picked);
+    }
+}
+
+bool ProxyEngine::expire_sessions(std::chrono::steady_clock::time_point now)
+{
+    bool expired = false;
+    for (auto &entry : this->routes)
+    {
+        ProxyRoute *route = entry.second.get();
+        for (auto it = route->sessions.begin(); it != route->sessions.end();)
+        {
+            ProxySession *session = &it->second;
+            ++it;
+#ifdef PROXY_WITH_XDP
+            // The socket engine doesn't see the traffic of fast path sessions.
+            XdpEngine *fast_path = this->fast_path;
+            if (session->fast_path && (fast_path->seen_within(session->fast_path_keys[0], std::chrono::milliseconds(PROXY_SESSION_TIMEOUT_MS)) ||
+                                       fast_path->seen_within(session->fast_path_keys[1], std::chrono::milliseconds(PROXY_SESSION_TIMEOUT_MS))))
+            {
+                session->last_activity = now;
+            }
+#endif
+            int timeout_ms = session->confirmed ? PROXY_SESSION_TIMEOUT_MS : ENGINE_UNCONFIRMED_TIMEOUT_MS;
+            if (now - session->last_activity >= std::chrono::milliseconds(timeout_ms))
+            {
+                this->close_session(route, session);
+                expired = true;
+            }
+        }
+        this->oldest_unconfirmed(route);
+    }
+    return expired;
+}
+
+#ifdef PROXY_WITH_XDP
+void ProxyEngine::set_fast_path(XdpEngine *fast_path)
+{
+    this->fast_path = fast_path;
+}
+
+// Plain IPv4 sessions go to the XDP fast path once confirmed and the next hops towards
+// both ends are known. Replies leave from the address the proxy reaches the server
+// with, so clients have to reach the proxy on that same address (a one-armed relay).
+void ProxyEngine::try_fast_path(ProxyRoute *route, ProxySession *session, std::chrono::steady_clock::time_point now)
+{
+    XdpEngine *fast_path = this->fast_path;
+    if (fast_path == nullptr || session->fast_path || !session->confirmed || route->tunnel != TUNNEL_NONE || this->impaired ||
+        rate_limit_enabled(this->active_session_limit) || this->global_limiter.packets.rate > 0 || this->global_limiter.bytes.rate > 0 ||
+        session->client.ss_family != AF_INET || now - session->fast_path_tried < std::chrono::milliseconds(ENGINE_FAST_PATH_RETRY_MS))
+    {
+        return;
+    }
+    session->fast_path_tried = now;
+
+    sockaddr_in local{}, server{};
+    socklen_t local_len = sizeof(local), server_len = sizeof(server);
+    if (getsockname(session->upstream, (sockaddr *)&local, &local_len) < 0 || getpeername(session->upstream, (sockaddr *)&server, &server_len) < 0 ||
+        server.sin_family != AF_INET)
+    {
+        return;
+    }
+    const sockaddr_in *client = (const sockaddr_in *)&session->client;
+    XdpRewrite to_server{}, to_client{};
+    if (!fast_path->resolve_next_hop(server.sin_addr.s_addr, to_server.next_hop) ||
+        !fast_path->resolve_next_hop(client->sin_addr.s_addr, to_client.next_hop))
+    {
+        return;
+    }
+    to_server.saddr = local.sin_addr.s_addr;
+    to_server.daddr = server.sin_addr.s_addr;
+    to_server.sport = local.sin_port;
+    to_server.dport = server.sin_port;
+    to_client.saddr = local.sin_addr.s_addr;
+    to_client.daddr = client->sin_addr.s_addr;
+    to_client.sport = htons(route->listen_port);
+    to_client.dport = client->sin_port;
+
+    session->fast_path_keys[0] = {client->sin_addr.s_addr, client->sin_port, htons(route->listen_port)};
+    session->fast_path_keys[1] = {server.sin_addr.s_addr, server.sin_port, local.sin_port};
+    if (!fast_path->add_flow(session->fast_path_keys[0], to_server))
+    {
+        return;
+    }
+    if (!fast_path->add_flow(session->fast_path_keys[1], to_client))
+    {
+        fast_path->remove_flow(session->fast_path_keys[0]);
+        return;
+    }
+    session->fast_path = true;
+    LOG(LOG_LEVEL_INFO, "Proxy {}: Client {} moved to the XDP fast path.", route->listen_port, session->client);
+}
+
+void ProxyEngine::leave_fast_path(ProxySession *session)
+{
+    if (session->fast_path)
+    {
+        XdpEngine *fast_path = this->fast_path;
+        fast_path->remove_flow(session->fast_path_keys[0]);
+        fast_path->remove_flow(session->fast_path_keys[1]);
+        session->fast_path = false;
+    }
+}
+
+// Limits and impairment only exist in the socket engine, every session goes back to it.
+void ProxyEngine::leave_fast_paths()
+{
+    for (auto &entry : this->routes)
+    {
+        for (auto &session : entry.second->sessions)
+        {
+            this->leave_fast_path(&session.second);
+        }
+    }
+}
+#endif
+
+void ProxyEngine::run()
+{
+    std::vector<char> buffers(ENGINE_BATCH_SIZE * ENGINE_BUFFER_SIZE);
+    std::vector<ReceivedDatagram> batch(ENGINE_BATCH_SIZE);
+    for (int i = 0; i < ENGINE_BATCH_SIZE; i++)
+    {
+        batch[i].data = &buffers[i * ENGINE_BUFFER_SIZE];
+    }
+    std::vector<pollfd> fds;
+    std::vector<std::pair<ProxyRoute *, ProxySession *>> owners;
+    bool dirty = true;
+    auto last_expiration = std::chrono::steady_clock::now();
+    auto last_tunnel_tick = last_expiration;
+    bool tunnels = false;
+    auto last_traffic = last_expiration;
+    double traffic_gap_us = 0; // Running average of the time between two polls with datagrams.
+    bool writable_wanted = false;
+
+    while (this->running)
+    {
+        if (this->wanted_buffer_size > this->buffer_size)
+        {
+            // Nothing points into the slots between two passes.
+            this->buffer_size = this->wanted_buffer_size;
+            buffers.resize((size_t)ENGINE_BATCH_SIZE * this->buffer_size);
+            for (int i = 0; i < ENGINE_BATCH_SIZE; i++)
+            {
+                batch[i].data = &buffers[(size_t)i * this->buffer_size];
+            }
+            LOG(LOG_LEVEL_INFO, "Engine: Receive buffers grown to {} bytes for larger datagrams.", this->buffer_size);
+        }
+        bool pending;
+        bool limits_changed;
+        bool impairment_changed;
+        bool paths_changed;
+        bool low_latency_changed;
+        bool filter_changed;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            pending = !this->added.empty() || !this->removed.empty() || this->export_requested;
+            limits_changed = this->limits_changed;
+            impairment_changed = this->impairment_changed;
+            paths_changed = this->paths_changed;
+            low_latency_changed = this->low_latency_changed;
+            filter_changed = this->filter_changed;
+        }
+        if (pending)
+        {
+            this->apply_changes();
+            dirty = true;
+        }
+        if (limits_changed)
+        {
+            this->apply_limits();
+        }
+        if (impairment_changed)
+        {
+            this->apply_impairment();
+        }
+        if (paths_changed)
+        {
+            this->apply_paths();
+        }
+        if (low_latency_changed)
+        {
+            this->apply_low_latency();
+        }
+        if (filter_changed)
+        {
+            this->apply_client_filter();
+            dirty = true;
+        }
+
+        if (dirty)
+        {
+            this->publish_status();
+            fds.clear();
+            owners.clear();
+            fds.push_back({(socket_t)this->wake_socket, POLLIN, 0});
+            owners.push_back({nullptr, nullptr});
+            tunnels = false;
+            for (auto &entry : this->routes)
+            {
+                ProxyRoute *route = entry.second.get();
+                tunnels = tunnels || route->tunnel != TUNNEL_NONE;
+                fds.push_back({(socket_t)route->listen_socket, POLLIN, 0});
+                owners.push_back({route, nullptr});
+                for (auto &session : route->sessions)
+                {
+                    fds.push_back({(socket_t)session.second.upstream, POLLIN, 0});
+                    owners.push_back({route, &session.second});
+                    for (const auto &path : session.second.paths)
+                    {
+                        if (path.socket >= 0)
+                        {
+                            fds.push_back({(socket_t)path.socket, POLLIN, 0});
+                            owners.push_back({route, &session.second});
+                        }
+                    }
+                }
+            }
+            dirty = false;
+        }
+
+        if (writable_wanted || this->egress.backlogged())
+        {
+            // Full sockets wait for POLLOUT to send what queued up behind them.
+            writable_wanted = this->egress.backlogged();
+            for (size_t i = 1; i < fds.size(); i++)
+            {
+                fds[i].events = writable_wanted && this->egress.backlogged((int)fds[i].fd) ? POLLIN | POLLOUT : POLLIN;
+            }
+        }
+
+        int timeout = this->delayed.next_timeout_ms(std::chrono::steady_clock::now(), tunnels ? TUNNEL_TICK_MS : ENGINE_POLL_TIMEOUT_MS);
+        int spin_us = this->active_low_latency.spin_us;
+        auto polled = std::chrono::steady_clock::now();
+        if (!this->bundles.empty() ||
+            (spin_us > 0 && traffic_gap_us < spin_us && polled - last_traffic < std::chrono::microseconds(spin_us)))
+        {
+            timeout = 0;
+        }
+        int ready = poll_sockets(fds.data(), fds.size(), timeout);
+        if (spin_us > 0 && ready > (fds[0].revents & POLLIN ? 1 : 0))
+        {
+            // Long idle periods are capped so the average comes back down after a few datagrams.
+            auto arrived = std::chrono::steady_clock::now();
+            double gap_us = std::min(std::chrono::duration<double, std::micro>(arrived - last_traffic).count(), 4.0 * spin_us);
+            traffic_gap_us += (gap_us - traffic_gap_us) / ENGINE_GAP_SMOOTHING;
+            last_traffic = arrived;
+        }
+        if (ready > 0)
+        {
+            if (fds[0].revents & POLLIN)
+            {
+                while (recv(this->wake_socket, batch[0].data, ENGINE_BUFFER_SIZE, 0) >= 0)
+                {
+                }
+            }
+            for (size_t i = 1; i < fds.size(); i++)
+            {
+                ProxyRoute *route = owners[i].first;
+                if (fds[i].revents & POLLOUT)
+                {
+                    this->grow_send_buffer((int)fds[i].fd);
+                    this->egress.drain((int)fds[i].fd, monotonic_ns(std::chrono::steady_clock::now()), this->pace_bytes_per_second, &route->send_failures);
+                }
+                if (!(fds[i].revents & (POLLIN | POLLERR)))
+                {
+                    continue;
+                }
+                if (fds[i].revents & POLLERR)
+                {
+                    // Transmit timestamps wait on the error queue, poll keeps reporting them until read.
+                    ProxySession *owner = owners[i].second;
+                    if (owner == nullptr && route->timestamps.enabled)
+                    {
+                        this->read_timestamps(route->listen_socket, &route->timestamps);
+                    }
+                    else if (owner != nullptr && owner->timestamps.enabled && (int)fds[i].fd == owner->upstream)
+                    {
+                        this->read_timestamps(owner->upstream, &owner->timestamps);
+                    }
+                }
+                if (owners[i].second == nullptr)
+                {
+                    size_t sessions = route->sessions.size();
+                    uint64_t closed = this->closed_sessions;
+                    this->forward_from_clients(route, batch.data());
+                    dirty = dirty || sessions != route->sessions.size();
+                    if (closed != this->closed_sessions)
+                    {
+                        // A new client replaced a session, the rest of the poll list may
+                        // still point at it. What's left is read after the next poll.
+                        dirty = true;
+                        break;
+                    }
+                }
+                else
+                {
+                    this->forward_from_server(route, owners[i].second, (int)fds[i].fd, batch.data());
+                }
+            }
+        }
+
+        for (auto &entry : this->routes)
+        {
+            this->check_backends(entry.second.get());
+        }
+
+        auto now = std::chrono::steady_clock::now();
+        this->delayed.flush(now);
+        if (tunnels && now - last_tunnel_tick >= std::chrono::milliseconds(TUNNEL_TICK_MS))
+        {
+            last_tunnel_tick = now;
+            this->tick_tunnels(now);
+        }
+        this->flush_bundles(now);
+        if (now - last_expiration >= std::chrono::seconds(1))
+        {
+            last_expiration = now;
+            dirty = this->expire_sessions(now) || dirty;
+            this->egress.expire(monotonic_ns(now));
+            if (!dirty)
+            {
+                // Drop counters only change the published status, not the poll list.
+                this->publish_status();
+            }
+        }
+    }
+
+    for (auto &entry : this->routes)
+    {
+        ProxyRoute *route = entry.second.get();
+        while (!route->sessions.empty())
+        {
+            this->close_session(route, &route->sessions.begin()->second);
+        }
+        close_socket(route->listen_socket);
+    }
+    this->routes.clear();
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->status.clear();
+        this->added.clear();
+    }
+    this->changed.notify_all();
+}
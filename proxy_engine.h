@@ -0,0 +1,318 @@
+#ifndef PROXY_ENGINE_H
+#define PROXY_ENGINE_H
+
+#include "proxy_common.h"
+#include "address_cookie.h"
+#include "backend_pool.h"
+#include "client_filter.h"
+#include "egress_scheduler.h"
+#include "handoff.h"
+#include "impairment.h"
+#include "latency_histogram.h"
+#include "quic_header.h"
+#include "rate_limiter.h"
+#include "tunnel.h"
+#include "xdp_engine.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#define ENGINE_BUFFER_SIZE 2048         // First size of the receive slots, they grow up to PROXY_MAX_DATAGRAM when a datagram doesn't fit.
+#define ENGINE_BATCH_SIZE 64            // Datagrams read from one socket before looking at the others.
+#define ENGINE_POLL_TIMEOUT_MS 1000     // Upper bound between two housekeeping passes.
+#define PROXY_SESSION_TIMEOUT_MS 10000  // A client silent for this long is disconnected.
+#define ENGINE_FAST_PATH_RETRY_MS 100   // Between two tries to hand a session to the XDP fast path.
+#define ENGINE_GAP_SMOOTHING 8          // Weight of the running average of the time between datagrams.
+#define ENGINE_MAX_SOCKET_BUFFER (8 * 1024 * 1024) // Automatic SO_RCVBUF / SO_SNDBUF sizing stops here.
+#define ENGINE_TIMESTAMP_PENDING 64     // Sent datagrams per socket waiting for their transmit timestamp.
+#define ENGINE_MAX_UNCONFIRMED 64       // Sessions of a route still unconfirmed when validating clients, a new client replaces the oldest.
+#define ENGINE_UNCONFIRMED_TIMEOUT_MS 3000 // An unconfirmed session is closed after this long without traffic.
+
+// Another way to the proxy at the other end of a tunnel: an upstream socket bound to
+// another local address on entries, another source address of the session on exits.
+typedef struct
+{
+    int socket;
+    sockaddr_storage address;
+    socklen_t address_len;
+    bool validated; // Entries: the exit acknowledged the cookie echoed on this path.
+    uint64_t cookie;
+} TunnelPath;
+
+// Receive side of a socket as the kernel sees it, drives the automatic buffer sizing.
+typedef struct
+{
+    uint32_t kernel_drops; // SO_RXQ_OVFL, datagrams dropped because the receive buffer was full.
+    uint32_t sized_drops;  // kernel_drops when the buffer was last sized.
+    int receive_buffer;    // SO_RCVBUF as reported by the kernel.
+    int peak_burst;        // Most bytes read in one pass.
+    bool capped;           // The kernel refused to grow the buffer further.
+} SocketCounters;
+
+struct ProxySession;
+
+typedef struct
+{
+    uint32_t id; // Number the kernel gives the send.
+    bool used;
+    KernelTimestamp arrival; // Of the datagram this send forwards.
+    ProxySession *session;
+} PendingSend;
+
+// Matches the transmit timestamps of a socket with the arrival of what it forwarded.
+typedef struct
+{
+    bool enabled;
+    bool stale;       // Sends happened that weren't counted, numbering restarts before the next one.
+    uint32_t next_id;
+    PendingSend pending[ENGINE_TIMESTAMP_PENDING];
+} TransmitTimestamps;
+
+// One datagram of a receive batch, its header is parsed once for every later stage.
+typedef struct
+{
+    char *data; // ProxyEngine::buffer_size bytes.
+    int size;
+    sockaddr_storage from; // Only for listening sockets.
+    socklen_t from_len;
+    KernelTimestamp arrival;
+    QuicHeader header; // QUIC_NOT_QUIC where the payload is tunnel frames.
+} ReceivedDatagram;
+
+typedef struct
+{
+    int busy_poll_us; // SO_BUSY_POLL of every socket, 0 leaves the kernel default.
+    int spin_us;      // The engine polls without sleeping this long after a datagram, 0 always sleeps.
+    int cpu;          // Engine thread pinned to this CPU, -1 leaves it to the scheduler.
+    bool realtime;    // Real-time priority for the engine thread.
+} LowLatencyConfig;
+
+struct ProxySession
+{
+    sockaddr_storage client;
+    socklen_t client_len;
+    int upstream; // Connected to the backend, one per client so the server can tell them apart.
+    int backend;
+    std::chrono::steady_clock::time_point last_activity;
+    RateLimiter limiter; // Client to server traffic of this session.
+    uint64_t dropped_packets;
+    uint64_t dropped_bytes;
+    std::unique_ptr<Tunnel> tunnel; // Only on tunnel routes, faces the upstream on entries and the client on exits.
+    uint32_t tunnel_session;
+    std::vector<TunnelPath> paths; // Every frame to the other proxy is copied on each of them.
+    bool validated;                // Entries: the exit acknowledged the cookie, frames stop being held.
+    uint64_t cookie;               // Entries: last cookie the exit sent, echoed in the hellos.
+    int hellos;
+    std::chrono::steady_clock::time_point hello_sent;
+    std::vector<std::vector<char>> held; // Entries: frames waiting for the cookie.
+    bool replied;                  // The server sent something back.
+    bool confirmed;                // The client sent a Handshake or 1-RTT packet to server_cid, it receives at its address.
+    uint8_t server_cid[QUIC_MAX_CID_LENGTH]; // Source id of the server's last Initial, Handshake or Retry while unconfirmed.
+    uint8_t server_cid_length;
+    std::chrono::steady_clock::time_point opened;
+    bool bundle_listed;            // In ProxyEngine::bundles.
+    SocketCounters counters;       // Of upstream.
+    TransmitTimestamps timestamps; // Of upstream.
+    LatencyHistogram residency;    // Kernel arrival to kernel departure of every forwarded datagram.
+    int path_mtu;                  // Of upstream as the kernel last reported it, -1 when it can't tell.
+#ifdef PROXY_WITH_XDP
+    bool fast_path;                // Both directions are forwarded by the XdpEngine.
+    XdpFlowKey fast_path_keys[2];  // From the client, from the server.
+    std::chrono::steady_clock::time_point fast_path_tried;
+#endif
+};
+
+typedef struct
+{
+    int listen_socket;
+    int listen_port;
+    sockaddr_storage upstream;
+    socklen_t upstream_len;
+    int tunnel; // TUNNEL_NONE, TUNNEL_ENTRY or TUNNEL_EXIT.
+    SocketCounters counters;  // Of listen_socket.
+    TransmitTimestamps timestamps;
+    uint64_t send_failures;   // Datagrams dropped on the way out because a socket stayed full, every socket of the route.
+    uint64_t filtered;        // Datagrams from addresses the client filter rejects.
+    uint64_t unvalidated;     // Datagrams of new clients refused by client validation.
+    uint64_t oversize;        // Datagrams dropped for their size: cut on reception, above the path MTU or too big for the tunnel.
+    int unconfirmed;          // Sessions not confirmed yet.
+    std::deque<std::pair<sockaddr_storage, std::chrono::steady_clock::time_point>> unconfirmed_order; // Their clients and opening times, oldest first, stale entries included.
+    std::shared_ptr<BackendPool> backends;
+    unsigned backend_generation;
+    std::unordered_map<sockaddr_storage, ProxySession, SockaddrHash, SockaddrEqual> sessions;
+    std::unordered_map<uint32_t, ProxySession *> tunnel_sessions;                                  // Exit routes, by session id.
+    std::unordered_map<sockaddr_storage, ProxySession *, SockaddrHash, SockaddrEqual> tunnel_paths; // Exit routes, extra source addresses.
+    std::vector<HandoffSession> handed; // Sessions another process was running, opened once the route is added.
+} ProxyRoute;
+
+typedef struct
+{
+    std::string client;
+    uint64_t dropped_packets; // Datagrams over the session or global rate limit.
+    uint64_t dropped_bytes;
+    int paths; // Ways to the other proxy of a tunnel session.
+    uint32_t kernel_drops;
+    int64_t residency_p50_ns; // Time datagrams spend in the proxy, 0 without kernel timestamps.
+    int64_t residency_p99_ns;
+    int path_mtu;
+} SessionStatus;
+
+typedef struct
+{
+    int listen_socket;
+    int listen_port;
+    int state;
+    size_t sessions;
+    std::string upstream;
+    uint64_t dropped_packets; // Sum over the current sessions.
+    int tunnel;
+    uint64_t recovered;       // Datagrams rebuilt by the tunnel's parity, sum over the current sessions.
+    uint64_t duplicates;      // Tunnel frames that arrived over more than one path.
+    uint64_t kernel_drops;    // Datagrams the kernel dropped on the route's sockets, full receive buffers.
+    uint64_t send_failures;
+    uint64_t filtered;        // Datagrams from addresses the client filter rejects.
+    uint64_t unvalidated;
+    uint64_t oversize;
+    int path_mtu;             // Smallest of the sessions' upstreams, -1 when unknown.
+    int receive_buffer;       // SO_RCVBUF of the listening socket.
+    int64_t residency_p50_ns; // Over every session, plain routes on Linux only.
+    int64_t residency_p99_ns;
+    std::vector<SessionStatus> clients;
+} RouteStatus;
+
+// Forwards every route (listening socket -> upstream server) of the process from a
+// single thread. Routes are added and removed from any thread, the engine owns the
+// listening socket once a route is added and closes it when the route is removed.
+class ProxyEngine
+{
+private:
+    std::map<int, std::unique_ptr<ProxyRoute>> routes; // Only touched by the engine thread.
+    std::vector<std::unique_ptr<ProxyRoute>> added;
+    std::vector<int> removed;
+    bool export_requested = false;
+    std::vector<HandoffRoute> exported;
+    std::map<int, RouteStatus> status;
+    std::function<void()> listener;
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::atomic<bool> running{false};
+    std::thread engine_thread;
+    int wake_socket = -1;
+    sockaddr_in wake_address{};
+    RateLimit session_limit{};
+    RateLimit global_limit{};
+    bool limits_changed = false;
+    RateLimit active_session_limit{}; // Engine thread copies of the limits above.
+    RateLimiter global_limiter{};     // Shared by every session of every route.
+    ImpairmentConfig upstream_impairment{};
+    ImpairmentConfig downstream_impairment{};
+    bool impairment_changed = false;
+    ImpairmentConfig active_upstream_impairment{}; // Engine thread copies of the configs above.
+    ImpairmentConfig active_downstream_impairment{};
+    bool impaired = false;
+    std::vector<sockaddr_storage> path_addresses;
+    bool paths_changed = false;
+    std::vector<sockaddr_storage> active_path_addresses;
+    std::atomic<int> bundle_delay_us{0};
+    std::atomic<int64_t> pace_bytes_per_second{0};
+    LowLatencyConfig low_latency{0, 0, -1, false};
+    bool low_latency_changed = false;
+    LowLatencyConfig active_low_latency{0, 0, -1, false};
+    ClientFilter client_filter;
+    bool filter_changed = false;
+    ClientFilter active_client_filter;
+    std::atomic<bool> validate_clients{false};
+    CookieKey cookie_key;
+    std::vector<std::pair<ProxyRoute *, ProxySession *>> bundles; // Sessions with tunnel frames waiting to be sent together.
+    Impairment impairment;
+    DelayQueue delayed;
+    EgressScheduler egress;
+    int buffer_size = ENGINE_BUFFER_SIZE;        // Of each receive slot.
+    int wanted_buffer_size = ENGINE_BUFFER_SIZE; // Set when a datagram didn't fit, the slots grow before the next reads.
+    uint64_t closed_sessions = 0;                // Sessions closed so far, the poll list is rebuilt after any of them.
+#ifdef PROXY_WITH_XDP
+    std::atomic<XdpEngine *> fast_path{nullptr};
+#endif
+
+    void run();
+    void wake();
+    void apply_changes();
+    int queue_route(std::unique_ptr<ProxyRoute> route);
+    void hand_off_routes();
+    void apply_limits();
+    void apply_impairment();
+    void apply_paths();
+    void apply_low_latency();
+    void apply_client_filter();
+    void tune_socket(int s);
+    void watch_socket(int s, SocketCounters *counters);
+    void size_receive_buffer(ProxyRoute *route, int s, SocketCounters *counters, int burst);
+    void grow_send_buffer(int s);
+    void start_timestamps(int s, TransmitTimestamps *timestamps);
+    void sent(int s, TransmitTimestamps *timestamps, bool ok, ProxySession *session, const KernelTimestamp &arrival);
+    void read_timestamps(int s, TransmitTimestamps *timestamps);
+    void publish_status();
+    int receive_batch(int s, ReceivedDatagram *batch, bool addressed, uint32_t *kernel_drops, uint64_t *oversize, bool timestamps, bool quic, int *burst);
+    void forward_from_clients(ProxyRoute *route, ReceivedDatagram *batch);
+    void forward_from_server(ProxyRoute *route, ProxySession *session, int upstream, ReceivedDatagram *batch);
+    bool send_to_server(ProxyRoute *route, int upstream, const char *data, int size, std::chrono::steady_clock::time_point now);
+    bool send_to_client(ProxyRoute *route, const sockaddr_storage *client, socklen_t client_len, const char *data, int size, std::chrono::steady_clock::time_point now);
+    void send_to_peer(ProxyRoute *route, ProxySession *session, const char *data, int size, std::chrono::steady_clock::time_point now);
+    void too_big(ProxyRoute *route, int s, int size);
+    void tick_tunnels(std::chrono::steady_clock::time_point now);
+    void track_bundle(ProxyRoute *route, ProxySession *session);
+    void flush_bundles(std::chrono::steady_clock::time_point now);
+    ProxySession *find_session(ProxyRoute *route, const sockaddr_storage &client, socklen_t client_len, const char *datagram, int size, const QuicHeader &header, bool validated);
+    bool answer_hello(ProxyRoute *route, const sockaddr_storage &client, socklen_t client_len, const char *frame, int size, std::chrono::steady_clock::time_point now);
+    void send_hellos(ProxyRoute *route, ProxySession *session, std::chrono::steady_clock::time_point now);
+    void take_cookie(ProxyRoute *route, ProxySession *session, int upstream, uint64_t cookie, std::chrono::steady_clock::time_point now);
+    void release_held(ProxyRoute *route, ProxySession *session, std::chrono::steady_clock::time_point now);
+    ProxySession *open_session(ProxyRoute *route, const sockaddr_storage &client, socklen_t client_len, uint32_t tunnel_session);
+    ProxySession *add_session(ProxyRoute *route, const sockaddr_storage &client, socklen_t client_len, int upstream, int backend, uint32_t tunnel_session);
+    void open_paths(ProxyRoute *route, ProxySession *session, const sockaddr_storage &target, socklen_t target_len);
+    void close_session(ProxyRoute *route, ProxySession *session);
+    void learn_server_cid(ProxySession *session, const char *datagram, int size, const QuicHeader &header);
+    void confirm_session(ProxyRoute *route, ProxySession *session, const char *datagram, int size, const QuicHeader &header);
+    ProxySession *oldest_unconfirmed(ProxyRoute *route);
+    void check_backends(ProxyRoute *route);
+    friend class SessionSink;
+    bool expire_sessions(std::chrono::steady_clock::time_point now);
+#ifdef PROXY_WITH_XDP
+    void try_fast_path(ProxyRoute *route, ProxySession *session, std::chrono::steady_clock::time_point now);
+    void leave_fast_path(ProxySession *session);
+    void leave_fast_paths();
+#endif
+
+public:
+    ProxyEngine();
+    ~ProxyEngine();
+    int add_route(int listen_socket, const sockaddr *upstream, socklen_t upstream_len, std::shared_ptr<BackendPool> backends, int tunnel);
+    int remove_route(int listen_socket);
+    // Detaches every route without closing its sockets, for the process taking over.
+    // Plain routes keep their sessions, tunnel routes close theirs.
+    int export_routes(std::vector<HandoffRoute> *routes);
+    // add_route() for a route exported by another process, its clients keep going.
+    int adopt_route(const HandoffRoute &route, std::shared_ptr<BackendPool> backends);
+    int get_route_state(int listen_socket);
+    std::vector<RouteStatus> get_routes();
+    void set_listener(std::function<void()> listener);
+    void set_rate_limits(RateLimit session_limit, RateLimit global_limit);
+    void set_impairment(ImpairmentConfig upstream, ImpairmentConfig downstream);
+    void set_tunnel_paths(std::vector<sockaddr_storage> local_addresses);
+    void set_bundle_delay(int microseconds);
+    void set_pacing(int64_t bytes_per_second);
+    void set_low_latency(LowLatencyConfig config);
+    void set_client_filter(ClientFilter filter);
+    void set_client_validation(bool enabled);
+#ifdef PROXY_WITH_XDP
+    // Hands established plain sessions to an opened XdpEngine, set before adding routes.
+    void set_fast_path(XdpEngine *fast_path);
+#endif
+};
+
+#endif
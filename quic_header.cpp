@@ -0,0 +1,256 @@
+#include "quic_header.h"
+#include <cstring>
+#include <random>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define QUIC_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#define QUIC_NEON
+#include <arm_neon.h>
+#endif
+
+// Kind by the high nibble of the first byte (header form, fixed bit, long packet type
+// as version 1 numbers them). Long headers are looked at again with their version.
+alignas(16) static const uint8_t nibble_kinds[16] = {
+    QUIC_NOT_QUIC, QUIC_NOT_QUIC, QUIC_NOT_QUIC, QUIC_NOT_QUIC,
+    QUIC_ONE_RTT, QUIC_ONE_RTT, QUIC_ONE_RTT, QUIC_ONE_RTT,
+    QUIC_NOT_QUIC, QUIC_NOT_QUIC, QUIC_NOT_QUIC, QUIC_NOT_QUIC,
+    QUIC_INITIAL, QUIC_ZERO_RTT, QUIC_HANDSHAKE, QUIC_RETRY};
+
+// Version 2 shuffled the long packet types.
+static const uint8_t version2_kinds[4] = {QUIC_RETRY, QUIC_INITIAL, QUIC_ZERO_RTT, QUIC_HANDSHAKE};
+
+static void classify_long(const uint8_t *datagram, int size, QuicHeader *header)
+{
+    header->kind = QUIC_NOT_QUIC;
+    if (size < QUIC_MIN_LONG_SIZE)
+    {
+        return;
+    }
+    uint32_t version = ((uint32_t)datagram[1] << 24) | ((uint32_t)datagram[2] << 16) | ((uint32_t)datagram[3] << 8) | datagram[4];
+    int dcid_length = datagram[5];
+    if (6 + dcid_length >= size)
+    {
+        return;
+    }
+    int scid_length = datagram[6 + dcid_length];
+    if (7 + dcid_length + scid_length > size)
+    {
+        return;
+    }
+    header->version = version;
+    header->dcid_length = (uint8_t)dcid_length;
+    header->scid_length = (uint8_t)scid_length;
+
+    if (version == 0)
+    {
+        // The fixed bit is arbitrary in version negotiation.
+        header->kind = QUIC_VERSION_NEGOTIATION;
+        return;
+    }
+    bool known = version == QUIC_VERSION_1 || version == QUIC_VERSION_2;
+    if (!known)
+    {
+        header->kind = QUIC_OTHER_VERSION;
+        return;
+    }
+    if (dcid_length > QUIC_MAX_CID_LENGTH || scid_length > QUIC_MAX_CID_LENGTH || !(datagram[0] & 0x40))
+    {
+        return;
+    }
+    int type = (datagram[0] >> 4) & 3;
+    header->kind = version == QUIC_VERSION_1 ? nibble_kinds[12 + type] : version2_kinds[type];
+}
+
+void quic_classify(const uint8_t *datagram, int size, QuicHeader *header)
+{
+    *header = {QUIC_NOT_QUIC, 0, 0, 0};
+    if (size < QUIC_MIN_LONG_SIZE)
+    {
+        return;
+    }
+    if (datagram[0] & 0x80)
+    {
+        classify_long(datagram, size, header);
+    }
+    else if (size >= QUIC_MIN_SHORT_SIZE)
+    {
+        header->kind = nibble_kinds[datagram[0] >> 4];
+    }
+}
+
+static void classify_first_scalar(const uint8_t *first, uint8_t *kinds, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        kinds[i] = nibble_kinds[first[i] >> 4];
+    }
+}
+
+#ifdef QUIC_X86
+__attribute__((target("ssse3"))) static void classify_first_ssse3(const uint8_t *first, uint8_t *kinds, int count)
+{
+    __m128i table = _mm_load_si128((const __m128i *)nibble_kinds);
+    __m128i mask = _mm_set1_epi8(0x0F);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(first + i));
+        _mm_storeu_si128((__m128i *)(kinds + i), _mm_shuffle_epi8(table, _mm_and_si128(_mm_srli_epi64(bytes, 4), mask)));
+    }
+    classify_first_scalar(first + i, kinds + i, count - i);
+}
+#endif
+
+#ifdef QUIC_NEON
+static void classify_first_neon(const uint8_t *first, uint8_t *kinds, int count)
+{
+    uint8x16_t table = vld1q_u8(nibble_kinds);
+    int i = 0;
+    for (; i + 16 <= count; i += 16)
+    {
+        vst1q_u8(kinds + i, vqtbl1q_u8(table, vshrq_n_u8(vld1q_u8(first + i), 4)));
+    }
+    classify_first_scalar(first + i, kinds + i, count - i);
+}
+#endif
+
+typedef void (*ClassifyFirst)(const uint8_t *first, uint8_t *kinds, int count);
+
+static ClassifyFirst pick_kernel(const char **name)
+{
+#ifdef QUIC_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        *name = "ssse3";
+        return classify_first_ssse3;
+    }
+#endif
+#ifdef QUIC_NEON
+    *name = "neon";
+    return classify_first_neon;
+#endif
+    *name = "scalar";
+    return classify_first_scalar;
+}
+
+static const char *kernel_name;
+static const ClassifyFirst kernel = pick_kernel(&kernel_name);
+
+void quic_classify_batch(const uint8_t *const *datagrams, const int *sizes, int count, QuicHeader *headers)
+{
+    for (int start = 0; start < count; start += QUIC_BATCH_SIZE)
+    {
+        int chunk = count - start < QUIC_BATCH_SIZE ? count - start : QUIC_BATCH_SIZE;
+        uint8_t first[QUIC_BATCH_SIZE];
+        uint8_t kinds[QUIC_BATCH_SIZE];
+        for (int i = 0; i < chunk; i++)
+        {
+            // Too short for any header, 0 maps to QUIC_NOT_QUIC.
+            first[i] = sizes[start + i] >= QUIC_MIN_LONG_SIZE ? datagrams[start + i][0] : 0;
+        }
+        kernel(first, kinds, chunk);
+
+        for (int i = 0; i < chunk; i++)
+        {
+            QuicHeader *header = &headers[start + i];
+            *header = {kinds[i], 0, 0, 0};
+            if (first[i] & 0x80)
+            {
+                classify_long(datagrams[start + i], sizes[start + i], header);
+            }
+            else if (sizes[start + i] < QUIC_MIN_SHORT_SIZE)
+            {
+                header->kind = QUIC_NOT_QUIC;
+            }
+        }
+    }
+}
+
+const char *quic_kind_name(int kind)
+{
+    static const char *names[QUIC_KINDS] = {"not QUIC", "Initial", "0-RTT", "Handshake", "Retry",
+                                            "Version Negotiation", "1-RTT", "other version"};
+    return kind >= 0 && kind < QUIC_KINDS ? names[kind] : "unknown";
+}
+
+const char *quic_classifier_kernel()
+{
+    return kernel_name;
+}
+
+static uint32_t read_u32(const uint8_t *bytes)
+{
+    return ((uint32_t)bytes[0] << 24) | ((uint32_t)bytes[1] << 16) | ((uint32_t)bytes[2] << 8) | bytes[3];
+}
+
+int quic_write_probe(uint8_t *buffer, QuicProbeIds *ids)
+{
+    static thread_local std::random_device random;
+    uint32_t words[(2 * QUIC_PROBE_CID_LENGTH) / 4 + 1];
+    for (uint32_t &word : words)
+    {
+        word = random();
+    }
+    memcpy(ids->dcid, words, QUIC_PROBE_CID_LENGTH);
+    memcpy(ids->scid, (const uint8_t *)words + QUIC_PROBE_CID_LENGTH, QUIC_PROBE_CID_LENGTH);
+    // Reserved versions only fix the low nibble of each byte.
+    ids->version = (words[2 * QUIC_PROBE_CID_LENGTH / 4] & 0xf0f0f0f0) | 0x0a0a0a0a;
+
+    int len = 0;
+    buffer[len++] = 0xc3; // Long header, Initial, 4 byte packet number.
+    buffer[len++] = (uint8_t)(ids->version >> 24);
+    buffer[len++] = (uint8_t)(ids->version >> 16);
+    buffer[len++] = (uint8_t)(ids->version >> 8);
+    buffer[len++] = (uint8_t)ids->version;
+    buffer[len++] = QUIC_PROBE_CID_LENGTH;
+    memcpy(buffer + len, ids->dcid, QUIC_PROBE_CID_LENGTH);
+    len += QUIC_PROBE_CID_LENGTH;
+    buffer[len++] = QUIC_PROBE_CID_LENGTH;
+    memcpy(buffer + len, ids->scid, QUIC_PROBE_CID_LENGTH);
+    len += QUIC_PROBE_CID_LENGTH;
+    buffer[len++] = 0x00; // No token.
+    // Length of the rest as a 2 byte varint, servers only look at the datagram size.
+    int rest = QUIC_MIN_INITIAL_SIZE - len - 2;
+    buffer[len++] = (uint8_t)(0x40 | (rest >> 8));
+    buffer[len++] = (uint8_t)rest;
+    memset(buffer + len, 0, QUIC_MIN_INITIAL_SIZE - len);
+    return QUIC_MIN_INITIAL_SIZE;
+}
+
+int quic_probe_answer(const uint8_t *reply, int size, const QuicProbeIds *ids)
+{
+    QuicHeader header;
+    quic_classify(reply, size, &header);
+    // Every answer is sent to the probe's source id.
+    if (header.kind == QUIC_NOT_QUIC || header.dcid_length != QUIC_PROBE_CID_LENGTH ||
+        memcmp(reply + 6, ids->scid, QUIC_PROBE_CID_LENGTH) != 0)
+    {
+        return QUIC_NOT_QUIC;
+    }
+    const uint8_t *scid = reply + 7 + QUIC_PROBE_CID_LENGTH;
+    bool echoed = header.scid_length == QUIC_PROBE_CID_LENGTH && memcmp(scid, ids->dcid, QUIC_PROBE_CID_LENGTH) == 0;
+    if (header.kind == QUIC_VERSION_NEGOTIATION)
+    {
+        int versions = 7 + QUIC_PROBE_CID_LENGTH + header.scid_length;
+        if (!echoed || size == versions || (size - versions) % 4 != 0)
+        {
+            return QUIC_NOT_QUIC;
+        }
+        for (int i = versions; i < size; i += 4)
+        {
+            if (read_u32(reply + i) == ids->version)
+            {
+                return QUIC_NOT_QUIC;
+            }
+        }
+        return QUIC_VERSION_NEGOTIATION;
+    }
+    if (header.kind == QUIC_INITIAL || (header.kind == QUIC_RETRY && !echoed))
+    {
+        return header.kind;
+    }
+    return QUIC_NOT_QUIC;
+}
@@ -0,0 +1,58 @@
+#ifndef QUIC_HEADER_H
+#define QUIC_HEADER_H
+
+#include <cstdint>
+
+#define QUIC_NOT_QUIC 0
+#define QUIC_INITIAL 1
+#define QUIC_ZERO_RTT 2
+#define QUIC_HANDSHAKE 3
+#define QUIC_RETRY 4
+#define QUIC_VERSION_NEGOTIATION 5
+#define QUIC_ONE_RTT 6       // Short header.
+#define QUIC_OTHER_VERSION 7 // Long header of a version other than 1 and 2, only the invariants are known.
+#define QUIC_KINDS 8
+
+#define QUIC_VERSION_1 0x00000001
+#define QUIC_VERSION_2 0x6b3343cf
+#define QUIC_MAX_CID_LENGTH 20     // Versions 1 and 2, other versions may use up to 255.
+#define QUIC_MIN_INITIAL_SIZE 1200 // Client Initial datagrams are padded to at least this.
+#define QUIC_MIN_LONG_SIZE 7       // First byte, version, both connection id lengths.
+#define QUIC_MIN_SHORT_SIZE 21     // Header protection samples 16 bytes, 4 bytes after the packet number starts.
+#define QUIC_BATCH_SIZE 64         // Datagrams whose first bytes are classified together.
+#define QUIC_PROBE_CID_LENGTH 16   // Random connection ids of a probe, an answer echoing them can't be guessed.
+
+typedef struct
+{
+    uint8_t kind;        // QUIC_*
+    uint8_t dcid_length; // Long headers only, short headers don't carry it.
+    uint8_t scid_length;
+    uint32_t version;    // Long headers only, 0 for version negotiation.
+} QuicHeader;
+
+// What a datagram starts with, by RFC 8999 (invariants), 9000 and 9369. Coalesced
+// packets after the first one aren't looked at.
+void quic_classify(const uint8_t *datagram, int size, QuicHeader *header);
+// Same for a whole receive batch. The first bytes go through a SIMD table lookup,
+// which settles short header packets, the bulk of established traffic, at once.
+void quic_classify_batch(const uint8_t *const *datagrams, const int *sizes, int count, QuicHeader *headers);
+const char *quic_kind_name(int kind);
+const char *quic_classifier_kernel();
+
+typedef struct
+{
+    uint8_t dcid[QUIC_PROBE_CID_LENGTH];
+    uint8_t scid[QUIC_PROBE_CID_LENGTH];
+    uint32_t version;
+} QuicProbeIds;
+
+// Writes a QUIC_MIN_INITIAL_SIZE client Initial of a reserved version (0x?a?a?a?a,
+// RFC 9000 section 15) with connection ids from the system's CSPRNG. Servers answer it
+// with a Version Negotiation packet (section 6) and keep no state for it. Returns its size.
+int quic_write_probe(uint8_t *buffer, QuicProbeIds *ids);
+// Kind of a reply to the probe of ids: QUIC_VERSION_NEGOTIATION echoing both ids and not
+// listing the probed version, QUIC_INITIAL or QUIC_RETRY sent to its source id.
+// QUIC_NOT_QUIC for anything else, garbage and forged answers included.
+int quic_probe_answer(const uint8_t *reply, int size, const QuicProbeIds *ids);
+
+#endif
@@ -0,0 +1,308 @@
+#include "quic_prober.h"
+#include <algorithm>
+#include <cstring>
+
+int probe_quic_many(std::vector<QuicProbe> &probes, int timeout_ms)
+{
+    int sockets[2] = {-1, -1};
+    int families[2] = {AF_INET, AF_INET6};
+    for (auto &probe : probes)
+    {
+        probe.reachable = false;
+        probe.rtt_ms = -1;
+        probe.answer = QUIC_NOT_QUIC;
+    }
+
+    for (int i = 0; i < 2; i++)
+    {
+        bool needed = false;
+        for (const auto &probe : probes)
+        {
+            needed = needed || probe.address.ss_family == families[i];
+        }
+        if (!needed)
+        {
+            continue;
+        }
+        sockets[i] = socket(families[i], SOCK_DGRAM, 0);
+        if (sockets[i] >= 0)
+        {
+            set_socket_nonblocking(sockets[i]);
+        }
+    }
+
+    uint8_t buffer[2048];
+    std::vector<std::vector<ProbeAttempt>> attempts(probes.size());
+    size_t pending = 0;
+    for (const auto &probe : probes)
+    {
+        pending += sockets[probe.address.ss_family == AF_INET ? 0 : 1] >= 0;
+    }
+
+    auto started = std::chrono::steady_clock::now();
+    auto deadline = started + std::chrono::milliseconds(timeout_ms);
+    auto next_attempt = started;
+    int retry_ms = PROBER_RETRY_MS;
+    while (pending > 0)
+    {
+        auto now = std::chrono::steady_clock::now();
+        if (now >= deadline)
+        {
+            break;
+        }
+        if (now >= next_attempt)
+        {
+            for (size_t i = 0; i < probes.size(); i++)
+            {
+                int s = sockets[probes[i].address.ss_family == AF_INET ? 0 : 1];
+                if (s < 0 || probes[i].reachable)
+                {
+                    continue;
+                }
+                ProbeAttempt attempt;
+                int n = quic_write_probe(buffer, &attempt.ids);
+                attempt.sent = std::chrono::steady_clock::now();
+                if (sendto(s, (const char *)buffer, n, 0, (sockaddr *)&probes[i].address, probes[i].address_len) >= 0)
+                {
+                    attempts[i].push_back(attempt);
+                }
+            }
+            next_attempt = now + std::chrono::milliseconds(retry_ms);
+            retry_ms *= 2;
+        }
+        // Rounded up, waking up early would only poll again.
+        auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(std::min(deadline, next_attempt) - now + std::chrono::microseconds(999)).count();
+
+        pollfd fds[2];
+        size_t count = 0;
+        for (int s : sockets)
+        {
+            if (s >= 0)
+            {
+                fds[count++] = {(socket_t)s, POLLIN, 0};
+            }
+        }
+        if (poll_sockets(fds, count, (int)remaining) <= 0)
+        {
+            continue;
+        }
+
+        for (size_t f = 0; f < count; f++)
+        {
+            if ((fds[f].revents & (POLLIN | POLLERR)) == 0)
+            {
+                continue;
+            }
+            int s = (int)fds[f].fd;
+            while (true)
+            {
+                sockaddr_storage from{};
+                socklen_t from_len = sizeof(from);
+                int n = recvfrom(s, (char *)buffer, sizeof(buffer), 0, (sockaddr *)&from, &from_len);
+                auto received = std::chrono::steady_clock::now();
+                if (n < 0)
+                {
+                    if (socket_would_block())
+                    {
+                        break;
+                    }
+                    // ICMP errors from other targets, keep reading.
+                    continue;
+                }
+                for (size_t i = 0; i < probes.size(); i++)
+                {
+                    if (probes[i].reachable || !sockaddr_equal((sockaddr *)&probes[i].address, (sockaddr *)&from))
+                    {
+                        continue;
+                    }
+                    for (const auto &attempt : attempts[i])
+                    {
+                        int answer = quic_probe_answer(buffer, n, &attempt.ids);
+                        if (answer != QUIC_NOT_QUIC)
+                        {
+                            probes[i].reachable = true;
+                            probes[i].answer = answer;
+                            probes[i].rtt_ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(received - attempt.sent).count();
+                            pending--;
+                            break;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    for (int s : sockets)
+    {
+        if (s >= 0)
+        {
+            close_socket(s);
+        }
+    }
+    return 0;
+}
+
+static int test_quic(const sockaddr *address, socklen_t address_len, const char *family)
+{
+    std::vector<QuicProbe> probes(1);
+    memset(&probes[0], 0, sizeof(QuicProbe));
+    memcpy(&probes[0].address, address, address_len);
+    probes[0].address_len = address_len;
+    std::cout << "QUIC " << family << ": Testing " << format_address(address) << std::endl;
+    probe_quic_many(probes, PROBER_TIMEOUT_MS);
+    if (!probes[0].reachable)
+    {
+        std::cout << "QUIC " << family << ": No answer within " << PROBER_TIMEOUT_MS << " ms." << std::endl;
+        return 1;
+    }
+    std::cout << "QUIC " << family << ": " << quic_kind_name(probes[0].answer) << " answer in " << probes[0].rtt_ms << " ms." << std::endl;
+    return 0;
+}
+
+int test_ipv4_quic(in_addr ipv4, int port)
+{
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr = ipv4;
+    return test_quic((const sockaddr *)&address, sizeof(address), "IPv4");
+}
+
+int test_ipv6_quic(in6_addr ipv6, int port)
+{
+    sockaddr_in6 address{};
+    address.sin6_family = AF_INET6;
+    address.sin6_port = htons(port);
+    address.sin6_addr = ipv6;
+    return test_quic((const sockaddr *)&address, sizeof(address), "IPv6");
+}
+
+static bool resolve_probe_target(const ProbeTarget &target, QuicProbe &probe)
+{
+    memset(&probe, 0, sizeof(probe));
+    if (target.address_type == eAddressType::IPv4)
+    {
+        sockaddr_in *addr = (sockaddr_in *)&probe.address;
+        addr->sin_family = AF_INET;
+        addr->sin_port = htons(target.port);
+        probe.address_len = sizeof(sockaddr_in);
+        return inet_pton(AF_INET, target.address.c_str(), &addr->sin_addr) == 1;
+    }
+    if (target.address_type == eAddressType::IPv6)
+    {
+        sockaddr_in6 *addr = (sockaddr_in6 *)&probe.address;
+        addr->sin6_family = AF_INET6;
+        addr->sin6_port = htons(target.port);
+        probe.address_len = sizeof(sockaddr_in6);
+        return inet_pton(AF_INET6, target.address.c_str(), &addr->sin6_addr) == 1;
+    }
+    if (target.address_type != eAddressType::Domain)
+    {
+        return false;
+    }
+
+    struct addrinfo hints;
+    struct addrinfo *result = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_DGRAM;
+    if (getaddrinfo(target.address.c_str(), std::to_string(target.port).c_str(), &hints, &result) != 0 || result == nullptr)
+    {
+        return false;
+    }
+    memcpy(&probe.address, result->ai_addr, result->ai_addrlen);
+    probe.address_len = (socklen_t)result->ai_addrlen;
+    freeaddrinfo(result);
+    return true;
+}
+
+QuicProber::QuicProber(std::function<void(std::vector<ProbeResult>)> on_results)
+{
+    this->on_results = on_results;
+}
+
+QuicProber::~QuicProber()
+{
+    this->stop();
+}
+
+void QuicProber::set_targets(std::vector<ProbeTarget> targets)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->targets = targets;
+        this->refresh = true;
+    }
+    this->wakeup.notify_all();
+}
+
+void QuicProber::start()
+{
+    if (this->running)
+    {
+        return;
+    }
+    this->running = true;
+    this->prober_thread = std::thread(&QuicProber::run, this);
+}
+
+void QuicProber::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->running = false;
+    }
+    this->wakeup.notify_all();
+    if (this->prober_thread.joinable())
+    {
+        this->prober_thread.join();
+    }
+}
+
+void QuicProber::run()
+{
+    while (this->running)
+    {
+        std::vector<ProbeTarget> targets;
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            targets = this->targets;
+            this->refresh = false;
+        }
+
+        // Resolving domains is the slow part, it stays on this thread too.
+        std::vector<QuicProbe> probes;
+        std::vector<ProbeResult> results;
+        std::vector<size_t> probe_index;
+        for (const auto &target : targets)
+        {
+            QuicProbe probe;
+            results.push_back({target.id, false, -1});
+            if (resolve_probe_target(target, probe))
+            {
+                probe_index.push_back(results.size() - 1);
+                probes.push_back(probe);
+            }
+        }
+
+        if (!this->running)
+        {
+            break;
+        }
+        probe_quic_many(probes, PROBER_TIMEOUT_MS);
+        for (size_t i = 0; i < probes.size(); i++)
+        {
+            results[probe_index[i]].reachable = probes[i].reachable;
+            results[probe_index[i]].rtt_ms = probes[i].rtt_ms;
+        }
+
+        if (this->running && !results.empty())
+        {
+            this->on_results(results);
+        }
+
+        std::unique_lock<std::mutex> lock(this->mutex);
+        this->wakeup.wait_for(lock, std::chrono::milliseconds(PROBER_INTERVAL_MS),
+                              [this]()
+                              { return !this->running || this->refresh; });
+    }
+}
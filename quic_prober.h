@@ -0,0 +1,78 @@
+#ifndef QUIC_PROBER_H
+#define QUIC_PROBER_H
+
+#include "proxy_common.h"
+#include "quic_header.h"
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#define PROBER_INTERVAL_MS 30000 // Time between two pings of the saved servers.
+#define PROBER_TIMEOUT_MS 2000   // A server not answering within this time is unreachable, past the last resend at 1400 ms.
+#define PROBER_RETRY_MS 200      // An unanswered probe is sent again after this, the wait doubles each time (200, 600, 1400 ms).
+
+typedef struct
+{
+    sockaddr_storage address;
+    socklen_t address_len;
+    bool reachable;
+    int rtt_ms;
+    int answer; // QUIC_* kind of the reply.
+} QuicProbe;
+
+// One sending of a probe, its ids tell which one an answer is for.
+typedef struct
+{
+    std::chrono::steady_clock::time_point sent;
+    QuicProbeIds ids;
+} ProbeAttempt;
+
+// Sends the QUIC probe (quic_write_probe) to every probe at once from a single non-blocking
+// socket per family, again with fresh connection ids to those still silent PROBER_RETRY_MS
+// later and then twice as long after each resend, until all answered or timeout_ms passed.
+// Resends due after timeout_ms are skipped. Only answers echoing the ids count, the round
+// trip is timed from the attempt answered.
+int probe_quic_many(std::vector<QuicProbe> &probes, int timeout_ms);
+// Blocking probe of a single server, 0 when it answered, 1 when it didn't.
+int test_ipv4_quic(in_addr ipv4, int port);
+int test_ipv6_quic(in6_addr ipv6, int port);
+
+typedef struct
+{
+    int id;
+    eAddressType address_type;
+    std::string address;
+    int port;
+} ProbeTarget;
+
+typedef struct
+{
+    int id;
+    bool reachable;
+    int rtt_ms;
+} ProbeResult;
+
+// Background thread pinging a list of servers on a schedule, results are handed to a
+// callback running on the prober thread.
+class QuicProber
+{
+private:
+    std::vector<ProbeTarget> targets;
+    std::function<void(std::vector<ProbeResult>)> on_results;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::atomic<bool> running{false};
+    bool refresh = false;
+    std::thread prober_thread;
+    void run();
+
+public:
+    QuicProber(std::function<void(std::vector<ProbeResult>)> on_results);
+    ~QuicProber();
+    void set_targets(std::vector<ProbeTarget> targets);
+    void start();
+    void stop();
+};
+
+#endif
@@ -0,0 +1,60 @@
+#include "rate_limiter.h"
+#include <algorithm>
+
+static void bucket_init(TokenBucket *bucket, double rate, double minimum_burst, std::chrono::steady_clock::time_point now)
+{
+    bucket->rate = rate > 0 ? rate : 0;
+    // Always room for at least one full datagram, otherwise a low byte rate would drop everything.
+    bucket->burst = std::max(bucket->rate * RATE_LIMIT_BURST_MS / 1000.0, minimum_burst);
+    bucket->tokens = bucket->burst;
+    bucket->last_refill = now;
+}
+
+static bool bucket_check(TokenBucket *bucket, double amount, std::chrono::steady_clock::time_point now)
+{
+    if (bucket->rate == 0)
+    {
+        return true;
+    }
+    double elapsed = std::chrono::duration<double>(now - bucket->last_refill).count();
+    if (elapsed > 0)
+    {
+        bucket->tokens = std::min(bucket->burst, bucket->tokens + elapsed * bucket->rate);
+        bucket->last_refill = now;
+    }
+    // A datagram larger than the whole burst passes once the bucket is full and leaves it in debt.
+    return bucket->tokens >= std::min(amount, bucket->burst);
+}
+
+static void bucket_consume(TokenBucket *bucket, double amount)
+{
+    if (bucket->rate != 0)
+    {
+        bucket->tokens -= amount;
+    }
+}
+
+bool rate_limit_enabled(RateLimit limit)
+{
+    return limit.packets_per_second > 0 || limit.bytes_per_second > 0;
+}
+
+void rate_limiter_init(RateLimiter *limiter, RateLimit limit, std::chrono::steady_clock::time_point now)
+{
+    bucket_init(&limiter->packets, limit.packets_per_second, 1, now);
+    bucket_init(&limiter->bytes, limit.bytes_per_second, RATE_LIMIT_MAX_DATAGRAM, now);
+}
+
+bool rate_limiter_check(RateLimiter *limiter, size_t size, std::chrono::steady_clock::time_point now)
+{
+    // Both buckets are refilled even when the first one already says no.
+    bool packets = bucket_check(&limiter->packets, 1, now);
+    bool bytes = bucket_check(&limiter->bytes, (double)size, now);
+    return packets && bytes;
+}
+
+void rate_limiter_consume(RateLimiter *limiter, size_t size)
+{
+    bucket_consume(&limiter->packets, 1);
+    bucket_consume(&limiter->bytes, (double)size);
+}
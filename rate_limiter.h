@@ -0,0 +1,38 @@
+#ifndef RATE_LIMITER_H
+#define RATE_LIMITER_H
+
+#include <chrono>
+#include <cstddef>
+
+#define RATE_LIMIT_BURST_MS 250      // Traffic a bucket may accumulate while a client is quiet.
+#define RATE_LIMIT_MAX_DATAGRAM 2048 // Smallest byte burst, larger datagrams need the bucket full.
+
+typedef struct
+{
+    double packets_per_second; // 0 means unlimited.
+    double bytes_per_second;   // 0 means unlimited.
+} RateLimit;
+
+typedef struct
+{
+    double rate;  // Tokens added per second, 0 disables the bucket.
+    double burst; // Capacity of the bucket.
+    double tokens;
+    std::chrono::steady_clock::time_point last_refill;
+} TokenBucket;
+
+// A packet bucket and a byte bucket, a datagram passes only if both have room for it.
+typedef struct
+{
+    TokenBucket packets;
+    TokenBucket bytes;
+} RateLimiter;
+
+bool rate_limit_enabled(RateLimit limit);
+void rate_limiter_init(RateLimiter *limiter, RateLimit limit, std::chrono::steady_clock::time_point now);
+// Refills the buckets and tells whether size bytes can pass, nothing is taken yet so
+// several limiters can be checked before committing to any of them.
+bool rate_limiter_check(RateLimiter *limiter, size_t size, std::chrono::steady_clock::time_point now);
+void rate_limiter_consume(RateLimiter *limiter, size_t size);
+
+#endif
@@ -0,0 +1,619 @@
+#include "server_io.h"
+#include <fstream>
+#include <sstream>
+
+std::string minimal_address(eAddressType address_type, std::string address, int port)
+{
+    std::string response;
+    if (address_type == eAddressType::IPv6)
+    {
+        response = "[" + address + "]";
+    }
+    else
+    {
+        response = address;
+    }
+    if (port != PROXY_DEFAULT_PORT)
+    {
+        return response += ":" + std::to_string(port);
+    }
+    return response;
+}
+
+// Same format accepted by the server address input, backends included.
+std::string server_minimal_address(ServerRecord record)
+{
+    std::string response = minimal_address(record.address_type, record.address, record.port);
+    for (const auto &backend : record.backends)
+    {
+        response += ", " + minimal_address(backend.address_type, backend.address, backend.port);
+    }
+    return response;
+}
+
+static bool is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+int parse_server_record(const std::string &input, ServerRecord &record)
+{
+    const char *text = input.data();
+    size_t length = input.size();
+    bool first = true;
+    record.backends.clear();
+
+    size_t start = 0;
+    while (start < length)
+    {
+        size_t end = start;
+        while (end < length && text[end] != ',')
+        {
+            end++;
+        }
+        size_t next = end + 1;
+        while (start < end && is_space(text[start]))
+        {
+            start++;
+        }
+        while (end > start && is_space(text[end - 1]))
+        {
+            end--;
+        }
+
+        const char *host;
+        size_t host_length;
+        int port;
+        eAddressType address_type = parse_server_address(text + start, end - start, &host, &host_length, &port);
+        if (address_type == eAddressType::Invalid)
+        {
+            return 1;
+        }
+        if (port == -1)
+        {
+            return 2;
+        }
+        if (first)
+        {
+            record.address_type = address_type;
+            record.address.assign(host, host_length);
+            record.port = port;
+            first = false;
+        }
+        else
+        {
+            record.backends.push_back({address_type, std::string(host, host_length), port});
+        }
+        start = next;
+    }
+
+    return first ? 1 : 0;
+}
+
+static bool ends_with(const std::string &text, const std::string &suffix)
+{
+    if (text.size() < suffix.size())
+    {
+        return false;
+    }
+    for (size_t i = 0; i < suffix.size(); i++)
+    {
+        char c = text[text.size() - suffix.size() + i];
+        if (c >= 'A' && c <= 'Z')
+        {
+            c = c - 'A' + 'a';
+        }
+        if (c != suffix[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void add_entry(std::vector<ServerRecord> &records, int *skipped, std::vector<std::string> &errors,
+                      int entry, std::string name, std::string address)
+{
+    ServerRecord record{};
+    record.name = name;
+    record.address_type = eAddressType::Invalid;
+    record.port = -1;
+    std::string reason;
+    if (name.empty())
+    {
+        reason = "the name is empty";
+    }
+    else
+    {
+        int status = parse_server_record(address, record);
+        if (status == 1)
+        {
+            reason = "invalid address \"" + address + "\"";
+        }
+        else if (status == 2)
+        {
+            reason = "invalid port in \"" + address + "\"";
+        }
+    }
+
+    if (reason.empty())
+    {
+        records.push_back(record);
+        return;
+    }
+    (*skipped)++;
+    if ((int)errors.size() < IMPORT_MAX_ERRORS)
+    {
+        errors.push_back("Entry " + std::to_string(entry) + ": " + reason + ".");
+    }
+}
+
+// RFC 4180 fields, a quoted field may hold commas, quotes ("") and line breaks.
+static bool read_csv_row(const std::string &text, size_t &i, std::vector<std::string> &fields)
+{
+    fields.clear();
+    if (i >= text.size())
+    {
+        return false;
+    }
+    std::string field;
+    bool quoted = false;
+    for (; i < text.size(); i++)
+    {
+        char c = text[i];
+        if (quoted)
+        {
+            if (c == '"' && i + 1 < text.size() && text[i + 1] == '"')
+            {
+                field += '"';
+                i++;
+            }
+            else if (c == '"')
+            {
+                quoted = false;
+            }
+            else
+            {
+                field += c;
+            }
+        }
+        else if (c == '"')
+        {
+            quoted = true;
+        }
+        else if (c == ',')
+        {
+            fields.push_back(field);
+            field.clear();
+        }
+        else if (c == '\n')
+        {
+            i++;
+            break;
+        }
+        else if (c != '\r')
+        {
+            field += c;
+        }
+    }
+    fields.push_back(field);
+    return true;
+}
+
+static std::string trim(const std::string &text)
+{
+    size_t start = 0;
+    size_t end = text.size();
+    while (start < end && is_space(text[start]))
+    {
+        start++;
+    }
+    while (end > start && is_space(text[end - 1]))
+    {
+        end--;
+    }
+    return text.substr(start, end - start);
+}
+
+static void import_csv(const std::string &text, std::vector<ServerRecord> &records, int *skipped, std::vector<std::string> &errors)
+{
+    size_t i = 0;
+    int entry = 0;
+    std::vector<std::string> fields;
+    while (read_csv_row(text, i, fields))
+    {
+        if (fields.size() == 1 && trim(fields[0]).empty())
+        {
+            continue;
+        }
+        if (entry == 0 && fields.size() >= 2 && trim(fields[0]) == "name" && trim(fields[1]) == "address")
+        {
+            continue;
+        }
+        entry++;
+        // An unquoted address list spills into the next columns.
+        std::string address = fields.size() > 1 ? fields[1] : "";
+        for (size_t j = 2; j < fields.size(); j++)
+        {
+            address += "," + fields[j];
+        }
+        add_entry(records, skipped, errors, entry, trim(fields[0]), address);
+    }
+}
+
+// Just enough JSON for an array of flat objects, values other than strings are skipped.
+class JsonReader
+{
+private:
+    const std::string &text;
+    size_t i = 0;
+
+    void skip_space()
+    {
+        while (i < text.size() && is_space(text[i]))
+        {
+            i++;
+        }
+    }
+
+    static void append_utf8(std::string &out, unsigned code)
+    {
+        if (code < 0x80)
+        {
+            out += (char)code;
+        }
+        else if (code < 0x800)
+        {
+            out += (char)(0xC0 | (code >> 6));
+            out += (char)(0x80 | (code & 0x3F));
+        }
+        else if (code < 0x10000)
+        {
+            out += (char)(0xE0 | (code >> 12));
+            out += (char)(0x80 | ((code >> 6) & 0x3F));
+            out += (char)(0x80 | (code & 0x3F));
+        }
+        else
+        {
+            out += (char)(0xF0 | (code >> 18));
+            out += (char)(0x80 | ((code >> 12) & 0x3F));
+            out += (char)(0x80 | ((code >> 6) & 0x3F));
+            out += (char)(0x80 | (code & 0x3F));
+        }
+    }
+
+    bool read_hex(unsigned *code)
+    {
+        if (i + 4 > text.size())
+        {
+            return false;
+        }
+        *code = 0;
+        for (int k = 0; k < 4; k++)
+        {
+            char c = text[i++];
+            *code <<= 4;
+            if (c >= '0' && c <= '9')
+            {
+                *code |= c - '0';
+            }
+            else if (c >= 'a' && c <= 'f')
+            {
+                *code |= c - 'a' + 10;
+            }
+            else if (c >= 'A' && c <= 'F')
+            {
+                *code |= c - 'A' + 10;
+            }
+            else
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+public:
+    JsonReader(const std::string &text) : text(text) {}
+
+    bool consume(char c)
+    {
+        skip_space();
+        if (i < text.size() && text[i] == c)
+        {
+            i++;
+            return true;
+        }
+        return false;
+    }
+
+    bool at_end()
+    {
+        skip_space();
+        return i == text.size();
+    }
+
+    bool read_string(std::string &out)
+    {
+        out.clear();
+        if (!consume('"'))
+        {
+            return false;
+        }
+        while (i < text.size())
+        {
+            char c = text[i++];
+            if (c == '"')
+            {
+                return true;
+            }
+            if (c != '\\')
+            {
+                out += c;
+                continue;
+            }
+            if (i >= text.size())
+            {
+                return false;
+            }
+            c = text[i++];
+            switch (c)
+            {
+            case 'b':
+                out += '\b';
+                break;
+            case 'f':
+                out += '\f';
+                break;
+            case 'n':
+                out += '\n';
+                break;
+            case 'r':
+                out += '\r';
+                break;
+            case 't':
+                out += '\t';
+                break;
+            case 'u':
+            {
+                unsigned code;
+                if (!read_hex(&code))
+                {
+                    return false;
+                }
+                // Surrogate pair
+                if (code >= 0xD800 && code < 0xDC00 && i + 6 <= text.size() && text[i] == '\\' && text[i + 1] == 'u')
+                {
+                    i += 2;
+                    unsigned low;
+                    if (!read_hex(&low))
+                    {
+                        return false;
+                    }
+                    code = 0x10000 + ((code - 0xD800) << 10) + (low - 0xDC00);
+                }
+                append_utf8(out, code);
+                break;
+            }
+            default:
+                out += c;
+                break;
+            }
+        }
+        return false;
+    }
+
+    bool skip_value()
+    {
+        skip_space();
+        if (i >= text.size())
+        {
+            return false;
+        }
+        std::string ignored;
+        char c = text[i];
+        if (c == '"')
+        {
+            return this->read_string(ignored);
+        }
+        if (c == '[' || c == '{')
+        {
+            char close = c == '[' ? ']' : '}';
+            i++;
+            if (consume(close))
+            {
+                return true;
+            }
+            do
+            {
+                if (close == '}' && (!this->read_string(ignored) || !consume(':')))
+                {
+                    return false;
+                }
+                if (!this->skip_value())
+                {
+                    return false;
+                }
+            } while (consume(','));
+            return consume(close);
+        }
+        size_t start = i;
+        while (i < text.size() && text[i] != ',' && text[i] != ']' && text[i] != '}' && !is_space(text[i]))
+        {
+            i++;
+        }
+        return i > start;
+    }
+};
+
+static int import_json(const std::string &text, std::vector<ServerRecord> &records, int *skipped, std::vector<std::string> &errors)
+{
+    JsonReader reader(text);
+    if (!reader.consume('['))
+    {
+        return 2;
+    }
+    int entry = 0;
+    if (!reader.consume(']'))
+    {
+        do
+        {
+            if (!reader.consume('{'))
+            {
+                return 2;
+            }
+            entry++;
+            std::string name;
+            std::string address;
+            if (!reader.consume('}'))
+            {
+                do
+                {
+                    std::string key;
+                    if (!reader.read_string(key) || !reader.consume(':'))
+                    {
+                        return 2;
+                    }
+                    bool read;
+                    if (key == "name")
+                    {
+                        read = reader.read_string(name);
+                    }
+                    else if (key == "address")
+                    {
+                        read = reader.read_string(address);
+                    }
+                    else
+                    {
+                        read = reader.skip_value();
+                    }
+                    if (!read)
+                    {
+                        return 2;
+                    }
+                } while (reader.consume(','));
+                if (!reader.consume('}'))
+                {
+                    return 2;
+                }
+            }
+            add_entry(records, skipped, errors, entry, trim(name), address);
+        } while (reader.consume(','));
+        if (!reader.consume(']'))
+        {
+            return 2;
+        }
+    }
+    return reader.at_end() ? 0 : 2;
+}
+
+int import_servers(const std::string &path, std::vector<ServerRecord> &records, int *skipped, std::vector<std::string> &errors)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return 1;
+    }
+    std::stringstream buffer;
+    buffer << file.rdbuf();
+    std::string text = buffer.str();
+    // UTF-8 byte order mark
+    if (text.compare(0, 3, "\xEF\xBB\xBF") == 0)
+    {
+        text.erase(0, 3);
+    }
+
+    *skipped = 0;
+    if (ends_with(path, ".json"))
+    {
+        return import_json(text, records, skipped, errors);
+    }
+    import_csv(text, records, skipped, errors);
+    return 0;
+}
+
+static std::string csv_field(const std::string &value)
+{
+    if (value.find_first_of(",\"\r\n") == std::string::npos)
+    {
+        return value;
+    }
+    std::string quoted = "\"";
+    for (char c : value)
+    {
+        quoted += c;
+        if (c == '"')
+        {
+            quoted += '"';
+        }
+    }
+    return quoted + "\"";
+}
+
+static std::string json_string(const std::string &value)
+{
+    std::string quoted = "\"";
+    for (char c : value)
+    {
+        switch (c)
+        {
+        case '"':
+            quoted += "\\\"";
+            break;
+        case '\\':
+            quoted += "\\\\";
+            break;
+        case '\n':
+            quoted += "\\n";
+            break;
+        case '\r':
+            quoted += "\\r";
+            break;
+        case '\t':
+            quoted += "\\t";
+            break;
+        default:
+            if ((unsigned char)c < 0x20)
+            {
+                char escaped[8];
+                snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+                quoted += escaped;
+            }
+            else
+            {
+                quoted += c;
+            }
+        }
+    }
+    return quoted + "\"";
+}
+
+int export_servers(const std::string &path, const std::vector<ServerRecord> &records)
+{
+    std::ofstream file(path, std::ios::binary);
+    if (!file)
+    {
+        return 1;
+    }
+
+    if (ends_with(path, ".json"))
+    {
+        file << "[";
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            file << (i == 0 ? "\n" : ",\n")
+                 << "  {\"name\": " << json_string(records[i].name)
+                 << ", \"address\": " << json_string(server_minimal_address(records[i])) << "}";
+        }
+        file << "\n]\n";
+    }
+    else
+    {
+        file << "name,address\n";
+        for (const auto &record : records)
+        {
+            file << csv_field(record.name) << "," << csv_field(server_minimal_address(record)) << "\n";
+        }
+    }
+    return file.good() ? 0 : 1;
+}
@@ -0,0 +1,23 @@
+#ifndef SERVER_IO_H
+#define SERVER_IO_H
+
+#include "server_store.h"
+#include <vector>
+
+#define IMPORT_MAX_ERRORS 10 // Skipped entries reported back, the rest are only counted.
+
+std::string minimal_address(eAddressType address_type, std::string address, int port);
+std::string server_minimal_address(ServerRecord record);
+
+// Same syntax as the server address input: comma separated addresses, the first one
+// is the server and the rest its backends. Returns 1 on an invalid address and 2 on
+// an invalid port.
+int parse_server_record(const std::string &input, ServerRecord &record);
+
+// Server lists are CSV (name,address) or a JSON array of {"name", "address"} objects,
+// picked by the file extension. Entries that don't parse are skipped and counted in
+// skipped, the first IMPORT_MAX_ERRORS are described in errors.
+int import_servers(const std::string &path, std::vector<ServerRecord> &records, int *skipped, std::vector<std::string> &errors);
+int export_servers(const std::string &path, const std::vector<ServerRecord> &records);
+
+#endif
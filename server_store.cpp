@@ -0,0 +1,620 @@
+#include "server_store.h"
+#include <limits>
+#include <map>
+
+bool position_between(double before, double after, double *position)
+{
+    double middle = before + (after - before) / 2;
+    if (!(middle > before && middle < after))
+    {
+        return false;
+    }
+    *position = middle;
+    return true;
+}
+
+// Steps a statement without rows and leaves it reset, an unreset statement would keep
+// its read snapshot open and stop WAL checkpoints.
+static bool step_done(sqlite3_stmt *stmt)
+{
+    int rc = sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE;
+}
+
+static std::string column_string(sqlite3_stmt *stmt, int column)
+{
+    const char *raw = reinterpret_cast<const char *>(sqlite3_column_text(stmt, column));
+    return raw ? raw : "";
+}
+
+ServerStore::ServerStore()
+{
+}
+
+ServerStore::~ServerStore()
+{
+    this->close();
+}
+
+int ServerStore::open(const char *path)
+{
+    if (sqlite3_open(path, &this->db) != SQLITE_OK)
+    {
+        std::cerr << "Cannot open database: " << sqlite3_errmsg(this->db) << std::endl;
+        sqlite3_close(this->db);
+        this->db = nullptr;
+        return 1;
+    }
+    sqlite3_busy_timeout(this->db, STORE_BUSY_TIMEOUT_MS);
+
+    // WAL keeps readers off the writer's way, with NORMAL sync a commit only waits
+    // for the log append and the database file is synced on checkpoints.
+    char *error_message = nullptr;
+    int rc = sqlite3_exec(this->db,
+                          "PRAGMA journal_mode=WAL;"
+                          "PRAGMA synchronous=NORMAL;"
+                          "CREATE TABLE IF NOT EXISTS server(id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT NOT NULL, address_type INTEGER, address TEXT NOT NULL, port INTEGER, position REAL);"
+                          "CREATE TABLE IF NOT EXISTS server_backend(id INTEGER PRIMARY KEY AUTOINCREMENT, server_id INTEGER NOT NULL, address_type INTEGER, address TEXT NOT NULL, port INTEGER);"
+                          "CREATE TABLE IF NOT EXISTS route(listen_port INTEGER PRIMARY KEY, server_id INTEGER NOT NULL, tunnel INTEGER NOT NULL DEFAULT 0);",
+                          nullptr, nullptr, &error_message);
+    if (rc != SQLITE_OK)
+    {
+        std::cerr << "Table creation failed: " << error_message << std::endl;
+        sqlite3_free(error_message);
+        sqlite3_close(this->db);
+        this->db = nullptr;
+        return 2;
+    }
+    if (!this->migrate())
+    {
+        sqlite3_close(this->db);
+        this->db = nullptr;
+        return 2;
+    }
+
+    // The tables exist now, the read connection only ever sees committed rows.
+    if (sqlite3_open_v2(path, &this->reader, SQLITE_OPEN_READONLY, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "Cannot open database for reading: " << sqlite3_errmsg(this->reader) << std::endl;
+        sqlite3_close(this->reader);
+        this->reader = nullptr;
+        sqlite3_close(this->db);
+        this->db = nullptr;
+        return 1;
+    }
+    sqlite3_busy_timeout(this->reader, STORE_BUSY_TIMEOUT_MS);
+
+    this->running = true;
+    this->worker = std::thread(&ServerStore::run, this);
+    return 0;
+}
+
+// Databases saved before the sort key existed were ordered by id.
+bool ServerStore::migrate()
+{
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v2(this->db, "SELECT position FROM server LIMIT 0;", -1, &stmt, nullptr) == SQLITE_OK)
+    {
+        sqlite3_finalize(stmt);
+    }
+    else if (sqlite3_exec(this->db, "ALTER TABLE server ADD COLUMN position REAL;", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "Couldn't add position to server: " << sqlite3_errmsg(this->db) << std::endl;
+        return false;
+    }
+    if (sqlite3_prepare_v2(this->db, "SELECT tunnel FROM route LIMIT 0;", -1, &stmt, nullptr) == SQLITE_OK)
+    {
+        sqlite3_finalize(stmt);
+    }
+    else if (sqlite3_exec(this->db, "ALTER TABLE route ADD COLUMN tunnel INTEGER NOT NULL DEFAULT 0;", nullptr, nullptr, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "Couldn't add tunnel to route: " << sqlite3_errmsg(this->db) << std::endl;
+        return false;
+    }
+
+    char *error_message = nullptr;
+    int rc = sqlite3_exec(this->db,
+                          "UPDATE server SET position = id WHERE position IS NULL;"
+                          "CREATE INDEX IF NOT EXISTS server_position ON server(position);"
+                          "CREATE INDEX IF NOT EXISTS server_backend_server ON server_backend(server_id);",
+                          nullptr, nullptr, &error_message);
+    if (rc != SQLITE_OK)
+    {
+        std::cerr << "Migration failed: " << error_message << std::endl;
+        sqlite3_free(error_message);
+        return false;
+    }
+    return true;
+}
+
+// Queued writes are flushed before the connection is closed.
+void ServerStore::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->running = false;
+    }
+    this->wakeup.notify_all();
+    this->written.notify_all();
+    if (this->worker.joinable())
+    {
+        this->worker.join();
+    }
+
+    for (auto &cached : this->statements)
+    {
+        sqlite3_finalize(cached.second);
+    }
+    this->statements.clear();
+    if (this->db)
+    {
+        sqlite3_close(this->db);
+        this->db = nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(this->read_mutex);
+    for (auto &cached : this->read_statements)
+    {
+        sqlite3_finalize(cached.second);
+    }
+    this->read_statements.clear();
+    if (this->reader)
+    {
+        sqlite3_close(this->reader);
+        this->reader = nullptr;
+    }
+}
+
+void ServerStore::run()
+{
+    while (true)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(this->mutex);
+            this->wakeup.wait(lock, [this]()
+                              { return !this->jobs.empty() || !this->running; });
+            if (this->jobs.empty())
+            {
+                return;
+            }
+            job = std::move(this->jobs.front());
+            this->jobs.pop_front();
+        }
+        job();
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->writes_done++;
+        }
+        this->written.notify_all();
+    }
+}
+
+// An import must decrement imports once it's done.
+void ServerStore::post(std::function<void()> job, bool import)
+{
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        if (!this->running)
+        {
+            return;
+        }
+        this->jobs.push_back(std::move(job));
+        this->writes_posted++;
+        this->imports += import;
+    }
+    this->wakeup.notify_one();
+}
+
+// Runs job on the calling thread with the read connection, once the writes queued
+// so far are done or an import is pending.
+void ServerStore::read(std::function<void()> job)
+{
+    {
+        std::unique_lock<std::mutex> lock(this->mutex);
+        uint64_t target = this->writes_posted;
+        this->written.wait(lock, [this, target]()
+                           { return this->writes_done >= target || this->imports > 0 || !this->running; });
+    }
+    std::lock_guard<std::mutex> lock(this->read_mutex);
+    if (this->reader)
+    {
+        job();
+    }
+}
+
+// Statements are prepared once per connection and reused, the returned statement is
+// reset with no bindings.
+static sqlite3_stmt *cached_statement(sqlite3 *db, std::unordered_map<std::string, sqlite3_stmt *> &statements, const char *sql)
+{
+    auto it = statements.find(sql);
+    if (it != statements.end())
+    {
+        sqlite3_reset(it->second);
+        sqlite3_clear_bindings(it->second);
+        return it->second;
+    }
+
+    sqlite3_stmt *stmt;
+    if (sqlite3_prepare_v3(db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, nullptr) != SQLITE_OK)
+    {
+        std::cerr << "Couldn't prepare statement: " << sqlite3_errmsg(db) << std::endl;
+        return nullptr;
+    }
+    statements[sql] = stmt;
+    return stmt;
+}
+
+sqlite3_stmt *ServerStore::statement(const char *sql)
+{
+    return cached_statement(this->db, this->statements, sql);
+}
+
+sqlite3_stmt *ServerStore::read_statement(const char *sql)
+{
+    return cached_statement(this->reader, this->read_statements, sql);
+}
+
+bool ServerStore::execute(const char *sql)
+{
+    sqlite3_stmt *stmt = this->statement(sql);
+    return stmt && step_done(stmt);
+}
+
+bool ServerStore::transaction(std::function<bool()> body)
+{
+    if (!this->execute("BEGIN IMMEDIATE;"))
+    {
+        return false;
+    }
+    if (body() && this->execute("COMMIT;"))
+    {
+        return true;
+    }
+    this->execute("ROLLBACK;");
+    return false;
+}
+
+// Columns: id, name, address_type, address, port, position.
+static ServerRecord read_server(sqlite3_stmt *stmt)
+{
+    ServerRecord record;
+    record.id = sqlite3_column_int(stmt, 0);
+    record.name = column_string(stmt, 1);
+    record.address_type = static_cast<eAddressType>(sqlite3_column_int(stmt, 2));
+    record.address = column_string(stmt, 3);
+    record.port = sqlite3_column_int(stmt, 4);
+    record.position = sqlite3_column_double(stmt, 5);
+    return record;
+}
+
+// Columns: server_id, address_type, address, port.
+static void read_backends(sqlite3_stmt *stmt, std::vector<ServerRecord> &records)
+{
+    std::map<int, size_t> record_index;
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        record_index[records[i].id] = i;
+    }
+    while (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        auto it = record_index.find(sqlite3_column_int(stmt, 0));
+        if (it == record_index.end())
+        {
+            continue;
+        }
+        eAddressType address_type = static_cast<eAddressType>(sqlite3_column_int(stmt, 1));
+        records[it->second].backends.push_back({address_type, column_string(stmt, 2), sqlite3_column_int(stmt, 3)});
+    }
+    sqlite3_reset(stmt);
+}
+
+long ServerStore::count_servers()
+{
+    long count = 0;
+    this->read([this, &count]()
+               {
+        sqlite3_stmt *stmt = this->read_statement("SELECT COUNT(*) FROM server;");
+        if (stmt && sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            count = (long)sqlite3_column_int64(stmt, 0);
+        }
+        if (stmt)
+        {
+            sqlite3_reset(stmt);
+        } });
+    return count;
+}
+
+// Binds the sort key rows have to come after, the top of the list without after.
+static void bind_after(sqlite3_stmt *stmt, const ServerRecord *after)
+{
+    sqlite3_bind_double(stmt, 1, after ? after->position : -std::numeric_limits<double>::infinity());
+    sqlite3_bind_int(stmt, 2, after ? after->id : 0);
+}
+
+// Up to limit rows (all of them when negative) following after in list order. The
+// position index (with the id it implicitly holds) is entered right at after, so a
+// page costs the same anywhere in the list.
+std::vector<ServerRecord> ServerStore::load_page(const ServerRecord *after, long limit)
+{
+    std::vector<ServerRecord> records;
+    this->read([this, &records, after, limit]()
+               {
+        sqlite3_stmt *stmt = this->read_statement("SELECT id, name, address_type, address, port, position FROM server "
+                                                  "WHERE (position, id) > (?, ?) ORDER BY position, id LIMIT ?;");
+        if (!stmt)
+        {
+            return;
+        }
+        bind_after(stmt, after);
+        sqlite3_bind_int64(stmt, 3, limit);
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            records.push_back(read_server(stmt));
+        }
+        sqlite3_reset(stmt);
+
+        stmt = this->read_statement("SELECT server_id, address_type, address, port FROM server_backend "
+                                    "WHERE server_id IN (SELECT id FROM server WHERE (position, id) > (?, ?) ORDER BY position, id LIMIT ?) ORDER BY id;");
+        if (!stmt)
+        {
+            return;
+        }
+        bind_after(stmt, after);
+        sqlite3_bind_int64(stmt, 3, limit);
+        read_backends(stmt, records); });
+    return records;
+}
+
+// Fills the id and position of the row count rows past after, false when the list
+// is shorter. Only the position index is read, for jumps to a page far away.
+bool ServerStore::seek_server(const ServerRecord *after, long count, ServerRecord *found)
+{
+    bool exists = false;
+    this->read([this, &exists, after, count, found]()
+               {
+        sqlite3_stmt *stmt = this->read_statement("SELECT id, position FROM server WHERE (position, id) > (?, ?) ORDER BY position, id LIMIT 1 OFFSET ?;");
+        if (!stmt)
+        {
+            return;
+        }
+        bind_after(stmt, after);
+        sqlite3_bind_int64(stmt, 3, count - 1);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            found->id = sqlite3_column_int(stmt, 0);
+            found->position = sqlite3_column_double(stmt, 1);
+            exists = true;
+        }
+        sqlite3_reset(stmt); });
+    return exists;
+}
+
+bool ServerStore::load_server(int id, ServerRecord *record)
+{
+    std::vector<ServerRecord> records;
+    this->read([this, &records, id]()
+               {
+        sqlite3_stmt *stmt = this->read_statement("SELECT id, name, address_type, address, port, position FROM server WHERE id = ?;");
+        if (!stmt)
+        {
+            return;
+        }
+        sqlite3_bind_int(stmt, 1, id);
+        if (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            records.push_back(read_server(stmt));
+        }
+        sqlite3_reset(stmt);
+
+        stmt = this->read_statement("SELECT server_id, address_type, address, port FROM server_backend WHERE server_id = ? ORDER BY id;");
+        if (!stmt)
+        {
+            return;
+        }
+        sqlite3_bind_int(stmt, 1, id);
+        read_backends(stmt, records); });
+    if (records.empty())
+    {
+        return false;
+    }
+    *record = records[0];
+    return true;
+}
+
+std::vector<RouteEntry> ServerStore::load_routes()
+{
+    std::vector<RouteEntry> routes;
+    this->read([this, &routes]()
+               {
+        sqlite3_stmt *stmt = this->read_statement("SELECT listen_port, server_id, tunnel FROM route ORDER BY listen_port;");
+        if (!stmt)
+        {
+            return;
+        }
+        while (sqlite3_step(stmt) == SQLITE_ROW)
+        {
+            routes.push_back({sqlite3_column_int(stmt, 0), sqlite3_column_int(stmt, 1), sqlite3_column_int(stmt, 2)});
+        }
+        sqlite3_reset(stmt); });
+    return routes;
+}
+
+// New servers go to the bottom of the list, must run inside a transaction.
+bool ServerStore::insert_rows(ServerRecord &record)
+{
+    sqlite3_stmt *stmt = this->statement("INSERT INTO server (name,address_type,address,port,position) "
+                                         "VALUES (?, ?, ?, ?, COALESCE((SELECT MAX(position) FROM server), 0) + 1) RETURNING id, position;");
+    if (!stmt)
+    {
+        return false;
+    }
+    int id = -1;
+    sqlite3_bind_text(stmt, 1, record.name.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 2, static_cast<int>(record.address_type));
+    sqlite3_bind_text(stmt, 3, record.address.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 4, record.port);
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+    {
+        id = sqlite3_column_int(stmt, 0);
+        record.position = sqlite3_column_double(stmt, 1);
+    }
+    if (!step_done(stmt) || id == -1)
+    {
+        return false;
+    }
+    record.id = id;
+
+    stmt = this->statement("INSERT INTO server_backend (server_id,address_type,address,port) VALUES (?, ?, ?, ?);");
+    if (!stmt)
+    {
+        return false;
+    }
+    for (const auto &backend : record.backends)
+    {
+        sqlite3_bind_int(stmt, 1, id);
+        sqlite3_bind_int(stmt, 2, static_cast<int>(backend.address_type));
+        sqlite3_bind_text(stmt, 3, backend.address.c_str(), -1, SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 4, backend.port);
+        if (!step_done(stmt))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// done runs on the worker thread with the record id and position filled in, id is
+// -1 if nothing was saved.
+void ServerStore::insert_server(ServerRecord record, std::function<void(ServerRecord)> done)
+{
+    this->post([this, record, done]() mutable
+               {
+        bool saved = this->transaction([this, &record]()
+                                       { return this->insert_rows(record); });
+        if (!saved)
+        {
+            record.id = -1;
+        }
+        done(record); });
+}
+
+// Imports are one transaction, so either every record is saved or none. done gets
+// the number of saved records, -1 on failure.
+void ServerStore::insert_servers(std::vector<ServerRecord> records, std::function<void(int)> done)
+{
+    this->post([this, records, done]() mutable
+               {
+        bool saved = this->transaction([this, &records]()
+                                       {
+            for (auto &record : records)
+            {
+                if (!this->insert_rows(record))
+                {
+                    return false;
+                }
+            }
+            return true; });
+        {
+            std::lock_guard<std::mutex> lock(this->mutex);
+            this->imports--;
+        }
+        done(saved ? (int)records.size() : -1); },
+               true);
+}
+
+void ServerStore::delete_server(int id)
+{
+    this->post([this, id]()
+               {
+        bool deleted = this->transaction([this, id]()
+                                         {
+            const char *queries[] = {"DELETE FROM server WHERE id = ?;",
+                                     "DELETE FROM server_backend WHERE server_id = ?;",
+                                     "DELETE FROM route WHERE server_id = ?;"};
+            for (const char *sql : queries)
+            {
+                sqlite3_stmt *stmt = this->statement(sql);
+                if (!stmt)
+                {
+                    return false;
+                }
+                sqlite3_bind_int(stmt, 1, id);
+                if (!step_done(stmt))
+                {
+                    return false;
+                }
+            }
+            return true; });
+        if (!deleted)
+        {
+            std::cerr << "Couldn't delete server " << id << "." << std::endl;
+        } });
+}
+
+// Moving a server only rewrites its own sort key.
+void ServerStore::set_position(int id, double position)
+{
+    this->post([this, id, position]()
+               {
+        sqlite3_stmt *stmt = this->statement("UPDATE server SET position = ? WHERE id = ?;");
+        if (!stmt)
+        {
+            return;
+        }
+        sqlite3_bind_double(stmt, 1, position);
+        sqlite3_bind_int(stmt, 2, id);
+        if (!step_done(stmt))
+        {
+            std::cerr << "Couldn't move server " << id << "." << std::endl;
+        } });
+}
+
+// Used when position_between ran out of precision, every server gets its rank as key.
+void ServerStore::renumber_positions()
+{
+    this->post([this]()
+               {
+        if (!this->execute("UPDATE server SET position = ranked.rank FROM "
+                           "(SELECT id, ROW_NUMBER() OVER (ORDER BY position, id) AS rank FROM server) AS ranked "
+                           "WHERE server.id = ranked.id;"))
+        {
+            std::cerr << "Couldn't renumber servers." << std::endl;
+        } });
+}
+
+void ServerStore::insert_route(int listen_port, int server_id, int tunnel)
+{
+    this->post([this, listen_port, server_id, tunnel]()
+               {
+        sqlite3_stmt *stmt = this->statement("INSERT INTO route (listen_port, server_id, tunnel) VALUES (?, ?, ?);");
+        if (!stmt)
+        {
+            return;
+        }
+        sqlite3_bind_int(stmt, 1, listen_port);
+        sqlite3_bind_int(stmt, 2, server_id);
+        sqlite3_bind_int(stmt, 3, tunnel);
+        if (!step_done(stmt))
+        {
+            std::cerr << "Couldn't save route " << listen_port << "." << std::endl;
+        } });
+}
+
+void ServerStore::delete_route(int listen_port)
+{
+    this->post([this, listen_port]()
+               {
+        sqlite3_stmt *stmt = this->statement("DELETE FROM route WHERE listen_port = ?;");
+        if (!stmt)
+        {
+            return;
+        }
+        sqlite3_bind_int(stmt, 1, listen_port);
+        if (!step_done(stmt))
+        {
+            std::cerr << "Couldn't delete route " << listen_port << "." << std::endl;
+        } });
+}
@@ -0,0 +1,97 @@
+#ifndef SERVER_STORE_H
+#define SERVER_STORE_H
+
+#include "proxy_common.h"
+#include "sqlite3.h"
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#define STORE_BUSY_TIMEOUT_MS 5000 // Wait for another connection holding the write lock.
+
+typedef struct
+{
+    eAddressType address_type;
+    std::string address;
+    int port;
+} ServerBackend;
+
+typedef struct
+{
+    int id;
+    std::string name;
+    eAddressType address_type;
+    std::string address;
+    int port;
+    std::vector<ServerBackend> backends; // Extra upstreams used for failover, the record address is the first one.
+    double position;                     // Sort key, a moved server gets a value between its new neighbours.
+} ServerRecord;
+
+typedef struct
+{
+    int listen_port;
+    int server_id;
+    int tunnel; // TUNNEL_NONE, or which end of a tunnel between two proxies the route is.
+} RouteEntry;
+
+// Returns a sort key strictly between before and after, false once doubles can't
+// split the gap anymore and the list has to be renumbered.
+bool position_between(double before, double after, double *position);
+
+// Owns servers.db. Every write runs on a single worker thread with prepared
+// statements kept for the lifetime of the connection, so writes queued from the
+// UI never wait on disk. Loads use a second, read-only connection on the calling
+// thread: they wait for the queued writes before them to be done so they see the
+// latest list, except while an import is pending, then they see the list as it was
+// before the import instead of waiting for it to commit.
+class ServerStore
+{
+private:
+    sqlite3 *db = nullptr;
+    std::unordered_map<std::string, sqlite3_stmt *> statements; // Only touched by the worker thread.
+    std::deque<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable wakeup;
+    std::condition_variable written; // A queued write is done.
+    uint64_t writes_posted = 0;
+    uint64_t writes_done = 0;
+    int imports = 0; // Imports posted and not done yet.
+    bool running = false;
+    std::thread worker;
+    sqlite3 *reader = nullptr;
+    std::unordered_map<std::string, sqlite3_stmt *> read_statements; // Guarded by read_mutex.
+    std::mutex read_mutex;
+
+    void run();
+    void post(std::function<void()> job, bool import = false);
+    void read(std::function<void()> job);
+    sqlite3_stmt *statement(const char *sql);
+    sqlite3_stmt *read_statement(const char *sql);
+    bool execute(const char *sql);
+    bool transaction(std::function<bool()> body);
+    bool migrate();
+    bool insert_rows(ServerRecord &record);
+
+public:
+    ServerStore();
+    ~ServerStore();
+    int open(const char *path);
+    void close();
+    long count_servers();
+    std::vector<ServerRecord> load_page(const ServerRecord *after, long limit);
+    bool seek_server(const ServerRecord *after, long count, ServerRecord *found);
+    bool load_server(int id, ServerRecord *record);
+    std::vector<RouteEntry> load_routes();
+    void insert_server(ServerRecord record, std::function<void(ServerRecord)> done);
+    void insert_servers(std::vector<ServerRecord> records, std::function<void(int)> done);
+    void delete_server(int id);
+    void set_position(int id, double position);
+    void renumber_positions();
+    void insert_route(int listen_port, int server_id, int tunnel);
+    void delete_route(int listen_port);
+};
+
+#endif
@@ -0,0 +1,550 @@
+#include "tunnel.h"
+#include "gf256.h"
+#include <algorithm>
+#include <cstring>
+#include <random>
+
+// Cauchy matrix entries, any square part of it can be inverted so any parity rows
+// rebuild the same number of lost data rows.
+static uint8_t coefficient(int parity_index, int data_index)
+{
+    return gf256_inv((uint8_t)((TUNNEL_FEC_GROUP + parity_index) ^ data_index));
+}
+
+static void write_u32(char *out, uint32_t value)
+{
+    out[0] = (char)(value >> 24);
+    out[1] = (char)(value >> 16);
+    out[2] = (char)(value >> 8);
+    out[3] = (char)value;
+}
+
+static uint32_t read_u32(const char *in)
+{
+    return ((uint32_t)(uint8_t)in[0] << 24) | ((uint32_t)(uint8_t)in[1] << 16) |
+           ((uint32_t)(uint8_t)in[2] << 8) | (uint32_t)(uint8_t)in[3];
+}
+
+static int count_bits(uint32_t bits)
+{
+    int count = 0;
+    for (; bits; bits &= bits - 1)
+    {
+        count++;
+    }
+    return count;
+}
+
+// Group numbers wrap around, a is older than b when it's less than half the range behind.
+static bool group_before(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) < 0;
+}
+
+const char *tunnel_mode_name(int mode)
+{
+    switch (mode)
+    {
+    case TUNNEL_ENTRY:
+        return "tunnel entry";
+    case TUNNEL_EXIT:
+        return "tunnel exit";
+    default:
+        return "direct";
+    }
+}
+
+uint32_t tunnel_new_session_id()
+{
+    static std::mt19937 random(std::random_device{}());
+    return (uint32_t)random();
+}
+
+bool tunnel_frame_session(const char *frame, int size, uint32_t *session_id)
+{
+    if (size < TUNNEL_HEADER || frame[0] != TUNNEL_VERSION)
+    {
+        return false;
+    }
+    *session_id = read_u32(frame + 2);
+    return true;
+}
+
+int tunnel_write_handshake(char *frame, int type, uint32_t session_id, uint64_t cookie)
+{
+    memset(frame, 0, TUNNEL_HANDSHAKE_SIZE);
+    frame[0] = TUNNEL_VERSION;
+    frame[1] = (char)type;
+    write_u32(frame + 2, session_id);
+    write_u32(frame + TUNNEL_HEADER, (uint32_t)(cookie >> 32));
+    write_u32(frame + TUNNEL_HEADER + 4, (uint32_t)cookie);
+    return TUNNEL_HANDSHAKE_SIZE;
+}
+
+bool tunnel_read_handshake(const char *frame, int size, int *type, uint32_t *session_id, uint64_t *cookie)
+{
+    if (size != TUNNEL_HANDSHAKE_SIZE || frame[0] != TUNNEL_VERSION || (frame[1] != TUNNEL_HELLO && frame[1] != TUNNEL_COOKIE))
+    {
+        return false;
+    }
+    *type = frame[1];
+    *session_id = read_u32(frame + 2);
+    *cookie = ((uint64_t)read_u32(frame + TUNNEL_HEADER) << 32) | read_u32(frame + TUNNEL_HEADER + 4);
+    return true;
+}
+
+bool SequenceWindow::accept(uint32_t sequence)
+{
+    if (!this->started)
+    {
+        this->started = true;
+        this->highest = sequence;
+        this->bits[(sequence % TUNNEL_DEDUP_WINDOW) / 64] |= 1ull << (sequence % 64);
+        return true;
+    }
+
+    int32_t ahead = (int32_t)(sequence - this->highest);
+    if (ahead > 0)
+    {
+        // Every slot is cleared once per trip around the window, so this stays O(1) on average.
+        if (ahead >= TUNNEL_DEDUP_WINDOW)
+        {
+            memset(this->bits, 0, sizeof(this->bits));
+        }
+        else
+        {
+            for (uint32_t skipped = this->highest + 1; skipped != sequence; skipped++)
+            {
+                this->bits[(skipped % TUNNEL_DEDUP_WINDOW) / 64] &= ~(1ull << (skipped % 64));
+            }
+        }
+        this->highest = sequence;
+    }
+    else if (this->highest - sequence >= TUNNEL_DEDUP_WINDOW)
+    {
+        return false;
+    }
+
+    uint64_t &word = this->bits[(sequence % TUNNEL_DEDUP_WINDOW) / 64];
+    uint64_t bit = 1ull << (sequence % 64);
+    if (ahead <= 0 && (word & bit))
+    {
+        return false;
+    }
+    word |= bit;
+    return true;
+}
+
+Tunnel::Tunnel(uint32_t session_id)
+{
+    this->session_id = session_id;
+    this->parity.resize(TUNNEL_FEC_MAX_PARITY);
+    for (auto &group : this->groups)
+    {
+        group.used = false;
+        group.data.resize(TUNNEL_FEC_GROUP);
+        group.parity.resize(TUNNEL_FEC_MAX_PARITY);
+    }
+    this->last_report = std::chrono::steady_clock::now();
+}
+
+void Tunnel::write_header(char *frame, int type)
+{
+    frame[0] = TUNNEL_VERSION;
+    frame[1] = (char)type;
+    write_u32(frame + 2, this->session_id);
+    write_u32(frame + 6, this->send_sequence++);
+}
+
+void Tunnel::emit(const char *frame, int size, std::chrono::steady_clock::time_point now, TunnelSink *sink)
+{
+    if (this->bundle_size + 2 + size > TUNNEL_BUNDLE_MAX)
+    {
+        this->flush_bundle(sink);
+    }
+    if (TUNNEL_BUNDLE_HEADER + 2 + size > TUNNEL_BUNDLE_MAX)
+    {
+        sink->to_peer(frame, size);
+        return;
+    }
+    if (this->bundle_frames == 0)
+    {
+        this->bundle[0] = TUNNEL_VERSION;
+        this->bundle[1] = TUNNEL_BUNDLE;
+        write_u32(this->bundle + 2, this->session_id);
+        this->bundle_size = TUNNEL_BUNDLE_HEADER;
+        this->bundle_started = now;
+    }
+    this->bundle[this->bundle_size] = (char)(size >> 8);
+    this->bundle[this->bundle_size + 1] = (char)size;
+    memcpy(this->bundle + this->bundle_size + 2, frame, size);
+    this->bundle_size += 2 + size;
+    this->bundle_frames++;
+}
+
+bool Tunnel::bundle_pending()
+{
+    return this->bundle_frames > 0;
+}
+
+std::chrono::steady_clock::time_point Tunnel::bundle_since()
+{
+    return this->bundle_started;
+}
+
+// A lone frame goes out as is, the bundle header would only add bytes.
+void Tunnel::flush_bundle(TunnelSink *sink)
+{
+    if (this->bundle_frames == 1)
+    {
+        sink->to_peer(this->bundle + TUNNEL_BUNDLE_HEADER + 2, this->bundle_size - TUNNEL_BUNDLE_HEADER - 2);
+    }
+    else if (this->bundle_frames > 1)
+    {
+        this->bundled += this->bundle_frames;
+        sink->to_peer(this->bundle, this->bundle_size);
+    }
+    this->bundle_frames = 0;
+    this->bundle_size = 0;
+}
+
+void Tunnel::send(const char *datagram, int size, std::chrono::steady_clock::time_point now, TunnelSink *sink)
+{
+    if (size > TUNNEL_MAX_PAYLOAD)
+    {
+        return;
+    }
+
+    if (this->send_count == 0)
+    {
+        // Twice the measured loss, so a group usually has parity left after losing datagrams.
+        int parity = (TUNNEL_FEC_GROUP * this->peer_loss * 2 + 999) / 1000;
+        this->send_parity = std::min(std::max(parity, TUNNEL_FEC_MIN_PARITY), TUNNEL_FEC_MAX_PARITY);
+        this->send_shard_size = 0;
+        this->send_started = now;
+        for (auto &parity_shard : this->parity)
+        {
+            parity_shard.clear();
+        }
+    }
+
+    char frame[TUNNEL_DATA_HEADER + TUNNEL_MAX_PAYLOAD];
+    this->write_header(frame, TUNNEL_DATA);
+    write_u32(frame + TUNNEL_HEADER, this->send_group);
+    frame[TUNNEL_HEADER + 4] = (char)this->send_count;
+    memcpy(frame + TUNNEL_DATA_HEADER, datagram, size);
+    this->emit(frame, TUNNEL_DATA_HEADER + size, now, sink);
+
+    // Shards carry their length so rebuilt datagrams lose the padding.
+    uint8_t shard[2 + TUNNEL_MAX_PAYLOAD];
+    shard[0] = (uint8_t)(size >> 8);
+    shard[1] = (uint8_t)size;
+    memcpy(shard + 2, datagram, size);
+    int shard_size = size + 2;
+    this->send_shard_size = std::max(this->send_shard_size, shard_size);
+    for (int i = 0; i < this->send_parity; i++)
+    {
+        if ((int)this->parity[i].size() < shard_size)
+        {
+            this->parity[i].resize(shard_size, 0);
+        }
+        gf256_mul_add(this->parity[i].data(), shard, coefficient(i, this->send_count), shard_size);
+    }
+
+    this->send_count++;
+    if (this->send_count == TUNNEL_FEC_GROUP)
+    {
+        this->close_group(now, sink);
+    }
+}
+
+void Tunnel::close_group(std::chrono::steady_clock::time_point now, TunnelSink *sink)
+{
+    if (this->send_count == 0)
+    {
+        return;
+    }
+    // Parity never shares a datagram with the data it covers, losing one mustn't lose both.
+    this->flush_bundle(sink);
+    char frame[TUNNEL_PARITY_HEADER + 2 + TUNNEL_MAX_PAYLOAD];
+    for (int i = 0; i < this->send_parity; i++)
+    {
+        this->write_header(frame, TUNNEL_PARITY);
+        write_u32(frame + TUNNEL_HEADER, this->send_group);
+        frame[TUNNEL_HEADER + 4] = (char)i;
+        frame[TUNNEL_HEADER + 5] = (char)this->send_count;
+        frame[TUNNEL_HEADER + 6] = (char)this->send_parity;
+        this->parity[i].resize(this->send_shard_size, 0);
+        memcpy(frame + TUNNEL_PARITY_HEADER, this->parity[i].data(), this->send_shard_size);
+        this->emit(frame, TUNNEL_PARITY_HEADER + this->send_shard_size, now, sink);
+    }
+    this->send_group++;
+    this->send_count = 0;
+}
+
+Tunnel::ReceiveGroup *Tunnel::find_group(uint32_t group)
+{
+    ReceiveGroup *slot = &this->groups[group % TUNNEL_FEC_WINDOW];
+    if (slot->used && slot->group == group)
+    {
+        return slot;
+    }
+    if (slot->used && group_before(group, slot->group))
+    {
+        return nullptr;
+    }
+    if (slot->used)
+    {
+        this->retire_group(slot);
+    }
+    slot->used = true;
+    slot->group = group;
+    slot->data_count = -1;
+    slot->shard_size = -1;
+    slot->received = 0;
+    slot->received_count = 0;
+    slot->highest = -1;
+    slot->parity_received = 0;
+    return slot;
+}
+
+// Counts the losses of a group leaving the window for the next report.
+void Tunnel::retire_group(ReceiveGroup *group)
+{
+    int count = group->data_count >= 0 ? group->data_count : group->highest + 1;
+    this->expected += count;
+    this->missing += count - group->received_count;
+    this->lost += count - count_bits(group->received & ((1u << count) - 1));
+}
+
+void Tunnel::deliver(ReceiveGroup *group, int index, const uint8_t *shard, int shard_size, TunnelSink *sink)
+{
+    group->received |= 1u << index;
+    group->highest = std::max(group->highest, index);
+    group->data[index].assign(shard, shard + shard_size);
+    int size = (shard[0] << 8) | shard[1];
+    if (size + 2 <= shard_size)
+    {
+        sink->to_local((const char *)shard + 2, size);
+    }
+}
+
+void Tunnel::try_recover(ReceiveGroup *group, TunnelSink *sink)
+{
+    int count = group->data_count;
+    if (count < 0)
+    {
+        return;
+    }
+    int lost_indexes[TUNNEL_FEC_GROUP];
+    int lost_count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (!(group->received & (1u << i)))
+        {
+            lost_indexes[lost_count++] = i;
+        }
+        else if ((int)group->data[i].size() > group->shard_size)
+        {
+            return; // Doesn't belong to the parity we got.
+        }
+    }
+    if (lost_count == 0 || count_bits(group->parity_received) < lost_count)
+    {
+        return;
+    }
+
+    // parity[p] minus what the received datagrams put in it leaves a lost_count x lost_count
+    // system over the lost datagrams, solved by inverting that part of the Cauchy matrix.
+    int parity_indexes[TUNNEL_FEC_GROUP];
+    for (int i = 0, found = 0; found < lost_count; i++)
+    {
+        if (group->parity_received & (1u << i))
+        {
+            parity_indexes[found++] = i;
+        }
+    }
+
+    int shard_size = group->shard_size;
+    std::vector<std::vector<uint8_t>> syndromes(lost_count);
+    uint8_t matrix[TUNNEL_FEC_GROUP][2 * TUNNEL_FEC_GROUP];
+    for (int r = 0; r < lost_count; r++)
+    {
+        syndromes[r] = group->parity[parity_indexes[r]];
+        for (int i = 0; i < count; i++)
+        {
+            if (group->received & (1u << i))
+            {
+                gf256_mul_add(syndromes[r].data(), group->data[i].data(), coefficient(parity_indexes[r], i), group->data[i].size());
+            }
+        }
+        for (int c = 0; c < lost_count; c++)
+        {
+            matrix[r][c] = coefficient(parity_indexes[r], lost_indexes[c]);
+            matrix[r][lost_count + c] = r == c ? 1 : 0;
+        }
+    }
+
+    // Gauss-Jordan, the right half ends up as the inverse.
+    for (int c = 0; c < lost_count; c++)
+    {
+        int pivot = c;
+        while (pivot < lost_count && matrix[pivot][c] == 0)
+        {
+            pivot++;
+        }
+        if (pivot == lost_count)
+        {
+            return;
+        }
+        if (pivot != c)
+        {
+            for (int k = 0; k < 2 * lost_count; k++)
+            {
+                std::swap(matrix[c][k], matrix[pivot][k]);
+            }
+        }
+        uint8_t scale = gf256_inv(matrix[c][c]);
+        for (int k = 0; k < 2 * lost_count; k++)
+        {
+            matrix[c][k] = gf256_mul(matrix[c][k], scale);
+        }
+        for (int r = 0; r < lost_count; r++)
+        {
+            uint8_t factor = matrix[r][c];
+            if (r != c && factor != 0)
+            {
+                for (int k = 0; k < 2 * lost_count; k++)
+                {
+                    matrix[r][k] ^= gf256_mul(factor, matrix[c][k]);
+                }
+            }
+        }
+    }
+
+    std::vector<uint8_t> shard(shard_size);
+    for (int c = 0; c < lost_count; c++)
+    {
+        std::fill(shard.begin(), shard.end(), 0);
+        for (int r = 0; r < lost_count; r++)
+        {
+            gf256_mul_add(shard.data(), syndromes[r].data(), matrix[c][lost_count + r], shard_size);
+        }
+        this->recovered++;
+        this->deliver(group, lost_indexes[c], shard.data(), shard_size, sink);
+    }
+}
+
+void Tunnel::receive(const char *frame, int size, std::chrono::steady_clock::time_point now, TunnelSink *sink)
+{
+    uint32_t session_id;
+    if (!tunnel_frame_session(frame, size, &session_id) || session_id != this->session_id)
+    {
+        return;
+    }
+    if (frame[1] == TUNNEL_BUNDLE)
+    {
+        for (int offset = TUNNEL_BUNDLE_HEADER; offset + 2 <= size;)
+        {
+            int length = ((uint8_t)frame[offset] << 8) | (uint8_t)frame[offset + 1];
+            offset += 2;
+            if (length > size - offset || length < 2 || frame[offset + 1] == TUNNEL_BUNDLE)
+            {
+                return;
+            }
+            this->receive(frame + offset, length, now, sink);
+            offset += length;
+        }
+        return;
+    }
+    if (!this->window.accept(read_u32(frame + 6)))
+    {
+        this->duplicates++;
+        return;
+    }
+
+    if (frame[1] == TUNNEL_DATA && size >= TUNNEL_DATA_HEADER)
+    {
+        int index = (uint8_t)frame[TUNNEL_HEADER + 4];
+        int payload = size - TUNNEL_DATA_HEADER;
+        if (index >= TUNNEL_FEC_GROUP || payload > TUNNEL_MAX_PAYLOAD)
+        {
+            return;
+        }
+        ReceiveGroup *group = this->find_group(read_u32(frame + TUNNEL_HEADER));
+        if (group == nullptr)
+        {
+            // Too late to be part of any parity, still worth delivering.
+            sink->to_local(frame + TUNNEL_DATA_HEADER, payload);
+            return;
+        }
+        if (group->received & (1u << index))
+        {
+            return;
+        }
+        uint8_t shard[2 + TUNNEL_MAX_PAYLOAD];
+        shard[0] = (uint8_t)(payload >> 8);
+        shard[1] = (uint8_t)payload;
+        memcpy(shard + 2, frame + TUNNEL_DATA_HEADER, payload);
+        group->received_count++;
+        this->deliver(group, index, shard, payload + 2, sink);
+        this->try_recover(group, sink);
+    }
+    else if (frame[1] == TUNNEL_PARITY && size > TUNNEL_PARITY_HEADER + 2)
+    {
+        int index = (uint8_t)frame[TUNNEL_HEADER + 4];
+        int data_count = (uint8_t)frame[TUNNEL_HEADER + 5];
+        int parity_count = (uint8_t)frame[TUNNEL_HEADER + 6];
+        int shard_size = size - TUNNEL_PARITY_HEADER;
+        if (data_count < 1 || data_count > TUNNEL_FEC_GROUP || parity_count > TUNNEL_FEC_MAX_PARITY ||
+            index >= parity_count || shard_size > 2 + TUNNEL_MAX_PAYLOAD)
+        {
+            return;
+        }
+        ReceiveGroup *group = this->find_group(read_u32(frame + TUNNEL_HEADER));
+        if (group == nullptr || (group->parity_received & (1u << index)) ||
+            (group->shard_size != -1 && group->shard_size != shard_size))
+        {
+            return;
+        }
+        group->data_count = data_count;
+        group->shard_size = shard_size;
+        group->parity_received |= 1u << index;
+        group->parity[index].assign((const uint8_t *)frame + TUNNEL_PARITY_HEADER, (const uint8_t *)frame + size);
+        this->try_recover(group, sink);
+    }
+    else if (frame[1] == TUNNEL_REPORT && size >= TUNNEL_REPORT_SIZE)
+    {
+        this->peer_loss = std::min(((uint8_t)frame[TUNNEL_HEADER] << 8) | (uint8_t)frame[TUNNEL_HEADER + 1], 1000);
+    }
+}
+
+// Sends the parity of a group that stopped filling up and the periodic loss report.
+void Tunnel::tick(std::chrono::steady_clock::time_point now, TunnelSink *sink)
+{
+    if (this->send_count > 0 && now - this->send_started >= std::chrono::milliseconds(TUNNEL_FEC_FLUSH_MS))
+    {
+        this->close_group(now, sink);
+    }
+
+    if (now - this->last_report >= std::chrono::milliseconds(TUNNEL_REPORT_INTERVAL_MS))
+    {
+        this->last_report = now;
+        if (this->expected > 0)
+        {
+            int loss = (int)(this->missing * 1000 / this->expected);
+            char frame[TUNNEL_REPORT_SIZE];
+            this->write_header(frame, TUNNEL_REPORT);
+            frame[TUNNEL_HEADER] = (char)(loss >> 8);
+            frame[TUNNEL_HEADER + 1] = (char)loss;
+            this->emit(frame, TUNNEL_REPORT_SIZE, now, sink);
+            this->expected = 0;
+            this->missing = 0;
+        }
+    }
+}
+
+TunnelStats Tunnel::stats()
+{
+    return {this->recovered, this->duplicates, this->lost, this->bundled, this->send_parity, this->peer_loss};
+}
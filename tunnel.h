@@ -0,0 +1,148 @@
+#ifndef TUNNEL_H
+#define TUNNEL_H
+
+#include <chrono>
+#include <cstdint>
+#include <vector>
+
+#define TUNNEL_NONE 0  // Plain forwarding.
+#define TUNNEL_ENTRY 1 // Clients are local, the route's server is another proxy with a TUNNEL_EXIT route.
+#define TUNNEL_EXIT 2  // Clients are TUNNEL_ENTRY proxies, the route's server is the game server.
+
+#define TUNNEL_VERSION 1
+#define TUNNEL_DATA 1
+#define TUNNEL_PARITY 2
+#define TUNNEL_REPORT 3
+#define TUNNEL_BUNDLE 4
+#define TUNNEL_HELLO 5  // Entry to exit when a session starts, empty or echoing the exit's cookie.
+#define TUNNEL_COOKIE 6 // Exit to entry, answers an empty hello.
+#define TUNNEL_HEADER 10        // version, type, session (4), sequence (4)
+#define TUNNEL_DATA_HEADER 15   // header, group (4), index
+#define TUNNEL_PARITY_HEADER 17 // header, group (4), parity index, data count, parity count
+#define TUNNEL_REPORT_SIZE 12   // header, loss per mille (2)
+#define TUNNEL_BUNDLE_HEADER 6  // version, type, session (4), then a length (2) before each frame
+#define TUNNEL_HANDSHAKE_SIZE 18 // header, cookie (8)
+
+#define TUNNEL_MAX_PAYLOAD 2048     // Largest datagram carried, same as ENGINE_BUFFER_SIZE.
+#define TUNNEL_FEC_GROUP 8          // Datagrams covered by the same parity.
+#define TUNNEL_FEC_MAX_PARITY 8     // Parity datagrams of a group at the worst measured loss.
+#define TUNNEL_FEC_MIN_PARITY 1     // Parity datagrams of a group on a clean path.
+#define TUNNEL_FEC_FLUSH_MS 20      // A group waits this long for more datagrams before its parity is sent.
+#define TUNNEL_FEC_WINDOW 8         // Groups the receiver keeps to recover late losses.
+#define TUNNEL_REPORT_INTERVAL_MS 250
+#define TUNNEL_TICK_MS 5            // Engine wake-up interval while a tunnel route runs.
+#define TUNNEL_DEDUP_WINDOW 1024    // Frames remembered to drop the copies sent over other paths.
+#define TUNNEL_BUNDLE_MAX 1200      // Frames are packed together up to this size, below the smallest IPv6 MTU.
+#define TUNNEL_HELLO_RETRY_MS 200   // An entry without a cookie asks again this often.
+#define TUNNEL_HELLO_ATTEMPTS 5     // Then it assumes an exit that doesn't validate and sends anyway.
+#define TUNNEL_HELD_FRAMES 64       // Frames an entry keeps while waiting for the cookie.
+
+// Where a tunnel puts its output, implemented by the engine for each session.
+class TunnelSink
+{
+public:
+    virtual void to_peer(const char *frame, int size) = 0;
+    virtual void to_local(const char *datagram, int size) = 0;
+};
+
+typedef struct
+{
+    uint64_t recovered;  // Lost datagrams rebuilt from parity.
+    uint64_t duplicates; // Copies of frames that already arrived over another path.
+    uint64_t lost;       // Lost datagrams parity couldn't rebuild.
+    uint64_t bundled;    // Frames sent in the same datagram as others.
+    int parity;          // Parity datagrams per group currently sent.
+    int peer_loss;       // Loss per mille the peer measured on what we send.
+} TunnelStats;
+
+// Sliding window over frame sequence numbers, tells in O(1) if a frame was already seen.
+class SequenceWindow
+{
+private:
+    uint64_t bits[TUNNEL_DEDUP_WINDOW / 64] = {};
+    uint32_t highest = 0;
+    bool started = false;
+
+public:
+    bool accept(uint32_t sequence);
+};
+
+// One side of a forward error correction tunnel between two proxies. Datagrams go
+// out right away with a group number, every TUNNEL_FEC_GROUP of them (or after
+// TUNNEL_FEC_FLUSH_MS) Reed-Solomon parity follows so the peer can rebuild as many
+// lost datagrams as parity it got. Each side reports the loss it sees and the other
+// side sends more or less parity to match. Frames carry the session id so a session
+// can use several paths, copies arriving over the slower paths are dropped. Frames
+// going out together are packed in one datagram until flush_bundle().
+class Tunnel
+{
+private:
+    typedef struct
+    {
+        uint32_t group;
+        bool used;
+        int data_count;     // -1 until a parity datagram tells how many datagrams the group has.
+        int shard_size;     // -1 until a parity datagram arrives.
+        uint32_t received;  // Bit per data index, recovered ones included.
+        int received_count; // Data datagrams that actually arrived.
+        int highest;        // Highest data index seen.
+        uint32_t parity_received;
+        std::vector<std::vector<uint8_t>> data;   // Length prefixed and padded like the sender's shards.
+        std::vector<std::vector<uint8_t>> parity;
+    } ReceiveGroup;
+
+    uint32_t session_id;
+
+    // Sending side.
+    uint32_t send_sequence = 0;
+    uint32_t send_group = 0;
+    int send_count = 0;
+    int send_parity = TUNNEL_FEC_MIN_PARITY;
+    int send_shard_size = 0;
+    std::chrono::steady_clock::time_point send_started;
+    std::vector<std::vector<uint8_t>> parity; // Parity of the open group, built as datagrams go out.
+    int peer_loss = 0;
+    char bundle[TUNNEL_BUNDLE_MAX];
+    int bundle_size = 0;
+    int bundle_frames = 0;
+    uint64_t bundled = 0;
+    std::chrono::steady_clock::time_point bundle_started;
+
+    // Receiving side.
+    SequenceWindow window;
+    uint64_t duplicates = 0;
+    ReceiveGroup groups[TUNNEL_FEC_WINDOW];
+    uint64_t expected = 0; // Since the last report.
+    uint64_t missing = 0;
+    uint64_t recovered = 0;
+    uint64_t lost = 0;
+    std::chrono::steady_clock::time_point last_report;
+
+    void write_header(char *frame, int type);
+    void emit(const char *frame, int size, std::chrono::steady_clock::time_point now, TunnelSink *sink);
+    void close_group(std::chrono::steady_clock::time_point now, TunnelSink *sink);
+    ReceiveGroup *find_group(uint32_t group);
+    void retire_group(ReceiveGroup *group);
+    void deliver(ReceiveGroup *group, int index, const uint8_t *shard, int shard_size, TunnelSink *sink);
+    void try_recover(ReceiveGroup *group, TunnelSink *sink);
+
+public:
+    Tunnel(uint32_t session_id);
+    void send(const char *datagram, int size, std::chrono::steady_clock::time_point now, TunnelSink *sink);
+    void receive(const char *frame, int size, std::chrono::steady_clock::time_point now, TunnelSink *sink);
+    void tick(std::chrono::steady_clock::time_point now, TunnelSink *sink);
+    bool bundle_pending();
+    std::chrono::steady_clock::time_point bundle_since();
+    void flush_bundle(TunnelSink *sink);
+    TunnelStats stats();
+};
+
+const char *tunnel_mode_name(int mode);
+uint32_t tunnel_new_session_id();
+// Session id of a frame, false if it isn't a tunnel frame.
+bool tunnel_frame_session(const char *frame, int size, uint32_t *session_id);
+int tunnel_write_handshake(char *frame, int type, uint32_t session_id, uint64_t cookie);
+// TUNNEL_HELLO or TUNNEL_COOKIE frames only, they never reach Tunnel::receive().
+bool tunnel_read_handshake(const char *frame, int size, int *type, uint32_t *session_id, uint64_t *cookie);
+
+#endif
@@ -0,0 +1,76 @@
+// Redirects the UDP packets of flows the proxy installed to its AF_XDP socket, every
+// other packet goes on to the kernel stack untouched.
+//
+// clang -O2 -g -target bpf -c xdp/flow_filter.bpf.c -o xdp_flow_filter.bpf.o
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/in.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <bpf/bpf_endian.h>
+#include <bpf/bpf_helpers.h>
+
+// XDP_FRAME_SIZE of xdp_engine.h less the headroom drivers keep in zero-copy mode, larger
+// packets (jumbo frames) go through the stack, whose buffers grow to fit them.
+#define MAX_FRAME (2048 - 256)
+
+// Same layout as XdpFlowKey in xdp_engine.h, every field in network order.
+struct flow_key
+{
+    __u32 saddr;
+    __u16 sport;
+    __u16 dport;
+};
+
+struct
+{
+    __uint(type, BPF_MAP_TYPE_HASH);
+    __uint(max_entries, 65536);
+    __type(key, struct flow_key);
+    __type(value, __u8);
+} flows SEC(".maps");
+
+struct
+{
+    __uint(type, BPF_MAP_TYPE_XSKMAP);
+    __uint(max_entries, 64);
+    __type(key, __u32);
+    __type(value, __u32);
+} xsks_map SEC(".maps");
+
+SEC("xdp")
+int flow_filter(struct xdp_md *ctx)
+{
+    void *data = (void *)(long)ctx->data;
+    void *data_end = (void *)(long)ctx->data_end;
+
+    if (ctx->data_end - ctx->data > MAX_FRAME)
+    {
+        return XDP_PASS;
+    }
+    struct ethhdr *eth = data;
+    if ((void *)(eth + 1) > data_end || eth->h_proto != bpf_htons(ETH_P_IP))
+    {
+        return XDP_PASS;
+    }
+    struct iphdr *ip = (void *)(eth + 1);
+    if ((void *)(ip + 1) > data_end || ip->protocol != IPPROTO_UDP || ip->ihl < 5 || (ip->frag_off & bpf_htons(0x3FFF)))
+    {
+        return XDP_PASS;
+    }
+    struct udphdr *udp = (void *)ip + ip->ihl * 4;
+    if ((void *)(udp + 1) > data_end)
+    {
+        return XDP_PASS;
+    }
+
+    struct flow_key key = {ip->saddr, udp->source, udp->dest};
+    if (!bpf_map_lookup_elem(&flows, &key))
+    {
+        return XDP_PASS;
+    }
+    // Falls back to the stack if no socket is bound to this queue.
+    return bpf_redirect_map(&xsks_map, ctx->rx_queue_index, XDP_PASS);
+}
+
+char _license[] SEC("license") = "GPL";
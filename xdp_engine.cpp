@@ -0,0 +1,475 @@
+#include "xdp_engine.h"
+#include "logger.h"
+
+#ifdef PROXY_WITH_XDP
+
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <linux/if_ether.h>
+#include <linux/if_link.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <net/if.h>
+#include <sys/mman.h>
+
+static uint64_t flow_id(XdpFlowKey key)
+{
+    return (uint64_t)key.saddr << 32 | (uint64_t)key.sport << 16 | key.dport;
+}
+
+static int64_t ticks(std::chrono::steady_clock::time_point time)
+{
+    return time.time_since_epoch().count();
+}
+
+// One's complement sum of 16 bit words, the byte order doesn't matter as long as it's the same everywhere.
+static uint32_t checksum_add(uint32_t sum, const uint16_t *words, int count)
+{
+    for (int i = 0; i < count; i++)
+    {
+        sum += words[i];
+    }
+    return sum;
+}
+
+static uint16_t checksum_fold(uint32_t sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// RFC 1624: HC' = ~(~HC + ~m + m') for every changed word m, whatever the payload size.
+static uint16_t checksum_update(uint16_t check, const uint16_t *before, const uint16_t *after, int count)
+{
+    uint32_t sum = (uint16_t)~check;
+    for (int i = 0; i < count; i++)
+    {
+        sum += (uint16_t)~before[i];
+        sum += after[i];
+    }
+    return checksum_fold(sum);
+}
+
+XdpEngine::~XdpEngine()
+{
+    this->close();
+}
+
+int XdpEngine::map_ring(XdpRing *ring, const xdp_ring_offset &offset, uint64_t page_offset, size_t descriptor_size, uint32_t size)
+{
+    ring->map_size = offset.desc + size * descriptor_size;
+    ring->map = mmap(nullptr, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->xsk, page_offset);
+    if (ring->map == MAP_FAILED)
+    {
+        ring->map = nullptr;
+        return 1;
+    }
+    uint8_t *base = (uint8_t *)ring->map;
+    ring->producer = (uint32_t *)(base + offset.producer);
+    ring->consumer = (uint32_t *)(base + offset.consumer);
+    ring->flags = (uint32_t *)(base + offset.flags);
+    ring->descriptors = base + offset.desc;
+    ring->mask = size - 1;
+    return 0;
+}
+
+int XdpEngine::open(const char *interface, int queue, bool native)
+{
+    this->interface = interface;
+    this->ifindex = if_nametoindex(interface);
+    if (this->ifindex == 0)
+    {
+        LOG(LOG_LEVEL_ERROR, "XDP: No interface named {}.", interface);
+        return 1;
+    }
+
+    this->program = bpf_object__open_file(XDP_PROGRAM_PATH, nullptr);
+    if (this->program == nullptr || bpf_object__load(this->program) != 0)
+    {
+        LOG(LOG_LEVEL_ERROR, "XDP: Couldn't load {}.", XDP_PROGRAM_PATH);
+        this->close();
+        return 1;
+    }
+    bpf_program *filter = bpf_object__find_program_by_name(this->program, "flow_filter");
+    this->flows_map = bpf_object__find_map_fd_by_name(this->program, "flows");
+    int xsks_map = bpf_object__find_map_fd_by_name(this->program, "xsks_map");
+    if (filter == nullptr || this->flows_map < 0 || xsks_map < 0)
+    {
+        LOG(LOG_LEVEL_ERROR, "XDP: {} isn't the flow filter.", XDP_PROGRAM_PATH);
+        this->close();
+        return 1;
+    }
+
+    // Generic mode works on any interface (veth pairs included), native mode needs driver support.
+    this->attach_flags = native ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+    if (bpf_xdp_attach(this->ifindex, bpf_program__fd(filter), this->attach_flags, nullptr) != 0)
+    {
+        LOG(LOG_LEVEL_ERROR, "XDP: Couldn't attach the program to {}.", interface);
+        this->attach_flags = 0;
+        this->close();
+        return 1;
+    }
+
+    size_t umem_size = (size_t)XDP_FRAME_SIZE * XDP_FRAME_COUNT;
+    this->umem = mmap(nullptr, umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    this->xsk = socket(AF_XDP, SOCK_RAW, 0);
+    if (this->umem == MAP_FAILED || this->xsk < 0)
+    {
+        LOG(LOG_LEVEL_ERROR, "XDP: Socket creation failed.");
+        if (this->umem == MAP_FAILED)
+        {
+            this->umem = nullptr;
+        }
+        this->close();
+        return 1;
+    }
+
+    xdp_umem_reg reg{};
+    reg.addr = (uint64_t)this->umem;
+    reg.len = umem_size;
+    reg.chunk_size = XDP_FRAME_SIZE;
+    int frames = XDP_FRAME_COUNT;
+    int descriptors = XDP_RING_SIZE;
+    xdp_mmap_offsets offsets{};
+    socklen_t offsets_len = sizeof(offsets);
+    if (setsockopt(this->xsk, SOL_XDP, XDP_UMEM_REG, &reg, sizeof(reg)) < 0 ||
+        setsockopt(this->xsk, SOL_XDP, XDP_UMEM_FILL_RING, &frames, sizeof(frames)) < 0 ||
+        setsockopt(this->xsk, SOL_XDP, XDP_UMEM_COMPLETION_RING, &frames, sizeof(frames)) < 0 ||
+        setsockopt(this->xsk, SOL_XDP, XDP_RX_RING, &descriptors, sizeof(descriptors)) < 0 ||
+        setsockopt(this->xsk, SOL_XDP, XDP_TX_RING, &descriptors, sizeof(descriptors)) < 0 ||
+        getsockopt(this->xsk, SOL_XDP, XDP_MMAP_OFFSETS, &offsets, &offsets_len) < 0 ||
+        this->map_ring(&this->fill, offsets.fr, XDP_UMEM_PGOFF_FILL_RING, sizeof(uint64_t), XDP_FRAME_COUNT) != 0 ||
+        this->map_ring(&this->completion, offsets.cr, XDP_UMEM_PGOFF_COMPLETION_RING, sizeof(uint64_t), XDP_FRAME_COUNT) != 0 ||
+        this->map_ring(&this->rx, offsets.rx, XDP_PGOFF_RX_RING, sizeof(xdp_desc), XDP_RING_SIZE) != 0 ||
+        this->map_ring(&this->tx, offsets.tx, XDP_PGOFF_TX_RING, sizeof(xdp_desc), XDP_RING_SIZE) != 0)
+    {
+        LOG(LOG_LEVEL_ERROR, "XDP: UMEM setup failed.");
+        this->close();
+        return 1;
+    }
+
+    // Every frame starts on the fill ring and goes back to it after being sent or dropped.
+    uint64_t *fill_addresses = (uint64_t *)this->fill.descriptors;
+    for (uint32_t i = 0; i < XDP_FRAME_COUNT; i++)
+    {
+        fill_addresses[i] = (uint64_t)i * XDP_FRAME_SIZE;
+    }
+    __atomic_store_n(this->fill.producer, XDP_FRAME_COUNT, __ATOMIC_RELEASE);
+
+    sockaddr_xdp address{};
+    address.sxdp_family = AF_XDP;
+    address.sxdp_ifindex = this->ifindex;
+    address.sxdp_queue_id = queue;
+    address.sxdp_flags = XDP_USE_NEED_WAKEUP | (native ? XDP_ZEROCOPY : XDP_COPY);
+    int bound = bind(this->xsk, (sockaddr *)&address, sizeof(address));
+    if (bound < 0 && native)
+    {
+        LOG(LOG_LEVEL_INFO, "XDP: {} has no zero-copy support, copying frames.", interface);
+        address.sxdp_flags = XDP_USE_NEED_WAKEUP | XDP_COPY;
+        bound = bind(this->xsk, (sockaddr *)&address, sizeof(address));
+    }
+    uint32_t key = queue;
+    if (bound < 0 || bpf_map_update_elem(xsks_map, &key, &this->xsk, BPF_ANY) != 0)
+    {
+        LOG(LOG_LEVEL_ERROR, "XDP: Couldn't bind to queue {} of {}.", queue, interface);
+        this->close();
+        return 1;
+    }
+
+    LOG(LOG_LEVEL_INFO, "XDP: Fast path on {} queue {} {}", interface, queue, native ? "(native)." : "(generic).");
+    this->running = true;
+    this->worker = std::thread(&XdpEngine::run, this);
+    return 0;
+}
+
+void XdpEngine::close()
+{
+    this->running = false;
+    if (this->worker.joinable())
+    {
+        this->worker.join();
+    }
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->attach_flags != 0)
+    {
+        bpf_xdp_detach(this->ifindex, this->attach_flags, nullptr);
+        this->attach_flags = 0;
+    }
+    if (this->program != nullptr)
+    {
+        bpf_object__close(this->program);
+        this->program = nullptr;
+        this->flows_map = -1;
+    }
+    for (XdpRing *ring : {&this->fill, &this->completion, &this->rx, &this->tx})
+    {
+        if (ring->map != nullptr)
+        {
+            munmap(ring->map, ring->map_size);
+        }
+        *ring = XdpRing{};
+    }
+    if (this->xsk >= 0)
+    {
+        ::close(this->xsk);
+        this->xsk = -1;
+    }
+    if (this->umem != nullptr)
+    {
+        munmap(this->umem, (size_t)XDP_FRAME_SIZE * XDP_FRAME_COUNT);
+        this->umem = nullptr;
+    }
+    this->flows.clear();
+}
+
+bool XdpEngine::add_flow(XdpFlowKey key, XdpRewrite rewrite)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->flows_map < 0)
+    {
+        return false;
+    }
+    // Known here before the program starts redirecting, so no packet misses its rewrite.
+    std::unique_ptr<Flow> &flow = this->flows[flow_id(key)];
+    flow = std::make_unique<Flow>();
+    flow->rewrite = rewrite;
+    flow->last_seen = ticks(std::chrono::steady_clock::now());
+    uint8_t present = 1;
+    if (bpf_map_update_elem(this->flows_map, &key, &present, BPF_ANY) != 0)
+    {
+        this->flows.erase(flow_id(key));
+        return false;
+    }
+    return true;
+}
+
+void XdpEngine::remove_flow(XdpFlowKey key)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    if (this->flows_map >= 0)
+    {
+        bpf_map_delete_elem(this->flows_map, &key);
+    }
+    this->flows.erase(flow_id(key));
+}
+
+bool XdpEngine::seen_within(XdpFlowKey key, std::chrono::milliseconds window)
+{
+    std::lock_guard<std::mutex> lock(this->mutex);
+    auto it = this->flows.find(flow_id(key));
+    if (it == this->flows.end())
+    {
+        return false;
+    }
+    auto last_seen = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(it->second->last_seen.load()));
+    return std::chrono::steady_clock::now() - last_seen < window;
+}
+
+// MAC a packet to address leaves with: the neighbour itself or the gateway of the longest
+// matching route through our interface, from the kernel's route and ARP tables.
+bool XdpEngine::resolve_next_hop(uint32_t address, uint8_t *mac)
+{
+    std::ifstream routes("/proc/net/route");
+    std::string line;
+    std::getline(routes, line);
+    uint32_t next_hop = 0;
+    int best_prefix = -1;
+    while (std::getline(routes, line))
+    {
+        std::istringstream fields(line);
+        std::string name;
+        uint32_t destination, gateway, mask;
+        int flags, refcnt, use, metric;
+        if (!(fields >> name >> std::hex >> destination >> gateway >> flags >> std::dec >> refcnt >> use >> metric >> std::hex >> mask) ||
+            name != this->interface || (address & mask) != destination)
+        {
+            continue;
+        }
+        // The table prints the addresses in memory order, like the network order values we compare.
+        int prefix = __builtin_popcount(mask);
+        if (prefix > best_prefix)
+        {
+            best_prefix = prefix;
+            next_hop = gateway != 0 ? gateway : address;
+        }
+    }
+    if (best_prefix < 0)
+    {
+        return false;
+    }
+
+    std::ifstream arp("/proc/net/arp");
+    std::getline(arp, line);
+    while (std::getline(arp, line))
+    {
+        char ip[64], hardware[64], device[IF_NAMESIZE + 1];
+        unsigned type, flags;
+        in_addr parsed;
+        unsigned bytes[6];
+        if (sscanf(line.c_str(), "%63s 0x%x 0x%x %63s %*s %16s", ip, &type, &flags, hardware, device) != 5 ||
+            this->interface != device || !(flags & 0x2) || inet_pton(AF_INET, ip, &parsed) != 1 || parsed.s_addr != next_hop ||
+            sscanf(hardware, "%x:%x:%x:%x:%x:%x", &bytes[0], &bytes[1], &bytes[2], &bytes[3], &bytes[4], &bytes[5]) != 6)
+        {
+            continue;
+        }
+        for (int i = 0; i < 6; i++)
+        {
+            mac[i] = (uint8_t)bytes[i];
+        }
+        return true;
+    }
+    return false;
+}
+
+XdpStats XdpEngine::stats()
+{
+    return {this->received.load(), this->forwarded.load(), this->dropped.load()};
+}
+
+// Rewrites an Ethernet/IPv4/UDP packet of an installed flow in place, false to drop it.
+bool XdpEngine::rewrite(uint8_t *packet, uint32_t length, int64_t now)
+{
+    if (length < ETH_HLEN + sizeof(iphdr) + sizeof(udphdr) || packet[12] != 0x08 || packet[13] != 0x00)
+    {
+        return false;
+    }
+    iphdr *ip = (iphdr *)(packet + ETH_HLEN);
+    uint32_t ip_length = ip->ihl * 4;
+    if (ip->version != 4 || ip->protocol != IPPROTO_UDP || ip_length < sizeof(iphdr) ||
+        ETH_HLEN + ip_length + sizeof(udphdr) > length || (ip->frag_off & htons(0x3FFF)))
+    {
+        return false;
+    }
+    udphdr *udp = (udphdr *)(packet + ETH_HLEN + ip_length);
+
+    XdpFlowKey key;
+    memcpy(&key.saddr, &ip->saddr, 4);
+    key.sport = udp->source;
+    key.dport = udp->dest;
+    auto it = this->flows.find(flow_id(key));
+    if (it == this->flows.end())
+    {
+        return false;
+    }
+    Flow *flow = it->second.get();
+    flow->last_seen.store(now, std::memory_order_relaxed);
+    const XdpRewrite &out = flow->rewrite;
+
+    // Replies leave from the MAC the packet came to.
+    memcpy(packet + ETH_ALEN, packet, ETH_ALEN);
+    memcpy(packet, out.next_hop, ETH_ALEN);
+
+    // The UDP checksum covers the addresses through the pseudo header, only the changed
+    // words are folded in so the cost doesn't grow with the payload. Zero means no checksum.
+    uint16_t before[6], after[6];
+    memcpy(before, &ip->saddr, 8);
+    before[4] = udp->source;
+    before[5] = udp->dest;
+    memcpy(after, &out.saddr, 4);
+    memcpy(after + 2, &out.daddr, 4);
+    after[4] = out.sport;
+    after[5] = out.dport;
+    if (udp->check != 0)
+    {
+        udp->check = checksum_update(udp->check, before, after, 6);
+        if (udp->check == 0)
+        {
+            udp->check = 0xFFFF;
+        }
+    }
+    memcpy(&ip->saddr, &out.saddr, 4);
+    memcpy(&ip->daddr, &out.daddr, 4);
+    udp->source = out.sport;
+    udp->dest = out.dport;
+
+    // We're the sender of the new packet, not a router, so it starts with a fresh TTL.
+    ip->ttl = 64;
+    ip->check = 0;
+    ip->check = checksum_fold(checksum_add(0, (const uint16_t *)ip, ip_length / 2));
+    return true;
+}
+
+void XdpEngine::recycle_completed()
+{
+    uint32_t producer = __atomic_load_n(this->completion.producer, __ATOMIC_ACQUIRE);
+    uint32_t consumer = *this->completion.consumer;
+    if (producer == consumer)
+    {
+        return;
+    }
+    const uint64_t *completed = (const uint64_t *)this->completion.descriptors;
+    uint64_t *fill_addresses = (uint64_t *)this->fill.descriptors;
+    uint32_t fill_producer = *this->fill.producer;
+    for (; consumer != producer; consumer++, fill_producer++)
+    {
+        fill_addresses[fill_producer & this->fill.mask] = completed[consumer & this->completion.mask];
+    }
+    __atomic_store_n(this->completion.consumer, consumer, __ATOMIC_RELEASE);
+    __atomic_store_n(this->fill.producer, fill_producer, __ATOMIC_RELEASE);
+}
+
+void XdpEngine::run()
+{
+    pollfd fd{this->xsk, POLLIN, 0};
+    const xdp_desc *received_frames = (const xdp_desc *)this->rx.descriptors;
+    xdp_desc *sent_frames = (xdp_desc *)this->tx.descriptors;
+    uint64_t *fill_addresses = (uint64_t *)this->fill.descriptors;
+
+    while (this->running)
+    {
+        this->recycle_completed();
+        uint32_t consumer = *this->rx.consumer;
+        uint32_t count = std::min<uint32_t>(__atomic_load_n(this->rx.producer, __ATOMIC_ACQUIRE) - consumer, XDP_BATCH_SIZE);
+        uint32_t tx_producer = *this->tx.producer;
+        uint32_t tx_free = XDP_RING_SIZE - (tx_producer - __atomic_load_n(this->tx.consumer, __ATOMIC_ACQUIRE));
+        if (count > tx_free)
+        {
+            // Sent frames come back through the completion ring once the kick goes through.
+            count = tx_free;
+            sendto(this->xsk, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+        }
+        if (count == 0)
+        {
+            poll(&fd, 1, XDP_POLL_TIMEOUT_MS);
+            continue;
+        }
+
+        int64_t now = ticks(std::chrono::steady_clock::now());
+        uint32_t fill_producer = *this->fill.producer;
+        uint32_t forwarded = 0;
+        {
+            // Once per batch, flows only change when sessions open or close.
+            std::lock_guard<std::mutex> lock(this->mutex);
+            for (uint32_t i = 0; i < count; i++)
+            {
+                xdp_desc frame = received_frames[(consumer + i) & this->rx.mask];
+                if (this->rewrite((uint8_t *)this->umem + frame.addr, frame.len, now))
+                {
+                    sent_frames[tx_producer++ & this->tx.mask] = {frame.addr, frame.len, 0};
+                    forwarded++;
+                }
+                else
+                {
+                    fill_addresses[fill_producer++ & this->fill.mask] = frame.addr;
+                }
+            }
+        }
+        __atomic_store_n(this->rx.consumer, consumer + count, __ATOMIC_RELEASE);
+        __atomic_store_n(this->tx.producer, tx_producer, __ATOMIC_RELEASE);
+        __atomic_store_n(this->fill.producer, fill_producer, __ATOMIC_RELEASE);
+        this->received += count;
+        this->forwarded += forwarded;
+        this->dropped += count - forwarded;
+        if (forwarded > 0 && (__atomic_load_n(this->tx.flags, __ATOMIC_RELAXED) & XDP_RING_NEED_WAKEUP))
+        {
+            sendto(this->xsk, nullptr, 0, MSG_DONTWAIT, nullptr, 0);
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,107 @@
+#ifndef XDP_ENGINE_H
+#define XDP_ENGINE_H
+
+// Optional Linux fast path, built with -DPROXY_WITH_XDP and linked with -lbpf.
+#ifdef PROXY_WITH_XDP
+
+#ifndef __linux__
+#error "PROXY_WITH_XDP needs Linux."
+#endif
+
+#include "proxy_common.h"
+#include <linux/if_xdp.h>
+#include <mutex>
+#include <unordered_map>
+
+#define XDP_FRAME_SIZE 2048
+#define XDP_FRAME_COUNT 4096
+#define XDP_RING_SIZE 2048   // RX and TX descriptors, the fill and completion rings hold every frame.
+#define XDP_BATCH_SIZE 64
+#define XDP_POLL_TIMEOUT_MS 100
+#define XDP_PROGRAM_PATH "xdp_flow_filter.bpf.o" // Built from xdp/flow_filter.bpf.c.
+
+struct bpf_object;
+
+// Matches struct flow_key in xdp/flow_filter.bpf.c, every field in network order.
+typedef struct
+{
+    uint32_t saddr;
+    uint16_t sport;
+    uint16_t dport;
+} XdpFlowKey;
+
+// How a packet of a flow leaves, every field in network order.
+typedef struct
+{
+    uint8_t next_hop[6]; // MAC of the neighbour or gateway towards daddr.
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+} XdpRewrite;
+
+typedef struct
+{
+    uint64_t received;
+    uint64_t forwarded;
+    uint64_t dropped; // Not IPv4/UDP, or the flow was removed while the packet was queued.
+} XdpStats;
+
+typedef struct
+{
+    uint32_t *producer;
+    uint32_t *consumer;
+    uint32_t *flags;
+    void *descriptors;
+    uint32_t mask;
+    void *map;
+    size_t map_size;
+} XdpRing;
+
+// AF_XDP forwarder for established IPv4 flows. An XDP program redirects the packets
+// of installed flows to a UMEM shared with this process, they're rewritten in place
+// (MACs, addresses, ports, checksums) and sent back out the same interface without
+// going through the kernel socket stack. Everything else, including the first
+// packets of a session, still reaches the socket engine.
+class XdpEngine
+{
+private:
+    struct Flow
+    {
+        XdpRewrite rewrite;
+        std::atomic<int64_t> last_seen{0}; // steady_clock ticks.
+    };
+
+    std::string interface;
+    int ifindex = 0;
+    uint32_t attach_flags = 0;
+    int xsk = -1;
+    void *umem = nullptr;
+    XdpRing fill{}, completion{}, rx{}, tx{};
+    bpf_object *program = nullptr;
+    int flows_map = -1;
+    std::unordered_map<uint64_t, std::unique_ptr<Flow>> flows;
+    std::mutex mutex;
+    std::atomic<bool> running{false};
+    std::thread worker;
+    std::atomic<uint64_t> received{0}, forwarded{0}, dropped{0};
+
+    int map_ring(XdpRing *ring, const xdp_ring_offset &offset, uint64_t page_offset, size_t descriptor_size, uint32_t size);
+    void run();
+    void recycle_completed();
+    bool rewrite(uint8_t *packet, uint32_t length, int64_t now);
+
+public:
+    ~XdpEngine();
+    int open(const char *interface, int queue, bool native);
+    void close();
+    bool add_flow(XdpFlowKey key, XdpRewrite rewrite);
+    void remove_flow(XdpFlowKey key);
+    bool seen_within(XdpFlowKey key, std::chrono::milliseconds window);
+    bool resolve_next_hop(uint32_t address, uint8_t *mac);
+    XdpStats stats();
+};
+
+#endif
+
+#endif